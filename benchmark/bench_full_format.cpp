@@ -0,0 +1,408 @@
+#include "btree_dir.h"
+#include "exceptions.h"
+#include "file_table_v2.h"
+#include "full_format.h"
+#include "fuse_high_level_ops_base.h"
+#include "fuse_tracer_v2.h"
+#include "logger.h"
+#include "myutils.h"
+#include "mystring.h"
+#include "platform.h"
+#include "tags.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <benchmark/benchmark.h>
+#include <fruit/fruit.h>
+
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace securefs::full_format
+{
+namespace
+{
+    fruit::Component<FuseHighLevelOpsBase, FileTable>
+    get_bench_component(std::shared_ptr<OSService> os)
+    {
+        return fruit::createComponent()
+            .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>()
+            .install(full_format::get_table_io_component, 2)
+            .registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
+            .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>()>([]() { return false; })
+            .registerProvider<fruit::Annotated<tReadOnly, bool>()>([]() { return false; })
+            .registerProvider<fruit::Annotated<tCaseInsensitive, bool>()>([]() { return false; })
+            .bind<Directory, BtreeDirectory>()
+            .registerProvider<fruit::Annotated<tMaxCachedFiles, unsigned>()>([]()
+                                                                             { return 256u; })
+            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>([]() { return 0u; })
+            .registerProvider<fruit::Annotated<tIvSize, unsigned>()>([]() { return 12u; })
+            .registerProvider<fruit::Annotated<tBlockSize, unsigned>()>([]() { return 4096u; })
+            .registerProvider<fruit::Annotated<tMasterKey, key_type>()>(
+                []() { return key_type(0x99); })
+            .registerProvider([]() { return Directory::DirNameComparison{&binary_compare}; })
+            .registerProvider([]() { return OwnerOverride{}; })
+            .registerProvider([]() { return TimeUpdatePolicy{}; })
+            .bindInstance(*os);
+    }
+
+    void check_rc(int rc)
+    {
+        if (rc < 0)
+        {
+            throwVFSException(-rc);
+        }
+    }
+
+    /// One repository shared by all the benchmarks on the filesystem, as each benchmark function
+    /// is run many times to settle on an iteration count.
+    class BenchRepo
+    {
+    public:
+        static BenchRepo& get()
+        {
+            static BenchRepo instance;
+            return instance;
+        }
+
+        FuseHighLevelOpsBase& ops() { return injector_.get<FuseHighLevelOpsBase&>(); }
+        FileTable& table() { return injector_.get<FileTable&>(); }
+        const fuse_context* ctx() const { return &ctx_; }
+
+        void ensure_file(const std::string& path)
+        {
+            fuse_stat st{};
+            if (ops().vgetattr(path.c_str(), &st, ctx()) == 0)
+            {
+                return;
+            }
+            fuse_file_info info{};
+            check_rc(ops().vcreate(path.c_str(), 0644, &info, ctx()));
+            check_rc(ops().vrelease(nullptr, &info, ctx()));
+        }
+
+        void ensure_directory(const std::string& path)
+        {
+            int rc = ops().vmkdir(path.c_str(), 0755, ctx());
+            if (rc != -EEXIST)
+            {
+                check_rc(rc);
+            }
+        }
+
+        // Ids of at least `count` empty regular files, which are not linked into any directory.
+        const std::vector<id_type>& file_ids(size_t count)
+        {
+            while (file_ids_.size() < count)
+            {
+                auto holder = table().create_as(RegularFile::class_type());
+                {
+                    FileLockGuard lg(*holder);
+                    holder->initialize_empty(0644 | S_IFREG, 0, 0);
+                }
+                file_ids_.push_back(holder->get_id());
+            }
+            return file_ids_;
+        }
+
+    private:
+        BenchRepo() : root_(make_root()), injector_(get_bench_component, root_) {}
+
+        static std::shared_ptr<OSService> make_root()
+        {
+            auto temp_dir_name = OSService::temp_name("tmp/bench", "dir");
+            OSService::get_default().ensure_directory(temp_dir_name, 0755);
+            return std::make_shared<OSService>(temp_dir_name);
+        }
+
+        std::shared_ptr<OSService> root_;
+        fruit::Injector<FuseHighLevelOpsBase, FileTable> injector_;
+        fuse_context ctx_{};
+        std::vector<id_type> file_ids_;
+    };
+
+    std::vector<std::string> make_names(size_t count)
+    {
+        std::mt19937_64 mt(0x5eed);
+        std::vector<std::string> names;
+        names.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            names.push_back(absl::StrFormat("%016x%d", mt(), i));
+        }
+        return names;
+    }
+
+    /// A `BtreeDirectory` on two temporary files, which are removed along with it.
+    class TempBtree
+    {
+    public:
+        explicit TempBtree(BtreeNodeBudget& budget)
+            : data_name_(OSService::temp_name("tmp/btree", ".data"))
+            , meta_name_(OSService::temp_name("tmp/btree", ".meta"))
+        {
+            auto& service = OSService::get_default();
+            int flags = O_RDWR | O_EXCL | O_CREAT;
+            dir_.emplace(Directory::DirNameComparison{&binary_compare},
+                         service.open_file_stream(data_name_, flags, 0644),
+                         service.open_file_stream(meta_name_, flags, 0644),
+                         key_type(0x3e),
+                         id_type{},
+                         true,
+                         8000,
+                         12,
+                         0,
+                         false,
+                         budget);
+        }
+
+        ~TempBtree()
+        {
+            dir_.reset();
+            OSService::get_default().remove_file(data_name_);
+            OSService::get_default().remove_file(meta_name_);
+        }
+
+        DISABLE_COPY_MOVE(TempBtree)
+
+        BtreeDirectory& dir() { return *dir_; }
+
+        void fill(const std::vector<std::string>& names)
+        {
+            FileLockGuard lg(*dir_);
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                dir_->add_entry(names[i], id_type(static_cast<byte>(i)), RegularFile::class_type());
+            }
+            dir_->flush();
+        }
+
+    private:
+        std::string data_name_, meta_name_;
+        std::optional<BtreeDirectory> dir_;
+    };
+
+    // Inserts `range(0)` entries into an empty directory and writes the nodes out.
+    void BM_BtreeDirectoryInsert(benchmark::State& state)
+    {
+        auto names = make_names(static_cast<size_t>(state.range(0)));
+        BtreeNodeBudget budget;
+        for (auto _ : state)
+        {
+            state.PauseTiming();
+            std::optional<TempBtree> btree(std::in_place, budget);
+            state.ResumeTiming();
+            btree->fill(names);
+            state.PauseTiming();
+            btree.reset();
+            state.ResumeTiming();
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * names.size()));
+    }
+    BENCHMARK(BM_BtreeDirectoryInsert)->Arg(100)->Arg(1000)->Arg(10000);
+
+    // With a budget of 128 nodes, most lookups read and parse their nodes again, into nodes
+    // recycled from earlier evictions.
+    void BM_BtreeDirectoryLookup(benchmark::State& state) ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        auto names = make_names(static_cast<size_t>(state.range(0)));
+        BtreeNodeBudget budget(state.range(1) ? 128 : BtreeNodeBudget::kDefaultMaxNodes);
+        TempBtree btree(budget);
+        btree.fill(names);
+        std::mt19937 mt(0x5eed);
+        std::uniform_int_distribution<size_t> dist(0, names.size() - 1);
+        FileLockGuard lg(btree.dir());
+        for (auto _ : state)
+        {
+            id_type id;
+            int type;
+            benchmark::DoNotOptimize(btree.dir().get_entry(names[dist(mt)], id, type));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_BtreeDirectoryLookup)
+        ->ArgNames({"entries", "cold"})
+        ->ArgsProduct({{1000, 10000}, {0, 1}});
+
+    void BM_BtreeDirectoryIterate(benchmark::State& state) ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        auto names = make_names(static_cast<size_t>(state.range(0)));
+        BtreeNodeBudget budget;
+        TempBtree btree(budget);
+        btree.fill(names);
+        FileLockGuard lg(btree.dir());
+        for (auto _ : state)
+        {
+            size_t count = 0;
+            btree.dir().iterate_over_entries([&count](const std::string&, const id_type&, int)
+                                             { ++count; });
+            benchmark::DoNotOptimize(count);
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * names.size()));
+    }
+    BENCHMARK(BM_BtreeDirectoryIterate)->Arg(1000)->Arg(10000);
+
+    // Opens and closes files in turn. The table caches 256 closed files, so a working set of 64
+    // is served from the cache, and one of 1024 has to open the underlying files every time.
+    void BM_FileTableOpenClose(benchmark::State& state)
+    {
+        static const std::vector<id_type>* ids;
+
+        auto& repo = BenchRepo::get();
+        auto working_set = static_cast<size_t>(state.range(0));
+        if (state.thread_index() == 0)
+        {
+            ids = &repo.file_ids(working_set);
+        }
+        size_t next = static_cast<size_t>(state.thread_index()) * 7919;
+        for (auto _ : state)
+        {
+            auto holder
+                = repo.table().open_as((*ids)[next++ % working_set], RegularFile::class_type());
+            benchmark::DoNotOptimize(holder.get());
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    BENCHMARK(BM_FileTableOpenClose)->Arg(64)->Arg(1024)->ThreadRange(1, 8)->UseRealTime();
+
+    // Each thread renames its own file back and forth, either in a directory of its own or in
+    // one shared by all threads.
+    void BM_FullFormatRename(benchmark::State& state)
+    {
+        auto& repo = BenchRepo::get();
+        bool shared = state.range(0) != 0;
+        auto dir_of = [shared](int thread)
+        { return shared ? std::string("/rename") : absl::StrCat("/rename", thread); };
+        if (state.thread_index() == 0)
+        {
+            for (int t = 0; t < state.threads(); ++t)
+            {
+                repo.ensure_directory(dir_of(t));
+                repo.ensure_file(absl::StrCat(dir_of(t), "/a", t));
+            }
+        }
+        auto from = absl::StrCat(dir_of(state.thread_index()), "/a", state.thread_index());
+        auto to = absl::StrCat(dir_of(state.thread_index()), "/b", state.thread_index());
+        for (auto _ : state)
+        {
+            check_rc(repo.ops().vrename(from.c_str(), to.c_str(), repo.ctx()));
+            check_rc(repo.ops().vrename(to.c_str(), from.c_str(), repo.ctx()));
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * 2));
+    }
+    BENCHMARK(BM_FullFormatRename)
+        ->ArgNames({"shared"})
+        ->Arg(0)
+        ->Arg(1)
+        ->ThreadRange(1, 8)
+        ->UseRealTime();
+
+    // Reads 64 KiB at random from one file, each thread through a handle of its own. The threads
+    // call the operations directly, so this shows how the operations scale with concurrent
+    // callers, and not how the pool of threads serving FUSE requests does, which needs a mount.
+    void BM_FullFormatRead(benchmark::State& state)
+    {
+        constexpr size_t kIoSize = 64 << 10;
+        constexpr size_t kFileSize = 16 << 20;
+        static std::vector<uint64_t> handles;
+
+        auto& repo = BenchRepo::get();
+        if (state.thread_index() == 0)
+        {
+            repo.ensure_file("/read");
+            handles.assign(state.threads(), 0);
+            std::vector<char> data(kIoSize, 0x42);
+            for (uint64_t& fh : handles)
+            {
+                fuse_file_info info{};
+                info.flags = O_RDWR;
+                check_rc(repo.ops().vopen("/read", &info, repo.ctx()));
+                fh = info.fh;
+            }
+            fuse_stat st{};
+            check_rc(repo.ops().vgetattr("/read", &st, repo.ctx()));
+            for (size_t offset = st.st_size; offset < kFileSize; offset += kIoSize)
+            {
+                fuse_file_info info{};
+                info.fh = handles[0];
+                check_rc(repo.ops().vwrite(
+                    nullptr, data.data(), kIoSize, offset, &info, repo.ctx()));
+            }
+        }
+
+        std::vector<char> buffer(kIoSize);
+        std::mt19937 mt(state.thread_index());
+        std::uniform_int_distribution<size_t> dist(0, kFileSize / kIoSize - 1);
+        for (auto _ : state)
+        {
+            fuse_file_info info{};
+            info.fh = handles[state.thread_index()];
+            check_rc(repo.ops().vread(
+                nullptr, buffer.data(), kIoSize, dist(mt) * kIoSize, &info, repo.ctx()));
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * kIoSize));
+
+        if (state.thread_index() == 0)
+        {
+            for (uint64_t fh : handles)
+            {
+                fuse_file_info info{};
+                info.fh = fh;
+                check_rc(repo.ops().vrelease(nullptr, &info, repo.ctx()));
+            }
+        }
+    }
+    BENCHMARK(BM_FullFormatRead)->ThreadRange(1, 8)->UseRealTime();
+
+    // Getattr through `FuseTracer::traced_call`, as the FUSE callbacks make it. The argument is 0
+    // without --trace, 1 with --trace written synchronously, and 2 with --trace written by the
+    // background thread as when mounted, which should cost well under five times the call without
+    // it. The lines the background thread cannot keep up with are dropped, as when mounted.
+    void BM_TracedGetattr(benchmark::State& state)
+    {
+        static std::unique_ptr<Logger> logger;
+
+        auto& repo = BenchRepo::get();
+        if (state.thread_index() == 0)
+        {
+            repo.ensure_file("/traced");
+#ifdef _WIN32
+            logger.reset(Logger::create_file_logger("NUL"));
+#else
+            logger.reset(Logger::create_file_logger("/dev/null"));
+#endif
+            logger->set_level(state.range(0) ? LoggingLevel::kLogTrace : LoggingLevel::kLogInfo);
+            if (state.range(0) == 2)
+            {
+                logger->start_async();
+            }
+        }
+
+        const char* path = "/traced";
+        for (auto _ : state)
+        {
+            fuse_stat st{};
+            check_rc(trace::FuseTracer::traced_call(
+                [&]() { return repo.ops().vgetattr(path, &st, repo.ctx()); },
+                "getattr",
+                __LINE__,
+                {{"path", {path}}, {"st", {&st}}},
+                logger.get()));
+        }
+
+        if (state.thread_index() == 0)
+        {
+            logger.reset();
+        }
+    }
+    BENCHMARK(BM_TracedGetattr)
+        ->ArgName("trace")
+        ->DenseRange(0, 2)
+        ->ThreadRange(1, 8)
+        ->UseRealTime();
+}    // namespace
+}    // namespace securefs::full_format
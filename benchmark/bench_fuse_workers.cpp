@@ -0,0 +1,195 @@
+#include "platform.h"
+
+#ifdef __linux__
+#include "btree_dir.h"
+#include "exceptions.h"
+#include "file_table_v2.h"
+#include "full_format.h"
+#include "full_format_low_level.h"
+#include "fuse2_workaround.h"
+#include "fuse_low_level_ops_base.h"
+#include "myutils.h"
+#include "mystring.h"
+#include "tags.h"
+
+#include <absl/strings/str_cat.h>
+#include <benchmark/benchmark.h>
+#include <fruit/fruit.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace securefs::full_format
+{
+namespace
+{
+    fruit::Component<FuseLowLevelOpsBase> get_mount_component(std::shared_ptr<OSService> os)
+    {
+        return fruit::createComponent()
+            .bind<FuseLowLevelOpsBase, full_format::FuseLowLevelOps>()
+            .install(full_format::get_table_io_component, 2)
+            // Every stat goes to the workers, instead of being answered by the kernel.
+            .registerProvider<fruit::Annotated<tKernelCacheTimeout, int>()>([]() { return 0; })
+            .registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
+            .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>()>([]() { return false; })
+            .registerProvider<fruit::Annotated<tReadOnly, bool>()>([]() { return false; })
+            .registerProvider<fruit::Annotated<tCaseInsensitive, bool>()>([]() { return false; })
+            .bind<Directory, BtreeDirectory>()
+            .registerProvider<fruit::Annotated<tMaxCachedFiles, unsigned>()>([]()
+                                                                             { return 256u; })
+            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>([]() { return 0u; })
+            .registerProvider<fruit::Annotated<tIvSize, unsigned>()>([]() { return 12u; })
+            .registerProvider<fruit::Annotated<tBlockSize, unsigned>()>([]() { return 4096u; })
+            .registerProvider<fruit::Annotated<tMasterKey, key_type>()>(
+                []() { return key_type(0x99); })
+            .registerProvider([]() { return Directory::DirNameComparison{&binary_compare}; })
+            .registerProvider([]() { return OwnerOverride{}; })
+            .registerProvider([]() { return TimeUpdatePolicy{}; })
+            .bindInstance(*os);
+    }
+
+    std::string make_temp_dir(const char* prefix)
+    {
+        auto name = OSService::temp_name(prefix, "dir");
+        OSService::get_default().ensure_directory(name, 0755);
+        char* absolute = ::realpath(name.c_str(), nullptr);
+        if (!absolute)
+            THROW_POSIX_EXCEPTION(errno, name);
+        DEFER(free(absolute));
+        return absolute;
+    }
+
+    /// The full format mounted through FUSE and served by `my_fuse_lowlevel_main`, so that the
+    /// requests from the kernel go through the pool of workers as they do in production.
+    class LoopbackMount
+    {
+    public:
+        explicit LoopbackMount(const FuseWorkerOptions& workers)
+            : root_(std::make_shared<OSService>(make_temp_dir("tmp/bench")))
+            , injector_(get_mount_component, root_)
+            , mountpoint_(make_temp_dir("tmp/mount"))
+            , callbacks_(FuseLowLevelOpsBase::build_ops(false))
+        {
+            struct ::stat before;
+            if (::stat(mountpoint_.c_str(), &before) != 0)
+                THROW_POSIX_EXCEPTION(errno, mountpoint_);
+            thread_ = std::thread(
+                [this, workers]()
+                {
+                    std::string program = "securefs_bench";
+                    std::vector<char*> args{program.data(), mountpoint_.data()};
+                    my_fuse_lowlevel_main(static_cast<int>(args.size()),
+                                          args.data(),
+                                          &callbacks_,
+                                          injector_.get<FuseLowLevelOpsBase*>(),
+                                          workers);
+                    exited_ = true;
+                });
+
+            // The mount is ready once the root has changed to ours, which the workers answer.
+            for (int i = 0; i < 1000 && !exited_; ++i)
+            {
+                struct ::stat after;
+                if (::stat(mountpoint_.c_str(), &after) == 0 && after.st_dev != before.st_dev)
+                {
+                    mounted_ = true;
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            if (!mounted_)
+                return;
+            file_ = absl::StrCat(mountpoint_, "/file");
+            int fd = ::open(file_.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        ~LoopbackMount()
+        {
+            // The workers see the device go away, and the session ends with them.
+            if (!exited_)
+                fuse_unmount(mountpoint_.c_str(), nullptr);
+            thread_.join();
+        }
+
+        DISABLE_COPY_MOVE(LoopbackMount)
+
+        bool mounted() const noexcept { return mounted_; }
+        const std::string& file() const noexcept { return file_; }
+
+    private:
+        std::shared_ptr<OSService> root_;
+        fruit::Injector<FuseLowLevelOpsBase> injector_;
+        std::string mountpoint_, file_;
+        fuse_lowlevel_ops callbacks_;
+        std::thread thread_;
+        std::atomic<bool> exited_{false};
+        bool mounted_ = false;
+    };
+
+    // Stats one file on a mount from one or more threads. Each stat is a lookup and a getattr
+    // served by the workers, so this shows how the pool scales with its settings: the arguments
+    // are --min-threads, --max-threads and --clone-fd. It needs FUSE, and is skipped where
+    // mounting is not permitted.
+    void BM_FuseWorkerPool(benchmark::State& state)
+    {
+        static std::unique_ptr<LoopbackMount> mount;
+
+        if (state.thread_index() == 0)
+        {
+            FuseWorkerOptions workers;
+            workers.min_threads = static_cast<unsigned>(state.range(0));
+            workers.max_threads = static_cast<unsigned>(state.range(1));
+            workers.clone_fd = state.range(2) != 0;
+            mount = std::make_unique<LoopbackMount>(workers);
+            if (!mount->mounted())
+            {
+                mount.reset();
+                state.SkipWithError("Cannot mount with FUSE");
+            }
+        }
+
+        for (auto _ : state)
+        {
+            if (!mount)
+            {
+                state.SkipWithError("Cannot mount with FUSE");
+                break;
+            }
+            struct ::stat st;
+            if (::stat(mount->file().c_str(), &st) != 0)
+            {
+                state.SkipWithError("Failed to stat through the mount");
+                break;
+            }
+        }
+
+        if (state.thread_index() == 0)
+        {
+            mount.reset();
+        }
+    }
+    BENCHMARK(BM_FuseWorkerPool)
+        ->ArgNames({"min", "max", "clone_fd"})
+        ->Args({1, 1, 0})
+        ->Args({1, 4, 0})
+        ->Args({4, 4, 0})
+        ->Args({1, 8, 0})
+        ->Args({1, 8, 1})
+        ->Args({8, 8, 1})
+        ->Threads(1)
+        ->Threads(8)
+        ->UseRealTime();
+}    // namespace
+}    // namespace securefs::full_format
+#endif
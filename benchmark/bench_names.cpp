@@ -0,0 +1,155 @@
+#include "crypto.h"
+#include "lite_long_name_lookup_table.h"
+#include "lock_guard.h"
+#include "myutils.h"
+#include "mystring.h"
+#include "platform.h"
+
+#include <absl/strings/str_format.h>
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    constexpr size_t kSIVSize = 16;
+
+    std::string make_name(size_t length) { return std::string(length, 'n'); }
+
+    void BM_AesSivEncrypt(benchmark::State& state)
+    {
+        key_type key(0x77);
+        AES_SIV siv(key.data(), key.size());
+        auto name = make_name(static_cast<size_t>(state.range(0)));
+        std::vector<byte> output(kSIVSize + name.size());
+        for (auto _ : state)
+        {
+            siv.encrypt_and_authenticate(
+                name.data(), name.size(), nullptr, 0, output.data() + kSIVSize, output.data());
+            benchmark::ClobberMemory();
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * name.size()));
+    }
+    BENCHMARK(BM_AesSivEncrypt)->Arg(16)->Arg(64)->Arg(255);
+
+    void BM_AesSivDecrypt(benchmark::State& state)
+    {
+        key_type key(0x77);
+        AES_SIV siv(key.data(), key.size());
+        auto name = make_name(static_cast<size_t>(state.range(0)));
+        std::vector<byte> ciphertext(kSIVSize + name.size());
+        siv.encrypt_and_authenticate(
+            name.data(), name.size(), nullptr, 0, ciphertext.data() + kSIVSize, ciphertext.data());
+        for (auto _ : state)
+        {
+            bool ok = siv.decrypt_and_verify(ciphertext.data() + kSIVSize,
+                                             name.size(),
+                                             nullptr,
+                                             0,
+                                             name.data(),
+                                             ciphertext.data());
+            benchmark::DoNotOptimize(ok);
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * name.size()));
+    }
+    BENCHMARK(BM_AesSivDecrypt)->Arg(16)->Arg(64)->Arg(255);
+
+    void BM_Base32Encode(benchmark::State& state)
+    {
+        std::vector<byte> input(static_cast<size_t>(state.range(0)), 0x9d);
+        std::string output;
+        for (auto _ : state)
+        {
+            base32_encode(input.data(), input.size(), output);
+            benchmark::DoNotOptimize(output.data());
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * input.size()));
+    }
+    BENCHMARK(BM_Base32Encode)->Arg(32)->Arg(271);
+
+    void BM_Base32Decode(benchmark::State& state)
+    {
+        std::vector<byte> input(static_cast<size_t>(state.range(0)), 0x9d);
+        std::string encoded, output;
+        base32_encode(input.data(), input.size(), encoded);
+        for (auto _ : state)
+        {
+            base32_decode(encoded.data(), encoded.size(), output);
+            benchmark::DoNotOptimize(output.data());
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * encoded.size()));
+    }
+    BENCHMARK(BM_Base32Decode)->Arg(32)->Arg(271);
+
+    constexpr int kNumMappings = 1000;
+
+    std::string hash_of(int i) { return absl::StrFormat("%064x", i); }
+
+    std::string fill_lookup_table()
+    {
+        auto db_name = OSService::temp_name("tmp/", ".db");
+        LongNameLookupTable table(db_name, false);
+        LockGuard<LongNameLookupTable> lg(table);
+        for (int i = 0; i < kNumMappings; ++i)
+        {
+            table.update_mapping(hash_of(i), make_name(300));
+        }
+        return db_name;
+    }
+
+    // Each lookup takes and releases the lock, which begins and ends a transaction, as when
+    // resolving a path.
+    void BM_LongNameLookupTableLookup(benchmark::State& state)
+    {
+        auto db_name = fill_lookup_table();
+        {
+            LongNameLookupTable table(db_name, true);
+            std::mt19937 mt(0x5eed);
+            std::uniform_int_distribution<int> dist(0, kNumMappings - 1);
+            for (auto _ : state)
+            {
+                LockGuard<LongNameLookupTable> lg(table);
+                benchmark::DoNotOptimize(table.lookup(hash_of(dist(mt))));
+            }
+        }
+        OSService::get_default().remove_file(db_name);
+    }
+    BENCHMARK(BM_LongNameLookupTableLookup);
+
+    void BM_LongNameLookupTableUpdate(benchmark::State& state)
+    {
+        auto db_name = fill_lookup_table();
+        {
+            LongNameLookupTable table(db_name, false);
+            int next = kNumMappings;
+            for (auto _ : state)
+            {
+                LockGuard<LongNameLookupTable> lg(table);
+                table.update_mapping(hash_of(next++), make_name(300));
+            }
+        }
+        OSService::get_default().remove_file(db_name);
+    }
+    BENCHMARK(BM_LongNameLookupTableUpdate);
+
+    void BM_LongNameIndexLookup(benchmark::State& state)
+    {
+        auto db_name = fill_lookup_table();
+        {
+            LongNameIndex index;
+            std::mt19937 mt(0x5eed);
+            std::uniform_int_distribution<int> dist(0, kNumMappings - 1);
+            for (auto _ : state)
+            {
+                benchmark::DoNotOptimize(index.lookup(db_name, hash_of(dist(mt))));
+            }
+        }
+        OSService::get_default().remove_file(db_name);
+    }
+    BENCHMARK(BM_LongNameIndexLookup);
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,143 @@
+#include "crypto.h"
+#include "lite_stream.h"
+#include "myutils.h"
+#include "streams.h"
+
+#include <benchmark/benchmark.h>
+#include <cryptopp/aes.h>
+#include <cryptopp/modes.h>
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    // Keeps the underlying bytes in memory, so that only the cost of the streams is measured.
+    class MemoryStream : public StreamBase
+    {
+    private:
+        std::vector<unsigned char> m_buffer;
+
+    public:
+        length_type read(void* output, offset_type offset, length_type length) override
+        {
+            if (offset >= m_buffer.size() || length <= 0)
+            {
+                return 0;
+            }
+            auto read_sz = std::min<length_type>(length, m_buffer.size() - offset);
+            memcpy(output, m_buffer.data() + offset, read_sz);
+            return read_sz;
+        }
+
+        void write(const void* input, offset_type offset, length_type length) override
+        {
+            if (length <= 0)
+            {
+                return;
+            }
+            if (offset + length > m_buffer.size())
+            {
+                m_buffer.resize(offset + length);
+            }
+            memcpy(m_buffer.data() + offset, input, length);
+        }
+
+        length_type size() const override { return m_buffer.size(); }
+
+        void flush() override {}
+
+        void resize(length_type size) override { m_buffer.resize(size); }
+        bool is_sparse() const noexcept override { return true; }
+    };
+
+    constexpr length_type kFileSize = 8 << 20;
+
+    enum Arg
+    {
+        kBlockSize,
+        kIoSize,
+        kRandom,
+        kUnaligned,
+    };
+
+    std::shared_ptr<StreamBase> make_lite_stream(unsigned block_size)
+    {
+        return std::make_shared<lite::AESGCMCryptStream>(
+            std::make_shared<MemoryStream>(), key_type(0x3a), block_size, 12, true);
+    }
+
+    std::shared_ptr<StreamBase> make_full_stream(unsigned block_size)
+    {
+        return make_cryptstream_aes_gcm(std::make_shared<MemoryStream>(),
+                                        std::make_shared<MemoryStream>(),
+                                        key_type(0x3a),
+                                        key_type(0x5c),
+                                        id_type(0x11),
+                                        true,
+                                        block_size,
+                                        12)
+            .first;
+    }
+
+    // Reads or writes `kIoSize` bytes per iteration, one after another or at random offsets, and
+    // at offsets that are multiples of the IO size or one byte past them.
+    template <bool Write>
+    void run_stream(benchmark::State& state, std::shared_ptr<StreamBase> (*make)(unsigned))
+    {
+        auto stream = make(static_cast<unsigned>(state.range(kBlockSize)));
+        auto io_size = static_cast<length_type>(state.range(kIoSize));
+        bool random = state.range(kRandom) != 0;
+        offset_type shift = state.range(kUnaligned) ? 1 : 0;
+
+        std::vector<byte> buffer(io_size, 0x42);
+        {
+            std::vector<byte> chunk(1 << 20, 0x42);
+            for (length_type offset = 0; offset < kFileSize + io_size; offset += chunk.size())
+            {
+                stream->write(chunk.data(), offset, chunk.size());
+            }
+        }
+
+        std::mt19937 mt(0x5eed);
+        std::uniform_int_distribution<length_type> dist(0, kFileSize / io_size - 1);
+        length_type next = 0;
+        for (auto _ : state)
+        {
+            length_type index = random ? dist(mt) : next++ % (kFileSize / io_size);
+            offset_type offset = index * io_size + shift;
+            if (Write)
+            {
+                stream->write(buffer.data(), offset, io_size);
+            }
+            else
+            {
+                benchmark::DoNotOptimize(stream->read(buffer.data(), offset, io_size));
+            }
+        }
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * io_size));
+    }
+
+    void stream_args(benchmark::internal::Benchmark* b)
+    {
+        b->ArgNames({"block", "io", "random", "unaligned"})
+            ->ArgsProduct({{1024, 4096, 32768}, {4096, 65536}, {0, 1}, {0, 1}});
+    }
+
+    void BM_LiteStreamRead(benchmark::State& state) { run_stream<false>(state, &make_lite_stream); }
+    BENCHMARK(BM_LiteStreamRead)->Apply(stream_args);
+
+    void BM_LiteStreamWrite(benchmark::State& state) { run_stream<true>(state, &make_lite_stream); }
+    BENCHMARK(BM_LiteStreamWrite)->Apply(stream_args);
+
+    void BM_FullStreamRead(benchmark::State& state) { run_stream<false>(state, &make_full_stream); }
+    BENCHMARK(BM_FullStreamRead)->Apply(stream_args);
+
+    void BM_FullStreamWrite(benchmark::State& state) { run_stream<true>(state, &make_full_stream); }
+    BENCHMARK(BM_FullStreamWrite)->Apply(stream_args);
+}    // namespace
+}    // namespace securefs
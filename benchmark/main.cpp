@@ -0,0 +1,40 @@
+#include "platform.h"
+
+#include <absl/strings/match.h>
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+int main(int argc, char** argv)
+{
+#ifdef _WIN32
+    securefs::windows_init();
+#endif
+    securefs::OSService::get_default().ensure_directory("tmp", 0755);
+
+    // Results are also written as JSON unless told otherwise, so that runs on different commits
+    // can be compared, e.g. with compare.py from Google Benchmark.
+    std::vector<char*> args(argv, argv + argc);
+    bool has_out = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        has_out = has_out || absl::StartsWith(argv[i], "--benchmark_out=");
+    }
+    char default_out[] = "--benchmark_out=securefs_bench.json";
+    char default_out_format[] = "--benchmark_out_format=json";
+    if (!has_out)
+    {
+        args.push_back(default_out);
+        args.push_back(default_out_format);
+    }
+    int num_args = static_cast<int>(args.size());
+
+    benchmark::Initialize(&num_args, args.data());
+    if (benchmark::ReportUnrecognizedArguments(num_args, args.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
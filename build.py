@@ -71,6 +71,12 @@ def main():
         help="Run integration test after building to ensure correctness",
         action="store_true",
     )
+    parser.add_argument(
+        "--enable_benchmark",
+        default=False,
+        help="Build the microbenchmarks as securefs_bench",
+        action="store_true",
+    )
     parser.add_argument(
         "--triplet",
         default="" if os.name != "nt" else "x64-windows-static-md",
@@ -112,6 +118,8 @@ def main():
         configure_args.append("-DSECUREFS_ENABLE_UNIT_TEST=OFF")
     if not args.enable_integration_test:
         configure_args.append("-DSECUREFS_ENABLE_INTEGRATION_TEST=OFF")
+    if args.enable_benchmark:
+        configure_args.append("-DSECUREFS_ENABLE_BENCHMARK=ON")
     if args.lto:
         configure_args += [
             "-DCMAKE_INTERPROCEDURAL_OPTIMIZATION=ON",
@@ -1,12 +1,16 @@
 #include "btree_dir.h"
 #include "exceptions.h"
 #include "files.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "trace_events.h"
 
 #include <absl/strings/str_format.h>
 
 #include <algorithm>
 #include <iterator>
 #include <stdio.h>
+#include <string.h>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -199,32 +203,42 @@ void BtreeDirectory::deallocate_page(uint32_t num)
     set_num_free_page(get_num_free_page() + 1);
 }
 
+// On disk, every name occupies a fixed field that is zero padded, and its last byte is always
+// zero. Names are read from and written to the field in place, without a temporary copy.
+static constexpr size_t BTREE_FILENAME_FIELD_LENGTH = Directory::MAX_FILENAME_LENGTH + 1;
+
 bool BtreeNode::from_buffer(const byte* buffer, size_t size)
 {
     const byte* end_of_buffer = buffer + size;
 
+    // The existing storage is overwritten rather than released, so that a recycled node parses
+    // without allocating.
+    m_child_indices.clear();
     auto flag = read_little_endian_and_forward<uint32_t>(&buffer, end_of_buffer);
     if (flag == 0)
     {
+        m_entries.clear();
         return false;
     }
     auto child_num = read_little_endian_and_forward<uint16_t>(&buffer, end_of_buffer);
     auto entry_num = read_little_endian_and_forward<uint16_t>(&buffer, end_of_buffer);
 
+    m_child_indices.reserve(child_num);
     for (uint16_t i = 0; i < child_num; ++i)
     {
         m_child_indices.push_back(read_little_endian_and_forward<uint32_t>(&buffer, end_of_buffer));
     }
-    for (uint16_t i = 0; i < entry_num; ++i)
+    m_entries.resize(entry_num);
+    for (DirEntry& e : m_entries)
     {
-        DirEntry e;
-        std::array<char, Directory::MAX_FILENAME_LENGTH + 1> filename;
-        buffer = read_and_forward(buffer, end_of_buffer, filename);
+        dir_check(buffer + BTREE_FILENAME_FIELD_LENGTH <= end_of_buffer);
+        auto name = reinterpret_cast<const char*>(buffer);
+        auto name_end
+            = static_cast<const char*>(memchr(name, 0, Directory::MAX_FILENAME_LENGTH));
+        e.filename.assign(name, name_end ? name_end - name : Directory::MAX_FILENAME_LENGTH);
+        buffer += BTREE_FILENAME_FIELD_LENGTH;
         buffer = read_and_forward(buffer, end_of_buffer, e.id);
         buffer = read_and_forward(buffer, end_of_buffer, e.type);
-        filename.back() = 0;
-        e.filename = filename.data();
-        m_entries.push_back(std::move(e));
     }
     return true;
 }
@@ -247,10 +261,10 @@ void BtreeNode::to_buffer(byte* buffer, size_t size) const
     {
         if (e.filename.size() > Directory::MAX_FILENAME_LENGTH)
             throwVFSException(ENAMETOOLONG);
-        std::array<char, Directory::MAX_FILENAME_LENGTH + 1> filename;
-        filename.fill(0);
-        std::copy(e.filename.begin(), e.filename.end(), filename.begin());
-        buffer = write_and_forward(filename, buffer, end_of_buffer);
+        dir_check(buffer + BTREE_FILENAME_FIELD_LENGTH <= end_of_buffer);
+        memcpy(buffer, e.filename.data(), e.filename.size());
+        memset(buffer + e.filename.size(), 0, BTREE_FILENAME_FIELD_LENGTH - e.filename.size());
+        buffer += BTREE_FILENAME_FIELD_LENGTH;
         buffer = write_and_forward(e.id, buffer, end_of_buffer);
         buffer = write_and_forward(e.type, buffer, end_of_buffer);
     }
@@ -258,6 +272,8 @@ void BtreeNode::to_buffer(byte* buffer, size_t size) const
 
 BtreeDirectory::~BtreeDirectory()
 {
+    // First, so that the budget no longer reclaims from a directory being destroyed.
+    m_node_budget.remove_directory(this);
     try
     {
         flush_cache();
@@ -265,6 +281,7 @@ BtreeDirectory::~BtreeDirectory()
     catch (...)
     {
     }
+    m_node_budget.release(m_node_cache.size() + m_spare_nodes.size());
 }
 
 void BtreeDirectory::flush_cache()
@@ -307,7 +324,111 @@ bool BtreeDirectory::validate_node(const BtreeNode* n, int depth)
     return true;
 }
 
-void BtreeDirectory::clear_cache() { m_node_cache.clear(); }
+void BtreeDirectory::clear_cache()
+{
+    for (auto&& pair : m_node_cache)
+        recycle_node(std::move(pair.second));
+    m_node_cache.clear();
+}
+
+void BtreeDirectory::recycle_node(std::unique_ptr<Node> n)
+{
+    // Spare nodes count against the budget like cached ones, so they are only kept while it
+    // has room.
+    if (m_spare_nodes.size() < kMaxSpareNodes && !m_node_budget.is_exceeded())
+        m_spare_nodes.push_back(std::move(n));
+    else
+        m_node_budget.release(1);
+}
+
+void BtreeDirectory::release_spare_nodes()
+{
+    m_node_budget.release(m_spare_nodes.size());
+    m_spare_nodes.clear();
+}
+
+void BtreeDirectory::trim_cache()
+{
+    m_last_use.store(m_node_budget.tick(), std::memory_order_relaxed);
+    // Under global pressure, the idle directories are emptied first, and then this one shrinks to
+    // little more than its upper levels if that was not enough.
+    if (m_node_budget.is_exceeded())
+        m_node_budget.reclaim(this);
+    bool under_pressure = m_node_budget.is_exceeded();
+    if (under_pressure)
+        release_spare_nodes();
+    size_t limit = under_pressure ? kMinCachedNodes : kMaxCachedNodes;
+    if (m_node_cache.size() <= limit)
+        return;
+    // Shrink below the limit, so that the sorting below is amortized over many operations.
+    evict_clean_nodes(limit - limit / 4);
+}
+
+void BtreeDirectory::evict_clean_nodes(size_t target)
+{
+    if (m_node_cache.size() <= target)
+        return;
+    std::vector<std::pair<uint64_t, uint32_t>> candidates;
+    candidates.reserve(m_node_cache.size());
+    for (auto&& pair : m_node_cache)
+    {
+        // Dirty nodes are left for `subflush()` to write back.
+        if (!pair.second->is_dirty())
+            candidates.emplace_back(pair.second->last_access(), pair.first);
+    }
+    size_t num_evicted = std::min(candidates.size(), m_node_cache.size() - target);
+    std::nth_element(candidates.begin(), candidates.begin() + num_evicted, candidates.end());
+    for (size_t i = 0; i < num_evicted; ++i)
+    {
+        auto iter = m_node_cache.find(candidates[i].second);
+        recycle_node(std::move(iter->second));
+        m_node_cache.erase(iter);
+    }
+}
+
+void BtreeNodeBudget::add_directory(BtreeDirectory* dir)
+{
+    LockGuard<Mutex> lg(m_mu);
+    m_directories.insert(dir);
+}
+
+void BtreeNodeBudget::remove_directory(BtreeDirectory* dir)
+{
+    LockGuard<Mutex> lg(m_mu);
+    m_directories.erase(dir);
+}
+
+void BtreeNodeBudget::reclaim(const BtreeDirectory* self)
+{
+    // One thread reclaiming at a time is enough, and the others go on with their operations.
+    UniqueLock<Mutex> lock(m_mu, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+    size_t target = m_max_nodes - m_max_nodes / 4;
+    std::vector<std::pair<uint64_t, BtreeDirectory*>> dirs;
+    dirs.reserve(m_directories.size());
+    for (BtreeDirectory* dir : m_directories)
+    {
+        if (dir != self)
+            dirs.emplace_back(dir->m_last_use.load(std::memory_order_relaxed), dir);
+    }
+    std::sort(dirs.begin(), dirs.end());
+    for (auto&& [last_use, dir] : dirs)
+    {
+        if (num_nodes() <= target)
+            break;
+        // The directories cannot be destroyed meanwhile, as that needs `m_mu` first. Only try
+        // their locks, since the thread calling us holds the lock of another directory.
+        [](BtreeDirectory* dir) ABSL_NO_THREAD_SAFETY_ANALYSIS
+        {
+            if (!dir->try_lock())
+                return;
+            DEFER(dir->unlock());
+            dir->evict_clean_nodes(0);
+            dir->release_spare_nodes();
+        }(dir);
+    }
+}
 
 BtreeNode* BtreeDirectory::retrieve_existing_node(uint32_t num)
 {
@@ -324,10 +445,31 @@ BtreeDirectory::Node* BtreeDirectory::retrieve_node(uint32_t parent_num, uint32_
     {
         auto n = iter->second.get();
         dir_check(parent_num == INVALID_PAGE || parent_num == n->parent_page_number());
+        n->touch(++m_access_clock);
         return n;
     }
-    auto n = make_unique<Node>(parent_num, num);
-    read_node(num, *n);
+    std::unique_ptr<Node> n;
+    if (m_spare_nodes.empty())
+    {
+        n = make_unique<Node>(parent_num, num);
+        m_node_budget.acquire(1);
+    }
+    else
+    {
+        n = std::move(m_spare_nodes.back());
+        m_spare_nodes.pop_back();
+        n->reset(parent_num, num);
+    }
+    try
+    {
+        read_node(num, *n);
+    }
+    catch (...)
+    {
+        recycle_node(std::move(n));
+        throw;
+    }
+    n->touch(++m_access_clock);
     auto result = n.get();
     m_node_cache.emplace(num, std::move(n));
     return result;
@@ -373,6 +515,7 @@ BtreeNode* BtreeDirectory::get_root_node()
 std::optional<std::string_view>
 BtreeDirectory::get_entry_impl(std::string_view name, id_type& id, int& type)
 {
+    trim_cache();
     if (name.size() > MAX_FILENAME_LENGTH)
         throwVFSException(ENAMETOOLONG);
 
@@ -397,6 +540,7 @@ bool BtreeDirectory::read_node(uint32_t num, BtreeDirectory::Node& n)
 {
     if (num == INVALID_PAGE)
         throw CorruptedDirectoryException();
+    trace::ScopedSpan span("stage", "btree_read_node", BLOCK_SIZE);
     byte buffer[BLOCK_SIZE];
     dir_check(m_stream->read(buffer, num * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
     return n.from_buffer(buffer, array_length(buffer));
@@ -413,6 +557,7 @@ void BtreeDirectory::write_node(uint32_t num, const BtreeDirectory::Node& n)
 
 bool BtreeDirectory::add_entry_impl(std::string_view name, const id_type& id, int type)
 {
+    trim_cache();
     if (name.size() > MAX_FILENAME_LENGTH)
         throwVFSException(ENAMETOOLONG);
 
@@ -515,7 +660,11 @@ void BtreeDirectory::del_node(BtreeNode* n)
     if (!n)
         return;
     deallocate_page(n->page_number());
-    m_node_cache.erase(n->page_number());
+    auto iter = m_node_cache.find(n->page_number());
+    if (iter == m_node_cache.end())
+        return;
+    recycle_node(std::move(iter->second));
+    m_node_cache.erase(iter);
 }
 
 std::pair<ptrdiff_t, BtreeNode*> BtreeDirectory::find_sibling(const BtreeNode* parent,
@@ -626,6 +775,7 @@ void BtreeDirectory::balance_up(BtreeNode* n, int depth)
 
 bool BtreeDirectory::remove_entry_impl(std::string_view name, id_type& id, int& type)
 {
+    trim_cache();
     if (name.size() > MAX_FILENAME_LENGTH)
         throwVFSException(ENAMETOOLONG);
 
@@ -740,18 +890,92 @@ void BtreeDirectory::mutable_recursive_iterate(BtreeNode* n, const Callback& cb,
 
 void BtreeDirectory::iterate_over_entries_impl(const BtreeDirectory::callback& cb)
 {
+    trim_cache();
     auto root = get_root_node();
     if (root)
         recursive_iterate(root, cb, 0);
 }
 
-void BtreeDirectory::rebuild()
+bool BtreeDirectory::resumable_iterate(const BtreeNode* n,
+                                       std::optional<std::string_view> after,
+                                       const resumable_callback& cb,
+                                       int depth)
 {
+    dir_check(depth < BTREE_MAX_DEPTH);
+    size_t start = 0;
+    if (after)
+    {
+        start = std::upper_bound(n->entries().begin(),
+                                 n->entries().end(),
+                                 *after,
+                                 [this](std::string_view name, const DirEntry& e)
+                                 { return cmpfn_(name, e.filename) < 0; })
+            - n->entries().begin();
+    }
+    for (size_t i = start; i <= n->entries().size(); ++i)
+    {
+        // Only the subtree left of the first unvisited entry may still hold visited ones.
+        if (!n->is_leaf()
+            && !resumable_iterate(retrieve_node(n->page_number(), n->children()[i]),
+                                  i == start ? after : std::nullopt,
+                                  cb,
+                                  depth + 1))
+            return false;
+        if (i < n->entries().size())
+        {
+            const DirEntry& e = n->entries()[i];
+            if (!cb(e.filename, e.id, e.type, m_cookies.remember(e.filename)))
+                return false;
+        }
+    }
+    return true;
+}
+
+void BtreeDirectory::iterate_over_entries_from_impl(uint64_t cookie,
+                                                    const resumable_callback& cb)
+{
+    trim_cache();
     auto root = get_root_node();
     if (!root)
         return;
+    if (cookie == 0)
+    {
+        resumable_iterate(root, std::nullopt, cb, 0);
+        return;
+    }
 
+    std::string after;
+    if (const std::string* name = m_cookies.recall(cookie))
+    {
+        after = *name;
+    }
+    else
+    {
+        // Forgotten, but still present if the entry was not removed.
+        recursive_iterate(
+            root,
+            [&](const std::string& filename, const id_type&, int)
+            {
+                if (after.empty() && ReaddirCookies::cookie_of(filename) == cookie)
+                    after = filename;
+            },
+            0);
+        if (after.empty())
+        {
+            WARN_LOG("Directory listing cannot resume from a forgotten cookie");
+            return;
+        }
+    }
+    resumable_iterate(root, after, cb, 0);
+}
+
+std::vector<DirEntry> BtreeDirectory::take_all_entries()
+{
     std::vector<DirEntry> entries;
+    auto root = get_root_node();
+    if (!root)
+        return entries;
+
     entries.reserve(this->m_stream->size() / BLOCK_SIZE * BTREE_MAX_NUM_ENTRIES);
     mutable_recursive_iterate(root, [&](DirEntry&& e) { entries.push_back(std::move(e)); }, 0);
     clear_cache();    // root is invalid after this line
@@ -759,8 +983,130 @@ void BtreeDirectory::rebuild()
     set_num_free_page(0);
     set_start_free_page(INVALID_PAGE);
     set_root_page(INVALID_PAGE);
+    return entries;
+}
+
+void BtreeDirectory::sort_and_deduplicate(std::vector<DirEntry>& entries)
+{
+    // Stable, so that of the entries with equal names, the earliest one is kept.
+    std::stable_sort(entries.begin(), entries.end(), dir_entry_cmp());
+    entries.erase(std::unique(entries.begin(),
+                              entries.end(),
+                              [this](const DirEntry& e1, const DirEntry& e2)
+                              { return cmpfn_(e1.filename, e2.filename) == 0; }),
+                  entries.end());
+}
+
+// Builds the tree level by level from sorted entries, starting with the leaves. Each level is
+// split into as few nodes as possible, and the entries between adjacent nodes move up to form the
+// next level. Nodes are written out as soon as they are complete, without going through the cache.
+void BtreeDirectory::bulk_load(std::vector<DirEntry> entries)
+{
+    dir_check(get_root_page() == INVALID_PAGE);
+    if (entries.empty())
+        return;
+
+    typedef std::move_iterator<std::vector<DirEntry>::iterator> entry_move_iterator;
+    std::vector<uint32_t> children;    // Pages of the level below, empty for the leaves
+
+    for (int depth = 0; depth < BTREE_MAX_DEPTH; ++depth)
+    {
+        // With `num_nodes` nodes, `num_nodes - 1` entries are reserved as separators. The count
+        // is the smallest such that every node gets at most BTREE_MAX_NUM_ENTRIES, and the
+        // remaining entries are spread evenly, which keeps every node at least half full.
+        size_t num_nodes
+            = (entries.size() + BTREE_MAX_NUM_ENTRIES + 1) / (BTREE_MAX_NUM_ENTRIES + 1);
+        size_t num_stored = entries.size() - (num_nodes - 1);
+
+        std::vector<DirEntry> separators;
+        std::vector<uint32_t> pages;
+        separators.reserve(num_nodes - 1);
+        pages.reserve(num_nodes);
+
+        auto entry_iter = entries.begin();
+        auto child_iter = children.begin();
+        for (size_t i = 0; i < num_nodes; ++i)
+        {
+            size_t count = num_stored / num_nodes + (i < num_stored % num_nodes ? 1 : 0);
+            Node n(INVALID_PAGE, allocate_page());
+            n.mutable_entries().assign(entry_move_iterator(entry_iter),
+                                       entry_move_iterator(entry_iter + count));
+            entry_iter += count;
+            if (!children.empty())
+            {
+                n.mutable_children().assign(child_iter, child_iter + count + 1);
+                child_iter += count + 1;
+            }
+            if (i + 1 < num_nodes)
+            {
+                separators.push_back(std::move(*entry_iter));
+                ++entry_iter;
+            }
+            write_node(n.page_number(), n);
+            pages.push_back(n.page_number());
+        }
+        dir_check(entry_iter == entries.end() && child_iter == children.end());
+
+        if (num_nodes == 1)
+        {
+            set_root_page(pages.front());
+            return;
+        }
+        entries = std::move(separators);
+        children = std::move(pages);
+    }
+    throw CorruptedDirectoryException();
+}
+
+void BtreeDirectory::rebuild()
+{
+    auto entries = take_all_entries();
+    // The entries come out of the tree sorted, unless it is corrupted.
+    if (!std::is_sorted(entries.begin(), entries.end(), dir_entry_cmp()))
+        sort_and_deduplicate(entries);
+    bulk_load(std::move(entries));
+}
+
+size_t BtreeDirectory::add_entries(std::vector<DirEntry> entries)
+{
+    trim_cache();
+    for (const DirEntry& e : entries)
+    {
+        if (e.filename.size() > MAX_FILENAME_LENGTH)
+            throwVFSException(ENAMETOOLONG);
+    }
+    if (entries.empty())
+        return 0;
+    update_mtime_helper();
+    sort_and_deduplicate(entries);
+
+    size_t num_pages = m_stream->size() / BLOCK_SIZE - get_num_free_page();
+    if (get_root_page() == INVALID_PAGE || entries.size() >= num_pages * BTREE_MAX_NUM_ENTRIES)
+    {
+        // Rebuilding costs about as much as the existing tree is large, so it pays off when the
+        // batch is at least as large as the tree.
+        auto existing = take_all_entries();
+        size_t num_existing = existing.size();
+        steal(existing, entries);
+        sort_and_deduplicate(existing);
+        size_t num_added = existing.size() - num_existing;
+        bulk_load(std::move(existing));
+        return num_added;
+    }
+
+    // Inserting in sorted order keeps consecutive insertions on the same path of the tree.
+    size_t num_added = 0;
     for (DirEntry& e : entries)
-        add_entry(e.filename, e.id, e.type);
+    {
+        BtreeNode* node;
+        bool is_equal;
+        std::tie(node, std::ignore, is_equal) = find_node(e.filename);
+        if (is_equal)
+            continue;
+        insert_and_balance(node, std::move(e), INVALID_PAGE, 0);
+        ++num_added;
+    }
+    return num_added;
 }
 
 bool BtreeDirectory::empty()
@@ -3,6 +3,7 @@
 #include "files.h"
 #include "myutils.h"
 
+#include <atomic>
 #include <memory>
 #include <stdio.h>
 #include <string>
@@ -11,6 +12,7 @@
 #include <vector>
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
 namespace securefs
 {
@@ -23,12 +25,6 @@ static_assert(BTREE_MAX_NUM_ENTRIES * (Directory::MAX_FILENAME_LENGTH + 1 + ID_L
                   <= BLOCK_SIZE,
               "A btree node may not fit in a single block");
 
-class CorruptedDirectoryException : public VerificationException
-{
-public:
-    std::string message() const override { return "Directory corrupted"; }
-};
-
 class DirEntry
 {
 public:
@@ -44,6 +40,7 @@ private:
     std::vector<uint32_t> m_child_indices;
     std::vector<DirEntry> m_entries;
     bool m_dirty;
+    uint64_t m_last_access = 0;
 
 public:
     explicit BtreeNode(uint32_t parent, uint32_t num)
@@ -56,6 +53,7 @@ public:
         , m_child_indices(std::move(other.m_child_indices))
         , m_entries(std::move(other.m_entries))
         , m_dirty(false)
+        , m_last_access(other.m_last_access)
     {
         std::swap(m_dirty, other.m_dirty);
         other.m_num = INVALID_PAGE;
@@ -70,9 +68,22 @@ public:
         std::swap(m_dirty, other.m_dirty);
         std::swap(m_num, other.m_num);
         std::swap(m_parent_num, other.m_parent_num);
+        std::swap(m_last_access, other.m_last_access);
         return *this;
     }
 
+    // Reassigns the node to another page, keeping its storage for `from_buffer` to reuse.
+    void reset(uint32_t parent, uint32_t num) noexcept
+    {
+        m_parent_num = parent;
+        m_num = num;
+        m_dirty = false;
+        m_last_access = 0;
+    }
+
+    uint64_t last_access() const noexcept { return m_last_access; }
+    void touch(uint64_t clock) noexcept { m_last_access = clock; }
+
     uint32_t page_number() const { return m_num; }
     uint32_t parent_page_number() const { return m_parent_num; }
     uint32_t& mutable_parent_page_number()
@@ -108,6 +119,47 @@ public:
     void to_buffer(byte* buffer, size_t size) const;
 };
 
+class BtreeDirectory;
+
+/// Bounds the B-tree nodes kept in memory, summed over all directories. Both the nodes in the
+/// caches and the spare ones kept for reuse count.
+///
+/// Every directory registers itself, so that when the budget is exceeded, the nodes of the
+/// directories least recently used are released first, including those of directories that sit
+/// idle in the cache of closed files.
+class BtreeNodeBudget
+{
+public:
+    static constexpr inline size_t kDefaultMaxNodes = 16384;
+
+    INJECT(BtreeNodeBudget()) : BtreeNodeBudget(kDefaultMaxNodes) {}
+    explicit BtreeNodeBudget(size_t max_nodes) : m_max_nodes(max_nodes) {}
+    DISABLE_COPY_MOVE(BtreeNodeBudget)
+
+    void acquire(size_t count) noexcept { m_num_nodes.fetch_add(count, std::memory_order_relaxed); }
+    void release(size_t count) noexcept { m_num_nodes.fetch_sub(count, std::memory_order_relaxed); }
+    bool is_exceeded() const noexcept
+    {
+        return m_num_nodes.load(std::memory_order_relaxed) > m_max_nodes;
+    }
+    size_t num_nodes() const noexcept { return m_num_nodes.load(std::memory_order_relaxed); }
+    uint64_t tick() noexcept { return m_clock.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+    void add_directory(BtreeDirectory* dir);
+    void remove_directory(BtreeDirectory* dir);
+    /// Releases the clean nodes of other directories, the least recently used first, until the
+    /// budget has a quarter of room again. Directories locked by someone, which includes those of
+    /// the operation in progress, are skipped rather than waited for.
+    void reclaim(const BtreeDirectory* self);
+
+private:
+    std::atomic<size_t> m_num_nodes{0};
+    std::atomic<uint64_t> m_clock{0};
+    size_t m_max_nodes;
+    Mutex m_mu;
+    absl::flat_hash_set<BtreeDirectory*> m_directories ABSL_GUARDED_BY(m_mu);
+};
+
 class BtreeDirectory final : public Directory
 {
 private:
@@ -116,7 +168,24 @@ private:
     class FreePage;
 
 private:
+    // Parsed nodes persist across operations, so that lookups in a hot directory need no reads
+    // or decryption. Clean nodes are evicted least recently used first, and only at the start of
+    // an operation, because an operation in progress relies on the nodes along its path staying
+    // in the cache, and the name returned by `get_entry_impl` points into a cached node.
+    static constexpr inline size_t kMaxCachedNodes = 1024, kMinCachedNodes = 16;
+    // Evicted nodes are kept for reuse while the budget has room, so that their vectors and
+    // names need no allocations the next time a page is parsed.
+    static constexpr inline size_t kMaxSpareNodes = 64;
+
     absl::flat_hash_map<uint32_t, std::unique_ptr<Node>> m_node_cache;
+    std::vector<std::unique_ptr<Node>> m_spare_nodes;
+    BtreeNodeBudget& m_node_budget;
+    ReaddirCookies m_cookies;
+    uint64_t m_access_clock = 0;
+    // The tick of the budget at the last operation, read by the budget without the lock.
+    std::atomic<uint64_t> m_last_use{0};
+
+    friend class BtreeNodeBudget;
 
 private:
     bool read_node(uint32_t, Node&) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
@@ -132,6 +201,10 @@ private:
     Node* get_root_node() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void flush_cache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void clear_cache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void trim_cache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void evict_clean_nodes(size_t target) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void release_spare_nodes() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void recycle_node(std::unique_ptr<Node> n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void adjust_children_in_cache(BtreeNode* n, uint32_t parent)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void adjust_children_in_cache(BtreeNode* n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
@@ -154,6 +227,10 @@ private:
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void balance_up(Node*, int depth) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
+    void sort_and_deduplicate(std::vector<DirEntry>& entries);
+    std::vector<DirEntry> take_all_entries() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void bulk_load(std::vector<DirEntry> entries) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
     bool validate_node(const Node* n, int depth) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void write_dot_graph(const Node*, FILE*) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
@@ -163,6 +240,10 @@ private:
     template <class Callback>
     void mutable_recursive_iterate(Node* n, const Callback& cb, int depth)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    bool resumable_iterate(const Node* n,
+                           std::optional<std::string_view> after,
+                           const resumable_callback& cb,
+                           int depth) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
 protected:
     void subflush() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
@@ -177,7 +258,8 @@ public:
                           ANNOTATED(tBlockSize, unsigned) block_size,
                           ANNOTATED(tIvSize, unsigned) iv_size,
                           ANNOTATED(tMaxPaddingSize, unsigned) max_padding_size,
-                          ANNOTATED(tStoreTimeWithinFs, bool) store_time))
+                          ANNOTATED(tStoreTimeWithinFs, bool) store_time,
+                          BtreeNodeBudget& node_budget))
         : Directory(cmpfn,
                     std::move(data_stream),
                     std::move(meta_stream),
@@ -188,7 +270,9 @@ public:
                     iv_size,
                     max_padding_size,
                     store_time)
+        , m_node_budget(node_budget)
     {
+        m_node_budget.add_directory(this);
     }
 
     ~BtreeDirectory() override;
@@ -202,6 +286,8 @@ protected:
     bool remove_entry_impl(std::string_view name, id_type& id, int& type) override
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     void iterate_over_entries_impl(const callback&) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void iterate_over_entries_from_impl(uint64_t cookie, const resumable_callback& cb) override
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
 private:
     auto dir_entry_cmp()
@@ -215,6 +301,15 @@ public:
     bool is_dirty() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) override;
     void rebuild() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
+    /**
+     * Adds many entries at once, which is far cheaper than calling `add_entry` for each of them.
+     * When the batch is large compared to the existing directory, the whole B-tree is built
+     * bottom up so that every page is written exactly once.
+     * Entries whose names already exist, or repeat within the batch, are skipped.
+     * Returns the number of entries actually added.
+     */
+    size_t add_entries(std::vector<DirEntry> entries) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
 public:
     bool validate_free_list() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
     bool validate_btree_structure() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
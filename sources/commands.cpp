@@ -1,26 +1,34 @@
 #include "commands.h"
 #include "btree_dir.h"
+#include "control_dir.h"
 #include "crypto.h"
 #include "exceptions.h"
 #include "files.h"
 #include "full_format.h"
+#include "full_format_low_level.h"
 #include "fuse2_workaround.h"
 #include "fuse_high_level_ops_base.h"
 #include "git-version.h"
 #include "lite_format.h"
+#include "lite_format_low_level.h"
 #include "lock_enabled.h"
 #include "logger.h"
 #include "myutils.h"
 #include "object.h"
+#include "op_recording.h"
+#include "operation_stats.h"
 #include "params.pb.h"
 #include "params_io.h"
 #include "platform.h"
 #include "tags.h"
+#include "trace_events.h"
 
 #include <absl/strings/escaping.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
 #include <argon2.h>
 #include <cryptopp/cpu.h>
 #include <cryptopp/hmac.h>
@@ -40,6 +48,7 @@
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
@@ -273,6 +282,14 @@ private:
         std::string(kSensitive),
         absl::StrCat(kSensitive, "/", kInsensitive),
         cmdline()};
+    TCLAP::SwitchArg hash_dirs{
+        "",
+        "hash-dirs",
+        "(For full format only) Index directories by hashes of their names instead of a B-tree. "
+        "Lookups in huge directories become faster, but listings are no longer sorted. "
+        "Older versions of securefs cannot mount such repositories.",
+        cmdline(),
+        false};
 
 private:
     static void randomize(std::string* str, size_t size)
@@ -348,6 +365,10 @@ public:
                          kInsensitive,
                          kInsensitive);
             }
+            if (hash_dirs.getValue())
+            {
+                params.mutable_full_format_params()->set_hash_indexed_directories(true);
+            }
         }
         else
         {
@@ -494,36 +515,16 @@ public:
     }
 };
 
-class MountCommand : public CommandBase
+// Opens an existing repository and builds the filesystem on it, for the commands that mount it
+// and for those that only call into the filesystem, such as replay. Only the options that shape
+// the filesystem itself are here; those of FUSE belong to `MountCommand`.
+class FilesystemCommand : public CommandBase
 {
-private:
-#ifdef __linux__
-    static constexpr inline long kKnownFileSystemTypesWithStableInodes[] = {
-        0x9123683E,    // BTRFS
-        0x2011BAB0,    // EXFAT
-        0x137D,        // EXT
-        0xEF53,        // EXT 2/3/4
-        0xEF51,        // EXT 2 old
-        0x4244,        // HFS
-        0x482B,        // HFS+
-        0x4858,        // HFSX
-        0x5346544E,    // NTFS
-        0x01021994,    // TMPFS
-        0x58465342,    // XFS
-        0x2FC12FC1,    // ZFS
-    };
-#endif
-
+protected:
     SinglePasswordHolder single_pass_holder_{cmdline()};
 
-    TCLAP::SwitchArg single_threaded{"s", "single", "Single threaded mode", cmdline()};
-    TCLAP::SwitchArg background{"b",
-                                "background",
-                                "Run securefs in the background (currently no effect on Windows)",
-                                cmdline()};
     TCLAP::SwitchArg insecure{
         "i", "insecure", "Disable all integrity verification (insecure mode)", cmdline()};
-    TCLAP::SwitchArg noxattr{"x", "noxattr", "Disable built-in xattr support", cmdline()};
     TCLAP::SwitchArg verbose{"v", "verbose", "Logs more verbose messages", cmdline()};
     TCLAP::SwitchArg trace{
         "", "trace", "Trace all calls into `securefs` (implies --verbose)", cmdline()};
@@ -534,45 +535,26 @@ private:
                                      "",
                                      "path",
                                      cmdline()};
+    TCLAP::ValueArg<std::string> trace_events{
+        "",
+        "trace-events",
+        "Path of a file to which every operation, and the stages inside it such as decryption and "
+        "the IO underneath, are written as Chrome trace events. Open it in chrome://tracing or "
+        "https://ui.perfetto.dev to see where the time goes.",
+        false,
+        "",
+        "path",
+        cmdline()};
     TCLAP::SwitchArg win_symlink{
         "",
         "win-symlink",
         "Enable symlink support on Windows at the cost of performance. No effect otherwise.",
         cmdline()};
-    TCLAP::MultiArg<std::string> fuse_options{
-        "o",
-        "opt",
-        "Additional FUSE options; this may crash the filesystem; use only for testing!",
-        false,
-        "options",
-        cmdline()};
-    TCLAP::UnlabeledValueArg<std::string> mount_point{
-        "mount_point", "Mount point", true, "", "mount_point", cmdline()};
-    TCLAP::ValueArg<std::string> fsname{
-        "", "fsname", "Filesystem name shown when mounted", false, "securefs", "fsname", cmdline()};
-    TCLAP::ValueArg<std::string> fssubtype{"",
-                                           "fssubtype",
-                                           "Filesystem subtype shown when mounted",
-                                           false,
-                                           "securefs",
-                                           "fssubtype",
-                                           cmdline()};
     TCLAP::SwitchArg noflock{"",
                              "noflock",
                              "Disables the usage of file locking. Needed on some network "
                              "filesystems. May cause data loss, so use it at your own risk!",
                              cmdline()};
-    TCLAP::ValueArg<std::string> use_ino{
-        "",
-        "use-ino",
-        "Asking libfuse to use the inode number reported by securefs as is. This may be needed if "
-        "the application reads inode number. For full format, this should always be on. For lite "
-        "format, the user needs to manually turn this on when the underlying filesystem has stable "
-        "inode numbers (e.g. ext4, APFS, ZFS).",
-        false,
-        "auto",
-        "auto/true/false",
-        cmdline()};
     TCLAP::ValueArg<std::string> normalization{"",
                                                "normalization",
                                                "Mode of filename normalization. Valid values: "
@@ -593,8 +575,36 @@ private:
                                       30,
                                       "int",
                                       cmdline()};
-    TCLAP::SwitchArg skip_dot_dot{
-        "", "skip-dot-dot", "A no-op option retained for backwards compatibility", cmdline()};
+    TCLAP::SwitchArg attr_cache{"",
+                                "attr-cache",
+                                "Also cache file attributes and nonexistent paths inside securefs "
+                                "for the duration of --attr-timeout. Only effective on lite format.",
+                                cmdline()};
+    TCLAP::ValueArg<unsigned> max_cached_files{
+        "",
+        "max-cached-files",
+        "Number of closed files to keep open for reuse. Each holds two file descriptors on the "
+        "underlying filesystem. Only effective on full format.",
+        false,
+        1600,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<std::string> atime{
+        "",
+        "atime",
+        "When reads update the access time of files. Valid values: noatime, relatime, "
+        "strictatime. Only effective on full format with timestamps stored.",
+        false,
+        "relatime",
+        "noatime/relatime/strictatime",
+        cmdline()};
+    TCLAP::SwitchArg lazytime{
+        "",
+        "lazytime",
+        "Keeps updates that change nothing but timestamps in memory, and writes them back "
+        "periodically, on fsync, or when the file is dropped from the cache. Timestamps may be "
+        "lost on a crash. Only effective on full format.",
+        cmdline()};
     TCLAP::SwitchArg plain_text_names{"",
                                       "plain-text-names",
                                       "When enabled, securefs does not encrypt or decrypt file "
@@ -620,52 +630,21 @@ private:
         cmdline()};
     DecryptedSecurefsParams fsparams{};
 
-private:
-    std::vector<const char*> to_c_style_args(const std::vector<std::string>& args)
-    {
-        std::vector<const char*> result(args.size());
-        std::transform(args.begin(),
-                       args.end(),
-                       result.begin(),
-                       [](const std::string& s) { return s.c_str(); });
-        return result;
-    }
-#ifdef _WIN32
-    static bool is_letter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
-    static bool is_drive_mount(std::string_view mount_point)
-    {
-        return mount_point.size() == 2 && is_letter(mount_point[0]) && mount_point[1] == ':';
-    }
-    static bool is_network_mount(std::string_view mount_point)
-    {
-        return absl::StartsWith(mount_point, "\\\\") && !absl::StartsWith(mount_point, "\\\\?\\");
-    }
-#endif
-
-    static std::string escape_args(const std::vector<std::string>& args)
-    {
-        std::string result;
-        for (const auto& a : args)
-        {
-            result.push_back('\"');
-            result.append(absl::Utf8SafeCEscape(a));
-            result.push_back('\"');
-            result.push_back(' ');
-        }
-        if (!result.empty())
-        {
-            result.pop_back();
-        }
-        return result;
-    }
 
     static key_type from_byte_string(std::string_view view)
     {
         return key_type{reinterpret_cast<const byte*>(view.data()), view.size()};
     }
 
-    static fruit::Component<FuseHighLevelOpsBase>
-    get_fuse_high_ops_component(const MountCommand* cmd)
+#ifdef _WIN32
+    using FuseOpsComponent = fruit::Component<FuseHighLevelOpsBase>;
+    using FuseOpsInjector = fruit::Injector<FuseHighLevelOpsBase>;
+#else
+    using FuseOpsComponent = fruit::Component<FuseHighLevelOpsBase, FuseLowLevelOpsBase>;
+    using FuseOpsInjector = fruit::Injector<FuseHighLevelOpsBase, FuseLowLevelOpsBase>;
+#endif
+
+    static FuseOpsComponent get_fuse_high_ops_component(const FilesystemCommand* cmd)
     {
         auto internal_binder = [](DecryptedSecurefsParams::FormatSpecificParamsCase format_case)
             -> fruit::Component<
@@ -684,15 +663,38 @@ private:
                 throwInvalidArgumentException("Unknown format case");
             }
         };
+#ifndef _WIN32
+        auto internal_low_level_binder
+            = [](DecryptedSecurefsParams::FormatSpecificParamsCase format_case)
+            -> fruit::Component<
+                fruit::Required<lite_format::FuseLowLevelOps, full_format::FuseLowLevelOps>,
+                FuseLowLevelOpsBase>
+        {
+            switch (format_case)
+            {
+            case DecryptedSecurefsParams::kLiteFormatParams:
+                return fruit::createComponent()
+                    .bind<FuseLowLevelOpsBase, lite_format::FuseLowLevelOps>();
+            case DecryptedSecurefsParams::kFullFormatParams:
+                return fruit::createComponent()
+                    .bind<FuseLowLevelOpsBase, full_format::FuseLowLevelOps>();
+            default:
+                throwInvalidArgumentException("Unknown format case");
+            }
+        };
+#endif
 
         return fruit::createComponent()
             .bindInstance(*cmd)
             .install(+internal_binder, cmd->fsparams.format_specific_params_case())
+#ifndef _WIN32
+            .install(+internal_low_level_binder, cmd->fsparams.format_specific_params_case())
+#endif
             .install(::securefs::lite_format::get_name_translator_component)
             .install(full_format::get_table_io_component,
                      cmd->fsparams.full_format_params().legacy_file_table_io())
-            .registerProvider<lite_format::NameNormalizationFlags(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<lite_format::NameNormalizationFlags(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 {
                     lite_format::NameNormalizationFlags flags{};
                     if (cmd.plain_text_names.getValue())
@@ -721,27 +723,30 @@ private:
                         = cmd.fsparams.lite_format_params().long_name_threshold();
                     return flags;
                 })
-            .registerProvider<fruit::Annotated<tVerify, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return !cmd.insecure.getValue(); })
-            .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tVerify, bool>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd) { return !cmd.insecure.getValue(); })
+            .registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return cmd.fsparams.full_format_params().store_time(); })
-            .registerProvider<fruit::Annotated<tReadOnly, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tReadOnly, bool>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 {
                     // TODO: Support readonly mounts.
                     return false;
                 })
-            .bind<Directory, BtreeDirectory>()
-            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .install(full_format::get_directory_component,
+                     cmd->fsparams.full_format_params().hash_indexed_directories())
+            .registerProvider<
+                fruit::Annotated<tMaxPaddingSize, unsigned>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return cmd.fsparams.size_params().max_padding_size(); })
-            .registerProvider<fruit::Annotated<tIvSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return cmd.fsparams.size_params().iv_size(); })
-            .registerProvider<fruit::Annotated<tBlockSize, unsigned>(const MountCommand&)>(
-                [](const MountCommand& cmd) { return cmd.fsparams.size_params().block_size(); })
-            .registerProvider<OwnerOverride(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tIvSize, unsigned>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd) { return cmd.fsparams.size_params().iv_size(); })
+            .registerProvider<fruit::Annotated<tBlockSize, unsigned>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
+                { return cmd.fsparams.size_params().block_size(); })
+            .registerProvider<OwnerOverride(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 {
                     OwnerOverride result{};
                     if (cmd.uid_override.getValue() != -1)
@@ -754,20 +759,23 @@ private:
                     }
                     return result;
                 })
-            .registerProvider<fruit::Annotated<tMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tMasterKey, key_type>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return from_byte_string(cmd.fsparams.full_format_params().master_key()); })
-            .registerProvider<fruit::Annotated<tNameMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tNameMasterKey, key_type>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return from_byte_string(cmd.fsparams.lite_format_params().name_key()); })
-            .registerProvider<fruit::Annotated<tContentMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<
+                fruit::Annotated<tContentMasterKey, key_type>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return from_byte_string(cmd.fsparams.lite_format_params().content_key()); })
-            .registerProvider<fruit::Annotated<tXattrMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<
+                fruit::Annotated<tXattrMasterKey, key_type>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return from_byte_string(cmd.fsparams.lite_format_params().xattr_key()); })
-            .registerProvider<fruit::Annotated<tPaddingMasterKey, key_type>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<
+                fruit::Annotated<tPaddingMasterKey, key_type>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 {
                     if (cmd.fsparams.size_params().max_padding_size() > 0
                         || !cmd.fsparams.lite_format_params().padding_key().empty())
@@ -775,10 +783,10 @@ private:
                     return key_type();
                 })
             .registerProvider(
-                [](const MountCommand& cmd)
+                [](const FilesystemCommand& cmd)
                 { return new OSService(cmd.single_pass_holder_.data_dir.getValue()); })
             .registerProvider(
-                [](const MountCommand& cmd)
+                [](const FilesystemCommand& cmd)
                 {
                     const auto& p = cmd.fsparams.full_format_params();
                     if (p.case_insensitive() && p.unicode_normalization_agnostic())
@@ -795,12 +803,327 @@ private:
                     }
                     return Directory::DirNameComparison{&binary_compare};
                 })
-            .registerProvider<fruit::Annotated<tCaseInsensitive, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
+            .registerProvider<fruit::Annotated<tCaseInsensitive, bool>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
                 { return cmd.fsparams.full_format_params().case_insensitive(); })
-            .registerProvider<fruit::Annotated<tEnableSymlink, bool>(const MountCommand&)>(
-                [](const MountCommand& cmd)
-                { return !is_windows() || cmd.win_symlink.getValue(); });
+            .registerProvider<fruit::Annotated<tEnableSymlink, bool>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
+                { return !is_windows() || cmd.win_symlink.getValue(); })
+            .registerProvider<
+                fruit::Annotated<tMaxCachedFiles, unsigned>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd) { return cmd.max_cached_files.getValue(); })
+            .registerProvider<TimeUpdatePolicy(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
+                {
+                    TimeUpdatePolicy result;
+                    if (cmd.atime.getValue() == "noatime")
+                    {
+                        result.atime = TimeUpdatePolicy::Atime::kNoAtime;
+                    }
+                    else if (cmd.atime.getValue() == "strictatime")
+                    {
+                        result.atime = TimeUpdatePolicy::Atime::kStrictAtime;
+                    }
+                    else if (cmd.atime.getValue() != "relatime")
+                    {
+                        throw_runtime_error("Invalid flag of --atime: " + cmd.atime.getValue());
+                    }
+                    result.lazy = cmd.lazytime.getValue();
+                    return result;
+                })
+            .registerProvider<fruit::Annotated<tAttrCacheTimeout, int>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd)
+                { return cmd.attr_cache.getValue() ? cmd.attr_timeout.getValue() : 0; })
+            .registerProvider<fruit::Annotated<tKernelCacheTimeout, int>(const FilesystemCommand&)>(
+                [](const FilesystemCommand& cmd) { return cmd.attr_timeout.getValue(); });
+    }
+
+    // Reads and decrypts the config into `fsparams`. Returns an exit code on failure, or 0.
+    int load_fsparams()
+    {
+        std::string config_content;
+        try
+        {
+            config_content
+                = OSService::get_default()
+                      .open_file_stream(
+                          single_pass_holder_.get_real_config_path_for_reading(), O_RDONLY, 0)
+                      ->as_string();
+        }
+        catch (const ExceptionBase& e)
+        {
+            if (e.error_number() == ENOENT)
+            {
+                ERROR_LOG("Encounter exception %s", e.what());
+                ERROR_LOG(
+                    "Config file %s does not exist. Perhaps you forget to run `create` command "
+                    "first?",
+                    single_pass_holder_.get_real_config_path_for_reading());
+                return 19;
+            }
+            throw;
+        }
+        fsparams
+            = decrypt(config_content,
+                      {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
+                      maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
+        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
+                                   single_pass_holder_.password.size());
+        return 0;
+    }
+
+    void set_log_level()
+    {
+        if (global_logger && verbose.getValue())
+            global_logger->set_level(LoggingLevel::kLogVerbose);
+        if (global_logger && trace.getValue())
+            global_logger->set_level(LoggingLevel::kLogTrace);
+    }
+
+    void recreate_logger()
+    {
+        if (log.isSet())
+        {
+            auto logger = Logger::create_file_logger(log.getValue());
+            delete global_logger;
+            global_logger = logger;
+        }
+        set_log_level();
+    }
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+
+        single_pass_holder_.get_password(false);
+        set_log_level();
+        set_lock_enabled(!noflock.getValue());
+    }
+};
+
+class MountCommand : public FilesystemCommand
+{
+private:
+#ifdef __linux__
+    static constexpr inline long kKnownFileSystemTypesWithStableInodes[] = {
+        0x9123683E,    // BTRFS
+        0x2011BAB0,    // EXFAT
+        0x137D,        // EXT
+        0xEF53,        // EXT 2/3/4
+        0xEF51,        // EXT 2 old
+        0x4244,        // HFS
+        0x482B,        // HFS+
+        0x4858,        // HFSX
+        0x5346544E,    // NTFS
+        0x01021994,    // TMPFS
+        0x58465342,    // XFS
+        0x2FC12FC1,    // ZFS
+    };
+#endif
+
+    TCLAP::SwitchArg single_threaded{"s", "single", "Single threaded mode", cmdline()};
+    TCLAP::SwitchArg background{"b",
+                                "background",
+                                "Run securefs in the background (currently no effect on Windows)",
+                                cmdline()};
+    TCLAP::SwitchArg noxattr{"x", "noxattr", "Disable built-in xattr support", cmdline()};
+    TCLAP::MultiArg<std::string> fuse_options{
+        "o",
+        "opt",
+        "Additional FUSE options; this may crash the filesystem; use only for testing!",
+        false,
+        "options",
+        cmdline()};
+    TCLAP::UnlabeledValueArg<std::string> mount_point{
+        "mount_point", "Mount point", true, "", "mount_point", cmdline()};
+    TCLAP::ValueArg<std::string> fsname{
+        "", "fsname", "Filesystem name shown when mounted", false, "securefs", "fsname", cmdline()};
+    TCLAP::ValueArg<std::string> fssubtype{"",
+                                           "fssubtype",
+                                           "Filesystem subtype shown when mounted",
+                                           false,
+                                           "securefs",
+                                           "fssubtype",
+                                           cmdline()};
+    TCLAP::ValueArg<std::string> use_ino{
+        "",
+        "use-ino",
+        "Asking libfuse to use the inode number reported by securefs as is. This may be needed if "
+        "the application reads inode number. For full format, this should always be on. For lite "
+        "format, the user needs to manually turn this on when the underlying filesystem has stable "
+        "inode numbers (e.g. ext4, APFS, ZFS).",
+        false,
+        "auto",
+        "auto/true/false",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> max_io_size{
+        "",
+        "max-io-size",
+        "Largest read, write and readahead request to ask the kernel for, in bytes. It is rounded "
+        "down to whole blocks of the filesystem, so that large transfers need no partial block. "
+        "The kernel may grant less. Not effective on Windows.",
+        false,
+        1u << 20,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> min_threads{
+        "",
+        "min-threads",
+        "Number of threads kept waiting for requests from FUSE. More are started while all of "
+        "them are busy, and the extra ones stop once --max-idle-threads are idle. Only "
+        "effective on Linux.",
+        false,
+        1,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> max_idle_threads{
+        "",
+        "max-idle-threads",
+        "Number of idle threads beyond which those serving requests from FUSE stop, so that "
+        "bursts of requests do not start and stop threads each time. Never less than "
+        "--min-threads. Only effective on Linux.",
+        false,
+        10,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> max_threads{"",
+                                          "max-threads",
+                                          "Maximum number of threads serving requests from FUSE. "
+                                          "0 means the number of CPUs. Only effective on Linux.",
+                                          false,
+                                          0,
+                                          "int",
+                                          cmdline()};
+    TCLAP::SwitchArg clone_fd{"",
+                              "clone-fd",
+                              "Gives each thread its own descriptor of the FUSE device, so that "
+                              "they do not contend on one. Only effective on Linux 4.2 or later.",
+                              cmdline()};
+    TCLAP::ValueArg<std::string> cpus{
+        "",
+        "cpus",
+        "Pins the threads serving requests from FUSE to these CPUs in turn, e.g. 0-3,8. To keep "
+        "them on one NUMA node, list the CPUs of that node. Only effective on Linux.",
+        false,
+        "",
+        "list",
+        cmdline()};
+    TCLAP::SwitchArg low_level{
+        "",
+        "low-level",
+        "Serves the filesystem through the low-level API of FUSE, which refers to files by inode "
+        "instead of by path. The full format then resolves no path on each operation, and the "
+        "lite format joins paths from the inodes it handed out. Not available on Windows.",
+        cmdline()};
+    TCLAP::ValueArg<std::string> stats_socket{
+        "",
+        "stats-socket",
+        "Path of a unix socket on which to serve the statistics of operations, which `securefs "
+        "stats` reads. They are also written to the log when securefs receives SIGUSR1. Not "
+        "available on Windows.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::SwitchArg control_dir{
+        "",
+        "control-dir",
+        "Serves a hidden directory /.securefs in the mounted filesystem, whose files stats.json "
+        "and metrics hold the statistics of operations and caches, and to whose file control the "
+        "commands drop_caches and flush can be written. Not available with --low-level.",
+        cmdline()};
+    TCLAP::ValueArg<std::string> record{
+        "",
+        "record",
+        "Path of a file to which every operation is appended in a compact binary form, so that "
+        "`securefs replay` can repeat the workload later. Paths are recorded in plain text, but "
+        "file contents are not. Not available with --low-level.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::SwitchArg skip_dot_dot{
+        "", "skip-dot-dot", "A no-op option retained for backwards compatibility", cmdline()};
+
+private:
+    std::vector<const char*> to_c_style_args(const std::vector<std::string>& args)
+    {
+        std::vector<const char*> result(args.size());
+        std::transform(args.begin(),
+                       args.end(),
+                       result.begin(),
+                       [](const std::string& s) { return s.c_str(); });
+        return result;
+    }
+#ifdef _WIN32
+    static bool is_letter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    static bool is_drive_mount(std::string_view mount_point)
+    {
+        return mount_point.size() == 2 && is_letter(mount_point[0]) && mount_point[1] == ':';
+    }
+    static bool is_network_mount(std::string_view mount_point)
+    {
+        return absl::StartsWith(mount_point, "\\\\") && !absl::StartsWith(mount_point, "\\\\?\\");
+    }
+#endif
+
+    static std::string escape_args(const std::vector<std::string>& args)
+    {
+        std::string result;
+        for (const auto& a : args)
+        {
+            result.push_back('\"');
+            result.append(absl::Utf8SafeCEscape(a));
+            result.push_back('\"');
+            result.push_back(' ');
+        }
+        if (!result.empty())
+        {
+            result.pop_back();
+        }
+        return result;
+    }
+
+    static std::vector<int> parse_cpu_list(std::string_view list)
+    {
+        std::vector<int> result;
+        for (std::string_view part : absl::StrSplit(list, ',', absl::SkipWhitespace()))
+        {
+            std::pair<std::string_view, std::string_view> range
+                = absl::StrSplit(part, absl::MaxSplits('-', 1));
+            int first, last;
+            if (!absl::SimpleAtoi(range.first, &first)
+                || !absl::SimpleAtoi(range.second.empty() ? range.first : range.second, &last)
+                || first < 0 || last < first)
+            {
+                throw_runtime_error(absl::StrCat("Invalid CPU list: ", list));
+            }
+#ifdef __linux__
+            // Beyond what `cpu_set_t` can hold, so the workers could not be pinned to them.
+            if (last >= CPU_SETSIZE)
+            {
+                throw_runtime_error(
+                    absl::StrCat("CPU ", last, " is out of range in the CPU list: ", list));
+            }
+#endif
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                result.push_back(cpu);
+            }
+        }
+        return result;
+    }
+
+    FuseWorkerOptions get_worker_options()
+    {
+        FuseWorkerOptions result;
+        result.min_threads = min_threads.getValue();
+        result.max_threads = max_threads.getValue();
+        result.max_idle_threads = max_idle_threads.getValue();
+        result.clone_fd = clone_fd.getValue();
+        result.cpus = parse_cpu_list(cpus.getValue());
+        return result;
     }
 
     bool should_use_ino()
@@ -837,16 +1160,7 @@ private:
 public:
     void parse_cmdline(int argc, const char* const* argv) override
     {
-        CommandBase::parse_cmdline(argc, argv);
-
-        single_pass_holder_.get_password(false);
-
-        if (global_logger && verbose.getValue())
-            global_logger->set_level(LoggingLevel::kLogVerbose);
-        if (global_logger && trace.getValue())
-            global_logger->set_level(LoggingLevel::kLogTrace);
-
-        set_lock_enabled(!noflock.getValue());
+        FilesystemCommand::parse_cmdline(argc, argv);
         if (noflock.getValue() && !single_threaded.getValue())
         {
             WARN_LOG("Using --noflock without --single is highly dangerous");
@@ -855,13 +1169,7 @@ public:
 
     void recreate_logger()
     {
-        if (log.isSet())
-        {
-            auto logger = Logger::create_file_logger(log.getValue());
-            delete global_logger;
-            global_logger = logger;
-        }
-        else if (background.getValue())
+        if (!log.isSet() && background.getValue())
         {
             WARN_LOG("securefs is about to enter background without a log file. You "
                      "won't be able to inspect what goes wrong. You can remount with "
@@ -869,10 +1177,7 @@ public:
             delete global_logger;
             global_logger = nullptr;
         }
-        if (global_logger && verbose.getValue())
-            global_logger->set_level(LoggingLevel::kLogVerbose);
-        if (global_logger && trace.getValue())
-            global_logger->set_level(LoggingLevel::kLogTrace);
+        FilesystemCommand::recreate_logger();
     }
 
     int execute() override
@@ -882,6 +1187,17 @@ public:
         {
             OSService::enter_background();
         }
+        // Only after entering the background, as the writer thread would not survive the fork.
+        if (global_logger)
+        {
+            global_logger->start_async();
+        }
+        DEFER(if (global_logger) global_logger->stop_async());
+        if (!trace_events.getValue().empty())
+        {
+            trace::TraceEvents::start(trace_events.getValue());
+        }
+        DEFER(trace::TraceEvents::stop());
 
         if (single_pass_holder_.data_dir.getValue() == mount_point.getValue())
         {
@@ -900,34 +1216,10 @@ public:
             VERBOSE_LOG("%s (ignore this error if mounting succeeds eventually)", e.what());
         }
 #endif
-        std::string config_content;
-        try
-        {
-            config_content
-                = OSService::get_default()
-                      .open_file_stream(
-                          single_pass_holder_.get_real_config_path_for_reading(), O_RDONLY, 0)
-                      ->as_string();
-        }
-        catch (const ExceptionBase& e)
+        if (int rc = load_fsparams())
         {
-            if (e.error_number() == ENOENT)
-            {
-                ERROR_LOG("Encounter exception %s", e.what());
-                ERROR_LOG(
-                    "Config file %s does not exist. Perhaps you forget to run `create` command "
-                    "first?",
-                    single_pass_holder_.get_real_config_path_for_reading());
-                return 19;
-            }
-            throw;
+            return rc;
         }
-        fsparams
-            = decrypt(config_content,
-                      {single_pass_holder_.password.data(), single_pass_holder_.password.size()},
-                      maybe_open_key_stream(single_pass_holder_.keyfile.getValue()).get());
-        CryptoPP::SecureWipeBuffer(single_pass_holder_.password.data(),
-                                   single_pass_holder_.password.size());
 
         try
         {
@@ -941,25 +1233,43 @@ public:
                      e.what());
         }
 
+        bool use_low_level = false;
+        if (low_level.getValue())
+        {
+            if (is_windows())
+            {
+                WARN_LOG("--low-level is ignored, as it is not available on Windows");
+            }
+            else
+            {
+                use_low_level = true;
+            }
+        }
+
         std::vector<std::string> fuse_args{
             "securefs",
             "-o",
-            "hard_remove",
-            "-o",
             "fsname=" + fsname.getValue(),
             "-o",
             "subtype=" + fssubtype.getValue(),
-            "-o",
-            absl::StrFormat("entry_timeout=%d", attr_timeout.getValue()),
-            "-o",
-            absl::StrFormat("attr_timeout=%d", attr_timeout.getValue()),
-            "-o",
-            absl::StrFormat("negative_timeout=%d", attr_timeout.getValue()),
 #ifndef _WIN32
             "-o",
             "atomic_o_trunc",
 #endif
         };
+        // The low-level API has no such options, as the timeouts are part of each reply instead.
+        if (!use_low_level)
+        {
+            fuse_args.insert(fuse_args.end(),
+                             {"-o",
+                              "hard_remove",
+                              "-o",
+                              absl::StrFormat("entry_timeout=%d", attr_timeout.getValue()),
+                              "-o",
+                              absl::StrFormat("attr_timeout=%d", attr_timeout.getValue()),
+                              "-o",
+                              absl::StrFormat("negative_timeout=%d", attr_timeout.getValue())});
+        }
         if (single_threaded.getValue())
         {
             fuse_args.emplace_back("-s");
@@ -975,7 +1285,7 @@ public:
         // Handling `daemon` ourselves, as FUSE's version interferes with our initialization.
         fuse_args.emplace_back("-f");
 
-        if (should_use_ino())
+        if (!use_low_level && should_use_ino())
         {
             fuse_args.emplace_back("-o");
             fuse_args.emplace_back("use_ino");
@@ -1012,6 +1322,18 @@ public:
 #else
         fuse_args.emplace_back("-o");
         fuse_args.emplace_back("big_writes");
+        {
+            unsigned block_size = std::max(fsparams.size_params().block_size(), 1u);
+            unsigned io_size = std::max(max_io_size.getValue() / block_size, 1u) * block_size;
+            fuse_args.emplace_back("-o");
+            fuse_args.emplace_back(absl::StrFormat("max_write=%u", io_size));
+            fuse_args.emplace_back("-o");
+            fuse_args.emplace_back(absl::StrFormat("max_readahead=%u", io_size));
+#ifdef __linux__
+            fuse_args.emplace_back("-o");
+            fuse_args.emplace_back(absl::StrFormat("max_read=%u", io_size));
+#endif
+        }
 #endif
         if (fuse_options.isSet())
         {
@@ -1027,7 +1349,7 @@ public:
 #endif
             fuse_args.emplace_back(mount_point.getValue());
 
-        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, this);
+        FuseOpsInjector injector(get_fuse_high_ops_component, this);
 
         bool native_xattr = !noxattr.getValue();
 #ifdef __APPLE__
@@ -1044,15 +1366,51 @@ public:
                 native_xattr = false;
             }
         }
+#endif
+#ifndef _WIN32
+        trace::StatsServer stats_server(stats_socket.getValue());
+        if (use_low_level)
+        {
+            if (control_dir.getValue())
+            {
+                WARN_LOG("--control-dir is ignored, as it is not available with --low-level");
+            }
+            if (!record.getValue().empty())
+            {
+                WARN_LOG("--record is ignored, as it is not available with --low-level");
+            }
+            auto low_level_ops = injector.get<FuseLowLevelOpsBase*>();
+            auto fuse_callbacks = FuseLowLevelOpsBase::build_ops(native_xattr);
+            VERBOSE_LOG("Calling fuse_lowlevel_main with arguments: %s", escape_args(fuse_args));
+            return my_fuse_lowlevel_main(static_cast<int>(fuse_args.size()),
+                                         const_cast<char**>(to_c_style_args(fuse_args).data()),
+                                         &fuse_callbacks,
+                                         low_level_ops,
+                                         get_worker_options());
+        }
 #endif
         auto high_level_ops = injector.get<FuseHighLevelOpsBase*>();
+        // Innermost, so that the requests served by the control directory are not recorded.
+        std::optional<RecordingOps> recording_ops;
+        if (!record.getValue().empty())
+        {
+            recording_ops.emplace(*high_level_ops, record.getValue());
+            high_level_ops = &*recording_ops;
+        }
+        std::optional<ControlDirOps> control_dir_ops;
+        if (control_dir.getValue())
+        {
+            control_dir_ops.emplace(*high_level_ops);
+            high_level_ops = &*control_dir_ops;
+        }
         auto fuse_callbacks = FuseHighLevelOpsBase::build_ops(
             high_level_ops, native_xattr, !is_windows() || win_symlink.getValue());
         VERBOSE_LOG("Calling fuse_main with arguments: %s", escape_args(fuse_args));
         return my_fuse_main(static_cast<int>(fuse_args.size()),
                             const_cast<char**>(to_c_style_args(fuse_args).data()),
                             &fuse_callbacks,
-                            high_level_ops);
+                            high_level_ops,
+                            get_worker_options());
     }
 
     const char* long_name() const noexcept override { return "mount"; }
@@ -1062,6 +1420,78 @@ public:
     const char* help_message() const noexcept override { return "Mount an existing filesystem"; }
 };
 
+class ReplayCommand : public FilesystemCommand
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> recording{
+        "recording", "The file written by --record of the mount", true, "", "path", cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"",
+                                      "threads",
+                                      "Number of threads making the recorded calls",
+                                      false,
+                                      1,
+                                      "int",
+                                      cmdline()};
+
+public:
+    const char* long_name() const noexcept override { return "replay"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Make the operations recorded by --record on an existing filesystem again, without "
+               "mounting it, and display how fast they were. Takes the options of mount that "
+               "shape the filesystem, but none of those that concern FUSE";
+    }
+
+    int execute() override
+    {
+        recreate_logger();
+        if (global_logger)
+        {
+            global_logger->start_async();
+        }
+        DEFER(if (global_logger) global_logger->stop_async());
+        if (!trace_events.getValue().empty())
+        {
+            trace::TraceEvents::start(trace_events.getValue());
+        }
+        DEFER(trace::TraceEvents::stop());
+
+        if (int rc = load_fsparams())
+        {
+            return rc;
+        }
+        auto recorded = read_recorded_ops(recording.getValue());
+
+        FuseOpsInjector injector(get_fuse_high_ops_component, this);
+        auto ops = injector.get<FuseHighLevelOpsBase*>();
+        fuse_conn_info conn{};
+        ops->initialize(&conn);
+        auto result = replay_recorded_ops(*ops, recorded, threads.getValue());
+
+        fputs(trace::OperationStats::format_table(trace::OperationStats::snapshot()).c_str(),
+              stdout);
+        double recorded_seconds = 0;
+        for (const RecordedOp& op : recorded)
+        {
+            recorded_seconds = std::max(recorded_seconds, (op.start_ns + op.duration_ns) / 1e9);
+        }
+        absl::PrintF("\n%d operations in %.3f s (%.0f ops/s, %.2f MiB/s read and written), "
+                     "recorded over %.3f s\n",
+                     result.operations,
+                     result.seconds,
+                     result.operations / std::max(result.seconds, 1e-9),
+                     result.bytes / 1048576.0 / std::max(result.seconds, 1e-9),
+                     recorded_seconds);
+        absl::PrintF("%d failed or succeeded unlike in the recording, %d were skipped\n",
+                     result.mismatches,
+                     result.skipped);
+        return 0;
+    }
+};
+
 class VersionCommand : public CommandBase
 {
 public:
@@ -1278,6 +1708,33 @@ public:
     }
 };
 
+class StatsCommand : public CommandBase
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> socket_path{
+        "socket", "The --stats-socket of the mount", true, "", "path", cmdline()};
+
+public:
+    const char* long_name() const noexcept override { return "stats"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Display the statistics of operations of a running mount";
+    }
+
+    int execute() override
+    {
+#ifdef _WIN32
+        throw_runtime_error("stats is not available on Windows");
+#else
+        fputs(trace::StatsServer::query(socket_path.getValue()).c_str(), stdout);
+        return 0;
+#endif
+    }
+};
+
 class DocCommand : public CommandBase
 {
 private:
@@ -1421,6 +1878,8 @@ int commands_main(int argc, const char* const* argv)
                                                make_unique<VersionCommand>(),
                                                make_unique<InfoCommand>(),
                                                make_unique<MigrateLongNameCommand>(),
+                                               make_unique<StatsCommand>(),
+                                               make_unique<ReplayCommand>(),
                                                make_unique<DocCommand>()};
 
         const char* const program_name = argv[0];
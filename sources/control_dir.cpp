@@ -0,0 +1,626 @@
+#include "control_dir.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "stat_workaround.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/strip.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace securefs
+{
+namespace
+{
+    constexpr std::string_view kDirPath = "/.securefs";
+    constexpr std::string_view kStatsJsonName = "stats.json";
+    constexpr std::string_view kMetricsName = "metrics";
+    constexpr std::string_view kControlName = "control";
+}    // namespace
+
+// The handles of the control directory and its files are told apart from those of the inner
+// filesystem by the lowest bit, which is always clear in the pointers the latter stores.
+struct ControlDirOps::Handle
+{
+    Entry entry;
+    // What a stats file reads, rendered once at open so that reads at any offset are consistent.
+    std::string content;
+    Mutex mu;
+    // The incomplete last line written to `control`.
+    std::string pending ABSL_GUARDED_BY(mu);
+};
+
+ControlDirOps::ControlDirOps(FuseHighLevelOpsBase& inner) : inner_(inner), mount_time_{}
+{
+    OSService::get_current_time(mount_time_);
+}
+
+ControlDirOps::Entry ControlDirOps::classify(const char* path)
+{
+    if (!path)
+    {
+        return Entry::kNone;
+    }
+    std::string_view p = path;
+    if (!absl::ConsumePrefix(&p, kDirPath))
+    {
+        return Entry::kNone;
+    }
+    if (p.empty() || p == "/")
+    {
+        return Entry::kDir;
+    }
+    if (!absl::ConsumePrefix(&p, "/"))
+    {
+        // Something like "/.securefs2", which belongs to the inner filesystem.
+        return Entry::kNone;
+    }
+    if (p == kStatsJsonName)
+    {
+        return Entry::kStatsJson;
+    }
+    if (p == kMetricsName)
+    {
+        return Entry::kMetrics;
+    }
+    if (p == kControlName)
+    {
+        return Entry::kControl;
+    }
+    return Entry::kMissing;
+}
+
+ControlDirOps::Handle* ControlDirOps::get_handle(fuse_file_info* info)
+{
+    if (!info || !(info->fh & 1))
+    {
+        return nullptr;
+    }
+    return reinterpret_cast<Handle*>(static_cast<uintptr_t>(info->fh & ~uint64_t(1)));
+}
+
+void ControlDirOps::fill_stat(Entry entry, fuse_stat* st, const fuse_context* ctx)
+{
+    memset(st, 0, sizeof(*st));
+    switch (entry)
+    {
+    case Entry::kDir:
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        break;
+    case Entry::kStatsJson:
+    case Entry::kMetrics:
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        // The size is unknown until rendered, and reads bypass the page cache anyway.
+        st->st_size = 0;
+        break;
+    case Entry::kControl:
+        st->st_mode = S_IFREG | 0200;
+        st->st_nlink = 1;
+        break;
+    default:
+        break;
+    }
+    if (ctx)
+    {
+        st->st_uid = ctx->uid;
+        st->st_gid = ctx->gid;
+    }
+    set_atim(*st, mount_time_);
+    set_mtim(*st, mount_time_);
+    set_ctim(*st, mount_time_);
+}
+
+std::string ControlDirOps::render(Entry entry)
+{
+    auto summaries = trace::OperationStats::snapshot();
+    std::vector<trace::StatsGauge> gauges;
+    inner_.collect_gauges(&gauges);
+    if (entry == Entry::kMetrics)
+    {
+        return trace::OperationStats::format_prometheus(summaries, gauges);
+    }
+    return trace::OperationStats::format_json(summaries, gauges);
+}
+
+int ControlDirOps::run_command(std::string_view command)
+{
+    command = absl::StripAsciiWhitespace(command);
+    if (command.empty())
+    {
+        return 0;
+    }
+    if (command == "drop_caches")
+    {
+        INFO_LOG("Dropping caches as requested through the control directory");
+        inner_.drop_caches();
+        return 0;
+    }
+    if (command == "flush")
+    {
+        INFO_LOG("Flushing deferred writes as requested through the control directory");
+        inner_.flush_deferred();
+        return 0;
+    }
+    WARN_LOG("Unknown command written to the control directory: %s", std::string(command));
+    return -EINVAL;
+}
+
+void ControlDirOps::initialize(fuse_conn_info* info) { inner_.initialize(info); }
+
+int ControlDirOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx)
+{
+    return inner_.vstatfs(path, buf, ctx);
+}
+
+int ControlDirOps::vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx)
+{
+    auto entry = classify(path);
+    switch (entry)
+    {
+    case Entry::kNone:
+        return inner_.vgetattr(path, st, ctx);
+    case Entry::kMissing:
+        return -ENOENT;
+    default:
+        fill_stat(entry, st, ctx);
+        return 0;
+    }
+}
+
+int ControlDirOps::vfgetattr(const char* path,
+                             fuse_stat* st,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        fill_stat(handle->entry, st, ctx);
+        return 0;
+    }
+    return inner_.vfgetattr(path, st, info, ctx);
+}
+
+int ControlDirOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Entry::kNone:
+        return inner_.vopendir(path, info, ctx);
+    case Entry::kDir:
+    {
+        auto handle = new Handle();
+        handle->entry = Entry::kDir;
+        info->fh = reinterpret_cast<uintptr_t>(handle) | 1;
+        return 0;
+    }
+    case Entry::kMissing:
+        return -ENOENT;
+    default:
+        return -ENOTDIR;
+    }
+}
+
+int ControlDirOps::vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        delete handle;
+        return 0;
+    }
+    return inner_.vreleasedir(path, info, ctx);
+}
+
+int ControlDirOps::vreaddir(const char* path,
+                            void* buf,
+                            fuse_fill_dir_t filler,
+                            fuse_off_t off,
+                            fuse_file_info* info,
+                            const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vreaddir(path, buf, filler, off, info, ctx);
+    }
+    if (handle->entry != Entry::kDir)
+    {
+        return -ENOTDIR;
+    }
+    fuse_stat st{};
+    st.st_mode = S_IFDIR;
+    for (const char* name : {".", ".."})
+    {
+        if (filler(buf, name, &st, 0) != 0)
+        {
+            return 0;
+        }
+    }
+    st.st_mode = S_IFREG;
+    for (std::string_view name : {kStatsJsonName, kMetricsName, kControlName})
+    {
+        if (filler(buf, std::string(name).c_str(), &st, 0) != 0)
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int ControlDirOps::vcreate(const char* path,
+                           fuse_mode_t mode,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Entry::kNone:
+        return inner_.vcreate(path, mode, info, ctx);
+    case Entry::kMissing:
+        return -EACCES;
+    default:
+        return -EEXIST;
+    }
+}
+
+int ControlDirOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto entry = classify(path);
+    bool read_only = (info->flags & O_ACCMODE) == O_RDONLY;
+    switch (entry)
+    {
+    case Entry::kNone:
+        return inner_.vopen(path, info, ctx);
+    case Entry::kDir:
+        return -EISDIR;
+    case Entry::kMissing:
+        return -ENOENT;
+    case Entry::kStatsJson:
+    case Entry::kMetrics:
+        if (!read_only)
+        {
+            return -EACCES;
+        }
+        break;
+    case Entry::kControl:
+        if (read_only)
+        {
+            return -EACCES;
+        }
+        break;
+    }
+    auto handle = new Handle();
+    handle->entry = entry;
+    if (entry != Entry::kControl)
+    {
+        try
+        {
+            handle->content = render(entry);
+        }
+        catch (...)
+        {
+            delete handle;
+            throw;
+        }
+    }
+    // The files have no size until opened, so the kernel must pass reads through as they are.
+    info->direct_io = 1;
+    info->fh = reinterpret_cast<uintptr_t>(handle) | 1;
+    return 0;
+}
+
+int ControlDirOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        delete handle;
+        return 0;
+    }
+    return inner_.vrelease(path, info, ctx);
+}
+
+int ControlDirOps::vread(const char* path,
+                         char* buf,
+                         size_t size,
+                         fuse_off_t offset,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vread(path, buf, size, offset, info, ctx);
+    }
+    if (handle->entry == Entry::kControl)
+    {
+        return -EBADF;
+    }
+    const auto& content = handle->content;
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    if (static_cast<uint64_t>(offset) >= content.size())
+    {
+        return 0;
+    }
+    size_t length = std::min(size, content.size() - static_cast<size_t>(offset));
+    memcpy(buf, content.data() + offset, length);
+    return static_cast<int>(length);
+}
+
+int ControlDirOps::vwrite(const char* path,
+                          const char* buf,
+                          size_t size,
+                          fuse_off_t offset,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vwrite(path, buf, size, offset, info, ctx);
+    }
+    if (handle->entry != Entry::kControl)
+    {
+        return -EBADF;
+    }
+    // Commands run as soon as their line is complete. The offset is ignored, as with a pipe.
+    LockGuard<Mutex> lg(handle->mu);
+    handle->pending.append(buf, size);
+    size_t start = 0;
+    for (size_t newline; (newline = handle->pending.find('\n', start)) != std::string::npos;
+         start = newline + 1)
+    {
+        if (int rc = run_command(std::string_view(handle->pending).substr(start, newline - start));
+            rc < 0)
+        {
+            handle->pending.clear();
+            return rc;
+        }
+    }
+    handle->pending.erase(0, start);
+    return static_cast<int>(size);
+}
+
+int ControlDirOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto handle = get_handle(info);
+    if (!handle)
+    {
+        return inner_.vflush(path, info, ctx);
+    }
+    if (handle->entry != Entry::kControl)
+    {
+        return 0;
+    }
+    // Runs what was written without a trailing newline, e.g. by `echo -n`.
+    std::string command;
+    {
+        LockGuard<Mutex> lg(handle->mu);
+        command.swap(handle->pending);
+    }
+    return run_command(command);
+}
+
+int ControlDirOps::vftruncate(const char* path,
+                              fuse_off_t len,
+                              fuse_file_info* info,
+                              const fuse_context* ctx)
+{
+    if (auto handle = get_handle(info))
+    {
+        return handle->entry == Entry::kControl ? 0 : -EACCES;
+    }
+    return inner_.vftruncate(path, len, info, ctx);
+}
+
+int ControlDirOps::vunlink(const char* path, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vunlink(path, ctx);
+}
+
+int ControlDirOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Entry::kNone:
+        return inner_.vmkdir(path, mode, ctx);
+    case Entry::kMissing:
+        return -EACCES;
+    default:
+        return -EEXIST;
+    }
+}
+
+int ControlDirOps::vrmdir(const char* path, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vrmdir(path, ctx);
+}
+
+int ControlDirOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vchmod(path, mode, ctx);
+}
+
+int ControlDirOps::vchown(const char* path,
+                          fuse_uid_t uid,
+                          fuse_gid_t gid,
+                          const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vchown(path, uid, gid, ctx);
+}
+
+int ControlDirOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
+{
+    if (classify(from) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vsymlink(to, from, ctx);
+}
+
+int ControlDirOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
+{
+    if (classify(src) != Entry::kNone || classify(dest) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vlink(src, dest, ctx);
+}
+
+int ControlDirOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Entry::kNone:
+        return inner_.vreadlink(path, buf, size, ctx);
+    case Entry::kMissing:
+        return -ENOENT;
+    default:
+        return -EINVAL;
+    }
+}
+
+int ControlDirOps::vrename(const char* from, const char* to, const fuse_context* ctx)
+{
+    if (classify(from) != Entry::kNone || classify(to) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vrename(from, to, ctx);
+}
+
+int ControlDirOps::vfsync(const char* path,
+                          int datasync,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    if (get_handle(info))
+    {
+        return 0;
+    }
+    return inner_.vfsync(path, datasync, info, ctx);
+}
+
+int ControlDirOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case Entry::kNone:
+        return inner_.vtruncate(path, len, ctx);
+    case Entry::kControl:
+        return 0;
+    case Entry::kDir:
+        return -EISDIR;
+    case Entry::kMissing:
+        return -ENOENT;
+    default:
+        return -EACCES;
+    }
+}
+
+int ControlDirOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -EPERM;
+    }
+    return inner_.vutimens(path, ts, ctx);
+}
+
+int ControlDirOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return 0;
+    }
+    return inner_.vlistxattr(path, list, size, ctx);
+}
+
+int ControlDirOps::vgetxattr(const char* path,
+                             const char* name,
+                             char* value,
+                             size_t size,
+                             uint32_t position,
+                             const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -ENOTSUP;
+    }
+    return inner_.vgetxattr(path, name, value, size, position, ctx);
+}
+
+int ControlDirOps::vsetxattr(const char* path,
+                             const char* name,
+                             const char* value,
+                             size_t size,
+                             int flags,
+                             uint32_t position,
+                             const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -ENOTSUP;
+    }
+    return inner_.vsetxattr(path, name, value, size, flags, position, ctx);
+}
+
+int ControlDirOps::vremovexattr(const char* path, const char* name, const fuse_context* ctx)
+{
+    if (classify(path) != Entry::kNone)
+    {
+        return -ENOTSUP;
+    }
+    return inner_.vremovexattr(path, name, ctx);
+}
+
+bool ControlDirOps::has_getpath() const { return inner_.has_getpath(); }
+
+int ControlDirOps::vgetpath(
+    const char* path, char* buf, size_t size, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (!get_handle(info) && classify(path) == Entry::kNone)
+    {
+        return inner_.vgetpath(path, buf, size, info, ctx);
+    }
+    // The names in the control directory are already in their canonical case.
+    if (!path || strlen(path) >= size)
+    {
+        return -ERANGE;
+    }
+    memcpy(buf, path, strlen(path) + 1);
+    return 0;
+}
+
+void ControlDirOps::collect_gauges(std::vector<trace::StatsGauge>* gauges)
+{
+    inner_.collect_gauges(gauges);
+}
+
+void ControlDirOps::drop_caches() { inner_.drop_caches(); }
+
+void ControlDirOps::flush_deferred() { inner_.flush_deferred(); }
+}    // namespace securefs
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+namespace securefs
+{
+/// Serves a hidden directory `/.securefs` in front of the operations of another filesystem, with
+///
+/// - `stats.json` and `metrics`, which render `OperationStats` and the gauges of the filesystem as
+///   JSON and in the text format of Prometheus, as of when they are opened;
+/// - `control`, to which commands can be written, one per line. `drop_caches` drops what the
+///   filesystem caches in memory, and `flush` writes back what it defers.
+///
+/// The directory is not listed in the root, and shadows any real entry of the same name.
+class ControlDirOps final : public FuseHighLevelOpsBase
+{
+public:
+    explicit ControlDirOps(FuseHighLevelOpsBase& inner);
+    DISABLE_COPY_MOVE(ControlDirOps)
+
+    void initialize(fuse_conn_info* info) override;
+    int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) override;
+    int vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx) override;
+    int vfgetattr(const char* path,
+                  fuse_stat* st,
+                  fuse_file_info* info,
+                  const fuse_context* ctx) override;
+    int vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreaddir(const char* path,
+                 void* buf,
+                 fuse_fill_dir_t filler,
+                 fuse_off_t off,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    int vcreate(const char* path,
+                fuse_mode_t mode,
+                fuse_file_info* info,
+                const fuse_context* ctx) override;
+    int vopen(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vread(const char* path,
+              char* buf,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info,
+              const fuse_context* ctx) override;
+    int vwrite(const char* path,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vflush(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vftruncate(const char* path,
+                   fuse_off_t len,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vunlink(const char* path, const fuse_context* ctx) override;
+    int vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vrmdir(const char* path, const fuse_context* ctx) override;
+    int vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx) override;
+    int vsymlink(const char* to, const char* from, const fuse_context* ctx) override;
+    int vlink(const char* src, const char* dest, const fuse_context* ctx) override;
+    int vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx) override;
+    int vrename(const char* from, const char* to, const fuse_context* ctx) override;
+    int
+    vfsync(const char* path, int datasync, fuse_file_info* info, const fuse_context* ctx) override;
+    int vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx) override;
+    int vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx) override;
+    int vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx) override;
+    int vgetxattr(const char* path,
+                  const char* name,
+                  char* value,
+                  size_t size,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vsetxattr(const char* path,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    bool has_getpath() const override;
+    int vgetpath(const char* path,
+                 char* buf,
+                 size_t size,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    void collect_gauges(std::vector<trace::StatsGauge>* gauges) override;
+    void drop_caches() override;
+    void flush_deferred() override;
+
+    /// Runs one line written to `control`. Returns a negative error number for unknown commands.
+    int run_command(std::string_view command);
+
+private:
+    enum class Entry
+    {
+        kNone,    // Not inside the control directory, so served by the inner filesystem.
+        kDir,
+        kStatsJson,
+        kMetrics,
+        kControl,
+        kMissing,    // Inside the control directory, but not one of its files.
+    };
+    struct Handle;
+
+    FuseHighLevelOpsBase& inner_;
+    fuse_timespec mount_time_;
+
+    static Entry classify(const char* path);
+    static Handle* get_handle(fuse_file_info* info);
+    void fill_stat(Entry entry, fuse_stat* st, const fuse_context* ctx);
+    std::string render(Entry entry);
+};
+}    // namespace securefs
@@ -190,6 +190,12 @@ public:
     std::string message() const override { return "File content has invalid checksum"; }
 };
 
+class CorruptedDirectoryException : public VerificationException
+{
+public:
+    std::string message() const override { return "Directory corrupted"; }
+};
+
 class StreamTooLongException : public ExceptionBase
 {
 private:
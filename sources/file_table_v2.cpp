@@ -1,21 +1,26 @@
 #include "file_table_v2.h"
+#include "btree_dir.h"
 #include "crypto.h"
 #include "exceptions.h"
 #include "files.h"
+#include "hash_dir.h"
 #include "lock_guard.h"
 #include "logger.h"
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
 #include "tags.h"
+#include "trace_events.h"
 
 #include <absl/base/thread_annotations.h>
 #include <absl/strings/str_cat.h>
-#include <algorithm>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
 #include <exception>
 #include <fruit/component.h>
 #include <fruit/macro.h>
 #include <memory>
+#include <vector>
 
 namespace securefs::full_format
 {
@@ -34,11 +39,16 @@ void FileTable::init()
         newly = true;
     }
     root_ = directory_factory_(pair.first, pair.second, kRootId);
+    root_->set_time_policy(time_policy_);
     if (newly)
     {
         LockGuard<FileBase> lg(*root_);
         root_->initialize_empty(0755 | S_IFDIR, OSService::getuid(), OSService::getgid());
     }
+    if (time_policy_.lazy)
+    {
+        flusher_ = std::thread([this]() { run_flusher(); });
+    }
 }
 FilePtrHolder FileTable::create_holder(FileBase* fb)
 {
@@ -60,24 +70,29 @@ FilePtrHolder FileTable::open_as(const id_type& id, int type)
         }
         return create_holder(root_);
     }
+    trace::ScopedSpan span("stage", "table_lookup");
     auto& s = find_shard(id);
     LockGuard<Mutex> lg(s.mu);
+    // A file that has just left the table may still be writing back, and must not be read from
+    // the disk before it is done.
+    auto departed = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(s.mu) { return !s.departing.contains(id); };
+    s.mu.Await(absl::Condition(&departed));
     if (auto it = s.live_map.find(id); it != s.live_map.end())
     {
+        hits_.fetch_add(1, std::memory_order_relaxed);
         return create_holder(it->second);
     }
-    if (auto it
-        = std::find_if(s.cache.begin(),
-                       s.cache.end(),
-                       [&](const std::unique_ptr<FileBase>& p) { return p->get_id() == id; });
-        it != s.cache.end())
+    if (auto it = s.lru_index.find(id); it != s.lru_index.end())
     {
-        auto holder = create_holder(*it);
-        auto unique_base = std::move(*it);
-        s.cache.erase(it);
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        auto unique_base = std::move(*it->second);
+        s.lru.erase(it->second);
+        s.lru_index.erase(it);
+        auto holder = create_holder(unique_base);
         s.live_map.emplace(id, std::move(unique_base));
         return holder;
     }
+    misses_.fetch_add(1, std::memory_order_relaxed);
     auto [data, meta] = io_.open(id);
     auto unique_base = construct(type, std::move(data), std::move(meta), id);
     auto holder = create_holder(unique_base);
@@ -109,17 +124,23 @@ std::unique_ptr<FileBase> FileTable::construct(int type,
                                                std::shared_ptr<FileStream> meta_stream,
                                                const id_type& id)
 {
+    std::unique_ptr<FileBase> result;
     switch (type)
     {
     case RegularFile::class_type():
-        return regular_file_factory_(std::move(data_stream), std::move(meta_stream), id);
+        result = regular_file_factory_(std::move(data_stream), std::move(meta_stream), id);
+        break;
     case Directory::class_type():
-        return directory_factory_(std::move(data_stream), std::move(meta_stream), id);
+        result = directory_factory_(std::move(data_stream), std::move(meta_stream), id);
+        break;
     case Symlink::class_type():
-        return symlink_factory_(std::move(data_stream), std::move(meta_stream), id);
+        result = symlink_factory_(std::move(data_stream), std::move(meta_stream), id);
+        break;
     default:
         throw_runtime_error("Invalid file type");
     }
+    result->set_time_policy(time_policy_);
+    return result;
 }
 void FileTable::close(const id_type& id)
 {
@@ -143,76 +164,237 @@ void FileTable::close(const id_type& id)
 void FileTable::close_internal(const id_type id)
 {
     auto& s = find_shard(id);
+    LruList departing;
+    {
+        LockGuard<Mutex> lg(s.mu);
+        auto it = s.live_map.find(id);
+        if (it == s.live_map.end())
+        {
+            return;
+        }
+        if (it->second->getref() > 0)
+        {
+            return;    // Already reopened by another thread.
+        }
 
-    LockGuard<Mutex> lg(s.mu);
-    auto it = s.live_map.find(id);
-    if (it == s.live_map.end())
+        // The file descriptor is not referenced anywhere else, so we don't need to lock it.
+        // If we do lock it, then later when it is destroyed, we are still holding the mutex,
+        // which may cause undefined behavior.
+        auto query_link_status = [](FileBase* fb) ABSL_NO_THREAD_SAFETY_ANALYSIS
+        {
+            bool result = fb->is_unlinked();
+            if (!result)
+            {
+                fb->flush();
+            }
+            return result;
+        };
+
+        bool should_unlink = query_link_status(it->second.get());
+        auto holder = std::move(it->second);
+        s.live_map.erase(it);
+        if (should_unlink)
+        {
+            holder.reset();
+            io_.unlink(id);
+            return;
+        }
+        if (max_cached_per_shard_ == 0)
+        {
+            s.departing.insert(id);
+            departing.push_back(std::move(holder));
+        }
+        else
+        {
+            s.lru.push_front(std::move(holder));
+            s.lru_index.insert_or_assign(id, s.lru.begin());
+        }
+        while (s.lru.size() > max_cached_per_shard_)
+        {
+            auto& victim = s.lru.back();
+            if (victim->getref() > 0)
+            {
+                ERROR_LOG("A file descriptor in the closed pool has outstanding references");
+                break;
+            }
+            s.lru_index.erase(victim->get_id());
+            s.departing.insert(victim->get_id());
+            departing.splice(departing.end(), s.lru, std::prev(s.lru.end()));
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    depart(s, departing);
+};
+
+void FileTable::depart(Shard& s, LruList& departing)
+{
+    if (departing.empty())
     {
         return;
     }
-    if (it->second->getref() > 0)
+    std::vector<id_type> ids;
+    ids.reserve(departing.size());
+    for (auto&& fb : departing)
+    {
+        ids.push_back(fb->get_id());
+    }
+    DEFER({
+        LockGuard<Mutex> lg(s.mu);
+        for (auto&& id : ids)
+        {
+            s.departing.erase(id);
+        }
+    });
+    // The files are no longer reachable through the table, so they need no locking. They are
+    // also destroyed here, so that the underlying files are not closed while holding the shard.
+    while (!departing.empty())
+    {
+        std::unique_ptr<FileBase> fb = std::move(departing.front());
+        departing.pop_front();
+        [](FileBase* fb) ABSL_NO_THREAD_SAFETY_ANALYSIS
+        {
+            if (fb->has_deferred_times())
+            {
+                fb->flush_all();
+            }
+        }(fb.get());
+    }
+}
+
+FileTable::Stats FileTable::get_stats() noexcept
+{
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    for (auto&& s : shards)
     {
-        return;    // Already reopened by another thread.
+        LockGuard<Mutex> lg(s.mu);
+        stats.open_files += s.live_map.size();
+        stats.cached_files += s.lru.size();
     }
+    return stats;
+}
 
-    // The file descriptor is not referenced anywhere else, so we don't need to lock it.
-    // If we do lock it, then later when it is destroyed, we are still holding the mutex,
-    // which may cause undefined behavior.
-    auto query_link_status = [](FileBase* fb) ABSL_NO_THREAD_SAFETY_ANALYSIS
+void FileTable::drop_cached()
+{
+    for (auto&& s : shards)
     {
-        bool result = fb->is_unlinked();
-        if (!result)
+        LruList dropped;
         {
-            fb->flush();
+            LockGuard<Mutex> lg(s.mu);
+            for (auto&& p : s.lru)
+            {
+                s.departing.insert(p->get_id());
+            }
+            s.lru_index.clear();
+            dropped.swap(s.lru);
         }
-        return result;
-    };
+        depart(s, dropped);
+    }
+}
 
-    bool should_unlink = query_link_status(it->second.get());
-    auto holder = std::move(it->second);
-    s.live_map.erase(it);
-    if (!should_unlink)
+void FileTable::flush_deferred_times()
+{
     {
-        s.cache.emplace_back(std::move(holder));
+        LockGuard<FileBase> lg(*root_);
+        if (root_->has_deferred_times())
+        {
+            root_->flush_all();
+        }
     }
-    else
+    for (auto&& s : shards)
     {
-        holder.reset();
-        io_.unlink(id);
+        std::vector<FilePtrHolder> live;
+        {
+            LockGuard<Mutex> lg(s.mu);
+            for (auto&& pair : s.live_map)
+            {
+                if (pair.second->has_deferred_times())
+                {
+                    live.push_back(create_holder(pair.second));
+                }
+            }
+            // Closed files are reopened, so that they are flushed like the others and return to
+            // the cache when released.
+            for (auto it = s.lru.begin(); it != s.lru.end();)
+            {
+                if (!(*it)->has_deferred_times())
+                {
+                    ++it;
+                    continue;
+                }
+                auto id = (*it)->get_id();
+                auto unique_base = std::move(*it);
+                it = s.lru.erase(it);
+                s.lru_index.erase(id);
+                live.push_back(create_holder(unique_base));
+                s.live_map.emplace(id, std::move(unique_base));
+            }
+        }
+        // Files in use are locked only after the shard is released, because the operations lock
+        // a file before opening others in the same shard.
+        for (auto&& holder : live)
+        {
+            LockGuard<FileBase> lg(*holder);
+            holder->flush_all();
+        }
     }
-    if (s.cache.size() > kMaxCached)
+}
+
+void FileTable::run_flusher()
+{
+    while (true)
     {
-        static_assert(kEjectNumber < kMaxCached);
-        auto begin = s.cache.begin();
-        auto end = s.cache.begin() + kEjectNumber;
-        for (auto it = begin; it != end; ++it)
         {
-            if (it->get()->getref() > 0)
+            LockGuard<Mutex> lg(flusher_mu_);
+            flusher_mu_.AwaitWithTimeout(absl::Condition(&stopping_),
+                                         absl::Seconds(time_policy_.lazy_writeback_seconds));
+            if (stopping_)
             {
-                ERROR_LOG("A file descriptor in the closed pool has outstanding references");
                 return;
             }
         }
-        s.cache.erase(begin, end);
+        try
+        {
+            flush_deferred_times();
+        }
+        catch (const std::exception& e)
+        {
+            ERROR_LOG("Failed to write back deferred timestamps: %s", e.what());
+        }
     }
-};
+}
 
 FileTable::~FileTable()
 {
+    if (flusher_.joinable())
+    {
+        {
+            LockGuard<Mutex> lg(flusher_mu_);
+            stopping_ = true;
+        }
+        flusher_.join();
+    }
+    auto stats = get_stats();
+    VERBOSE_LOG("File table hits: %d, misses: %d, evictions: %d",
+                stats.hits,
+                stats.misses,
+                stats.evictions);
     VERBOSE_LOG("Flushing all opened and cached file descriptors, please wait...");
-    root_->flush();
+    root_->flush_all();
     for (auto&& s : shards)
     {
         LockGuard<Mutex> lg(s.mu);
         for (auto&& pair : s.live_map)
         {
             LockGuard<FileBase> inner_lg(*pair.second);
-            pair.second->flush();
+            pair.second->flush_all();
         }
-        for (auto&& p : s.cache)
+        for (auto&& p : s.lru)
         {
             LockGuard<FileBase> inner_lg(*p);
-            p->flush();
+            p->flush_all();
         }
     }
 }
@@ -344,6 +526,22 @@ get_table_io_component(bool legacy)
     }
     return fruit::createComponent().bind<FileTableIO, FileTableIOVersion2>();
 }
+fruit::Component<fruit::Required<Directory::DirNameComparison,
+                                 fruit::Annotated<tMasterKey, key_type>,
+                                 fruit::Annotated<tVerify, bool>,
+                                 fruit::Annotated<tBlockSize, unsigned>,
+                                 fruit::Annotated<tIvSize, unsigned>,
+                                 fruit::Annotated<tMaxPaddingSize, unsigned>,
+                                 fruit::Annotated<tStoreTimeWithinFs, bool>>,
+                 FileTable::Factory<Directory>>
+get_directory_component(bool hash_indexed)
+{
+    if (hash_indexed)
+    {
+        return fruit::createComponent().bind<Directory, HashDirectory>();
+    }
+    return fruit::createComponent().bind<Directory, BtreeDirectory>();
+}
 void FileTableCloser::operator()(FileBase* fb) const
 {
     if (fb && table_ && fb->decref() <= 0)
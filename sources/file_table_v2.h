@@ -1,3 +1,4 @@
+#pragma once
 
 #include "files.h"
 #include "myutils.h"
@@ -7,14 +8,19 @@
 
 #include <absl/base/thread_annotations.h>
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
 #include <array>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <fruit/component.h>
 #include <fruit/fruit_forward_decls.h>
 #include <fruit/macro.h>
 #include <functional>
+#include <list>
 #include <memory>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -48,14 +54,34 @@ public:
         std::shared_ptr<FileStream>, std::shared_ptr<FileStream>, const id_type&)>;
 
 public:
+    struct Stats
+    {
+        // Opens served by an already constructed file, whether live or cached.
+        uint64_t hits = 0;
+        // Opens that had to open the underlying files.
+        uint64_t misses = 0;
+        // Closed files dropped from the cache to stay within capacity.
+        uint64_t evictions = 0;
+        // Files currently open, besides the root.
+        uint64_t open_files = 0;
+        // Closed files kept for reuse.
+        uint64_t cached_files = 0;
+    };
+
+public:
+    /// `max_cached_files` bounds the closed files kept open for reuse, across all shards.
     INJECT(FileTable(FileTableIO& io,
                      Factory<RegularFile> regular_file_factory,
                      Factory<Directory> directory_factory,
-                     Factory<Symlink> symlink_factory))
+                     Factory<Symlink> symlink_factory,
+                     ANNOTATED(tMaxCachedFiles, unsigned) max_cached_files,
+                     TimeUpdatePolicy time_policy))
         : io_(io)
         , regular_file_factory_(std::move(regular_file_factory))
         , directory_factory_(std::move(directory_factory))
         , symlink_factory_(std::move(symlink_factory))
+        , max_cached_per_shard_((max_cached_files + kNumShards - 1) / kNumShards)
+        , time_policy_(time_policy)
     {
         init();
     }
@@ -63,16 +89,27 @@ public:
     FilePtrHolder open_as(const id_type& id, int type);
     FilePtrHolder create_as(int type);
     void close(const id_type& id);
+    Stats get_stats() noexcept;
+    /// Writes back the timestamps deferred by lazy time updates in every file of the table.
+    void flush_deferred_times();
+    /// Closes all the closed files kept for reuse.
+    void drop_cached();
 
 private:
+    using LruList = std::list<std::unique_ptr<FileBase>>;
+
     struct Shard
     {
         Mutex mu;
         absl::flat_hash_map<id_type, std::unique_ptr<FileBase>, id_hash>
             live_map ABSL_GUARDED_BY(mu);
-        std::vector<std::unique_ptr<FileBase>> cache ABSL_GUARDED_BY(mu);
+        // Closed files, the most recently closed at the front.
+        LruList lru ABSL_GUARDED_BY(mu);
+        absl::flat_hash_map<id_type, LruList::iterator, id_hash> lru_index ABSL_GUARDED_BY(mu);
+        // Files that have left the table but are still writing back outside the lock.
+        absl::flat_hash_set<id_type, id_hash> departing ABSL_GUARDED_BY(mu);
     };
-    static constexpr inline size_t kNumShards = 32, kMaxCached = 50, kEjectNumber = 10;
+    static constexpr inline size_t kNumShards = 32;
 
     void init();
     Shard& find_shard(const id_type& id);
@@ -81,8 +118,12 @@ private:
                                         std::shared_ptr<FileStream> meta_stream,
                                         const id_type& id);
     void close_internal(const id_type id);
+    // Flushes and destroys files taken out of `s` and listed in its `departing` set, without
+    // holding its lock, then removes them from the set.
+    void depart(Shard& s, LruList& departing);
     FilePtrHolder create_holder(FileBase* fb);
     FilePtrHolder create_holder(std::unique_ptr<FileBase>& fb);
+    void run_flusher();
 
 private:
     FileTableIO& io_;
@@ -91,6 +132,12 @@ private:
     Factory<Directory> directory_factory_;
     Factory<Symlink> symlink_factory_;
     std::array<Shard, kNumShards> shards{};
+    size_t max_cached_per_shard_;
+    std::atomic<uint64_t> hits_{0}, misses_{0}, evictions_{0};
+    TimeUpdatePolicy time_policy_;
+    Mutex flusher_mu_;
+    bool stopping_ ABSL_GUARDED_BY(flusher_mu_) = false;
+    std::thread flusher_;
 };
 
 class FileTableCloser
@@ -103,4 +150,15 @@ public:
 private:
     FileTable* table_;
 };
+
+/// Binds the directory implementation chosen when the filesystem was created.
+fruit::Component<fruit::Required<Directory::DirNameComparison,
+                                 fruit::Annotated<tMasterKey, key_type>,
+                                 fruit::Annotated<tVerify, bool>,
+                                 fruit::Annotated<tBlockSize, unsigned>,
+                                 fruit::Annotated<tIvSize, unsigned>,
+                                 fruit::Annotated<tMaxPaddingSize, unsigned>,
+                                 fruit::Annotated<tStoreTimeWithinFs, bool>>,
+                 FileTable::Factory<Directory>>
+get_directory_component(bool hash_indexed);
 }    // namespace securefs::full_format
@@ -1,12 +1,16 @@
 #include "files.h"
 #include "crypto.h"
 #include "exceptions.h"
+#include "logger.h"
 #include "myutils.h"
 #include "stat_workaround.h"
 
+#include <absl/hash/hash.h>
 #include <cryptopp/integer.h>
 #include <cryptopp/secblock.h>
 
+#include <algorithm>
+#include <iterator>
 #include <utility>
 
 #include <sys/types.h>
@@ -238,12 +242,68 @@ void FileBase::stat(fuse_stat* st)
         set_ctim(*st, get_ctime());
         set_birthtim(*st, get_birthtime());
     }
+    m_stat_snapshot.store(*st);
+    m_stat_stale = m_stat_times_stale = false;
+    m_stat_written_end = 0;
+}
+
+void FileBase::stat_without_waiting(fuse_stat* st)
+{
+    if (stat_snapshot(st))
+    {
+        return;
+    }
+    FileLockGuard lg(*this);
+    stat(st);
+}
+
+void FileBase::refresh_stat_snapshot() noexcept
+{
+    bool only_times = !m_stat_stale;
+    offset_type written_end = m_stat_written_end;
+    m_stat_stale = m_stat_times_stale = false;
+    m_stat_written_end = 0;
+    fuse_stat st;
+    if (!m_stat_snapshot.load(st))
+    {
+        // Nobody has asked for the stat yet, so there is no need to pay for it now.
+        return;
+    }
+    if (only_times)
+    {
+        if (!m_store_time)
+        {
+            // The times are those of the underlying file, which only `fstat` knows. The next
+            // `stat()` under the lock publishes them again.
+            m_stat_snapshot.reset();
+            return;
+        }
+        // The other fields are those of the underlying file as of the last full refresh, which
+        // the next `flush()` brings up to date.
+        st.st_size = std::max(st.st_size, static_cast<decltype(st.st_size)>(written_end));
+        set_atim(st, get_atime());
+        set_mtim(st, get_mtime());
+        set_ctim(st, get_ctime());
+        m_stat_snapshot.store(st);
+        return;
+    }
+    try
+    {
+        stat(&st);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to refresh the stat of a file: %s", e.what());
+        m_stat_snapshot.reset();
+    }
 }
 
 FileBase::~FileBase() {}
 
 void FileBase::flush()
 {
+    // Subclasses may grow the underlying file during the flush.
+    mark_stat_stale();
     this->subflush();
     if (m_dirty)
     {
@@ -268,11 +328,21 @@ void FileBase::flush()
         }
         m_header->write_header(header.get(), header_size);
         m_dirty = false;
+        m_times_deferred.store(false, std::memory_order_relaxed);
     }
     m_header->flush_header();
     m_stream->flush();
 }
 
+void FileBase::flush_all()
+{
+    if (m_times_deferred.load(std::memory_order_relaxed))
+    {
+        mark_dirty();
+    }
+    flush();
+}
+
 void FileBase::throw_invalid_cast(int to_type)
 {
     throw InvalidCastException(type_name(this->type()), type_name(to_type));
@@ -385,6 +455,29 @@ void FileBase::removexattr(const char* name)
     m_meta_stream->removexattr(name);
 }
 
+bool RegularFile::check_underlying_changes()
+{
+    fuse_stat st{};
+    underlying_stat(&st);
+    auto mtime = get_mtim(st);
+    int64_t mtime_ns = static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+    auto previous = m_underlying_mtime_ns.exchange(mtime_ns, std::memory_order_relaxed);
+    if (previous == kUnknownMtime || previous == mtime_ns)
+    {
+        return false;
+    }
+    m_content_generation.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool RegularFile::claim_kernel_cache()
+{
+    check_underlying_changes();
+    auto generation = m_content_generation.load(std::memory_order_relaxed);
+    return m_kernel_cached_generation.exchange(generation, std::memory_order_relaxed)
+        == generation;
+}
+
 void SimpleDirectory::initialize()
 {
     char buffer[Directory::MAX_FILENAME_LENGTH + 1 + 32 + 4];
@@ -439,6 +532,65 @@ bool SimpleDirectory::remove_entry_impl(std::string_view name, id_type& id, int&
     return true;
 }
 
+uint64_t ReaddirCookies::cookie_of(std::string_view name)
+{
+    // Like the hashes of `HashDirectory`, cookies must be positive offsets even after FUSE adds
+    // its own, and must not be zero.
+    uint64_t hash = absl::HashOf(name) >> 2u;
+    return hash == 0 ? 1 : hash;
+}
+
+uint64_t ReaddirCookies::remember(std::string_view name)
+{
+    uint64_t cookie = cookie_of(name);
+    if (m_current.size() >= kGenerationSize && !m_current.contains(cookie))
+    {
+        m_previous = std::move(m_current);
+        m_current.clear();
+    }
+    m_current.insert_or_assign(cookie, name);
+    return cookie;
+}
+
+const std::string* ReaddirCookies::recall(uint64_t cookie) const
+{
+    if (auto it = m_current.find(cookie); it != m_current.end())
+        return &it->second;
+    if (auto it = m_previous.find(cookie); it != m_previous.end())
+        return &it->second;
+    return nullptr;
+}
+
+void SimpleDirectory::iterate_over_entries_from_impl(uint64_t cookie,
+                                                     const resumable_callback& cb)
+{
+    auto it = m_table.begin();
+    if (cookie != 0)
+    {
+        const std::string* after = m_cookies.recall(cookie);
+        if (!after)
+        {
+            // Forgotten, but still present if the entry was not removed.
+            auto found = std::find_if(m_table.begin(),
+                                      m_table.end(),
+                                      [&](const auto& pair)
+                                      { return ReaddirCookies::cookie_of(pair.first) == cookie; });
+            if (found == m_table.end())
+            {
+                WARN_LOG("Directory listing cannot resume from a forgotten cookie");
+                return;
+            }
+            after = &found->first;
+        }
+        it = m_table.upper_bound(*after);
+    }
+    for (; it != m_table.end(); ++it)
+    {
+        if (!cb(it->first, it->second.first, it->second.second, m_cookies.remember(it->first)))
+            return;
+    }
+}
+
 void SimpleDirectory::subflush()
 {
     if (m_dirty)
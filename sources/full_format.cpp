@@ -2,6 +2,7 @@
 #include "apple_xattr_workaround.h"
 #include "exceptions.h"
 #include "files.h"
+#include "lock_guard.h"
 #include "logger.h"
 #include "myutils.h"
 #include "platform.h"
@@ -17,6 +18,96 @@
 
 namespace securefs::full_format
 {
+std::optional<DentryCache::Child> DentryCache::get(const id_type& parent, std::string_view name)
+{
+    auto& shard = get_shard(parent);
+    LockGuard<Mutex> lg(shard.mu, false);
+    auto parent_it = shard.children.find(parent);
+    if (parent_it == shard.children.end())
+    {
+        return {};
+    }
+    auto it = parent_it->second.find(name);
+    if (it == parent_it->second.end())
+    {
+        return {};
+    }
+    return it->second;
+}
+
+void DentryCache::put(const id_type& parent, std::string_view name, const Child& child)
+{
+    auto& shard = get_shard(parent);
+    LockGuard<Mutex> lg(shard.mu);
+    if (shard.num_entries >= max_entries_per_shard_)
+    {
+        // Dropping whole directories keeps the bookkeeping trivial, and a directory evicted by
+        // mistake is refilled on the next lookup.
+        while (!shard.children.empty() && shard.num_entries >= max_entries_per_shard_)
+        {
+            auto victim = shard.children.begin();
+            shard.num_entries -= victim->second.size();
+            shard.children.erase(victim);
+        }
+    }
+    if (shard.children[parent].insert_or_assign(std::string(name), child).second)
+    {
+        ++shard.num_entries;
+    }
+}
+
+void DentryCache::invalidate(const id_type& parent, std::string_view name)
+{
+    auto& shard = get_shard(parent);
+    LockGuard<Mutex> lg(shard.mu);
+    auto parent_it = shard.children.find(parent);
+    if (parent_it == shard.children.end())
+    {
+        return;
+    }
+    if (!exact_names_)
+    {
+        shard.num_entries -= parent_it->second.size();
+        shard.children.erase(parent_it);
+        return;
+    }
+    shard.num_entries -= parent_it->second.erase(name);
+}
+
+void DentryCache::forget_directory(const id_type& parent)
+{
+    auto& shard = get_shard(parent);
+    LockGuard<Mutex> lg(shard.mu);
+    auto parent_it = shard.children.find(parent);
+    if (parent_it == shard.children.end())
+    {
+        return;
+    }
+    shard.num_entries -= parent_it->second.size();
+    shard.children.erase(parent_it);
+}
+
+void DentryCache::clear()
+{
+    for (auto& shard : shards_)
+    {
+        LockGuard<Mutex> lg(shard.mu);
+        shard.children.clear();
+        shard.num_entries = 0;
+    }
+}
+
+size_t DentryCache::size()
+{
+    size_t result = 0;
+    for (auto& shard : shards_)
+    {
+        LockGuard<Mutex> lg(shard.mu, false);
+        result += shard.num_entries;
+    }
+    return result;
+}
+
 void FuseHighLevelOps::initialize(struct fuse_conn_info* conn)
 {
     if (!case_insensitive_)
@@ -42,8 +133,7 @@ int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* st, const fuse_conte
     {
         return -ENOENT;
     }
-    FileLockGuard lg(**opened);
-    (**opened).stat(st);
+    (**opened).stat_without_waiting(st);
     postprocess_stat(st);
     return 0;
 };
@@ -53,8 +143,7 @@ int FuseHighLevelOps::vfgetattr(const char* path,
                                 const fuse_context* ctx)
 {
     auto fp = get_file(info);
-    FileLockGuard lg(*fp);
-    fp->stat(st);
+    fp->stat_without_waiting(st);
     postprocess_stat(st);
     return 0;
 };
@@ -98,25 +187,31 @@ int FuseHighLevelOps::vreaddir(const char* path,
     fuse_stat st{};
     FileLockGuard lg(*fp);
 
-    st.st_ino = to_inode_number(fp->get_id());
+    // Offsets 1 and 2 follow "." and "..", and each entry after them is followed by its cookie
+    // shifted by 2. When the filler reports a full buffer, FUSE calls again with the offset of the
+    // last entry it accepted, and the listing resumes right there.
     st.st_mode = S_IFDIR;
-    filler(buf, ".", &st, 0);
-
-    st.st_ino = fp->get_parent_ino();
-    filler(buf, "..", &st, 0);
+    if (off < 1)
+    {
+        st.st_ino = to_inode_number(fp->get_id());
+        if (filler(buf, ".", &st, 1) != 0)
+            return 0;
+    }
+    if (off < 2)
+    {
+        st.st_ino = fp->get_parent_ino();
+        if (filler(buf, "..", &st, 2) != 0)
+            return 0;
+    }
 
-    fp->cast_as<Directory>()->iterate_over_entries(
-        [&](const std::string& name, const id_type& id, int type)
+    uint64_t cookie = off <= 2 ? 0 : static_cast<uint64_t>(off) - 2;
+    fp->cast_as<Directory>()->iterate_over_entries_from(
+        cookie,
+        [&](const std::string& name, const id_type& id, int type, uint64_t next_cookie)
         {
             st.st_mode = FileBase::mode_for_type(type);
             st.st_ino = to_inode_number(id);
-            int rc = std::abs(filler(buf, name.c_str(), &st, 0));
-            if (rc != 0)
-            {
-                VERBOSE_LOG("Filling directory buffer failed: %s",
-                            OSService::stringify_system_error(rc));
-                throwVFSException(rc);
-            }
+            return filler(buf, name.c_str(), &st, static_cast<fuse_off_t>(next_cookie + 2)) == 0;
         });
     return 0;
 };
@@ -141,6 +236,10 @@ int FuseHighLevelOps::vopen(const char* path, fuse_file_info* info, const fuse_c
         FileLockGuard lg(**opened);
         (**opened).cast_as<RegularFile>()->truncate(0);
     }
+    if ((**opened).type() == RegularFile::class_type())
+    {
+        info->keep_cache = (**opened).cast_as<RegularFile>()->claim_kernel_cache();
+    }
     set_file(info, opened->release());
     return 0;
 };
@@ -207,6 +306,7 @@ int FuseHighLevelOps::vunlink(const char* path, const fuse_context* ctx)
         {
             return -ENOENT;
         }
+        dentry_cache_.invalidate(dirholder->get_id(), last_component);
     }
 
     auto fp = ft_.open_as(id, type);
@@ -231,6 +331,7 @@ int FuseHighLevelOps::vrmdir(const char* path, const fuse_context* ctx)
         {
             return -ENOENT;
         }
+        dentry_cache_.invalidate(dirholder->get_id(), last_component);
     }
 
     auto fp = ft_.open_as(id, type);
@@ -239,6 +340,7 @@ int FuseHighLevelOps::vrmdir(const char* path, const fuse_context* ctx)
         [](const std::string& name, const id_type& id, int type) -> bool
         { throwVFSException(ENOTEMPTY); });
     fp->unlink();
+    dentry_cache_.forget_directory(id);
     return 0;
 };
 int FuseHighLevelOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
@@ -331,7 +433,12 @@ int FuseHighLevelOps::vrename(const char* from, const char* to, const fuse_conte
         {
             return -ENOENT;
         }
+        dentry_cache_.invalidate(base_from->get_id(), last_from);
         has_to_item = base_to->cast_as<Directory>()->remove_entry(last_to, to_id, to_type);
+        if (has_to_item)
+        {
+            dentry_cache_.invalidate(base_to->get_id(), last_to);
+        }
         if (has_to_item && from_id == to_id)
         {
             // Cannot rename a hardlink onto itself
@@ -356,6 +463,15 @@ int FuseHighLevelOps::vfsync(const char* path,
 {
     auto fp = get_file(info);
     FileLockGuard lg(*fp);
+    // Timestamps are metadata, which a data only sync need not persist.
+    if (datasync)
+    {
+        fp->flush();
+    }
+    else
+    {
+        fp->flush_all();
+    }
     fp->fsync();
     return 0;
 };
@@ -505,27 +621,76 @@ int FuseHighLevelOps::vgetpath(
     return copy_and_return(result);
 };
 
-FuseHighLevelOps::OpenBaseResult FuseHighLevelOps::open_base(absl::string_view path)
+void FuseHighLevelOps::collect_gauges(std::vector<trace::StatsGauge>* gauges)
+{
+    auto stats = ft_.get_stats();
+    auto lookups = stats.hits + stats.misses;
+    gauges->push_back({"file_table_hits_total", static_cast<double>(stats.hits), true});
+    gauges->push_back({"file_table_misses_total", static_cast<double>(stats.misses), true});
+    gauges->push_back({"file_table_evictions_total", static_cast<double>(stats.evictions), true});
+    gauges->push_back({"file_table_hit_ratio",
+                       lookups ? static_cast<double>(stats.hits) / lookups : 0.0,
+                       false});
+    gauges->push_back({"open_files", static_cast<double>(stats.open_files), false});
+    gauges->push_back({"cached_files", static_cast<double>(stats.cached_files), false});
+    gauges->push_back(
+        {"dentry_cache_entries", static_cast<double>(dentry_cache_.size()), false});
+}
+
+void FuseHighLevelOps::drop_caches()
 {
-    absl::InlinedVector<std::string_view, 7> splits = absl::StrSplit(path, '/', absl::SkipEmpty());
-    uint64_t parent_ino = to_inode_number(kRootId);
-    FilePtrHolder holder = ft_.open_as(kRootId, Directory::class_type());
-    for (size_t i = 0; i + 1 < splits.size(); ++i)
+    dentry_cache_.clear();
+    ft_.drop_cached();
+}
+
+void FuseHighLevelOps::flush_deferred() { ft_.flush_deferred_times(); }
+
+std::optional<FuseHighLevelOps::ResolvedEntry>
+FuseHighLevelOps::resolve(absl::Span<const std::string_view> components)
+{
+    ResolvedEntry current{kRootId, Directory::class_type(), kRootId};
+    for (size_t i = 0; i < components.size(); ++i)
     {
-        id_type id;
-        int type;
+        auto child = dentry_cache_.get(current.id, components[i]);
+        if (!child)
         {
+            auto holder = ft_.open_as(current.id, current.type);
             FileLockGuard lg(*holder);
-            if (!holder->cast_as<Directory>()->get_entry(splits[i], id, type))
+            id_type id;
+            int type;
+            if (!holder->cast_as<Directory>()->get_entry(components[i], id, type))
             {
+                if (i + 1 == components.size())
+                {
+                    return {};
+                }
                 throwVFSException(ENOENT);
             }
+            child = DentryCache::Child{id, type};
+            dentry_cache_.put(current.id, components[i], *child);
         }
-        holder = ft_.open_as(id, type);
-        holder->set_parent_ino(parent_ino);
-        parent_ino = holder->get_parent_ino();
+        current = {child->id, child->type, current.id};
     }
-    return {std::move(holder), splits.empty() ? std::string_view() : splits.back()};
+    return current;
+}
+FuseHighLevelOps::OpenBaseResult FuseHighLevelOps::open_base(absl::string_view path)
+{
+    absl::InlinedVector<std::string_view, 7> splits = absl::StrSplit(path, '/', absl::SkipEmpty());
+    if (splits.empty())
+    {
+        return {ft_.open_as(kRootId, Directory::class_type()), std::string_view()};
+    }
+    auto base = resolve(absl::MakeConstSpan(splits).first(splits.size() - 1));
+    if (!base)
+    {
+        throwVFSException(ENOENT);
+    }
+    auto holder = ft_.open_as(base->id, base->type);
+    if (base->id != kRootId)
+    {
+        holder->set_parent_ino(to_inode_number(base->parent_id));
+    }
+    return {std::move(holder), splits.back()};
 }
 FilePtrHolder
 FuseHighLevelOps::create(absl::string_view path, unsigned mode, int type, int uid, int gid)
@@ -552,25 +717,17 @@ FuseHighLevelOps::create(absl::string_view path, unsigned mode, int type, int ui
 }
 std::optional<FilePtrHolder> FuseHighLevelOps::open_all(absl::string_view path)
 {
-    if (path.empty() || path == "/")
-    {
-        return ft_.open_as(kRootId, Directory::class_type());
-    }
-    auto [base_dir, last_component] = open_base(path);
-    bool success = false;
-    id_type id;
-    int type;
-
+    absl::InlinedVector<std::string_view, 7> splits = absl::StrSplit(path, '/', absl::SkipEmpty());
+    auto entry = resolve(splits);
+    if (!entry)
     {
-        FileLockGuard lg(*base_dir);
-        success = base_dir->cast_as<Directory>()->get_entry(last_component, id, type).has_value();
+        return {};
     }
-    if (!success)
+    auto holder = ft_.open_as(entry->id, entry->type);
+    if (entry->id != kRootId)
     {
-        return {};
+        holder->set_parent_ino(to_inode_number(entry->parent_id));
     }
-    auto holder = ft_.open_as(id, type);
-    holder->set_parent_ino(to_inode_number(base_dir->get_id()));
     return holder;
 }
 
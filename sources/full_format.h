@@ -1,13 +1,19 @@
+#pragma once
+
 #include "file_table_v2.h"
 #include "files.h"
 #include "fuse_high_level_ops_base.h"
 #include "logger.h"
+#include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
 #include "tags.h"
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/strings/string_view.h>
+#include <absl/types/span.h>
 
+#include <array>
 #include <cstdint>
 #include <exception>
 #include <fruit/macro.h>
@@ -56,6 +62,55 @@ private:
     OSService& root_;
     std::shared_ptr<FileStream> lock_stream_;
 };
+/// Caches the results of directory lookups, so that resolving a path does not need to open and
+/// lock every directory along it.
+///
+/// Entries must only be inserted and invalidated while the parent directory is locked, which orders
+/// them with the modifications of the directory itself.
+class DentryCache
+{
+public:
+    struct Child
+    {
+        id_type id;
+        int type;
+    };
+
+    /// When `exact_names` is false, differently spelled names may refer to the same entry, so a
+    /// removal invalidates all entries of the parent directory.
+    explicit DentryCache(bool exact_names, size_t max_entries_per_shard = 4096)
+        : exact_names_(exact_names), max_entries_per_shard_(max_entries_per_shard)
+    {
+    }
+    DISABLE_COPY_MOVE(DentryCache)
+
+    std::optional<Child> get(const id_type& parent, std::string_view name);
+    void put(const id_type& parent, std::string_view name, const Child& child);
+    void invalidate(const id_type& parent, std::string_view name);
+    /// Drops all entries of a directory, e.g. after the directory itself is removed.
+    void forget_directory(const id_type& parent);
+    void clear();
+    size_t size();
+
+private:
+    static constexpr inline size_t kNumShards = 32;
+
+    struct Shard
+    {
+        Mutex mu;
+        absl::flat_hash_map<id_type, absl::flat_hash_map<std::string, Child>, id_hash>
+            children ABSL_GUARDED_BY(mu);
+        size_t num_entries ABSL_GUARDED_BY(mu) = 0;
+    };
+
+    bool exact_names_;
+    size_t max_entries_per_shard_;
+    std::array<Shard, kNumShards> shards_;
+
+    // All entries of a parent live in the same shard, so that they can be dropped together.
+    Shard& get_shard(const id_type& parent) { return shards_[id_hash{}(parent) % kNumShards]; }
+};
+
 class FuseHighLevelOps : public ::securefs::FuseHighLevelOpsBase
 {
 public:
@@ -63,12 +118,14 @@ public:
                             FileTable& ft,
                             RepoLocker& locker,
                             const OwnerOverride& owner_override,
+                            Directory::DirNameComparison cmpfn,
                             ANNOTATED(tCaseInsensitive, bool) case_insensitive))
         : root_(root)
         , ft_(ft)
         , locker_(locker)
         , owner_override_(owner_override)
         , case_insensitive_(case_insensitive)
+        , dentry_cache_(cmpfn.fn == &binary_compare)
     {
     }
 
@@ -144,6 +201,9 @@ public:
                  size_t size,
                  fuse_file_info* info,
                  const fuse_context* ctx) override;
+    void collect_gauges(std::vector<trace::StatsGauge>* gauges) override;
+    void drop_caches() override;
+    void flush_deferred() override;
 
 private:
     OSService& root_;
@@ -151,6 +211,7 @@ private:
     [[maybe_unused]] RepoLocker& locker_;    // We only needs this to construct and destruct.
     OwnerOverride owner_override_;
     bool case_insensitive_;
+    DentryCache dentry_cache_;
 
 private:
     struct OpenBaseResult
@@ -159,6 +220,15 @@ private:
         std::string_view last_component;
     };
 
+    struct ResolvedEntry
+    {
+        id_type id;
+        int type;
+        id_type parent_id;
+    };
+
+    // Returns nullopt if only the last component is missing, and throws if any other one is.
+    std::optional<ResolvedEntry> resolve(absl::Span<const std::string_view> components);
     OpenBaseResult open_base(absl::string_view path);
     FilePtrHolder create(absl::string_view path, unsigned mode, int type, int uid, int gid);
     std::optional<FilePtrHolder> open_all(absl::string_view path);
@@ -0,0 +1,761 @@
+#include "full_format_low_level.h"
+
+#ifndef _WIN32
+#include "apple_xattr_workaround.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace securefs::full_format
+{
+NodeTable::NodeTable()
+{
+    LockGuard<Mutex> lg(mu_);
+    entries_.emplace(FUSE_ROOT_ID, Entry{Node{kRootId, Directory::class_type()}, 1});
+    inos_.emplace(kRootId, FUSE_ROOT_ID);
+}
+
+fuse_ino_t NodeTable::remember(const id_type& id, int type)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto [it, inserted] = inos_.try_emplace(id, next_ino_);
+    if (inserted)
+    {
+        ++next_ino_;
+        entries_.emplace(it->second, Entry{Node{id, type}, 1});
+        return it->second;
+    }
+    ++entries_[it->second].nlookup;
+    return it->second;
+}
+
+std::optional<NodeTable::Node> NodeTable::get(fuse_ino_t ino)
+{
+    LockGuard<Mutex> lg(mu_, false);
+    auto it = entries_.find(ino);
+    if (it == entries_.end())
+    {
+        return {};
+    }
+    return it->second.node;
+}
+
+void NodeTable::forget(fuse_ino_t ino, uint64_t nlookup)
+{
+    if (ino == FUSE_ROOT_ID)
+    {
+        return;
+    }
+    LockGuard<Mutex> lg(mu_);
+    auto it = entries_.find(ino);
+    if (it == entries_.end())
+    {
+        return;
+    }
+    if (it->second.nlookup > nlookup)
+    {
+        it->second.nlookup -= nlookup;
+        return;
+    }
+    inos_.erase(it->second.node.id);
+    entries_.erase(it);
+}
+
+size_t NodeTable::size()
+{
+    LockGuard<Mutex> lg(mu_, false);
+    return entries_.size();
+}
+
+FuseLowLevelOps::~FuseLowLevelOps() { set_channel(nullptr); }
+
+void FuseLowLevelOps::set_channel(fuse_chan* channel)
+{
+    if (invalidator_.joinable())
+    {
+        {
+            LockGuard<Mutex> lg(invalidation_mu_);
+            stopping_ = true;
+        }
+        invalidator_.join();
+    }
+    LockGuard<Mutex> lg(invalidation_mu_);
+    channel_ = channel;
+    pending_invalidations_.clear();
+    stopping_ = false;
+    if (channel)
+    {
+        invalidator_ = std::thread([this]() { run_invalidator(); });
+    }
+}
+
+void FuseLowLevelOps::invalidate(fuse_ino_t ino)
+{
+    LockGuard<Mutex> lg(invalidation_mu_);
+    if (channel_)
+    {
+        pending_invalidations_.push_back(ino);
+    }
+}
+
+void FuseLowLevelOps::run_invalidator()
+{
+    while (true)
+    {
+        std::vector<fuse_ino_t> batch;
+        fuse_chan* channel;
+        {
+            LockGuard<Mutex> lg(invalidation_mu_);
+            invalidation_mu_.Await(
+                absl::Condition(this, &FuseLowLevelOps::has_invalidation_work));
+            if (stopping_)
+            {
+                return;
+            }
+            batch.swap(pending_invalidations_);
+            channel = channel_;
+        }
+        for (auto ino : batch)
+        {
+            // The kernel reports ENOENT for nodes it no longer caches, which is harmless.
+            int rc = fuse_lowlevel_notify_inval_inode(channel, ino, 0, 0);
+            if (rc < 0 && rc != -ENOENT)
+            {
+                VERBOSE_LOG("Failed to invalidate the cache of node %llu: %d",
+                            static_cast<unsigned long long>(ino),
+                            rc);
+            }
+        }
+    }
+}
+
+void FuseLowLevelOps::initialize(fuse_conn_info* conn)
+{
+    if (!case_insensitive_)
+    {
+        return;
+    }
+#ifdef FUSE_CAP_CASE_INSENSITIVE
+    if (conn->capable & FUSE_CAP_CASE_INSENSITIVE)
+    {
+        conn->want |= FUSE_CAP_CASE_INSENSITIVE;
+    }
+#endif
+}
+
+int FuseLowLevelOps::vlookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto dir = open_node(parent);
+    id_type id;
+    int type;
+    {
+        FileLockGuard lg(*dir);
+        if (!dir->cast_as<Directory>()->get_entry(name, id, type))
+        {
+            // A zero node id tells the kernel to cache the absence of the name.
+            fuse_entry_param e{};
+            e.entry_timeout = kernel_cache_timeout_;
+            replies_.entry(req, &e);
+            return 0;
+        }
+    }
+    auto holder = ft_.open_as(id, type);
+    holder->set_parent_ino(to_inode_number(dir->get_id()));
+    return reply_entry(req, *holder);
+}
+
+void FuseLowLevelOps::vforget(fuse_ino_t ino, uint64_t nlookup) noexcept
+{
+    nodes_.forget(ino, nlookup);
+}
+
+int FuseLowLevelOps::vgetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    FilePtrHolder holder(nullptr, FileTableCloser(&ft_));
+    FileBase* fp;
+    if (info && info->fh)
+    {
+        fp = get_file(info);
+    }
+    else
+    {
+        holder = open_node(ino);
+        fp = holder.get();
+    }
+    // The kernel asks again once the attributes expire, which is when the pages it kept with
+    // `keep_cache` need to be checked too.
+    bool changed = fp->type() == RegularFile::class_type()
+        && fp->cast_as<RegularFile>()->check_underlying_changes();
+    fuse_stat st{};
+    fp->stat_without_waiting(&st);
+    postprocess_stat(&st);
+    replies_.attr(req, &st, kernel_cache_timeout_);
+    if (changed)
+    {
+        invalidate(ino);
+    }
+    return 0;
+}
+
+int FuseLowLevelOps::vsetattr(
+    fuse_req_t req, fuse_ino_t ino, fuse_stat* attr, int to_set, fuse_file_info* info)
+{
+    FilePtrHolder holder(nullptr, FileTableCloser(&ft_));
+    FileBase* fp;
+    if (info && info->fh)
+    {
+        fp = get_file(info);
+    }
+    else
+    {
+        holder = open_node(ino);
+        fp = holder.get();
+    }
+    {
+        FileLockGuard lg(*fp);
+        if (to_set & FUSE_SET_ATTR_MODE)
+        {
+            fp->set_mode((fp->get_mode() & ~0777u) | (attr->st_mode & 0777u));
+        }
+        if (to_set & FUSE_SET_ATTR_UID)
+        {
+            fp->set_uid(attr->st_uid);
+        }
+        if (to_set & FUSE_SET_ATTR_GID)
+        {
+            fp->set_gid(attr->st_gid);
+        }
+        if (to_set & FUSE_SET_ATTR_SIZE)
+        {
+            fp->cast_as<RegularFile>()->truncate(attr->st_size);
+        }
+        if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+        {
+            // Passed on the same way as the high-level API of FUSE passes them to `utimens`.
+            fuse_timespec ts[2]{};
+            ts[0].tv_nsec = UTIME_OMIT;
+            ts[1].tv_nsec = UTIME_OMIT;
+            if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                ts[0].tv_nsec = UTIME_NOW;
+            else if (to_set & FUSE_SET_ATTR_ATIME)
+                ts[0] = attr->st_atim;
+            if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                ts[1].tv_nsec = UTIME_NOW;
+            else if (to_set & FUSE_SET_ATTR_MTIME)
+                ts[1] = attr->st_mtim;
+            fp->utimens(ts);
+        }
+    }
+    fuse_stat st{};
+    fp->stat_without_waiting(&st);
+    postprocess_stat(&st);
+    replies_.attr(req, &st, kernel_cache_timeout_);
+    return 0;
+}
+
+int FuseLowLevelOps::vreadlink(fuse_req_t req, fuse_ino_t ino)
+{
+    auto holder = open_node(ino);
+    std::string destination;
+    {
+        FileLockGuard lg(*holder);
+        destination = holder->cast_as<Symlink>()->get();
+    }
+    replies_.readlink(req, destination.c_str());
+    return 0;
+}
+
+int FuseLowLevelOps::vmkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode)
+{
+    auto holder = create(req, parent, name, mode, Directory::class_type());
+    return reply_entry(req, *holder);
+}
+
+int FuseLowLevelOps::vunlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto dir = open_node(parent);
+    id_type id;
+    int type;
+    {
+        FileLockGuard lg(*dir);
+        if (!dir->cast_as<Directory>()->remove_entry(name, id, type))
+        {
+            return -ENOENT;
+        }
+    }
+    {
+        auto fp = ft_.open_as(id, type);
+        FileLockGuard lg(*fp);
+        fp->unlink();
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vrmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto dir = open_node(parent);
+    id_type id;
+    int type;
+    {
+        FileLockGuard lg(*dir);
+        if (!dir->cast_as<Directory>()->get_entry(name, id, type))
+        {
+            return -ENOENT;
+        }
+    }
+    {
+        auto fp = ft_.open_as(id, type);
+        // Checks the emptiness before removing the entry, so that a failed removal leaves no
+        // orphan behind.
+        DoubleFileLockGuard lg(*dir, *fp);
+        fp->cast_as<Directory>()->iterate_over_entries(
+            [](const std::string& name, const id_type& id, int type) -> bool
+            { throwVFSException(ENOTEMPTY); });
+        id_type removed_id;
+        if (!dir->cast_as<Directory>()->get_entry(name, removed_id, type) || removed_id != id)
+        {
+            return -ENOENT;
+        }
+        dir->cast_as<Directory>()->remove_entry(name, removed_id, type);
+        fp->unlink();
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vsymlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name)
+{
+    auto holder = create(req, parent, name, 0644, Symlink::class_type());
+    {
+        FileLockGuard fg(*holder);
+        holder->cast_as<Symlink>()->set(to);
+    }
+    return reply_entry(req, *holder);
+}
+
+int FuseLowLevelOps::vrename(fuse_req_t req,
+                             fuse_ino_t parent,
+                             const char* name,
+                             fuse_ino_t newparent,
+                             const char* newname)
+{
+    auto base_from = open_node(parent);
+    auto base_to = open_node(newparent);
+
+    id_type from_id, to_id;
+    int from_type, to_type;
+    bool has_to_item = false;
+
+    {
+        DoubleFileLockGuard lg(*base_from, *base_to);
+
+        if (!base_from->cast_as<Directory>()->remove_entry(name, from_id, from_type))
+        {
+            return -ENOENT;
+        }
+        has_to_item = base_to->cast_as<Directory>()->remove_entry(newname, to_id, to_type);
+        if (has_to_item && from_id == to_id)
+        {
+            // Cannot rename a hardlink onto itself
+            base_from->cast_as<Directory>()->add_entry(name, from_id, from_type);
+            base_to->cast_as<Directory>()->add_entry(newname, to_id, to_type);
+            replies_.err(req, 0);
+            return 0;
+        }
+        base_to->cast_as<Directory>()->add_entry(newname, from_id, from_type);
+    }
+    if (from_type == Directory::class_type() && parent != newparent)
+    {
+        // Otherwise ".." of the moved directory keeps naming its old parent until the next lookup.
+        ft_.open_as(from_id, from_type)->set_parent_ino(to_inode_number(base_to->get_id()));
+    }
+    if (has_to_item)
+    {
+        auto holder = ft_.open_as(to_id, to_type);
+        FileLockGuard lg(*holder);
+        holder->unlink();
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vlink(fuse_req_t req,
+                           fuse_ino_t ino,
+                           fuse_ino_t newparent,
+                           const char* newname)
+{
+    auto holder = open_node(ino);
+    auto base_dir = open_node(newparent);
+    {
+        DoubleFileLockGuard lg(*base_dir, *holder);
+        if (!base_dir->cast_as<Directory>()->add_entry(
+                newname, holder->get_id(), holder->get_real_type()))
+        {
+            return -EEXIST;
+        }
+        holder->set_nlink(holder->get_nlink() + 1);
+    }
+    return reply_entry(req, *holder);
+}
+
+int FuseLowLevelOps::vcreate(
+    fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode, fuse_file_info* info)
+{
+    auto holder = create(req, parent, name, mode, RegularFile::class_type());
+    auto e = make_entry(*holder);
+    info->fh = reinterpret_cast<uintptr_t>(holder.get());
+    if (replies_.create(req, &e, info) != 0)
+    {
+        // The kernel never learns about the handle, and thus never releases it.
+        nodes_.forget(e.ino, 1);
+        return 0;
+    }
+    holder.release();
+    return 0;
+}
+
+int FuseLowLevelOps::vopen(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto holder = open_node(ino);
+    if (holder->type() != RegularFile::class_type())
+    {
+        return -EINVAL;
+    }
+    if (info->flags & O_TRUNC)
+    {
+        FileLockGuard lg(*holder);
+        holder->cast_as<RegularFile>()->truncate(0);
+    }
+    info->keep_cache = holder->cast_as<RegularFile>()->claim_kernel_cache();
+    return reply_open(req, std::move(holder), info);
+}
+
+int FuseLowLevelOps::vread(
+    fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t offset, fuse_file_info* info)
+{
+    thread_local std::vector<char> buffer;
+    buffer.resize(size);
+    auto fp = get_file(info);
+    size_t read_size;
+    {
+        FileLockGuard lg(*fp);
+        read_size = fp->cast_as<RegularFile>()->read(buffer.data(), offset, size);
+    }
+    replies_.buf(req, buffer.data(), read_size);
+    return static_cast<int>(read_size);
+}
+
+int FuseLowLevelOps::vwrite(fuse_req_t req,
+                            fuse_ino_t ino,
+                            const char* buf,
+                            size_t size,
+                            fuse_off_t offset,
+                            fuse_file_info* info)
+{
+    auto fp = get_file(info);
+    {
+        FileLockGuard lg(*fp);
+        fp->cast_as<RegularFile>()->write(buf, offset, size);
+    }
+    replies_.write(req, size);
+    return static_cast<int>(size);
+}
+
+int FuseLowLevelOps::vflush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto fp = get_file(info);
+    {
+        FileLockGuard lg(*fp);
+        fp->flush();
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vrelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    {
+        FilePtrHolder holder(get_file(info), FileTableCloser(&ft_));
+        // Let destructor does its job.
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vfsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info)
+{
+    auto fp = get_file(info);
+    {
+        FileLockGuard lg(*fp);
+        // Timestamps are metadata, which a data only sync need not persist.
+        if (datasync)
+        {
+            fp->flush();
+        }
+        else
+        {
+            fp->flush_all();
+        }
+        fp->fsync();
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vopendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto holder = open_node(ino);
+    if (holder->type() != Directory::class_type())
+    {
+        return -ENOTDIR;
+    }
+    return reply_open(req, std::move(holder), info);
+}
+
+int FuseLowLevelOps::vreaddir(
+    fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, fuse_file_info* info)
+{
+    auto fp = get_file(info);
+    if (fp->type() != Directory::class_type())
+    {
+        return -ENOTDIR;
+    }
+    thread_local std::vector<char> buffer;
+    buffer.resize(size);
+    size_t used = 0;
+    // Returns false once the buffer is full, and then the entry is left for the next call.
+    auto add = [&](const char* name, const fuse_stat& st, fuse_off_t next_off)
+    {
+        size_t entry_size
+            = replies_.add_direntry(req, buffer.data() + used, size - used, name, &st, next_off);
+        if (entry_size > size - used)
+        {
+            return false;
+        }
+        used += entry_size;
+        return true;
+    };
+
+    {
+        fuse_stat st{};
+        FileLockGuard lg(*fp);
+
+        // The same offsets as `FuseHighLevelOps::vreaddir`.
+        bool full = false;
+        st.st_mode = S_IFDIR;
+        if (off < 1)
+        {
+            st.st_ino = to_inode_number(fp->get_id());
+            full = !add(".", st, 1);
+        }
+        if (!full && off < 2)
+        {
+            st.st_ino = fp->get_parent_ino();
+            full = !add("..", st, 2);
+        }
+        if (!full)
+        {
+            uint64_t cookie = off <= 2 ? 0 : static_cast<uint64_t>(off) - 2;
+            fp->cast_as<Directory>()->iterate_over_entries_from(
+                cookie,
+                [&](const std::string& name, const id_type& id, int type, uint64_t next_cookie)
+                {
+                    st.st_mode = FileBase::mode_for_type(type);
+                    st.st_ino = to_inode_number(id);
+                    return add(name.c_str(), st, static_cast<fuse_off_t>(next_cookie + 2));
+                });
+        }
+    }
+    replies_.buf(req, buffer.data(), used);
+    return 0;
+}
+
+int FuseLowLevelOps::vreleasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    return vrelease(req, ino, info);
+}
+
+int FuseLowLevelOps::vstatfs(fuse_req_t req, fuse_ino_t ino)
+{
+    fuse_statvfs buf{};
+    root_.statfs(&buf);
+    replies_.statfs(req, &buf);
+    return 0;
+}
+
+int FuseLowLevelOps::vlistxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    auto holder = open_node(ino);
+    std::vector<char> list(size);
+    ssize_t rc;
+    {
+        FileLockGuard fg(*holder);
+        rc = holder->listxattr(size ? list.data() : nullptr, size);
+    }
+    if (rc < 0)
+    {
+        return static_cast<int>(rc);
+    }
+    if (!size)
+    {
+        replies_.xattr(req, rc);
+        return 0;
+    }
+    transform_listxattr_result(list.data(), size);
+    replies_.buf(req, list.data(), rc);
+    return 0;
+}
+
+int FuseLowLevelOps::vgetxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+{
+    if (int rc = precheck_getxattr(&name); rc < 0)
+        return rc;
+    auto holder = open_node(ino);
+    std::vector<char> value(size);
+    ssize_t rc;
+    {
+        FileLockGuard fg(*holder);
+        rc = holder->getxattr(name, size ? value.data() : nullptr, size);
+    }
+    if (rc < 0)
+    {
+        return static_cast<int>(rc);
+    }
+    if (!size)
+    {
+        replies_.xattr(req, rc);
+        return 0;
+    }
+    replies_.buf(req, value.data(), rc);
+    return 0;
+}
+
+int FuseLowLevelOps::vsetxattr(fuse_req_t req,
+                               fuse_ino_t ino,
+                               const char* name,
+                               const char* value,
+                               size_t size,
+                               int flags)
+{
+    int rc = precheck_setxattr(&name, &flags);
+    if (rc < 0)
+        return rc;
+    if (rc > 0)
+    {
+        flags &= XATTR_CREATE | XATTR_REPLACE;
+        auto holder = open_node(ino);
+        FileLockGuard fg(*holder);
+        holder->setxattr(name, value, size, flags);
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vremovexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
+{
+    int rc = precheck_removexattr(&name);
+    if (rc < 0)
+        return rc;
+    if (rc > 0)
+    {
+        auto holder = open_node(ino);
+        FileLockGuard fg(*holder);
+        holder->removexattr(name);
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+NodeTable::Node FuseLowLevelOps::get_node(fuse_ino_t ino)
+{
+    auto node = nodes_.get(ino);
+    if (!node)
+    {
+        throwVFSException(ESTALE);
+    }
+    return *node;
+}
+
+FilePtrHolder FuseLowLevelOps::open_node(fuse_ino_t ino)
+{
+    auto node = get_node(ino);
+    return ft_.open_as(node.id, node.type);
+}
+
+FilePtrHolder FuseLowLevelOps::create(
+    fuse_req_t req, fuse_ino_t parent, const char* name, unsigned mode, int type)
+{
+    const fuse_ctx* ctx = replies_.req_ctx(req);
+    auto base_dir = open_node(parent);
+    auto holder = ft_.create_as(type);
+    {
+        FileLockGuard lg(*holder);
+        holder->initialize_empty(
+            (mode & 0777) | FileBase::mode_for_type(type), ctx->uid, ctx->gid);
+    }
+    bool success = false;
+    {
+        FileLockGuard lg(*base_dir);
+        success = base_dir->cast_as<Directory>()->add_entry(name, holder->get_id(), type);
+    }
+    if (!success)
+    {
+        FileLockGuard lg(*holder);
+        holder->unlink();
+        throwVFSException(EEXIST);
+    }
+    holder->set_parent_ino(to_inode_number(base_dir->get_id()));
+    return holder;
+}
+
+fuse_entry_param FuseLowLevelOps::make_entry(FileBase& fb)
+{
+    fuse_entry_param e{};
+    fb.stat_without_waiting(&e.attr);
+    postprocess_stat(&e.attr);
+    e.ino = nodes_.remember(fb.get_id(), fb.type());
+    e.attr_timeout = kernel_cache_timeout_;
+    e.entry_timeout = kernel_cache_timeout_;
+    return e;
+}
+
+int FuseLowLevelOps::reply_entry(fuse_req_t req, FileBase& fb)
+{
+    auto e = make_entry(fb);
+    if (replies_.entry(req, &e) != 0)
+    {
+        // The lookup is only counted once the kernel receives it.
+        nodes_.forget(e.ino, 1);
+    }
+    return 0;
+}
+
+int FuseLowLevelOps::reply_open(fuse_req_t req, FilePtrHolder holder, fuse_file_info* info)
+{
+    info->fh = reinterpret_cast<uintptr_t>(holder.get());
+    if (replies_.open(req, info) == 0)
+    {
+        holder.release();
+    }
+    return 0;
+}
+
+void FuseLowLevelOps::postprocess_stat(fuse_stat* st)
+{
+    if (owner_override_.uid_override.has_value())
+    {
+        st->st_uid = *owner_override_.uid_override;
+    }
+    if (owner_override_.gid_override.has_value())
+    {
+        st->st_gid = *owner_override_.gid_override;
+    }
+}
+}    // namespace securefs::full_format
+#endif
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "full_format.h"
+#include "fuse_low_level_ops_base.h"
+
+#ifndef _WIN32
+#include "files.h"
+#include "mystring.h"
+#include "myutils.h"
+#include "platform.h"
+#include "tags.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <fruit/macro.h>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace securefs::full_format
+{
+/// Maps the node ids handed out to the kernel to the files they refer to.
+///
+/// The kernel counts the lookups that returned each node id, and drops them with `forget`. A node
+/// id stays valid until its count drops to zero, after which it is never reused. The root is
+/// always `FUSE_ROOT_ID` and never forgotten.
+class NodeTable
+{
+public:
+    struct Node
+    {
+        id_type id;
+        int type;
+    };
+
+    NodeTable();
+    DISABLE_COPY_MOVE(NodeTable)
+
+    /// Returns the node id of the file, and counts one more lookup of it.
+    fuse_ino_t remember(const id_type& id, int type);
+    std::optional<Node> get(fuse_ino_t ino);
+    void forget(fuse_ino_t ino, uint64_t nlookup);
+    size_t size();
+
+private:
+    struct Entry
+    {
+        Node node;
+        uint64_t nlookup;
+    };
+
+    Mutex mu_;
+    fuse_ino_t next_ino_ ABSL_GUARDED_BY(mu_) = FUSE_ROOT_ID + 1;
+    absl::flat_hash_map<fuse_ino_t, Entry> entries_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map<id_type, fuse_ino_t, id_hash> inos_ ABSL_GUARDED_BY(mu_);
+};
+
+/// Serves the full format through the low-level API of FUSE. Unlike `FuseHighLevelOps`, it never
+/// resolves paths, as the kernel already tells which directory each name is in.
+class FuseLowLevelOps : public ::securefs::FuseLowLevelOpsBase
+{
+public:
+    INJECT(FuseLowLevelOps(OSService& root,
+                           FileTable& ft,
+                           RepoLocker& locker,
+                           const OwnerOverride& owner_override,
+                           ANNOTATED(tCaseInsensitive, bool) case_insensitive,
+                           ANNOTATED(tKernelCacheTimeout, int) kernel_cache_timeout))
+        : root_(root)
+        , ft_(ft)
+        , locker_(locker)
+        , owner_override_(owner_override)
+        , case_insensitive_(case_insensitive)
+        , kernel_cache_timeout_(kernel_cache_timeout)
+    {
+    }
+    ~FuseLowLevelOps() override;
+
+    void initialize(fuse_conn_info* info) override;
+    void set_channel(fuse_chan* channel) override;
+    int vlookup(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    void vforget(fuse_ino_t ino, uint64_t nlookup) noexcept override;
+    int vgetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vsetattr(fuse_req_t req,
+                 fuse_ino_t ino,
+                 fuse_stat* attr,
+                 int to_set,
+                 fuse_file_info* info) override;
+    int vreadlink(fuse_req_t req, fuse_ino_t ino) override;
+    int vmkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode) override;
+    int vunlink(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    int vrmdir(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    int vsymlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name) override;
+    int vrename(fuse_req_t req,
+                fuse_ino_t parent,
+                const char* name,
+                fuse_ino_t newparent,
+                const char* newname) override;
+    int vlink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) override;
+    int vcreate(fuse_req_t req,
+                fuse_ino_t parent,
+                const char* name,
+                fuse_mode_t mode,
+                fuse_file_info* info) override;
+    int vopen(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vread(fuse_req_t req,
+              fuse_ino_t ino,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info) override;
+    int vwrite(fuse_req_t req,
+               fuse_ino_t ino,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info) override;
+    int vflush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vrelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vfsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info) override;
+    int vopendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vreaddir(fuse_req_t req,
+                 fuse_ino_t ino,
+                 size_t size,
+                 fuse_off_t off,
+                 fuse_file_info* info) override;
+    int vreleasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vstatfs(fuse_req_t req, fuse_ino_t ino) override;
+    int vlistxattr(fuse_req_t req, fuse_ino_t ino, size_t size) override;
+    int vgetxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) override;
+    int vsetxattr(fuse_req_t req,
+                  fuse_ino_t ino,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags) override;
+    int vremovexattr(fuse_req_t req, fuse_ino_t ino, const char* name) override;
+
+private:
+    OSService& root_;
+    FileTable& ft_;
+    [[maybe_unused]] RepoLocker& locker_;    // We only needs this to construct and destruct.
+    OwnerOverride owner_override_;
+    bool case_insensitive_;
+    double kernel_cache_timeout_;
+    NodeTable nodes_;
+
+    // Invalidations are sent from a thread of their own, as the kernel may send requests back
+    // while handling them, which the worker waiting for the invalidation could not serve.
+    Mutex invalidation_mu_;
+    fuse_chan* channel_ ABSL_GUARDED_BY(invalidation_mu_) = nullptr;
+    std::vector<fuse_ino_t> pending_invalidations_ ABSL_GUARDED_BY(invalidation_mu_);
+    bool stopping_ ABSL_GUARDED_BY(invalidation_mu_) = false;
+    std::thread invalidator_;
+
+    // Drops the pages the kernel cached for the node, without waiting for it.
+    void invalidate(fuse_ino_t ino);
+    void run_invalidator();
+    bool has_invalidation_work() const ABSL_SHARED_LOCKS_REQUIRED(invalidation_mu_)
+    {
+        return stopping_ || !pending_invalidations_.empty();
+    }
+
+    NodeTable::Node get_node(fuse_ino_t ino);
+    FilePtrHolder open_node(fuse_ino_t ino);
+    FilePtrHolder
+    create(fuse_req_t req, fuse_ino_t parent, const char* name, unsigned mode, int type);
+    fuse_entry_param make_entry(FileBase& fb);
+    int reply_entry(fuse_req_t req, FileBase& fb);
+    int reply_open(fuse_req_t req, FilePtrHolder holder, fuse_file_info* info);
+
+    FileBase* get_file(fuse_file_info* info)
+    {
+        return reinterpret_cast<FileBase*>(static_cast<uintptr_t>(info->fh));
+    }
+
+    void postprocess_stat(fuse_stat* st);
+};
+}    // namespace securefs::full_format
+#endif
@@ -6,17 +6,32 @@
 #include <fuse_lowlevel.h>
 
 #include "exceptions.h"
+#include "lock_guard.h"
 #include "logger.h"
 #include "myutils.h"
+#include "platform.h"
 
 #include <cerrno>
 #include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <list>
 #include <thread>
 #include <vector>
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
 #endif
 
 namespace securefs
@@ -62,6 +77,12 @@ namespace
                 THROW_POSIX_EXCEPTION(errno, "sem_post fails");
             }
         }
+        void drain()
+        {
+            while (sem_trywait(&s_) == 0 || errno == EINTR)
+            {
+            }
+        }
 
     private:
         sem_t s_;
@@ -82,56 +103,292 @@ namespace
         pthread_sigmask(SIG_BLOCK, &newset, nullptr);
     }
 
-    void worker_loop(fuse_session* session, fuse_chan* channel, std::atomic<int>* error_code)
+    void install_signal_handler(int sig)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &signal_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(sig, &sa, nullptr))
+        {
+            THROW_POSIX_EXCEPTION(errno, "Failed to install signal handler");
+        }
+    }
+
+    // Reads and writes a descriptor cloned from the one of the mount, so that each worker has its
+    // own queue of requests being processed in the kernel. It mirrors the channel of libfuse, which
+    // only ever serves the descriptor it opened itself.
+    int cloned_channel_receive(fuse_chan** chp, char* buf, size_t size)
+    {
+        auto session = static_cast<fuse_session*>(fuse_chan_data(*chp));
+        while (true)
+        {
+            ssize_t res = ::read(fuse_chan_fd(*chp), buf, size);
+            int err = errno;
+            if (fuse_session_exited(session))
+                return 0;
+            if (res >= 0)
+                return static_cast<int>(res);
+            if (err == ENOENT)
+                continue;    // The request was interrupted.
+            if (err == ENODEV)
+            {
+                fuse_session_exit(session);
+                return 0;
+            }
+            return -err;
+        }
+    }
+
+    int cloned_channel_send(fuse_chan* ch, const iovec iov[], size_t count)
+    {
+        if (!iov)
+            return 0;
+        if (::writev(fuse_chan_fd(ch), iov, static_cast<int>(count)) < 0)
+            return -errno;
+        return 0;
+    }
+
+    void cloned_channel_destroy(fuse_chan* ch) { ::close(fuse_chan_fd(ch)); }
+
+    fuse_chan_ops cloned_channel_ops{
+        &cloned_channel_receive, &cloned_channel_send, &cloned_channel_destroy};
+
+    // Returns null if the kernel cannot clone the descriptor.
+    fuse_chan* clone_channel(fuse_session* session, fuse_chan* channel)
     {
-        block_some_signals();
-        std::vector<char> buffer(fuse_chan_bufsize(channel));
+        int fd = ::open("/dev/fuse", O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+        uint32_t master_fd = fuse_chan_fd(channel);
+        if (::ioctl(fd, FUSE_DEV_IOC_CLONE, &master_fd) < 0)
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        auto cloned = fuse_chan_new(&cloned_channel_ops, fd, fuse_chan_bufsize(channel), session);
+        if (!cloned)
+            ::close(fd);
+        return cloned;
+    }
 
-        DEFER(global_semaphore.post());
+    /// Serves the requests of a session with a pool of workers that grows while all of them are
+    /// busy, and shrinks back to `max_idle_threads` idle workers once the load is gone.
+    class WorkerPool
+    {
+    public:
+        WorkerPool(fuse_session* session, fuse_chan* channel, const FuseWorkerOptions& options)
+            : session_(session)
+            , channel_(channel)
+            , min_workers_(std::max(options.min_threads, 1u))
+            , max_workers_(options.max_threads ? options.max_threads
+                                               : std::max(std::thread::hardware_concurrency(), 1u))
+            , max_idle_workers_(std::max(options.max_idle_threads, min_workers_))
+            , clone_fd_(options.clone_fd)
+            , cpus_(options.cpus)
+        {
+            max_workers_ = std::max(max_workers_, min_workers_);
+        }
+        DISABLE_COPY_MOVE(WorkerPool)
 
-        while (!fuse_session_exited(session))
+        int run()
         {
-            fuse_buf fbuf{};
-            fbuf.mem = buffer.data();
-            fbuf.size = buffer.size();
-
-            int res;
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
-            res = fuse_session_receive_buf(session, &fbuf, &channel);
-            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
-            if (res == -EINTR)
-                continue;
-            if (res < 0)
+            // Every worker of an earlier session in this process posted on its way out.
+            global_semaphore.drain();
             {
-                ERROR_LOG(
-                    "fuse_session_receive_buf failed with error code %d, exiting abnormally...",
-                    res);
-                *error_code = res;
-                return;
+                LockGuard<Mutex> lg(mu_);
+                for (unsigned i = 0; i < min_workers_; ++i)
+                {
+                    spawn();
+                }
+            }
+
+            install_signal_handler(SIGINT);
+            install_signal_handler(SIGTERM);
+            install_signal_handler(SIGHUP);
+
+            std::thread waiter(
+                [&]()
+                {
+                    block_some_signals();
+                    global_semaphore.wait();
+                    fuse_session_exit(session_);
+
+                    LockGuard<Mutex> lg(mu_);
+                    stopping_ = true;
+                    for (auto&& w : workers_)
+                    {
+                        if (!w.exited)
+                            pthread_cancel(w.thread.native_handle());
+                    }
+                });
+            waiter.join();
+
+            // Workers may still need the lock to wind down, so they are joined without it.
+            std::list<Worker> workers;
+            {
+                LockGuard<Mutex> lg(mu_);
+                workers.swap(workers_);
             }
-            if (res == 0)
+            for (auto&& w : workers)
             {
+                w.thread.join();
+            }
+            return error_code_;
+        }
+
+    private:
+        struct Worker
+        {
+            std::thread thread;
+            bool exited = false;
+        };
+
+        fuse_session* session_;
+        fuse_chan* channel_;
+        unsigned min_workers_, max_workers_, max_idle_workers_;
+        bool clone_fd_;
+        std::vector<int> cpus_;
+        std::atomic<int> error_code_{0};
+
+        Mutex mu_;
+        std::list<Worker> workers_ ABSL_GUARDED_BY(mu_);
+        unsigned num_live_ ABSL_GUARDED_BY(mu_) = 0;
+        unsigned num_idle_ ABSL_GUARDED_BY(mu_) = 0;
+        unsigned num_spawned_ ABSL_GUARDED_BY(mu_) = 0;
+        bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+
+        void spawn() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+        {
+            // Exited workers hold no lock when they are marked, so they can be joined right away.
+            for (auto it = workers_.begin(); it != workers_.end();)
+            {
+                if (!it->exited)
+                {
+                    ++it;
+                    continue;
+                }
+                it->thread.join();
+                it = workers_.erase(it);
+            }
+            ++num_live_;
+            ++num_idle_;
+            auto& w = workers_.emplace_back();
+            w.thread = std::thread(&WorkerPool::work, this, &w, num_spawned_++);
+        }
+
+        void pin(unsigned index)
+        {
+            if (cpus_.empty())
                 return;
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus_[index % cpus_.size()], &set);
+            if (int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); rc != 0)
+            {
+                WARN_LOG("Failed to pin a FUSE worker to CPU %d: %s",
+                         cpus_[index % cpus_.size()],
+                         OSService::stringify_system_error(rc));
             }
-            fuse_session_process_buf(session, &fbuf, channel);
+#endif
         }
-    }
 
-    void install_signal_handler(int sig)
+        fuse_chan* open_channel()
+        {
+            if (!clone_fd_)
+                return channel_;
+            if (auto cloned = clone_channel(session_, channel_); cloned)
+                return cloned;
+            WARN_LOG("Failed to clone the FUSE device (%s), sharing the descriptor of the mount",
+                     OSService::stringify_system_error(errno));
+            return channel_;
+        }
+
+        void work(Worker* self, unsigned index)
+        {
+            block_some_signals();
+            pin(index);
+            auto channel = open_channel();
+            DEFER(if (channel != channel_) fuse_chan_destroy(channel));
+            std::vector<char> buffer(fuse_chan_bufsize(channel));
+
+            // Any worker stopping for other reasons than being idle means the session is over.
+            bool idle_exit = false;
+            DEFER(if (!idle_exit) global_semaphore.post());
+
+            while (!fuse_session_exited(session_))
+            {
+                fuse_buf fbuf{};
+                fbuf.mem = buffer.data();
+                fbuf.size = buffer.size();
+
+                int res;
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+                res = fuse_session_receive_buf(session_, &fbuf, &channel);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+                if (res == -EINTR)
+                    continue;
+                if (res < 0)
+                {
+                    ERROR_LOG(
+                        "fuse_session_receive_buf failed with error code %d, exiting abnormally...",
+                        res);
+                    error_code_ = res;
+                    return;
+                }
+                if (res == 0)
+                {
+                    return;
+                }
+                {
+                    LockGuard<Mutex> lg(mu_);
+                    --num_idle_;
+                    if (num_idle_ == 0 && num_live_ < max_workers_ && !stopping_)
+                    {
+                        spawn();
+                    }
+                }
+                fuse_session_process_buf(session_, &fbuf, channel);
+                {
+                    // Each start costs a thread, and with `clone_fd` a descriptor of the device,
+                    // so workers only stop once plenty of others are idle.
+                    LockGuard<Mutex> lg(mu_);
+                    if (num_idle_ >= max_idle_workers_)
+                    {
+                        --num_live_;
+                        self->exited = true;
+                        idle_exit = true;
+                        return;
+                    }
+                    ++num_idle_;
+                }
+            }
+        }
+    };
+
+    int run_workers(fuse_session* session,
+                    fuse_chan* channel,
+                    bool multithreaded,
+                    const FuseWorkerOptions& options)
     {
-        struct sigaction sa;
-        memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = &signal_handler;
-        sigemptyset(&sa.sa_mask);
-        if (sigaction(sig, &sa, nullptr))
+        if (!multithreaded)
         {
-            THROW_POSIX_EXCEPTION(errno, "Failed to install signal handler");
+            FuseWorkerOptions single = options;
+            single.min_threads = 1;
+            single.max_threads = 1;
+            return WorkerPool(session, channel, single).run();
         }
+        return WorkerPool(session, channel, options).run();
     }
 }    // namespace
 #endif
 
-int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
+int my_fuse_main(int argc,
+                 char** argv,
+                 fuse_operations* op,
+                 void* user_data,
+                 const FuseWorkerOptions& workers)
 {
 #if defined(_WIN32) || defined(__APPLE__)
     return fuse_main(argc, argv, op, user_data);
@@ -156,38 +413,55 @@ int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
     {
         return 3;
     }
+    return run_workers(session, channel, multithreaded, workers);
+#endif
+}
 
-    std::atomic<int> error_code;
-    std::vector<std::thread> workers(multithreaded ? std::thread::hardware_concurrency() : 1);
-    for (auto&& w : workers)
+#ifndef _WIN32
+int my_fuse_lowlevel_main(int argc,
+                          char** argv,
+                          const fuse_lowlevel_ops* op,
+                          FuseLowLevelOpsBase* user_data,
+                          const FuseWorkerOptions& workers)
+{
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    DEFER(fuse_opt_free_args(&args));
+    char* mountpoint = nullptr;
+    int multithreaded = 0;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, nullptr) != 0)
     {
-        w = std::thread(worker_loop, session, channel, &error_code);
+        return 1;
     }
+    DEFER(free(mountpoint));
 
-    install_signal_handler(SIGINT);
-    install_signal_handler(SIGTERM);
-    install_signal_handler(SIGHUP);
-
-    std::thread waiter(
-        [&]()
-        {
-            block_some_signals();
-            global_semaphore.wait();
-            fuse_session_exit(session);
-
-            for (auto&& w : workers)
-            {
-                pthread_cancel(w.native_handle());
-            }
-        });
-    waiter.join();
+    auto channel = fuse_mount(mountpoint, &args);
+    if (!channel)
+    {
+        return 1;
+    }
+    DEFER(fuse_unmount(mountpoint, channel));
 
-    for (auto&& w : workers)
+    auto session = fuse_lowlevel_new(&args, op, sizeof(*op), user_data);
+    if (!session)
     {
-        w.join();
+        return 1;
     }
+    DEFER(fuse_session_destroy(session));
+    fuse_session_add_chan(session, channel);
+    DEFER(fuse_session_remove_chan(channel));
+    user_data->set_channel(channel);
+    DEFER(user_data->set_channel(nullptr));
 
-    return error_code;
+#ifdef __APPLE__
+    if (fuse_set_signal_handlers(session) != 0)
+    {
+        return 2;
+    }
+    DEFER(fuse_remove_signal_handlers(session));
+    return multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+#else
+    return run_workers(session, channel, multithreaded, workers);
 #endif
 }
+#endif
 }    // namespace securefs
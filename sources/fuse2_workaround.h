@@ -2,7 +2,44 @@
 
 #include <fuse.h>
 
+#ifndef _WIN32
+#include "fuse_low_level_ops_base.h"
+
+#include <fuse_lowlevel.h>
+#endif
+
+#include <vector>
+
 namespace securefs
 {
-int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data);
+/// How requests from the kernel are spread over threads. Only honored on Linux.
+struct FuseWorkerOptions
+{
+    /// Workers kept waiting for requests. More are started while all of them are busy.
+    unsigned min_threads = 1;
+    /// Zero means the number of CPUs.
+    unsigned max_threads = 0;
+    /// The extra workers keep waiting for requests until this many are idle, so that bursts do
+    /// not start and stop a thread each time. Never less than `min_threads`.
+    unsigned max_idle_threads = 10;
+    /// Gives each worker its own descriptor of the FUSE device.
+    bool clone_fd = false;
+    /// Workers are pinned to these CPUs in turn. Empty means no pinning.
+    std::vector<int> cpus;
+};
+
+int my_fuse_main(int argc,
+                 char** argv,
+                 fuse_operations* op,
+                 void* user_data,
+                 const FuseWorkerOptions& workers = {});
+
+#ifndef _WIN32
+/// Same as `my_fuse_main`, but serves the low-level API of FUSE.
+int my_fuse_lowlevel_main(int argc,
+                          char** argv,
+                          const fuse_lowlevel_ops* op,
+                          FuseLowLevelOpsBase* user_data,
+                          const FuseWorkerOptions& workers = {});
+#endif
 }    // namespace securefs
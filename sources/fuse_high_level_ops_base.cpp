@@ -351,6 +351,11 @@ fuse_operations FuseHighLevelOpsBase::build_ops(const FuseHighLevelOpsBase* op,
 #ifdef FUSE_CAP_WRITEBACK_CACHE
         enable_if_capable(info, FUSE_CAP_WRITEBACK_CACHE);
 #endif
+        // The kernel and libfuse clamp the sizes asked for by the mount options, so the granted
+        // ones are only known here.
+        VERBOSE_LOG("Negotiated max_write=%u and max_readahead=%u",
+                    info->max_write,
+                    info->max_readahead);
         auto op = static_cast<FuseHighLevelOpsBase*>(fuse_get_context()->private_data);
         op->initialize(info);
         INFO_LOG("Fuse operations initialized");
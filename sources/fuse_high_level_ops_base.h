@@ -1,9 +1,11 @@
 #pragma once
 
 #include "object.h"
+#include "operation_stats.h"
 #include "platform.h"    // IWYU pragma: keep
 
 #include <optional>
+#include <vector>
 
 namespace securefs
 {
@@ -95,6 +97,13 @@ public:
         return -ENOSYS;
     }
 
+    /// Appends the counters of the implementation, such as those of its caches, to `gauges`.
+    virtual void collect_gauges(std::vector<trace::StatsGauge>* gauges) {}
+    /// Drops whatever the implementation caches in memory.
+    virtual void drop_caches() {}
+    /// Writes back whatever the implementation defers.
+    virtual void flush_deferred() {}
+
 private:
     static int static_statfs(const char* path, fuse_statvfs* buf);
     static int static_getattr(const char* path, fuse_stat* st);
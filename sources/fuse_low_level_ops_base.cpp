@@ -0,0 +1,402 @@
+#include "fuse_low_level_ops_base.h"
+
+#ifndef _WIN32
+#include "fuse_tracer_v2.h"
+#include "logger.h"
+
+#include <initializer_list>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    FuseLowLevelOpsBase* get_op(fuse_req_t req)
+    {
+        return static_cast<FuseLowLevelOpsBase*>(fuse_req_userdata(req));
+    }
+
+    template <class ActualFunction>
+    void reply_on_error(fuse_req_t req,
+                        ActualFunction&& func,
+                        const char* funcsig,
+                        int lineno,
+                        const std::initializer_list<trace::WrappedFuseArg>& args)
+    {
+        int rc = trace::FuseTracer::traced_call(
+            std::forward<ActualFunction>(func), funcsig, lineno, args);
+        if (rc < 0)
+        {
+            fuse_reply_err(req, -rc);
+        }
+    }
+
+    void enable_if_capable(fuse_conn_info* info, int cap)
+    {
+        if (info->capable & cap)
+        {
+            info->want |= cap;
+        }
+    }
+
+    void static_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vlookup(req, parent, name); },
+            "lookup",
+            __LINE__,
+            {{"parent", {parent}}, {"name", {name}}});
+    }
+    void static_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+    {
+        get_op(req)->vforget(ino, nlookup);
+        fuse_reply_none(req);
+    }
+    void static_forget_multi(fuse_req_t req, size_t count, fuse_forget_data* forgets)
+    {
+        auto op = get_op(req);
+        for (size_t i = 0; i < count; ++i)
+        {
+            op->vforget(forgets[i].ino, forgets[i].nlookup);
+        }
+        fuse_reply_none(req);
+    }
+    void static_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vgetattr(req, ino, info); },
+            "getattr",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_setattr(
+        fuse_req_t req, fuse_ino_t ino, fuse_stat* attr, int to_set, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vsetattr(req, ino, attr, to_set, info); },
+            "setattr",
+            __LINE__,
+            {{"ino", {ino}}, {"attr", {attr}}, {"to_set", {to_set}}, {"info", {info}}});
+    }
+    void static_readlink(fuse_req_t req, fuse_ino_t ino)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vreadlink(req, ino); },
+            "readlink",
+            __LINE__,
+            {{"ino", {ino}}});
+    }
+    void static_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vmkdir(req, parent, name, mode); },
+            "mkdir",
+            __LINE__,
+            {{"parent", {parent}}, {"name", {name}}, {"mode", {mode}}});
+    }
+    void static_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vunlink(req, parent, name); },
+            "unlink",
+            __LINE__,
+            {{"parent", {parent}}, {"name", {name}}});
+    }
+    void static_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vrmdir(req, parent, name); },
+            "rmdir",
+            __LINE__,
+            {{"parent", {parent}}, {"name", {name}}});
+    }
+    void static_symlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vsymlink(req, to, parent, name); },
+            "symlink",
+            __LINE__,
+            {{"to", {to}}, {"parent", {parent}}, {"name", {name}}});
+    }
+    void static_rename(fuse_req_t req,
+                       fuse_ino_t parent,
+                       const char* name,
+                       fuse_ino_t newparent,
+                       const char* newname)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vrename(req, parent, name, newparent, newname); },
+            "rename",
+            __LINE__,
+            {{"parent", {parent}},
+             {"name", {name}},
+             {"newparent", {newparent}},
+             {"newname", {newname}}});
+    }
+    void static_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vlink(req, ino, newparent, newname); },
+            "link",
+            __LINE__,
+            {{"ino", {ino}}, {"newparent", {newparent}}, {"newname", {newname}}});
+    }
+    void static_create(
+        fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vcreate(req, parent, name, mode, info); },
+            "create",
+            __LINE__,
+            {{"parent", {parent}}, {"name", {name}}, {"mode", {mode}}, {"info", {info}}});
+    }
+    void static_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vopen(req, ino, info); },
+            "open",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_read(
+        fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t offset, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vread(req, ino, size, offset, info); },
+            "read",
+            __LINE__,
+            {{"ino", {ino}}, {"size", {size}}, {"offset", {offset}}, {"info", {info}}});
+    }
+    void static_write(fuse_req_t req,
+                      fuse_ino_t ino,
+                      const char* buf,
+                      size_t size,
+                      fuse_off_t offset,
+                      fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vwrite(req, ino, buf, size, offset, info); },
+            "write",
+            __LINE__,
+            {{"ino", {ino}},
+             {"buf", {static_cast<const void*>(buf)}},
+             {"size", {size}},
+             {"offset", {offset}},
+             {"info", {info}}});
+    }
+    void static_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vflush(req, ino, info); },
+            "flush",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vrelease(req, ino, info); },
+            "release",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vfsync(req, ino, datasync, info); },
+            "fsync",
+            __LINE__,
+            {{"ino", {ino}}, {"datasync", {datasync}}, {"info", {info}}});
+    }
+    void static_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vopendir(req, ino, info); },
+            "opendir",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_readdir(
+        fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vreaddir(req, ino, size, off, info); },
+            "readdir",
+            __LINE__,
+            {{"ino", {ino}}, {"size", {size}}, {"off", {off}}, {"info", {info}}});
+    }
+    void static_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vreleasedir(req, ino, info); },
+            "releasedir",
+            __LINE__,
+            {{"ino", {ino}}, {"info", {info}}});
+    }
+    void static_statfs(fuse_req_t req, fuse_ino_t ino)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vstatfs(req, ino); },
+            "statfs",
+            __LINE__,
+            {{"ino", {ino}}});
+    }
+#ifdef __APPLE__
+    void static_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vlistxattr(req, ino, size); },
+            "listxattr",
+            __LINE__,
+            {{"ino", {ino}}, {"size", {size}}});
+    }
+    void static_getxattr(
+        fuse_req_t req, fuse_ino_t ino, const char* name, size_t size, uint32_t position)
+    {
+        reply_on_error(
+            req,
+            [=]()
+            {
+                if (position != 0)
+                {
+                    return -EINVAL;
+                }
+                return get_op(req)->vgetxattr(req, ino, name, size);
+            },
+            "getxattr",
+            __LINE__,
+            {{"ino", {ino}}, {"name", {name}}, {"size", {size}}, {"position", {position}}});
+    }
+    void static_setxattr(fuse_req_t req,
+                         fuse_ino_t ino,
+                         const char* name,
+                         const char* value,
+                         size_t size,
+                         int flags,
+                         uint32_t position)
+    {
+        reply_on_error(
+            req,
+            [=]()
+            {
+                if (position != 0)
+                {
+                    return -EINVAL;
+                }
+                return get_op(req)->vsetxattr(req, ino, name, value, size, flags);
+            },
+            "setxattr",
+            __LINE__,
+            {{"ino", {ino}},
+             {"name", {name}},
+             {"value", {value}},
+             {"size", {size}},
+             {"flags", {flags}},
+             {"position", {position}}});
+    }
+    void static_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
+    {
+        reply_on_error(
+            req,
+            [=]() { return get_op(req)->vremovexattr(req, ino, name); },
+            "removexattr",
+            __LINE__,
+            {{"ino", {ino}}, {"name", {name}}});
+    }
+#endif
+}    // namespace
+
+fuse_lowlevel_ops FuseLowLevelOpsBase::build_ops(bool enable_xattr, bool enable_symlink)
+{
+    fuse_lowlevel_ops opt{};
+
+    opt.init = [](void* userdata, fuse_conn_info* info)
+    {
+#ifdef FUSE_CAP_ASYNC_READ
+        enable_if_capable(info, FUSE_CAP_ASYNC_READ);
+#endif
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+        enable_if_capable(info, FUSE_CAP_ATOMIC_O_TRUNC);
+#endif
+#ifdef FUSE_CAP_BIG_WRITES
+        enable_if_capable(info, FUSE_CAP_BIG_WRITES);
+#endif
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+        enable_if_capable(info, FUSE_CAP_CACHE_SYMLINKS);
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+        enable_if_capable(info, FUSE_CAP_WRITEBACK_CACHE);
+#endif
+        // The kernel and libfuse clamp the sizes asked for by the mount options, so the granted
+        // ones are only known here.
+        VERBOSE_LOG("Negotiated max_write=%u and max_readahead=%u",
+                    info->max_write,
+                    info->max_readahead);
+        auto op = static_cast<FuseLowLevelOpsBase*>(userdata);
+        op->initialize(info);
+        INFO_LOG("Fuse low-level operations initialized");
+        TRACE_LOG("Initalize with fuse op class %s", typeid(*op).name());
+    };
+    opt.destroy = [](void* data) { INFO_LOG("Fuse low-level operations destroyed"); };
+    opt.lookup = &static_lookup;
+    opt.forget = &static_forget;
+    opt.forget_multi = &static_forget_multi;
+    opt.getattr = &static_getattr;
+    opt.setattr = &static_setattr;
+    opt.mkdir = &static_mkdir;
+    opt.unlink = &static_unlink;
+    opt.rmdir = &static_rmdir;
+    if (enable_symlink)
+    {
+        opt.symlink = &static_symlink;
+        opt.readlink = &static_readlink;
+    }
+    opt.rename = &static_rename;
+    opt.link = &static_link;
+    opt.create = &static_create;
+    opt.open = &static_open;
+    opt.read = &static_read;
+    opt.write = &static_write;
+    opt.flush = &static_flush;
+    opt.release = &static_release;
+    opt.fsync = &static_fsync;
+    opt.opendir = &static_opendir;
+    opt.readdir = &static_readdir;
+    opt.releasedir = &static_releasedir;
+    opt.statfs = &static_statfs;
+
+    if (!enable_xattr)
+        return opt;
+
+#ifdef __APPLE__
+    opt.listxattr = &static_listxattr;
+    opt.getxattr = &static_getxattr;
+    opt.setxattr = &static_setxattr;
+    opt.removexattr = &static_removexattr;
+#endif
+    return opt;
+}
+}    // namespace securefs
+#endif
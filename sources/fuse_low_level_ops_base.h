@@ -0,0 +1,109 @@
+#pragma once
+
+#include "object.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef _WIN32
+namespace securefs
+{
+/// The functions of libfuse with which the operations reply. The tests substitute their own, as
+/// the real ones need a request read from a mounted session.
+struct FuseLowLevelReplies
+{
+    decltype(&fuse_reply_err) err = &fuse_reply_err;
+    decltype(&fuse_reply_entry) entry = &fuse_reply_entry;
+    decltype(&fuse_reply_create) create = &fuse_reply_create;
+    decltype(&fuse_reply_attr) attr = &fuse_reply_attr;
+    decltype(&fuse_reply_readlink) readlink = &fuse_reply_readlink;
+    decltype(&fuse_reply_open) open = &fuse_reply_open;
+    decltype(&fuse_reply_write) write = &fuse_reply_write;
+    decltype(&fuse_reply_buf) buf = &fuse_reply_buf;
+    decltype(&fuse_reply_statfs) statfs = &fuse_reply_statfs;
+    decltype(&fuse_reply_xattr) xattr = &fuse_reply_xattr;
+    decltype(&fuse_req_ctx) req_ctx = &fuse_req_ctx;
+    decltype(&fuse_add_direntry) add_direntry = &fuse_add_direntry;
+};
+
+/// The counterpart of `FuseHighLevelOpsBase` for the low-level API of FUSE, where the kernel
+/// refers to files by node ids it got from earlier lookups instead of by paths.
+///
+/// Each operation either replies to `req` and returns 0, or returns a negative error number
+/// without replying, in which case the caller replies with that error. Exceptions are translated
+/// into error numbers the same way as for the high-level API. `vforget` never replies. `vread`
+/// and `vwrite` return the number of bytes they replied with instead of 0, for the statistics.
+class FuseLowLevelOpsBase : public Object
+{
+public:
+    static fuse_lowlevel_ops build_ops(bool enable_xattr, bool enable_symlink = true);
+
+    virtual void initialize(fuse_conn_info* info) = 0;
+    /// Called with the channel of the mount before the first request, and with null after the
+    /// last one, so that notifications can be sent to the kernel in between.
+    virtual void set_channel(fuse_chan* channel) {}
+    virtual int vlookup(fuse_req_t req, fuse_ino_t parent, const char* name) = 0;
+    /// Drops `nlookup` of the lookups that returned `ino`.
+    virtual void vforget(fuse_ino_t ino, uint64_t nlookup) noexcept = 0;
+    virtual int vgetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int
+    vsetattr(fuse_req_t req, fuse_ino_t ino, fuse_stat* attr, int to_set, fuse_file_info* info)
+        = 0;
+    virtual int vreadlink(fuse_req_t req, fuse_ino_t ino) = 0;
+    virtual int vmkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode) = 0;
+    virtual int vunlink(fuse_req_t req, fuse_ino_t parent, const char* name) = 0;
+    virtual int vrmdir(fuse_req_t req, fuse_ino_t parent, const char* name) = 0;
+    virtual int vsymlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name) = 0;
+    virtual int vrename(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char* name,
+                        fuse_ino_t newparent,
+                        const char* newname)
+        = 0;
+    virtual int vlink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname)
+        = 0;
+    virtual int vcreate(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char* name,
+                        fuse_mode_t mode,
+                        fuse_file_info* info)
+        = 0;
+    virtual int vopen(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int
+    vread(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t offset, fuse_file_info* info)
+        = 0;
+    virtual int vwrite(fuse_req_t req,
+                       fuse_ino_t ino,
+                       const char* buf,
+                       size_t size,
+                       fuse_off_t offset,
+                       fuse_file_info* info)
+        = 0;
+    virtual int vflush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int vrelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int vfsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info) = 0;
+    virtual int vopendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int
+    vreaddir(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, fuse_file_info* info)
+        = 0;
+    virtual int vreleasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) = 0;
+    virtual int vstatfs(fuse_req_t req, fuse_ino_t ino) = 0;
+    virtual int vlistxattr(fuse_req_t req, fuse_ino_t ino, size_t size) = 0;
+    virtual int vgetxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) = 0;
+    virtual int vsetxattr(fuse_req_t req,
+                          fuse_ino_t ino,
+                          const char* name,
+                          const char* value,
+                          size_t size,
+                          int flags)
+        = 0;
+    virtual int vremovexattr(fuse_req_t req, fuse_ino_t ino, const char* name) = 0;
+
+    void set_replies(const FuseLowLevelReplies& replies) { replies_ = replies; }
+
+protected:
+    FuseLowLevelReplies replies_;
+};
+}    // namespace securefs
+#endif
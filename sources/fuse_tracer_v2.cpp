@@ -6,6 +6,7 @@
 #include <absl/strings/str_format.h>
 #include <absl/time/time.h>
 
+#include <cstring>
 #include <ctime>
 #include <type_traits>
 #include <variant>
@@ -99,48 +100,207 @@ namespace
     {
         absl::Format(&sink, "%v", value.value);
     }
+
+    using WrappedValue = decltype(WrappedFuseArg::value);
+
+    // Values that point to a structure, whose copy is encoded instead of the pointer.
+    template <typename T>
+    constexpr bool points_to_struct = std::is_pointer_v<T> && !std::is_same_v<T, const void*>
+        && !std::is_same_v<T, const char*> && !std::is_convertible_v<T, fuse_fill_dir_t>;
+
+    template <typename T>
+    void put_raw(std::string* out, const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    T get_raw(absl::string_view* in)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (in->size() < sizeof(T))
+        {
+            throw_runtime_error("Truncated trace record");
+        }
+        T value;
+        memcpy(&value, in->data(), sizeof(T));
+        in->remove_prefix(sizeof(T));
+        return value;
+    }
+
+    void put_bytes(std::string* out, absl::string_view bytes)
+    {
+        put_raw(out, static_cast<uint32_t>(bytes.size()));
+        out->append(bytes.data(), bytes.size());
+    }
+
+    absl::string_view get_bytes(absl::string_view* in)
+    {
+        auto size = get_raw<uint32_t>(in);
+        if (in->size() < size)
+        {
+            throw_runtime_error("Truncated trace record");
+        }
+        auto bytes = in->substr(0, size);
+        in->remove_prefix(size);
+        return bytes;
+    }
+
+    /// Decodes a value of the alternative `index`, and passes it on while the strings and
+    /// structures it points to are alive.
+    template <size_t I = 0>
+    void decode_value(size_t index,
+                      absl::string_view name,
+                      absl::string_view* in,
+                      absl::FunctionRef<void(const WrappedFuseArg&)> fn)
+    {
+        if constexpr (I < std::variant_size_v<WrappedValue>)
+        {
+            if (index != I)
+            {
+                return decode_value<I + 1>(index, name, in, fn);
+            }
+            using T = std::variant_alternative_t<I, WrappedValue>;
+            if constexpr (std::is_same_v<T, const char*>)
+            {
+                std::string str;
+                bool present = get_raw<bool>(in);
+                if (present)
+                {
+                    str = std::string(get_bytes(in));
+                }
+                fn({name, WrappedValue(std::in_place_index<I>, present ? str.c_str() : nullptr)});
+            }
+            else if constexpr (points_to_struct<T>)
+            {
+                using Struct = std::remove_const_t<std::remove_pointer_t<T>>;
+                Struct copy{};
+                bool present = get_raw<bool>(in);
+                if (present)
+                {
+                    copy = get_raw<Struct>(in);
+                }
+                fn({name, WrappedValue(std::in_place_index<I>, present ? &copy : nullptr)});
+            }
+            else
+            {
+                fn({name, WrappedValue(std::in_place_index<I>, get_raw<T>(in))});
+            }
+        }
+        else
+        {
+            throw_runtime_error("Invalid trace record");
+        }
+    }
 }    // namespace
 
-void FuseTracer::print(FILE* fp, const WrappedFuseArg& arg)
+void FuseTracer::print(std::string* out, const WrappedFuseArg& arg)
 {
-    absl::FPrintF(fp, "%s=", arg.name);
+    absl::StrAppendFormat(out, "%s=", arg.name);
     std::visit(
-        [fp](auto value)
+        [out](auto value)
         {
             if constexpr (std::is_convertible_v<decltype(value), fuse_fill_dir_t>)
             {
-                absl::FPrintF(fp, "%p", value);
+                absl::StrAppendFormat(out, "%p", value);
             }
             else if constexpr (std::is_pointer_v<decltype(value)>)
             {
                 if (value == nullptr)
                 {
-                    absl::FPrintF(fp, "%p", nullptr);
+                    absl::StrAppendFormat(out, "%p", nullptr);
                 }
                 else
                 {
-                    absl::FPrintF(fp, "%v", Wrapped<decltype(value)>{value});
+                    absl::StrAppendFormat(out, "%v", Wrapped<decltype(value)>{value});
                 }
             }
             else
             {
-                absl::FPrintF(fp, "%v", value);
+                absl::StrAppendFormat(out, "%v", value);
             }
         },
         arg.value);
 }
-void FuseTracer::print(FILE* fp, const WrappedFuseArg* args, size_t arg_size)
+void FuseTracer::print(std::string* out, const WrappedFuseArg* args, size_t arg_size)
+{
+    out->push_back('(');
+    for (size_t i = 0; i < arg_size; ++i)
+    {
+        if (i)
+        {
+            out->append(", ");
+        }
+        print(out, args[i]);
+    }
+    out->push_back(')');
+}
+
+void FuseTracer::encode(std::string* out, const WrappedFuseArg* args, size_t arg_size)
 {
-    fputc('(', fp);
+    put_raw(out, static_cast<uint32_t>(arg_size));
     for (size_t i = 0; i < arg_size; ++i)
+    {
+        put_bytes(out, args[i].name);
+        put_raw(out, static_cast<uint8_t>(args[i].value.index()));
+        std::visit(
+            [out](auto value)
+            {
+                using T = decltype(value);
+                if constexpr (std::is_same_v<T, const char*>)
+                {
+                    put_raw(out, value != nullptr);
+                    if (value)
+                    {
+                        put_bytes(out, value);
+                    }
+                }
+                else if constexpr (points_to_struct<T>)
+                {
+                    put_raw(out, value != nullptr);
+                    if (value)
+                    {
+                        put_raw(out, *value);
+                    }
+                }
+                else
+                {
+                    put_raw(out, value);
+                }
+            },
+            args[i].value);
+    }
+}
+
+void FuseTracer::print_encoded(std::string* out, absl::string_view* payload)
+{
+    auto arg_size = get_raw<uint32_t>(payload);
+    out->push_back('(');
+    for (uint32_t i = 0; i < arg_size; ++i)
     {
         if (i)
         {
-            fputs(", ", fp);
+            out->append(", ");
         }
-        print(fp, args[i]);
+        auto name = get_bytes(payload);
+        auto index = get_raw<uint8_t>(payload);
+        decode_value(index, name, payload, [out](const WrappedFuseArg& arg) { print(out, arg); });
     }
-    fputc(')', fp);
+    out->push_back(')');
+}
+
+void FuseTracer::format_function_starts(std::string* out, absl::string_view payload)
+{
+    out->append("Function starts with arguments ");
+    print_encoded(out, &payload);
+}
+
+void FuseTracer::format_function_returns(std::string* out, absl::string_view payload)
+{
+    out->append("Function ends with arguments ");
+    print_encoded(out, &payload);
+    absl::StrAppendFormat(out, " and return code %lld", get_raw<int>(&payload));
 }
 
 void FuseTracer::print_function_starts(
@@ -148,11 +308,11 @@ void FuseTracer::print_function_starts(
 {
     if (logger && logger->get_level() <= LoggingLevel::kLogTrace)
     {
-        logger->prelog(LoggingLevel::kLogTrace, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogTrace));
-
-        fputs("Function starts with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
+        logger->log_payload(LoggingLevel::kLogTrace,
+                            funcsig,
+                            lineno,
+                            &format_function_starts,
+                            [&](std::string* out) { encode(out, args, arg_size); });
     }
 }
 
@@ -165,12 +325,15 @@ void FuseTracer::print_function_returns(Logger* logger,
 {
     if (logger && logger->get_level() <= LoggingLevel::kLogTrace)
     {
-        logger->prelog(LoggingLevel::kLogTrace, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogTrace));
-
-        fputs("Function ends with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
-        absl::FPrintF(logger->m_fp, " and return code %lld", rc);
+        logger->log_payload(LoggingLevel::kLogTrace,
+                            funcsig,
+                            lineno,
+                            &format_function_returns,
+                            [&](std::string* out)
+                            {
+                                encode(out, args, arg_size);
+                                put_raw(out, rc);
+                            });
     }
 }
 
@@ -198,16 +361,20 @@ void FuseTracer::print_function_exception(Logger* logger,
     }
     if (logger->get_level() <= LoggingLevel::kLogError)
     {
-        logger->prelog(LoggingLevel::kLogError, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogError));
-
-        fputs("Function fails with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
-        absl::FPrintF(logger->m_fp,
-                      " with return code %d because it encounters exception %s: %s",
-                      rc,
-                      get_type_name(e).get(),
-                      e.what());
+        logger->log_v2(LoggingLevel::kLogError,
+                       funcsig,
+                       lineno,
+                       [&](std::string* out)
+                       {
+                           out->append("Function fails with arguments ");
+                           print(out, args, arg_size);
+                           absl::StrAppendFormat(
+                               out,
+                               " with return code %d because it encounters exception %s: %s",
+                               rc,
+                               get_type_name(e).get(),
+                               e.what());
+                       });
     }
 }
 
@@ -1,10 +1,13 @@
 #pragma once
 #include "exceptions.h"
 #include "logger.h"
+#include "operation_stats.h"
 #include "platform.h"    // IWYU pragma: keep
+#include "trace_events.h"
 
 #include <cstdint>
 #include <cstdio>
+#include <string>
 #include <variant>
 
 namespace securefs::trace
@@ -29,8 +32,15 @@ struct WrappedFuseArg
 class FuseTracer
 {
 private:
-    static void print(FILE* fp, const WrappedFuseArg& arg);
-    static void print(FILE* fp, const WrappedFuseArg* args, size_t arg_size);
+    static void print(std::string* out, const WrappedFuseArg& arg);
+    static void print(std::string* out, const WrappedFuseArg* args, size_t arg_size);
+
+    // The arguments are copied into a binary payload on the calling thread, including the
+    // strings and structures they point to, and printed from it by the writer of the logger.
+    static void encode(std::string* out, const WrappedFuseArg* args, size_t arg_size);
+    static void print_encoded(std::string* out, absl::string_view* payload);
+    static void format_function_starts(std::string* out, absl::string_view payload);
+    static void format_function_returns(std::string* out, absl::string_view payload);
 
     static void print_function_starts(Logger* logger,
                                       const char* funcsig,
@@ -54,12 +64,39 @@ private:
                                          int rc);
 
 public:
+    /// Calls `func`, translating exceptions into error numbers, and counts the call in
+    /// `OperationStats` under `funcsig`. The call is also recorded as a span in `TraceEvents`.
     template <class ActualFunction>
     static inline auto traced_call(ActualFunction&& func,
                                    const char* funcsig,
                                    int lineno,
                                    const std::initializer_list<WrappedFuseArg>& args,
                                    Logger* logger = global_logger) -> decltype(func())
+    {
+        // Each call site instantiates its own copy, so this is looked up only once per site.
+        static const int op = OperationStats::register_operation(funcsig);
+        ScopedSpan span("fuse", funcsig);
+        auto start = OperationStats::now_ns();
+        auto rc = call(std::forward<ActualFunction>(func), funcsig, lineno, args, logger);
+        OperationStats::record(op, OperationStats::now_ns() - start, rc);
+        if (rc < 0)
+        {
+            span.set_error(static_cast<int>(-rc));
+        }
+        else
+        {
+            span.set_size(static_cast<uint64_t>(rc));
+        }
+        return rc;
+    }
+
+private:
+    template <class ActualFunction>
+    static inline auto call(ActualFunction&& func,
+                            const char* funcsig,
+                            int lineno,
+                            const std::initializer_list<WrappedFuseArg>& args,
+                            Logger* logger) -> decltype(func())
     {
         print_function_starts(logger, funcsig, lineno, args.begin(), args.size());
         try
@@ -0,0 +1,538 @@
+#include "hash_dir.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "mystring.h"
+
+#include <cryptopp/blake2.h>
+#include <uni_algo/all.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+#include <utility>
+
+static void dir_check(bool condition)
+{
+    if (!condition)
+    {
+        throw securefs::CorruptedDirectoryException();
+    }
+}
+
+namespace securefs
+{
+// Page layouts, all little endian.
+//
+// Table page: magic, global depth, number of entries, next table page, count, then `count`
+// bucket page numbers. The table spans a chain of such pages starting from the root page, and
+// only the first one has meaningful global depth and number of entries.
+//
+// Bucket page: magic, local depth, count, then `count` records of hash (8 bytes), id, type
+// (1 byte), name length (1 byte) and name.
+static constexpr uint32_t kTablePageMagic = 0x42544448, kBucketPageMagic = 0x424b4448;
+static constexpr uint32_t kNoPage = static_cast<uint32_t>(-1);
+static constexpr size_t kTablePageHeaderSize = 5 * sizeof(uint32_t),
+                        kTableEntriesPerPage
+                        = (BLOCK_SIZE - kTablePageHeaderSize) / sizeof(uint32_t),
+                        kBucketHeaderSize = 3 * sizeof(uint32_t),
+                        kRecordHeaderSize = sizeof(uint64_t) + ID_LENGTH + 2;
+
+static size_t record_size(std::string_view name) { return kRecordHeaderSize + name.size(); }
+
+// Names that compare equal must hash equally, so they are hashed in a form where the equivalence
+// of the comparison becomes equality.
+static std::string normalize_for_hash(Directory::DirNameComparison cmpfn, std::string_view name)
+{
+    if (cmpfn.fn == &case_insensitive_compare)
+    {
+        return una::cases::to_casefold_utf8(name);
+    }
+    if (cmpfn.fn == &uni_norm_insensitive_compare)
+    {
+        return is_ascii(name) ? std::string(name) : una::norm::to_nfd_utf8(name);
+    }
+    if (cmpfn.fn == &case_uni_norm_insensitve_compare)
+    {
+        return una::cases::to_casefold_utf8(una::norm::to_nfd_utf8(name));
+    }
+    throwInvalidArgumentException("Unsupported name comparison for hash indexed directories");
+}
+
+void HashDirectory::derive_hash_key(const key_type& master_key, const id_type& id)
+{
+    static constexpr std::string_view kInfo = "securefs hash directory";
+    hkdf(master_key.data(),
+         master_key.size(),
+         id.data(),
+         id.size(),
+         kInfo.data(),
+         kInfo.size(),
+         m_hash_key.data(),
+         m_hash_key.size());
+}
+
+uint64_t HashDirectory::hash_name(std::string_view name)
+{
+    std::string normalized;
+    if (cmpfn_.fn != &binary_compare)
+    {
+        normalized = normalize_for_hash(cmpfn_, name);
+        name = normalized;
+    }
+    CryptoPP::BLAKE2b blake(
+        m_hash_key.data(), m_hash_key.size(), nullptr, 0, nullptr, 0, false, sizeof(uint64_t));
+    blake.Update(reinterpret_cast<const byte*>(name.data()), name.size());
+    byte digest[sizeof(uint64_t)];
+    blake.TruncatedFinal(digest, sizeof(digest));
+    // Hashes double as readdir cookies, which must be positive offsets even after FUSE adds its
+    // own, and must not be zero.
+    uint64_t hash = from_little_endian<uint64_t>(digest) >> 2u;
+    return hash == 0 ? 1 : hash;
+}
+
+size_t HashDirectory::table_index(uint64_t hash) const noexcept
+{
+    return m_global_depth == 0 ? 0 : static_cast<size_t>(hash >> (62u - m_global_depth));
+}
+
+uint32_t HashDirectory::allocate_page()
+{
+    auto result = static_cast<uint32_t>(m_stream->size() / BLOCK_SIZE);
+    m_stream->resize(m_stream->size() + BLOCK_SIZE);
+    return result;
+}
+
+void HashDirectory::load_table()
+{
+    if (m_table_loaded)
+        return;
+
+    uint32_t num_pages = static_cast<uint32_t>(m_stream->size() / BLOCK_SIZE);
+    byte buffer[BLOCK_SIZE];
+    for (uint32_t pg = get_root_page(); pg != kNoPage;)
+    {
+        dir_check(pg < num_pages && m_table_pages.size() < num_pages);
+        dir_check(m_stream->read(buffer, pg * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+        dir_check(from_little_endian<uint32_t>(buffer) == kTablePageMagic);
+        if (m_table_pages.empty())
+        {
+            m_global_depth = from_little_endian<uint32_t>(buffer + 4);
+            m_num_entries = from_little_endian<uint32_t>(buffer + 8);
+            dir_check(m_global_depth <= kMaxGlobalDepth);
+        }
+        auto count = from_little_endian<uint32_t>(buffer + 16);
+        dir_check(count <= kTableEntriesPerPage);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            auto bucket_page = from_little_endian<uint32_t>(buffer + kTablePageHeaderSize + i * 4);
+            dir_check(bucket_page < num_pages);
+            m_table.push_back(bucket_page);
+        }
+        m_table_pages.push_back(pg);
+        pg = from_little_endian<uint32_t>(buffer + 12);
+    }
+    dir_check(m_table_pages.empty() || m_table.size() == size_t(1) << m_global_depth);
+    m_dirty_table_pages.assign(m_table_pages.size(), false);
+    m_table_loaded = true;
+}
+
+void HashDirectory::mark_table_dirty(size_t begin, size_t end)
+{
+    size_t num_pages = std::max<size_t>(
+        1, (m_table.size() + kTableEntriesPerPage - 1) / kTableEntriesPerPage);
+    m_dirty_table_pages.resize(num_pages, true);
+    for (size_t i = begin / kTableEntriesPerPage; i < num_pages && i * kTableEntriesPerPage < end;
+         ++i)
+    {
+        m_dirty_table_pages[i] = true;
+    }
+}
+
+void HashDirectory::write_table()
+{
+    size_t num_pages = m_dirty_table_pages.size();
+    while (m_table_pages.size() < num_pages)
+    {
+        // The previous last page now links to the new one.
+        if (!m_table_pages.empty())
+            m_dirty_table_pages[m_table_pages.size() - 1] = true;
+        m_table_pages.push_back(allocate_page());
+    }
+    for (size_t i = 0; i < num_pages; ++i)
+    {
+        if (!m_dirty_table_pages[i])
+            continue;
+        byte buffer[BLOCK_SIZE] = {};
+        size_t begin = i * kTableEntriesPerPage,
+               end = std::min(m_table.size(), begin + kTableEntriesPerPage);
+        to_little_endian(kTablePageMagic, buffer);
+        to_little_endian(m_global_depth, buffer + 4);
+        to_little_endian(m_num_entries, buffer + 8);
+        to_little_endian(i + 1 < num_pages ? m_table_pages[i + 1] : kNoPage, buffer + 12);
+        to_little_endian(static_cast<uint32_t>(end - begin), buffer + 16);
+        for (size_t j = begin; j < end; ++j)
+        {
+            to_little_endian(m_table[j], buffer + kTablePageHeaderSize + (j - begin) * 4);
+        }
+        m_stream->write(buffer, m_table_pages[i] * BLOCK_SIZE, BLOCK_SIZE);
+        m_dirty_table_pages[i] = false;
+    }
+    if (get_root_page() != m_table_pages.front())
+        set_root_page(m_table_pages.front());
+}
+
+HashDirectory::Bucket* HashDirectory::retrieve_bucket(uint32_t page)
+{
+    auto iter = m_bucket_cache.find(page);
+    if (iter != m_bucket_cache.end())
+        return iter->second.get();
+
+    byte buffer[BLOCK_SIZE];
+    dir_check(m_stream->read(buffer, page * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    dir_check(from_little_endian<uint32_t>(buffer) == kBucketPageMagic);
+
+    auto b = std::make_unique<Bucket>();
+    b->page = page;
+    b->local_depth = from_little_endian<uint32_t>(buffer + 4);
+    b->dirty = false;
+    dir_check(b->local_depth <= m_global_depth);
+    auto count = from_little_endian<uint32_t>(buffer + 8);
+    dir_check(count <= (BLOCK_SIZE - kBucketHeaderSize) / kRecordHeaderSize);
+    const byte* cursor = buffer + kBucketHeaderSize;
+    const byte* end = buffer + BLOCK_SIZE;
+    b->records.resize(count);
+    for (Record& r : b->records)
+    {
+        dir_check(cursor + kRecordHeaderSize <= end);
+        r.hash = from_little_endian<uint64_t>(cursor);
+        cursor += sizeof(uint64_t);
+        memcpy(r.id.data(), cursor, ID_LENGTH);
+        cursor += ID_LENGTH;
+        r.type = cursor[0];
+        size_t name_length = cursor[1];
+        cursor += 2;
+        dir_check(cursor + name_length <= end);
+        r.filename.assign(reinterpret_cast<const char*>(cursor), name_length);
+        cursor += name_length;
+    }
+    b->used_bytes = cursor - buffer;
+
+    auto result = b.get();
+    m_bucket_cache.emplace(page, std::move(b));
+    return result;
+}
+
+HashDirectory::Bucket* HashDirectory::new_bucket(uint32_t local_depth)
+{
+    auto b = std::make_unique<Bucket>();
+    b->page = allocate_page();
+    b->local_depth = local_depth;
+    b->used_bytes = kBucketHeaderSize;
+    b->dirty = true;
+    auto result = b.get();
+    m_bucket_cache.emplace(result->page, std::move(b));
+    return result;
+}
+
+void HashDirectory::write_bucket(const Bucket& b)
+{
+    byte buffer[BLOCK_SIZE] = {};
+    to_little_endian(kBucketPageMagic, buffer);
+    to_little_endian(b.local_depth, buffer + 4);
+    to_little_endian(static_cast<uint32_t>(b.records.size()), buffer + 8);
+    byte* cursor = buffer + kBucketHeaderSize;
+    for (const Record& r : b.records)
+    {
+        dir_check(cursor + record_size(r.filename) <= buffer + BLOCK_SIZE);
+        to_little_endian(r.hash, cursor);
+        cursor += sizeof(uint64_t);
+        memcpy(cursor, r.id.data(), ID_LENGTH);
+        cursor += ID_LENGTH;
+        cursor[0] = r.type;
+        cursor[1] = static_cast<byte>(r.filename.size());
+        cursor += 2;
+        memcpy(cursor, r.filename.data(), r.filename.size());
+        cursor += r.filename.size();
+    }
+    m_stream->write(buffer, b.page * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+void HashDirectory::flush_cache()
+{
+    for (auto&& pair : m_bucket_cache)
+    {
+        auto&& b = *pair.second;
+        if (b.dirty)
+        {
+            write_bucket(b);
+            b.dirty = false;
+        }
+    }
+    if (std::find(m_dirty_table_pages.begin(), m_dirty_table_pages.end(), true)
+        != m_dirty_table_pages.end())
+        write_table();
+}
+
+void HashDirectory::trim_cache()
+{
+    if (m_bucket_cache.size() <= kMaxCachedBuckets)
+        return;
+    flush_cache();
+    m_bucket_cache.clear();
+}
+
+void HashDirectory::subflush() { flush_cache(); }
+
+HashDirectory::~HashDirectory()
+{
+    try
+    {
+        flush_cache();
+    }
+    catch (...)
+    {
+    }
+}
+
+std::optional<size_t>
+HashDirectory::find_record(const Bucket& b, uint64_t hash, std::string_view name)
+{
+    auto iter = std::lower_bound(b.records.begin(),
+                                 b.records.end(),
+                                 hash,
+                                 [](const Record& r, uint64_t h) { return r.hash < h; });
+    for (; iter != b.records.end() && iter->hash == hash; ++iter)
+    {
+        if (cmpfn_(name, iter->filename) == 0)
+            return iter - b.records.begin();
+    }
+    return {};
+}
+
+// Splits a full bucket by the next bit of the hash. When the bucket is already as deep as the
+// table, the table doubles first.
+void HashDirectory::split(Bucket* b)
+{
+    dir_check(!b->records.empty());
+    if (b->local_depth == m_global_depth)
+    {
+        if (m_global_depth >= kMaxGlobalDepth)
+            throwVFSException(ENOSPC);
+        std::vector<uint32_t> doubled(m_table.size() * 2);
+        for (size_t i = 0; i < m_table.size(); ++i)
+        {
+            doubled[2 * i] = m_table[i];
+            doubled[2 * i + 1] = m_table[i];
+        }
+        m_table.swap(doubled);
+        ++m_global_depth;
+        mark_table_dirty(0, m_table.size());
+    }
+
+    // The table entries of the bucket form an aligned range, whose upper half moves over.
+    size_t span = size_t(1) << (m_global_depth - b->local_depth);
+    size_t begin = table_index(b->records.front().hash) & ~(span - 1);
+
+    uint32_t local_depth = b->local_depth + 1;
+    Bucket* sibling = new_bucket(local_depth);
+    b->local_depth = local_depth;
+    b->dirty = true;
+
+    // All records share the leading bits up to the old depth, so being sorted, those with the
+    // next bit set come last.
+    uint64_t bit = uint64_t(1) << (62u - local_depth);
+    auto mid = std::partition_point(b->records.begin(),
+                                    b->records.end(),
+                                    [bit](const Record& r) { return (r.hash & bit) == 0; });
+    for (auto iter = mid; iter != b->records.end(); ++iter)
+    {
+        size_t size = record_size(iter->filename);
+        b->used_bytes -= size;
+        sibling->used_bytes += size;
+    }
+    sibling->records.assign(std::make_move_iterator(mid),
+                            std::make_move_iterator(b->records.end()));
+    b->records.erase(mid, b->records.end());
+
+    std::fill(m_table.begin() + begin + span / 2, m_table.begin() + begin + span, sibling->page);
+    mark_table_dirty(begin + span / 2, begin + span);
+}
+
+std::optional<std::string_view>
+HashDirectory::get_entry_impl(std::string_view name, id_type& id, int& type)
+{
+    trim_cache();
+    if (name.size() > MAX_FILENAME_LENGTH)
+        throwVFSException(ENAMETOOLONG);
+    load_table();
+    if (m_table.empty())
+        return {};
+
+    uint64_t hash = hash_name(name);
+    Bucket* b = retrieve_bucket(m_table[table_index(hash)]);
+    auto index = find_record(*b, hash, name);
+    if (!index)
+        return {};
+    const Record& r = b->records[*index];
+    id = r.id;
+    type = r.type;
+    return r.filename;
+}
+
+bool HashDirectory::add_entry_impl(std::string_view name, const id_type& id, int type)
+{
+    trim_cache();
+    if (name.size() > MAX_FILENAME_LENGTH)
+        throwVFSException(ENAMETOOLONG);
+    dir_check(type >= 0 && type <= 255);
+    load_table();
+    if (m_table.empty())
+    {
+        m_global_depth = 0;
+        m_table.push_back(new_bucket(0)->page);
+        mark_table_dirty(0, 1);
+    }
+
+    uint64_t hash = hash_name(name);
+    while (true)
+    {
+        Bucket* b = retrieve_bucket(m_table[table_index(hash)]);
+        if (find_record(*b, hash, name))
+            return false;
+        if (b->used_bytes + record_size(name) > BLOCK_SIZE)
+        {
+            split(b);
+            continue;
+        }
+        auto iter = std::upper_bound(b->records.begin(),
+                                     b->records.end(),
+                                     hash,
+                                     [](uint64_t h, const Record& r) { return h < r.hash; });
+        b->records.insert(iter, Record{hash, std::string(name), id, static_cast<byte>(type)});
+        b->used_bytes += record_size(name);
+        b->dirty = true;
+        ++m_num_entries;
+        mark_table_dirty(0, 1);
+        return true;
+    }
+}
+
+bool HashDirectory::remove_entry_impl(std::string_view name, id_type& id, int& type)
+{
+    trim_cache();
+    if (name.size() > MAX_FILENAME_LENGTH)
+        throwVFSException(ENAMETOOLONG);
+    load_table();
+    if (m_table.empty())
+        return false;
+
+    uint64_t hash = hash_name(name);
+    Bucket* b = retrieve_bucket(m_table[table_index(hash)]);
+    auto index = find_record(*b, hash, name);
+    if (!index)
+        return false;
+    auto iter = b->records.begin() + *index;
+    id = iter->id;
+    type = iter->type;
+    b->used_bytes -= record_size(iter->filename);
+    b->records.erase(iter);
+    b->dirty = true;
+    dir_check(m_num_entries > 0);
+    --m_num_entries;
+    mark_table_dirty(0, 1);
+    return true;
+}
+
+void HashDirectory::iterate_over_entries_impl(const callback& cb)
+{
+    iterate_over_entries_from_impl(
+        0,
+        [&](const std::string& name, const id_type& id, int type, uint64_t)
+        {
+            cb(name, id, type);
+            return true;
+        });
+}
+
+// The cookie of an entry is its hash, and the buckets partition the hash space in table order,
+// so the listing runs in hash order and resumes at the first greater hash.
+void HashDirectory::iterate_over_entries_from_impl(uint64_t cookie, const resumable_callback& cb)
+{
+    trim_cache();
+    load_table();
+    for (size_t i = cookie == 0 ? 0 : table_index(cookie); i < m_table.size();)
+    {
+        // A full listing would otherwise pull every bucket into the cache.
+        bool was_cached = m_bucket_cache.contains(m_table[i]);
+        Bucket* b = retrieve_bucket(m_table[i]);
+        auto iter = std::upper_bound(b->records.begin(),
+                                     b->records.end(),
+                                     cookie,
+                                     [](uint64_t h, const Record& r) { return h < r.hash; });
+        for (; iter != b->records.end(); ++iter)
+        {
+            if (!cb(iter->filename, iter->id, iter->type, iter->hash))
+                return;
+        }
+        size_t span = size_t(1) << (m_global_depth - b->local_depth);
+        i = (i & ~(span - 1)) + span;
+        if (!was_cached && !b->dirty)
+            m_bucket_cache.erase(b->page);
+    }
+}
+
+bool HashDirectory::empty()
+{
+    load_table();
+    return m_num_entries == 0;
+}
+
+bool HashDirectory::is_dirty() const
+{
+    if (Directory::is_dirty())
+    {
+        return true;
+    }
+    for (auto&& pair : m_bucket_cache)
+    {
+        if (pair.second->dirty)
+        {
+            return true;
+        }
+    }
+    return std::find(m_dirty_table_pages.begin(), m_dirty_table_pages.end(), true)
+        != m_dirty_table_pages.end();
+}
+
+bool HashDirectory::validate()
+{
+    load_table();
+    size_t num_entries = 0;
+    for (size_t i = 0; i < m_table.size();)
+    {
+        Bucket* b = retrieve_bucket(m_table[i]);
+        size_t span = size_t(1) << (m_global_depth - b->local_depth);
+        if (i % span != 0)
+            return false;
+        for (size_t j = i; j < i + span; ++j)
+        {
+            if (m_table[j] != b->page)
+                return false;
+        }
+        size_t used_bytes = kBucketHeaderSize;
+        for (size_t k = 0; k < b->records.size(); ++k)
+        {
+            const Record& r = b->records[k];
+            if (table_index(r.hash) / span != i / span || r.hash != hash_name(r.filename)
+                || (k > 0 && b->records[k - 1].hash > r.hash))
+                return false;
+            used_bytes += record_size(r.filename);
+        }
+        if (used_bytes != b->used_bytes || used_bytes > BLOCK_SIZE)
+            return false;
+        num_entries += b->records.size();
+        i += span;
+    }
+    return num_entries == m_num_entries;
+}
+}    // namespace securefs
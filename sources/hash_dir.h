@@ -0,0 +1,125 @@
+#pragma once
+#include "files.h"
+#include "myutils.h"
+
+#include <array>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <absl/container/flat_hash_map.h>
+
+namespace securefs
+{
+/**
+ * A directory indexed by extendible hashing, for very large directories.
+ *
+ * Every name is hashed, after being normalized to agree with the name comparison, by a hash
+ * keyed per directory. The leading bits of the hash select a bucket page through a table kept in
+ * memory, so a lookup reads and decrypts a single page regardless of the directory size. A full
+ * bucket splits in two, doubling the table when needed. Buckets never merge, so a directory
+ * keeps its size after mass removal. Entries are listed in hash order, not in name order.
+ */
+class HashDirectory final : public Directory
+{
+private:
+    struct Record
+    {
+        uint64_t hash;
+        std::string filename;
+        id_type id;
+        byte type;
+    };
+
+    struct Bucket
+    {
+        uint32_t page;
+        uint32_t local_depth;
+        // Sorted by hash
+        std::vector<Record> records;
+        size_t used_bytes;
+        bool dirty;
+    };
+
+    static constexpr inline uint32_t kMaxGlobalDepth = 24;
+    static constexpr inline size_t kMaxCachedBuckets = 256;
+
+    std::array<byte, 32> m_hash_key;
+    std::vector<uint32_t> m_table;
+    std::vector<uint32_t> m_table_pages;
+    uint32_t m_global_depth = 0;
+    uint32_t m_num_entries = 0;
+    bool m_table_loaded = false;
+    // Only the table pages that changed are written back.
+    std::vector<bool> m_dirty_table_pages;
+    absl::flat_hash_map<uint32_t, std::unique_ptr<Bucket>> m_bucket_cache;
+
+private:
+    void derive_hash_key(const key_type& master_key, const id_type& id);
+    uint64_t hash_name(std::string_view name);
+    size_t table_index(uint64_t hash) const noexcept;
+    uint32_t allocate_page() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
+    void load_table() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void write_table() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void mark_table_dirty(size_t begin, size_t end) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    Bucket* retrieve_bucket(uint32_t page) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    Bucket* new_bucket(uint32_t local_depth) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void write_bucket(const Bucket& b) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void flush_cache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void trim_cache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void split(Bucket* b) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
+    // Returns the index of the record with an equivalent name, if any.
+    std::optional<size_t> find_record(const Bucket& b, uint64_t hash, std::string_view name);
+
+protected:
+    void subflush() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
+public:
+    INJECT(HashDirectory(DirNameComparison cmpfn,
+                         ASSISTED(std::shared_ptr<FileStream>) data_stream,
+                         ASSISTED(std::shared_ptr<FileStream>) meta_stream,
+                         ANNOTATED(tMasterKey, const key_type&) key_,
+                         ASSISTED(const id_type&) id_,
+                         ANNOTATED(tVerify, bool) check,
+                         ANNOTATED(tBlockSize, unsigned) block_size,
+                         ANNOTATED(tIvSize, unsigned) iv_size,
+                         ANNOTATED(tMaxPaddingSize, unsigned) max_padding_size,
+                         ANNOTATED(tStoreTimeWithinFs, bool) store_time))
+        : Directory(cmpfn,
+                    std::move(data_stream),
+                    std::move(meta_stream),
+                    key_,
+                    id_,
+                    check,
+                    block_size,
+                    iv_size,
+                    max_padding_size,
+                    store_time)
+    {
+        derive_hash_key(key_, id_);
+    }
+
+    ~HashDirectory() override;
+
+protected:
+    std::optional<std::string_view>
+    get_entry_impl(std::string_view name, id_type& id, int& type) override
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    bool add_entry_impl(std::string_view name, const id_type& id, int type) override
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    bool remove_entry_impl(std::string_view name, id_type& id, int& type) override
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void iterate_over_entries_impl(const callback&) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    void iterate_over_entries_from_impl(uint64_t cookie, const resumable_callback& cb) override
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
+public:
+    bool empty() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    bool is_dirty() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) override;
+
+    bool validate() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+};
+}    // namespace securefs
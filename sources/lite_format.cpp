@@ -8,9 +8,12 @@
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
+#include "stat_workaround.h"
 #include "tags.h"
+#include "trace_events.h"
 
 #include <absl/base/thread_annotations.h>
+#include <absl/hash/hash.h>
 #include <absl/container/inlined_vector.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
@@ -76,6 +79,258 @@ void StreamOpener::validate()
     }
 }
 
+VirtualSizeCache::Shard& VirtualSizeCache::get_shard(std::string_view abs_path)
+{
+    return shards_[absl::HashOf(abs_path) % kNumShards];
+}
+
+VirtualSizeCache::Entry VirtualSizeCache::Entry::from_stat(const fuse_stat& st,
+                                                          unsigned padding_size)
+{
+    Entry entry;
+    auto mtime = get_mtim(st);
+    entry.mtime_sec = mtime.tv_sec;
+    entry.mtime_nsec = mtime.tv_nsec;
+    entry.physical_size = st.st_size;
+#ifndef _WIN32
+    auto ctime = get_ctim(st);
+    entry.ino = st.st_ino;
+    entry.ctime_sec = ctime.tv_sec;
+    entry.ctime_nsec = ctime.tv_nsec;
+#endif
+    entry.padding_size = padding_size;
+    return entry;
+}
+
+bool VirtualSizeCache::Entry::matches(const fuse_stat& st) const
+{
+    Entry other = from_stat(st, padding_size);
+    return mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec
+        && physical_size == other.physical_size
+#ifndef _WIN32
+        && ino == other.ino && ctime_sec == other.ctime_sec && ctime_nsec == other.ctime_nsec
+#endif
+        ;
+}
+
+std::optional<unsigned> VirtualSizeCache::get_padding(std::string_view abs_path,
+                                                      const fuse_stat& st)
+{
+    auto& shard = get_shard(abs_path);
+    LockGuard<Mutex> lg(shard.mu);
+    auto it = shard.entries.find(abs_path);
+    if (it == shard.entries.end() || !it->second.matches(st))
+    {
+        return std::nullopt;
+    }
+    return it->second.padding_size;
+}
+
+void VirtualSizeCache::put_padding(std::string_view abs_path,
+                                   const fuse_stat& st,
+                                   unsigned padding_size)
+{
+    auto& shard = get_shard(abs_path);
+    auto entry = Entry::from_stat(st, padding_size);
+    LockGuard<Mutex> lg(shard.mu);
+    if (shard.entries.size() >= kMaxEntriesPerShard && !shard.entries.contains(abs_path))
+    {
+        // The iteration order of the hash map is effectively random, and so is the victim.
+        shard.entries.erase(shard.entries.begin());
+    }
+    shard.entries.insert_or_assign(std::string(abs_path), entry);
+}
+
+bool KernelCacheTracker::claim(const fuse_stat& st)
+{
+    std::pair<uint64_t, uint64_t> key(st.st_dev, st.st_ino);
+    auto& shard = shards_[absl::HashOf(key) % kNumShards];
+    auto mtime = get_mtim(st);
+    Entry entry{mtime.tv_sec, mtime.tv_nsec, static_cast<int64_t>(st.st_size)};
+    LockGuard<Mutex> lg(shard.mu);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+        bool unchanged = it->second.mtime_sec == entry.mtime_sec
+            && it->second.mtime_nsec == entry.mtime_nsec && it->second.size == entry.size;
+        it->second = entry;
+        return unchanged;
+    }
+    if (shard.entries.size() >= kMaxEntriesPerShard)
+    {
+        shard.entries.erase(shard.entries.begin());
+    }
+    shard.entries.emplace(key, entry);
+    return false;
+}
+
+AttrCache::Shard& AttrCache::get_shard(std::string_view key)
+{
+    return shards_[absl::HashOf(key) % kNumShards];
+}
+
+bool AttrCache::is_being_written(std::string_view key)
+{
+    LockGuard<Mutex> lg(writers_mu_);
+    return !writer_counts_.empty() && writer_counts_.contains(key);
+}
+
+AttrCache::LookupResult AttrCache::get(std::string_view key, fuse_stat* st)
+{
+    if (is_being_written(key))
+    {
+        return LookupResult::kMiss;
+    }
+    auto& shard = get_shard(key);
+    LockGuard<Mutex> lg(shard.mu);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end())
+    {
+        ++shard.misses;
+        return LookupResult::kMiss;
+    }
+    if (absl::Now() >= it->second.expiry)
+    {
+        ++shard.misses;
+        shard.entries.erase(it);
+        return LookupResult::kMiss;
+    }
+    ++shard.hits;
+    if (!it->second.st.has_value())
+    {
+        return LookupResult::kNonexistent;
+    }
+    *st = *it->second.st;
+    return LookupResult::kFound;
+}
+
+uint64_t AttrCache::begin_fill(std::string_view key)
+{
+    auto& shard = get_shard(key);
+    LockGuard<Mutex> lg(shard.mu);
+    return shard.generation;
+}
+
+void AttrCache::put(std::string_view key, const fuse_stat* st, uint64_t token)
+{
+    if (is_being_written(key))
+    {
+        return;
+    }
+    Entry entry{absl::Now() + timeout_, st ? std::optional<fuse_stat>(*st) : std::nullopt};
+    auto& shard = get_shard(key);
+    LockGuard<Mutex> lg(shard.mu);
+    if (shard.generation != token)
+    {
+        return;
+    }
+    if (shard.entries.size() >= kMaxEntriesPerShard && !shard.entries.contains(key))
+    {
+        shard.entries.erase(shard.entries.begin());
+    }
+    shard.entries.insert_or_assign(std::string(key), std::move(entry));
+}
+
+void AttrCache::invalidate(std::string_view key)
+{
+    auto& shard = get_shard(key);
+    LockGuard<Mutex> lg(shard.mu);
+    ++shard.generation;
+    shard.entries.erase(key);
+}
+
+void AttrCache::invalidate_all()
+{
+    for (auto& shard : shards_)
+    {
+        LockGuard<Mutex> lg(shard.mu);
+        ++shard.generation;
+        shard.entries.clear();
+    }
+}
+
+AttrCache::Stats AttrCache::get_stats()
+{
+    Stats stats;
+    for (auto& shard : shards_)
+    {
+        LockGuard<Mutex> lg(shard.mu);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.entries += shard.entries.size();
+    }
+    return stats;
+}
+
+void AttrCache::add_writer(uintptr_t handle, std::string key)
+{
+    {
+        LockGuard<Mutex> lg(writers_mu_);
+        if (!writer_handles_.try_emplace(handle, key).second)
+        {
+            return;
+        }
+        ++writer_counts_[key];
+    }
+    invalidate(key);
+}
+
+void AttrCache::remove_writer(uintptr_t handle)
+{
+    std::string key;
+    {
+        LockGuard<Mutex> lg(writers_mu_);
+        auto it = writer_handles_.find(handle);
+        if (it == writer_handles_.end())
+        {
+            return;
+        }
+        key = std::move(it->second);
+        writer_handles_.erase(it);
+        auto count_it = writer_counts_.find(key);
+        if (count_it != writer_counts_.end() && --count_it->second == 0)
+        {
+            writer_counts_.erase(count_it);
+        }
+    }
+    invalidate(key);
+}
+
+void AttrCache::rename_writers(std::string_view from_key, std::string_view to_key)
+{
+    LockGuard<Mutex> lg(writers_mu_);
+    if (writer_counts_.empty())
+    {
+        return;
+    }
+    // The renamed path may be a directory, in which case the files open beneath it move too.
+    auto renamed = [&](std::string_view key) -> std::optional<std::string>
+    {
+        if (key == from_key)
+        {
+            return std::string(to_key);
+        }
+        if (absl::StartsWith(key, from_key) && key.size() > from_key.size()
+            && key[from_key.size()] == '/')
+        {
+            return absl::StrCat(to_key, key.substr(from_key.size()));
+        }
+        return std::nullopt;
+    };
+    for (auto&& [handle, key] : writer_handles_)
+    {
+        if (auto new_key = renamed(key))
+        {
+            key = std::move(*new_key);
+        }
+    }
+    writer_counts_.clear();
+    for (auto&& [handle, key] : writer_handles_)
+    {
+        ++writer_counts_[key];
+    }
+}
+
 std::vector<byte> XattrCryptor::encrypt(const char* value, size_t size)
 {
     std::vector<byte> result(infer_encrypted_size(size));
@@ -175,6 +430,7 @@ namespace
         std::string encrypt_full_path(std::string_view path,
                                       std::string* out_encrypted_last_component) override
         {
+            trace::ScopedSpan span("stage", "encrypt_path", path.size());
             if (path.empty())
             {
                 return {};
@@ -342,6 +598,7 @@ namespace
         std::string encrypt_full_path(std::string_view path,
                                       std::string* out_encrypted_last_component) override
         {
+            trace::ScopedSpan span("stage", "encrypt_path", path.size());
             absl::InlinedVector<std::string_view, 7> splits = absl::StrSplit(path, '/');
             std::string result;
             result.reserve(path.size() * 3);
@@ -554,8 +811,7 @@ namespace
         {
         }
 
-        std::string encrypt_full_path(std::string_view path,
-                                      std::string* out_encrypted_last_component) override
+        std::string normalize_path(std::string_view path) override
         {
             try
             {
@@ -571,15 +827,22 @@ namespace
                     normed_string = una::cases::to_casefold_utf8(subject);
                     subject = normed_string;
                 }
-                return delegate_->encrypt_full_path(normed_string, out_encrypted_last_component);
+                return std::string(subject);
             }
             catch (const std::exception& e)
             {
                 WARN_LOG("Failed to normalize path %s: %s", path, e.what());
-                return delegate_->encrypt_full_path(path, out_encrypted_last_component);
+                return std::string(path);
             }
         }
 
+        std::string encrypt_full_path(std::string_view path,
+                                      std::string* out_encrypted_last_component) override
+        {
+            return delegate_->encrypt_full_path(normalize_path(path),
+                                                out_encrypted_last_component);
+        }
+
         absl::variant<InvalidNameTag, LongNameTag, std::string>
         decrypt_path_component(std::string_view path) override
         {
@@ -606,22 +869,41 @@ namespace
         bool nfc_;
     };
 
+    // Computes the virtual size of a regular file in a padded repository. The file is opened only
+    // if its padding is not cached yet.
+    length_type get_padded_virtual_size(StreamOpener& opener,
+                                        VirtualSizeCache& cache,
+                                        const std::string& abs_path,
+                                        const fuse_stat& st)
+    {
+        if (auto padding = cache.get_padding(abs_path, st); padding.has_value())
+        {
+            return opener.compute_virtual_size(st.st_size, *padding);
+        }
+        auto stream
+            = opener.open(OSService::get_default().open_file_stream(abs_path, O_RDONLY, 0));
+        cache.put_padding(abs_path, st, stream->get_padding_size());
+        return opener.compute_virtual_size(st.st_size, stream->get_padding_size());
+    }
+
     class DirectoryImpl : public Directory
     {
     public:
         DirectoryImpl(std::string dir_abs_path,
+                      std::string long_name_table_file_name,
                       NameTranslator& name_trans,
                       StreamOpener& opener,
+                      LongNameIndex& long_name_index,
+                      VirtualSizeCache& virtual_size_cache,
                       bool readdir_plus)
             : dir_abs_path_(std::move(dir_abs_path))
+            , long_name_table_file_name_(std::move(long_name_table_file_name))
             , name_trans_(name_trans)
             , opener_(opener)
+            , long_name_index_(long_name_index)
+            , virtual_size_cache_(virtual_size_cache)
             , readdir_plus_(readdir_plus)
         {
-            if (readdir_plus && !opener_.can_compute_virtual_size())
-            {
-                throw_runtime_error("Readdir plus should only be used without padding");
-            }
             under_traverser_ = OSService::get_default().create_traverser(dir_abs_path_);
         }
 
@@ -651,7 +933,7 @@ namespace
                 }
                 if (stbuf && readdir_plus_ && (stbuf->st_mode & S_IFMT) == S_IFREG)
                 {
-                    stbuf->st_size = opener_.compute_virtual_size(stbuf->st_size);
+                    fill_virtual_size(under_name, *stbuf);
                 }
                 if (name_trans_.is_no_op())
                 {
@@ -665,14 +947,10 @@ namespace
                 {
                     std::visit(Overload{[&](std::string&& decoded) { decoded.swap(*name); },
                                         [](const InvalidNameTag&) {},
-                                        [&](const LongNameTag&) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+                                        [&](const LongNameTag&)
                                         {
-                                            auto&& table = lazy_get_table();
-                                            std::string encrypted_name;
-                                            {
-                                                LockGuard<LongNameLookupTable> lg(table);
-                                                encrypted_name = table.lookup(under_name);
-                                            }
+                                            auto encrypted_name = long_name_index_.lookup(
+                                                long_name_table_file_name_, under_name);
                                             auto decoded = name_trans_.decrypt_path_component(
                                                 encrypted_name);
                                             std::get<std::string>(decoded).swap(*name);
@@ -693,23 +971,40 @@ namespace
         void rewind() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { under_traverser_->rewind(); }
 
     private:
-        LongNameLookupTable& lazy_get_table() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+        void fill_virtual_size(const std::string& under_name, fuse_stat& stbuf)
         {
-            if (long_table_.has_value())
+            if (opener_.can_compute_virtual_size())
+            {
+                stbuf.st_size = opener_.compute_virtual_size(stbuf.st_size);
+                return;
+            }
+            if (stbuf.st_size <= 0)
+            {
+                return;
+            }
+            auto abs_path = OSService::concat_and_norm_narrowed(dir_abs_path_, under_name);
+            try
+            {
+                stbuf.st_size
+                    = get_padded_virtual_size(opener_, virtual_size_cache_, abs_path, stbuf);
+            }
+            catch (const std::exception& e)
             {
-                return *long_table_;
+                ERROR_LOG("Encountered exception %s when opening file %s for read: %s",
+                          get_type_name(e).get(),
+                          abs_path,
+                          e.what());
             }
-            long_table_.emplace(
-                OSService::concat_and_norm_narrowed(dir_abs_path_, kLongNameTableFileName), true);
-            return *long_table_;
         }
 
     private:
-        std::optional<LongNameLookupTable> long_table_ ABSL_GUARDED_BY(*this);
         std::string dir_abs_path_;
+        std::string long_name_table_file_name_;
         std::unique_ptr<DirectoryTraverser> under_traverser_ ABSL_GUARDED_BY(*this);
         NameTranslator& name_trans_;
         StreamOpener& opener_;
+        LongNameIndex& long_name_index_;
+        VirtualSizeCache& virtual_size_cache_;
         bool readdir_plus_;
     };
 
@@ -743,7 +1038,8 @@ void FuseHighLevelOps::initialize(fuse_conn_info* info)
 {
     (void)info;
 #ifdef FSP_FUSE_CAP_READDIR_PLUS
-    if (opener_.can_compute_virtual_size() && (info->capable & FSP_FUSE_CAP_READDIR_PLUS))
+    // Padded files are sized through `virtual_size_cache_`, so they no longer preclude this.
+    if (info->capable & FSP_FUSE_CAP_READDIR_PLUS)
     {
         info->want |= FSP_FUSE_CAP_READDIR_PLUS;
         read_dir_plus_ = true;
@@ -758,6 +1054,30 @@ int FuseHighLevelOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_co
     return 0;
 }
 int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_context* ctx)
+{
+    if (!attr_cache_)
+    {
+        return getattr_uncached(path, buf);
+    }
+    auto key = attr_cache_key(path);
+    switch (attr_cache_->get(key, buf))
+    {
+    case AttrCache::LookupResult::kFound:
+        return 0;
+    case AttrCache::LookupResult::kNonexistent:
+        return -ENOENT;
+    default:
+        break;
+    }
+    auto token = attr_cache_->begin_fill(key);
+    int rc = getattr_uncached(path, buf);
+    if (rc == 0 || rc == -ENOENT)
+    {
+        attr_cache_->put(key, rc == 0 ? buf : nullptr, token);
+    }
+    return rc;
+}
+int FuseHighLevelOps::getattr_uncached(const char* path, fuse_stat* buf)
 {
     auto enc_path = name_trans_.encrypt_full_path(path, nullptr);
     if (!root_.stat(enc_path, buf))
@@ -804,8 +1124,8 @@ int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_cont
             {
                 try
                 {
-                    auto virtual_file = opener_.open(root_.open_file_stream(enc_path, O_RDONLY, 0));
-                    buf->st_size = virtual_file->size();
+                    buf->st_size = get_padded_virtual_size(
+                        opener_, virtual_size_cache_, root_.norm_path_narrowed(enc_path), *buf);
                 }
                 catch (const std::exception& e)
                 {
@@ -834,11 +1154,16 @@ int FuseHighLevelOps::vfgetattr(const char* path,
 }
 int FuseHighLevelOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
-    auto dir = std::make_unique<DirectoryImpl>(
-        root_.norm_path_narrowed(name_trans_.encrypt_full_path(path, nullptr)),
-        name_trans_,
-        opener_,
-        read_dir_plus_);
+    auto enc_path = name_trans_.encrypt_full_path(path, nullptr);
+    auto table_file_name
+        = root_.norm_path_narrowed(absl::StrCat(enc_path, "/", kLongNameTableFileName));
+    auto dir = std::make_unique<DirectoryImpl>(root_.norm_path_narrowed(enc_path),
+                                               std::move(table_file_name),
+                                               name_trans_,
+                                               opener_,
+                                               long_name_index_,
+                                               virtual_size_cache_,
+                                               read_dir_plus_);
     info->fh = reinterpret_cast<uintptr_t>(dir.release());
     return 0;
 }
@@ -878,6 +1203,10 @@ int FuseHighLevelOps::vcreate(const char* path,
                               const fuse_context* ctx)
 {
     info->fh = reinterpret_cast<uintptr_t>(open(path, O_CREAT | O_EXCL | O_RDWR, mode).release());
+    if (attr_cache_)
+    {
+        attr_cache_->add_writer(info->fh, attr_cache_key(path));
+    }
     if (win_symlink_workaround)
     {
         LockGuard lg(win_symlink_workaround->mutex);
@@ -887,11 +1216,27 @@ int FuseHighLevelOps::vcreate(const char* path,
 }
 int FuseHighLevelOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
-    info->fh = reinterpret_cast<uintptr_t>(open(path, info->flags, 0).release());
+    auto fp = open(path, info->flags, 0);
+    {
+        fuse_stat st{};
+        LockGuard<File> lg(*fp, false);
+        fp->fstat(&st);
+        info->keep_cache = kernel_cache_tracker_.claim(st);
+    }
+    info->fh = reinterpret_cast<uintptr_t>(fp.release());
+    if (attr_cache_ && (info->flags & O_ACCMODE) != O_RDONLY)
+    {
+        attr_cache_->add_writer(info->fh, attr_cache_key(path));
+    }
     return 0;
 }
 int FuseHighLevelOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
+    if (attr_cache_)
+    {
+        // Before the handle is freed, so that its value cannot be reused in between.
+        attr_cache_->remove_writer(info->fh);
+    }
     delete get_base(info);
 
     if (win_symlink_workaround)
@@ -990,14 +1335,19 @@ int FuseHighLevelOps::vrmdir(const char* path, const fuse_context* ctx)
                                LongNameComponentAction::kDelete,
                                [&](std::string&& enc_path)
                                {
-                                   root_.remove_file_nothrow(
-                                       absl::StrCat(enc_path, "/", kLongNameTableFileName));
+                                   forget_long_name_tables_under(enc_path);
+                                   auto table_path
+                                       = absl::StrCat(enc_path, "/", kLongNameTableFileName);
+                                   root_.remove_file_nothrow(table_path);
+                                   root_.remove_file_nothrow(absl::StrCat(table_path, "-wal"));
+                                   root_.remove_file_nothrow(absl::StrCat(table_path, "-shm"));
                                    root_.remove_directory(enc_path);
                                });
     return 0;
 }
 int FuseHighLevelOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr_cache(path, false));
     root_.chmod(name_trans_.encrypt_full_path(path, nullptr), mode);
     return 0;
 }
@@ -1006,6 +1356,7 @@ int FuseHighLevelOps::vchown(const char* path,
                              fuse_gid_t gid,
                              const fuse_context* ctx)
 {
+    DEFER(invalidate_attr_cache(path, false));
     root_.chown(name_trans_.encrypt_full_path(path, nullptr), uid, gid);
     return 0;
 }
@@ -1032,6 +1383,8 @@ int FuseHighLevelOps::vsymlink(const char* to, const char* from, const fuse_cont
 }
 int FuseHighLevelOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
 {
+    // The link count of `src` changes.
+    DEFER(invalidate_attr_cache(src, false));
     process_possible_long_name(
         dest,
         LongNameComponentAction::kCreate,
@@ -1072,6 +1425,8 @@ int FuseHighLevelOps::vrename(const char* from, const char* to, const fuse_conte
         return vrename_impl(from, to, ctx);
     }
     // This is a delayed rename
+    invalidate_attr_cache(from, true);
+    invalidate_attr_cache(to, true);
     win_symlink_workaround->permanent_symlinks_to_temporary_symlinks.try_emplace(to, from);
     win_symlink_workaround->temporary_symlinks.erase(it);
     return 0;
@@ -1082,6 +1437,26 @@ int FuseHighLevelOps::vrename_impl(const char* from, const char* to, const fuse_
     auto enc_from = name_trans_.encrypt_full_path(from, &encrypted_last_component_from);
     auto enc_to = name_trans_.encrypt_full_path(to, &encrypted_last_component_to);
 
+    // If a directory is being moved, the databases cached under its old path must not be reused.
+    forget_long_name_tables_under(enc_from);
+    forget_long_name_tables_under(enc_to);
+
+    bool moving_directory = false;
+    if (attr_cache_)
+    {
+        fuse_stat from_st{};
+        moving_directory
+            = root_.stat(enc_from, &from_st) && (from_st.st_mode & S_IFMT) == S_IFDIR;
+        attr_cache_->rename_writers(attr_cache_key(from), attr_cache_key(to));
+    }
+    DEFER(if (moving_directory) {
+        // Every cached path under the directory changes. This is rare enough to start afresh.
+        attr_cache_->invalidate_all();
+    } else {
+        invalidate_attr_cache(from, true);
+        invalidate_attr_cache(to, true);
+    });
+
     if (encrypted_last_component_from.empty() && encrypted_last_component_to.empty())
     {
         // Neither are long name, so fast path.
@@ -1089,20 +1464,34 @@ int FuseHighLevelOps::vrename_impl(const char* from, const char* to, const fuse_
         return 0;
     }
 
-    DoubleLongNameLookupTable table(long_name_table_file_name(enc_from),
-                                    long_name_table_file_name(enc_to));
-    LockGuard<decltype(table)> lg(table);
+    auto from_table_file_name = long_name_table_file_name(enc_from);
+    auto to_table_file_name = long_name_table_file_name(enc_to);
+    {
+        DoubleLongNameLookupTable table(from_table_file_name, to_table_file_name);
+        LockGuard<decltype(table)> lg(table);
 
+        if (!encrypted_last_component_from.empty())
+        {
+            table.remove_mapping_from_from_db(name_trans_.get_last_component(enc_from));
+        }
+        if (!encrypted_last_component_to.empty())
+        {
+            table.update_mapping_to_to_db(name_trans_.get_last_component(enc_to),
+                                          encrypted_last_component_to);
+        }
+        root_.rename(enc_from, enc_to);
+    }
     if (!encrypted_last_component_from.empty())
     {
-        table.remove_mapping_from_from_db(name_trans_.get_last_component(enc_from));
+        long_name_index_.remove_mapping(from_table_file_name,
+                                        name_trans_.get_last_component(enc_from));
     }
     if (!encrypted_last_component_to.empty())
     {
-        table.update_mapping_to_to_db(name_trans_.get_last_component(enc_to),
-                                      encrypted_last_component_to);
+        long_name_index_.update_mapping(to_table_file_name,
+                                        name_trans_.get_last_component(enc_to),
+                                        encrypted_last_component_to);
     }
-    root_.rename(enc_from, enc_to);
     return 0;
 }
 int FuseHighLevelOps::vfsync(const char* path,
@@ -1118,6 +1507,7 @@ int FuseHighLevelOps::vfsync(const char* path,
 }
 int FuseHighLevelOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr_cache(path, false));
     auto fp = open(path, O_WRONLY, 0);
     LockGuard<File> lg(*fp);
     fp->resize(len);
@@ -1125,6 +1515,7 @@ int FuseHighLevelOps::vtruncate(const char* path, fuse_off_t len, const fuse_con
 }
 int FuseHighLevelOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr_cache(path, false));
     root_.utimens(name_trans_.encrypt_full_path(path, nullptr), ts);
     return 0;
 }
@@ -1197,6 +1588,7 @@ int FuseHighLevelOps::vsetxattr(const char* path,
         return 0;
     }
     auto data = xattr_.encrypt(value, size);
+    DEFER(invalidate_attr_cache(path, false));
     return root_.setxattr(name_trans_.encrypt_full_path(path, nullptr).c_str(),
                           name,
                           data.data(),
@@ -1210,8 +1602,31 @@ int FuseHighLevelOps::vremovexattr(const char* path, const char* name, const fus
     {
         return rc;
     }
+    DEFER(invalidate_attr_cache(path, false));
     return root_.removexattr(name_trans_.encrypt_full_path(path, nullptr).c_str(), name);
 }
+void FuseHighLevelOps::collect_gauges(std::vector<trace::StatsGauge>* gauges)
+{
+    if (!attr_cache_)
+    {
+        return;
+    }
+    auto stats = attr_cache_->get_stats();
+    auto lookups = stats.hits + stats.misses;
+    gauges->push_back({"attr_cache_hits_total", static_cast<double>(stats.hits), true});
+    gauges->push_back({"attr_cache_misses_total", static_cast<double>(stats.misses), true});
+    gauges->push_back({"attr_cache_hit_ratio",
+                       lookups ? static_cast<double>(stats.hits) / lookups : 0.0,
+                       false});
+    gauges->push_back({"attr_cache_entries", static_cast<double>(stats.entries), false});
+}
+void FuseHighLevelOps::drop_caches()
+{
+    if (attr_cache_)
+    {
+        attr_cache_->invalidate_all();
+    }
+}
 std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, unsigned mode)
 {
     if (flags & O_APPEND)
@@ -1251,6 +1666,38 @@ std::string FuseHighLevelOps::long_name_table_file_name(absl::string_view enc_pa
     return root_.norm_path_narrowed(
         absl::StrCat(name_trans_.remove_last_component(enc_path), "/", kLongNameTableFileName));
 }
+std::string FuseHighLevelOps::attr_cache_key(std::string_view path)
+{
+    // Different spellings of the same path must share one entry.
+    return name_trans_.normalize_path(path);
+}
+void FuseHighLevelOps::invalidate_attr_cache(std::string_view path, bool including_parent) noexcept
+{
+    if (!attr_cache_)
+    {
+        return;
+    }
+    try
+    {
+        attr_cache_->invalidate(attr_cache_key(path));
+        if (including_parent)
+        {
+            auto pos = path.rfind('/');
+            attr_cache_->invalidate(attr_cache_key(
+                pos == std::string_view::npos || pos == 0 ? "/" : path.substr(0, pos)));
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ERROR_LOG("Failed to invalidate the cached attributes of %s: %s", path, e.what());
+        attr_cache_->invalidate_all();
+    }
+}
+void FuseHighLevelOps::forget_long_name_tables_under(absl::string_view enc_dir_path)
+{
+    long_name_committer_.evict(root_.norm_path_narrowed(absl::StrCat(enc_dir_path, "/")));
+    long_name_index_.evict(root_.norm_path_narrowed(enc_dir_path));
+}
 void FuseHighLevelOps::process_possible_long_name(
     absl::string_view path,
     LongNameComponentAction action,
@@ -1261,6 +1708,7 @@ void FuseHighLevelOps::process_possible_long_name(
         callback(name_trans_.encrypt_full_path(path, nullptr));
         return;
     }
+    DEFER(invalidate_attr_cache(path, true));
     std::string encrypted_last_component, enc_path;
     enc_path = name_trans_.encrypt_full_path(path, &encrypted_last_component);
 
@@ -1269,21 +1717,30 @@ void FuseHighLevelOps::process_possible_long_name(
         callback(std::move(enc_path));
         return;
     }
-    LongNameLookupTable table(long_name_table_file_name(enc_path), false);
-    // Open a transaction so that we will rollback properly if the following operations fail.
-    LockGuard<LongNameLookupTable> table_lg(table);
+    auto table_file_name = long_name_table_file_name(enc_path);
+    auto keyed_hash = std::string(name_trans_.get_last_component(enc_path));
+    // The mapping is committed before the file is created, and removed only after the file is
+    // gone, so that a visible file always has its mapping. A mapping left behind by a failed
+    // operation is harmless, as the same long name always maps to the same hash and ciphertext.
     switch (action)
     {
     case LongNameComponentAction::kCreate:
-        table.update_mapping(name_trans_.get_last_component(enc_path), encrypted_last_component);
+        long_name_committer_.submit(table_file_name,
+                                    LongNameMappingCommitter::Action::kUpdate,
+                                    keyed_hash,
+                                    encrypted_last_component);
+        long_name_index_.update_mapping(table_file_name, keyed_hash, encrypted_last_component);
+        callback(std::move(enc_path));
         break;
     case LongNameComponentAction::kDelete:
-        table.remove_mapping(name_trans_.get_last_component(enc_path));
+        callback(std::move(enc_path));
+        long_name_committer_.submit(
+            table_file_name, LongNameMappingCommitter::Action::kRemove, keyed_hash);
+        long_name_index_.remove_mapping(table_file_name, keyed_hash);
         break;
     default:
         throw_runtime_error("Unspecified action");
     }
-    callback(std::move(enc_path));
 }
 fruit::Component<
     fruit::Required<const NameNormalizationFlags, fruit::Annotated<tNameMasterKey, key_type>>,
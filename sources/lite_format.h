@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fuse_high_level_ops_base.h"
+#include "lite_long_name_lookup_table.h"
 #include "lite_stream.h"
 #include "lock_guard.h"
 #include "mystring.h"
@@ -14,6 +15,7 @@
 #include <absl/functional/function_ref.h>
 #include <absl/strings/string_view.h>
 #include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
 #include <array>
 #include <cryptopp/aes.h>
 #include <cryptopp/gcm.h>
@@ -24,7 +26,9 @@
 #include <fruit/macro.h>
 
 #include <memory>
+#include <optional>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -69,6 +73,17 @@ public:
 
     bool can_compute_virtual_size() const noexcept { return max_padding_size_ <= 0; }
 
+    // Same as above, but for a file whose padding is already known.
+    length_type compute_virtual_size(length_type physical_size,
+                                     unsigned padding_size) const noexcept
+    {
+        if (physical_size <= lite::AESGCMCryptStream::get_id_size() + padding_size)
+        {
+            return 0;
+        }
+        return compute_virtual_size(physical_size - padding_size);
+    }
+
     void compute_session_key(const std::array<unsigned char, 16>& id,
                              std::array<unsigned char, 16>& outkey) override;
     unsigned compute_padding(const std::array<unsigned char, 16>& id) override;
@@ -84,6 +99,155 @@ private:
     ThreadLocal<AES_ECB> content_ecb, padding_ecb;
 };
 
+/// Remembers the padding of files in padded repositories, so that their virtual sizes can be
+/// derived from `stat` instead of opening the files. An entry is only valid while the underlying
+/// file keeps the modification time and size it had when the entry was recorded, and outside of
+/// Windows, its inode number and change time, so that another file renamed over it with the same
+/// size and a preserved modification time is not mistaken for it.
+class VirtualSizeCache
+{
+public:
+    VirtualSizeCache() = default;
+    DISABLE_COPY_MOVE(VirtualSizeCache)
+
+    std::optional<unsigned> get_padding(std::string_view abs_path, const fuse_stat& st);
+    void put_padding(std::string_view abs_path, const fuse_stat& st, unsigned padding_size);
+
+private:
+    static constexpr size_t kNumShards = 16, kMaxEntriesPerShard = 2048;
+
+    struct Entry
+    {
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t physical_size;
+#ifndef _WIN32
+        uint64_t ino;
+        int64_t ctime_sec;
+        int64_t ctime_nsec;
+#endif
+        unsigned padding_size;
+
+        static Entry from_stat(const fuse_stat& st, unsigned padding_size);
+        bool matches(const fuse_stat& st) const;
+    };
+
+    struct Shard
+    {
+        Mutex mu;
+        absl::flat_hash_map<std::string, Entry> entries ABSL_GUARDED_BY(mu);
+    };
+
+    std::array<Shard, kNumShards> shards_;
+
+    Shard& get_shard(std::string_view abs_path);
+};
+
+/// Remembers the underlying files as of their last open, so that the next open may let the kernel
+/// keep the pages it cached if the file is unchanged since. Lite files live no longer than their
+/// handles, so unlike the generations of `RegularFile` in the full format, changes are told from
+/// the modification time and size of the underlying file, which our own writes update too.
+class KernelCacheTracker
+{
+public:
+    KernelCacheTracker() = default;
+    DISABLE_COPY_MOVE(KernelCacheTracker)
+
+    /// Called on each open with the attributes of the underlying file. Returns true if they are
+    /// the same as at the previous open.
+    bool claim(const fuse_stat& st);
+
+private:
+    static constexpr size_t kNumShards = 16, kMaxEntriesPerShard = 2048;
+
+    struct Entry
+    {
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        int64_t size;
+    };
+
+    struct Shard
+    {
+        Mutex mu;
+        // Keyed by device and inode, which unlike the path stay the same across renames.
+        absl::flat_hash_map<std::pair<uint64_t, uint64_t>, Entry> entries ABSL_GUARDED_BY(mu);
+    };
+
+    std::array<Shard, kNumShards> shards_;
+};
+
+/// Optional cache of `getattr` results within securefs, including those of nonexistent paths.
+///
+/// Entries expire after a fixed timeout, and are dropped early when securefs itself modifies the
+/// path. Changes made to the underlying directory by other processes are only noticed on expiry.
+class AttrCache
+{
+public:
+    enum class LookupResult : unsigned char
+    {
+        kMiss = 0,
+        kFound = 1,
+        kNonexistent = 2,
+    };
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t entries = 0;
+    };
+
+    explicit AttrCache(absl::Duration timeout) : timeout_(timeout) {}
+    DISABLE_COPY_MOVE(AttrCache)
+
+    LookupResult get(std::string_view key, fuse_stat* st);
+
+    /// Returns a token to pass to `put()`, which must be obtained before the attributes are read
+    /// from the underlying filesystem. Results that raced with an invalidation are then dropped.
+    uint64_t begin_fill(std::string_view key);
+    /// A null `st` records that the path does not exist.
+    void put(std::string_view key, const fuse_stat* st, uint64_t token);
+
+    void invalidate(std::string_view key);
+    void invalidate_all();
+    Stats get_stats();
+
+    /// Paths open for writing are never cached, because their sizes change without notice.
+    void add_writer(uintptr_t handle, std::string key);
+    void remove_writer(uintptr_t handle);
+    void rename_writers(std::string_view from_key, std::string_view to_key);
+
+private:
+    static constexpr size_t kNumShards = 16, kMaxEntriesPerShard = 4096;
+
+    struct Entry
+    {
+        absl::Time expiry;
+        std::optional<fuse_stat> st;
+    };
+
+    struct Shard
+    {
+        Mutex mu;
+        absl::flat_hash_map<std::string, Entry> entries ABSL_GUARDED_BY(mu);
+        uint64_t generation ABSL_GUARDED_BY(mu) = 0;
+        // Counted under the lock already held, so that they cost no extra contention.
+        uint64_t hits ABSL_GUARDED_BY(mu) = 0;
+        uint64_t misses ABSL_GUARDED_BY(mu) = 0;
+    };
+
+    absl::Duration timeout_;
+    std::array<Shard, kNumShards> shards_;
+
+    Mutex writers_mu_;
+    absl::flat_hash_map<uintptr_t, std::string> writer_handles_ ABSL_GUARDED_BY(writers_mu_);
+    absl::flat_hash_map<std::string, size_t> writer_counts_ ABSL_GUARDED_BY(writers_mu_);
+
+    Shard& get_shard(std::string_view key);
+    bool is_being_written(std::string_view key);
+};
+
 class File;
 class Directory;
 
@@ -190,6 +354,9 @@ struct LongNameTag
 struct NameTranslator : public Object
 {
     virtual bool is_no_op() const noexcept { return false; }
+    /// @brief Bring a plaintext path to the spelling that is actually encrypted, so that paths
+    /// which name the same file, e.g. under case folding, compare equal.
+    virtual std::string normalize_path(std::string_view path) { return std::string(path); }
     /// @brief Encrypt the full path.
     /// @param path The original path.
     /// @param out_encrypted_last_component If it is not null, and the last path component is a
@@ -276,13 +443,18 @@ public:
                             StreamOpener& opener,
                             NameTranslator& name_trans,
                             XattrCryptor& xattr,
-                            ANNOTATED(tEnableSymlink, bool) enable_symlink))
+                            ANNOTATED(tEnableSymlink, bool) enable_symlink,
+                            ANNOTATED(tAttrCacheTimeout, int) attr_cache_timeout))
         : root_(root), opener_(opener), name_trans_(name_trans), xattr_(xattr)
     {
         if (is_windows() && enable_symlink)
         {
             win_symlink_workaround = std::make_unique<WinSymlinkWorkAround>();
         }
+        if (attr_cache_timeout > 0)
+        {
+            attr_cache_ = std::make_unique<AttrCache>(absl::Seconds(attr_cache_timeout));
+        }
     }
 
     void initialize(fuse_conn_info* info) override;
@@ -351,6 +523,8 @@ public:
                   uint32_t position,
                   const fuse_context* ctx) override;
     int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    void collect_gauges(std::vector<trace::StatsGauge>* gauges) override;
+    void drop_caches() override;
 
 private:
     std::unique_ptr<File> open(std::string_view path, int flags, unsigned mode);
@@ -377,6 +551,12 @@ private:
                                     absl::FunctionRef<void(std::string&& enc_path)> callback);
 
     std::string long_name_table_file_name(absl::string_view enc_path);
+    // Must be called before the directory is removed or renamed on the underlying filesystem.
+    void forget_long_name_tables_under(absl::string_view enc_dir_path);
+
+    std::string attr_cache_key(std::string_view path);
+    void invalidate_attr_cache(std::string_view path, bool including_parent) noexcept;
+    int getattr_uncached(const char* path, fuse_stat* buf);
     int vrename_impl(const char* from, const char* to, const fuse_context* ctx);
 
 private:
@@ -385,6 +565,11 @@ private:
     NameTranslator& name_trans_;
     XattrCryptor& xattr_;
     std::unique_ptr<WinSymlinkWorkAround> win_symlink_workaround;
+    LongNameMappingCommitter long_name_committer_;
+    LongNameIndex long_name_index_;
+    VirtualSizeCache virtual_size_cache_;
+    KernelCacheTracker kernel_cache_tracker_;
+    std::unique_ptr<AttrCache> attr_cache_;
     bool read_dir_plus_ = false;
 };
 }    // namespace securefs::lite_format
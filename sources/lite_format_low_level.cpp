@@ -0,0 +1,641 @@
+#include "lite_format_low_level.h"
+
+#ifndef _WIN32
+#include "exceptions.h"
+#include "lock_guard.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <memory>
+
+namespace securefs::lite_format
+{
+NodeTable::NodeTable()
+{
+    LockGuard<Mutex> lg(mu_);
+    entries_.emplace(FUSE_ROOT_ID, Entry{"/", 1});
+    inos_.emplace("/", FUSE_ROOT_ID);
+}
+
+fuse_ino_t NodeTable::remember(const std::string& path)
+{
+    LockGuard<Mutex> lg(mu_);
+    auto [it, inserted] = inos_.try_emplace(path, next_ino_);
+    if (inserted)
+    {
+        ++next_ino_;
+        entries_.emplace(it->second, Entry{path, 1});
+        return it->second;
+    }
+    ++entries_[it->second].nlookup;
+    return it->second;
+}
+
+std::optional<std::string> NodeTable::get(fuse_ino_t ino)
+{
+    LockGuard<Mutex> lg(mu_, false);
+    auto it = entries_.find(ino);
+    if (it == entries_.end())
+    {
+        return {};
+    }
+    return it->second.path;
+}
+
+void NodeTable::forget(fuse_ino_t ino, uint64_t nlookup)
+{
+    if (ino == FUSE_ROOT_ID)
+    {
+        return;
+    }
+    LockGuard<Mutex> lg(mu_);
+    auto it = entries_.find(ino);
+    if (it == entries_.end())
+    {
+        return;
+    }
+    if (it->second.nlookup > nlookup)
+    {
+        it->second.nlookup -= nlookup;
+        return;
+    }
+    if (it->second.path)
+    {
+        inos_.erase(*it->second.path);
+    }
+    entries_.erase(it);
+}
+
+void NodeTable::rename(const std::string& from, const std::string& to)
+{
+    if (from == to)
+    {
+        return;
+    }
+    LockGuard<Mutex> lg(mu_);
+    detach_locked(to);
+    std::vector<std::pair<std::string, fuse_ino_t>> moved;
+    if (auto it = inos_.find(from); it != inos_.end())
+    {
+        moved.emplace_back(to, it->second);
+        inos_.erase(it);
+    }
+    auto prefix = absl::StrCat(from, "/");
+    for (auto it = inos_.lower_bound(prefix);
+         it != inos_.end() && absl::StartsWith(it->first, prefix);)
+    {
+        moved.emplace_back(absl::StrCat(to, std::string_view(it->first).substr(from.size())),
+                           it->second);
+        it = inos_.erase(it);
+    }
+    for (auto& [path, ino] : moved)
+    {
+        entries_[ino].path = path;
+        inos_.insert_or_assign(std::move(path), ino);
+    }
+}
+
+void NodeTable::detach(const std::string& path)
+{
+    LockGuard<Mutex> lg(mu_);
+    detach_locked(path);
+}
+
+void NodeTable::detach_locked(const std::string& path)
+{
+    if (auto it = inos_.find(path); it != inos_.end())
+    {
+        entries_[it->second].path.reset();
+        inos_.erase(it);
+    }
+    auto prefix = absl::StrCat(path, "/");
+    for (auto it = inos_.lower_bound(prefix);
+         it != inos_.end() && absl::StartsWith(it->first, prefix);)
+    {
+        entries_[it->second].path.reset();
+        it = inos_.erase(it);
+    }
+}
+
+size_t NodeTable::size()
+{
+    LockGuard<Mutex> lg(mu_, false);
+    return entries_.size();
+}
+
+void FuseLowLevelOps::initialize(fuse_conn_info* info) { ops_.initialize(info); }
+
+int FuseLowLevelOps::vlookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    fuse_entry_param e{};
+    int rc = ops_.vgetattr(path.c_str(), &e.attr, &ctx);
+    if (rc == -ENOENT)
+    {
+        // A zero node id tells the kernel to cache the absence of the name.
+        e = {};
+        e.entry_timeout = kernel_cache_timeout_;
+        replies_.entry(req, &e);
+        return 0;
+    }
+    if (rc < 0)
+    {
+        return rc;
+    }
+    e.ino = nodes_.remember(path);
+    e.attr_timeout = kernel_cache_timeout_;
+    e.entry_timeout = kernel_cache_timeout_;
+    if (replies_.entry(req, &e) != 0)
+    {
+        // The lookup is only counted once the kernel receives it.
+        nodes_.forget(e.ino, 1);
+    }
+    return 0;
+}
+
+void FuseLowLevelOps::vforget(fuse_ino_t ino, uint64_t nlookup) noexcept
+{
+    nodes_.forget(ino, nlookup);
+}
+
+int FuseLowLevelOps::vgetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    return reply_attr(req, ino, info, ctx);
+}
+
+int FuseLowLevelOps::vsetattr(
+    fuse_req_t req, fuse_ino_t ino, fuse_stat* attr, int to_set, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    int rc = 0;
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        rc = ops_.vchmod(get_path(ino).c_str(), attr->st_mode, &ctx);
+    }
+    if (rc >= 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    {
+        // Passed on the same way as the high-level API of FUSE passes them to `chown`.
+        fuse_uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : static_cast<fuse_uid_t>(-1);
+        fuse_gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : static_cast<fuse_gid_t>(-1);
+        rc = ops_.vchown(get_path(ino).c_str(), uid, gid, &ctx);
+    }
+    if (rc >= 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        // Through the handle when there is one, as the file may have lost its path.
+        rc = info ? ops_.vftruncate(nullptr, attr->st_size, info, &ctx)
+                  : ops_.vtruncate(get_path(ino).c_str(), attr->st_size, &ctx);
+    }
+    if (rc >= 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    {
+        fuse_timespec ts[2]{};
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            ts[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            ts[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            ts[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            ts[1] = attr->st_mtim;
+        rc = ops_.vutimens(get_path(ino).c_str(), ts, &ctx);
+    }
+    if (rc < 0)
+    {
+        return rc;
+    }
+    return reply_attr(req, ino, info, ctx);
+}
+
+int FuseLowLevelOps::vreadlink(fuse_req_t req, fuse_ino_t ino)
+{
+    auto ctx = make_context(req);
+    std::vector<char> destination(PATH_MAX);
+    int rc = ops_.vreadlink(get_path(ino).c_str(), destination.data(), destination.size(), &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    replies_.readlink(req, destination.data());
+    return 0;
+}
+
+int FuseLowLevelOps::vmkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vmkdir(path.c_str(), mode, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    return reply_entry(req, path, ctx);
+}
+
+int FuseLowLevelOps::vunlink(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vunlink(path.c_str(), &ctx); rc < 0)
+    {
+        return rc;
+    }
+    nodes_.detach(path);
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vrmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vrmdir(path.c_str(), &ctx); rc < 0)
+    {
+        return rc;
+    }
+    nodes_.detach(path);
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vsymlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vsymlink(to, path.c_str(), &ctx); rc < 0)
+    {
+        return rc;
+    }
+    return reply_entry(req, path, ctx);
+}
+
+int FuseLowLevelOps::vrename(fuse_req_t req,
+                             fuse_ino_t parent,
+                             const char* name,
+                             fuse_ino_t newparent,
+                             const char* newname)
+{
+    auto from = get_child_path(parent, name);
+    auto to = get_child_path(newparent, newname);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vrename(from.c_str(), to.c_str(), &ctx); rc < 0)
+    {
+        return rc;
+    }
+    nodes_.rename(from, to);
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vlink(fuse_req_t req,
+                           fuse_ino_t ino,
+                           fuse_ino_t newparent,
+                           const char* newname)
+{
+    auto path = get_child_path(newparent, newname);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vlink(get_path(ino).c_str(), path.c_str(), &ctx); rc < 0)
+    {
+        return rc;
+    }
+    return reply_entry(req, path, ctx);
+}
+
+int FuseLowLevelOps::vcreate(
+    fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode, fuse_file_info* info)
+{
+    auto path = get_child_path(parent, name);
+    auto ctx = make_context(req);
+    if (int rc = ops_.vcreate(path.c_str(), mode, info, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    fuse_entry_param e{};
+    int rc;
+    try
+    {
+        rc = ops_.vfgetattr(nullptr, &e.attr, info, &ctx);
+    }
+    catch (...)
+    {
+        ops_.vrelease(nullptr, info, &ctx);
+        throw;
+    }
+    if (rc < 0)
+    {
+        ops_.vrelease(nullptr, info, &ctx);
+        return rc;
+    }
+    e.ino = nodes_.remember(path);
+    e.attr_timeout = kernel_cache_timeout_;
+    e.entry_timeout = kernel_cache_timeout_;
+    if (replies_.create(req, &e, info) != 0)
+    {
+        // The kernel never learns about the handle, and thus never releases it.
+        nodes_.forget(e.ino, 1);
+        ops_.vrelease(nullptr, info, &ctx);
+    }
+    return 0;
+}
+
+int FuseLowLevelOps::vopen(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vopen(get_path(ino).c_str(), info, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    if (replies_.open(req, info) != 0)
+    {
+        ops_.vrelease(nullptr, info, &ctx);
+    }
+    return 0;
+}
+
+int FuseLowLevelOps::vread(
+    fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t offset, fuse_file_info* info)
+{
+    thread_local std::vector<char> buffer;
+    buffer.resize(size);
+    auto ctx = make_context(req);
+    int rc = ops_.vread(nullptr, buffer.data(), size, offset, info, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    replies_.buf(req, buffer.data(), rc);
+    return rc;
+}
+
+int FuseLowLevelOps::vwrite(fuse_req_t req,
+                            fuse_ino_t ino,
+                            const char* buf,
+                            size_t size,
+                            fuse_off_t offset,
+                            fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    int rc = ops_.vwrite(nullptr, buf, size, offset, info, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    replies_.write(req, rc);
+    return rc;
+}
+
+int FuseLowLevelOps::vflush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vflush(nullptr, info, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vrelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vrelease(nullptr, info, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vfsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vfsync(nullptr, datasync, info, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vopendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    auto ctx = make_context(req);
+    auto handle = std::make_unique<DirHandle>();
+    handle->inner.flags = info->flags;
+    if (int rc = ops_.vopendir(get_path(ino).c_str(), &handle->inner, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    info->fh = reinterpret_cast<uintptr_t>(handle.get());
+    if (replies_.open(req, info) != 0)
+    {
+        ops_.vreleasedir(nullptr, &handle->inner, &ctx);
+        return 0;
+    }
+    handle.release();
+    return 0;
+}
+
+int FuseLowLevelOps::vreaddir(
+    fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, fuse_file_info* info)
+{
+    auto handle = get_dir_handle(info);
+    LockGuard<Mutex> lg(handle->mu);
+    if (off <= 0)
+    {
+        handle->entries.clear();
+        auto ctx = make_context(req);
+        fuse_fill_dir_t filler = [](void* buf, const char* name, const fuse_stat* st, fuse_off_t)
+        {
+            static_cast<DirEntries*>(buf)->emplace_back(name, st ? *st : fuse_stat{});
+            return 0;
+        };
+        int rc = ops_.vreaddir(nullptr, &handle->entries, filler, 0, &handle->inner, &ctx);
+        if (rc < 0)
+        {
+            return rc;
+        }
+    }
+
+    thread_local std::vector<char> buffer;
+    buffer.resize(size);
+    size_t used = 0;
+    for (size_t i = off <= 0 ? 0 : static_cast<size_t>(off); i < handle->entries.size(); ++i)
+    {
+        const auto& [name, st] = handle->entries[i];
+        size_t entry_size = replies_.add_direntry(req,
+                                                  buffer.data() + used,
+                                                  size - used,
+                                                  name.c_str(),
+                                                  &st,
+                                                  static_cast<fuse_off_t>(i + 1));
+        if (entry_size > size - used)
+        {
+            break;
+        }
+        used += entry_size;
+    }
+    replies_.buf(req, buffer.data(), used);
+    return 0;
+}
+
+int FuseLowLevelOps::vreleasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info)
+{
+    std::unique_ptr<DirHandle> handle(get_dir_handle(info));
+    auto ctx = make_context(req);
+    if (int rc = ops_.vreleasedir(nullptr, &handle->inner, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vstatfs(fuse_req_t req, fuse_ino_t ino)
+{
+    auto ctx = make_context(req);
+    fuse_statvfs buf{};
+    if (int rc = ops_.vstatfs("/", &buf, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.statfs(req, &buf);
+    return 0;
+}
+
+int FuseLowLevelOps::vlistxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    auto ctx = make_context(req);
+    std::vector<char> list(size);
+    int rc = ops_.vlistxattr(get_path(ino).c_str(), size ? list.data() : nullptr, size, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    if (!size)
+    {
+        replies_.xattr(req, rc);
+        return 0;
+    }
+    replies_.buf(req, list.data(), rc);
+    return 0;
+}
+
+int FuseLowLevelOps::vgetxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+{
+    auto ctx = make_context(req);
+    std::vector<char> value(size);
+    int rc = ops_.vgetxattr(
+        get_path(ino).c_str(), name, size ? value.data() : nullptr, size, 0, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    if (!size)
+    {
+        replies_.xattr(req, rc);
+        return 0;
+    }
+    replies_.buf(req, value.data(), rc);
+    return 0;
+}
+
+int FuseLowLevelOps::vsetxattr(fuse_req_t req,
+                               fuse_ino_t ino,
+                               const char* name,
+                               const char* value,
+                               size_t size,
+                               int flags)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vsetxattr(get_path(ino).c_str(), name, value, size, flags, 0, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+int FuseLowLevelOps::vremovexattr(fuse_req_t req, fuse_ino_t ino, const char* name)
+{
+    auto ctx = make_context(req);
+    if (int rc = ops_.vremovexattr(get_path(ino).c_str(), name, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    replies_.err(req, 0);
+    return 0;
+}
+
+std::string FuseLowLevelOps::get_path(fuse_ino_t ino)
+{
+    auto path = nodes_.get(ino);
+    if (!path)
+    {
+        throwVFSException(ESTALE);
+    }
+    return std::move(*path);
+}
+
+std::string FuseLowLevelOps::get_child_path(fuse_ino_t parent, const char* name)
+{
+    auto path = get_path(parent);
+    if (path != "/")
+    {
+        path.push_back('/');
+    }
+    path += name_trans_.normalize_path(name);
+    return path;
+}
+
+fuse_context FuseLowLevelOps::make_context(fuse_req_t req)
+{
+    const fuse_ctx* req_ctx = replies_.req_ctx(req);
+    fuse_context ctx{};
+    ctx.uid = req_ctx->uid;
+    ctx.gid = req_ctx->gid;
+    ctx.pid = req_ctx->pid;
+    ctx.umask = req_ctx->umask;
+    return ctx;
+}
+
+int FuseLowLevelOps::reply_entry(fuse_req_t req, const std::string& path, const fuse_context& ctx)
+{
+    fuse_entry_param e{};
+    if (int rc = ops_.vgetattr(path.c_str(), &e.attr, &ctx); rc < 0)
+    {
+        return rc;
+    }
+    e.ino = nodes_.remember(path);
+    e.attr_timeout = kernel_cache_timeout_;
+    e.entry_timeout = kernel_cache_timeout_;
+    if (replies_.entry(req, &e) != 0)
+    {
+        nodes_.forget(e.ino, 1);
+    }
+    return 0;
+}
+
+int FuseLowLevelOps::reply_attr(fuse_req_t req,
+                                fuse_ino_t ino,
+                                fuse_file_info* info,
+                                const fuse_context& ctx)
+{
+    fuse_stat st{};
+    // The kernel passes the handle of open files, which still works after they lose their path.
+    int rc = info ? ops_.vfgetattr(nullptr, &st, info, &ctx)
+                  : ops_.vgetattr(get_path(ino).c_str(), &st, &ctx);
+    if (rc < 0)
+    {
+        return rc;
+    }
+    replies_.attr(req, &st, kernel_cache_timeout_);
+    return 0;
+}
+}    // namespace securefs::lite_format
+#endif
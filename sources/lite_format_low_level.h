@@ -0,0 +1,167 @@
+#pragma once
+
+#include "fuse_low_level_ops_base.h"
+#include "lite_format.h"
+
+#ifndef _WIN32
+#include "lock_guard.h"
+#include "myutils.h"
+#include "platform.h"
+#include "tags.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/btree_map.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <fruit/macro.h>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace securefs::lite_format
+{
+/// Maps the node ids handed out to the kernel to the plaintext paths they refer to, spelled as
+/// `NameTranslator::normalize_path` spells them, so that different spellings share one node.
+///
+/// The lite format has no ids of its own, so renames and removals must be mirrored here. Node ids
+/// are counted and forgotten the same way as in `full_format::NodeTable`.
+class NodeTable
+{
+public:
+    NodeTable();
+    DISABLE_COPY_MOVE(NodeTable)
+
+    /// Returns the node id of the path, and counts one more lookup of it.
+    fuse_ino_t remember(const std::string& path);
+    /// Returns nothing for forgotten nodes, and for nodes whose path has since been removed.
+    std::optional<std::string> get(fuse_ino_t ino);
+    void forget(fuse_ino_t ino, uint64_t nlookup);
+    /// Moves the node at `from`, and those beneath it, to `to`. The nodes that were at `to` lose
+    /// their path.
+    void rename(const std::string& from, const std::string& to);
+    /// The node at `path`, and those beneath it, lose their path, while the kernel may still
+    /// refer to them until it forgets them.
+    void detach(const std::string& path);
+    size_t size();
+
+private:
+    struct Entry
+    {
+        std::optional<std::string> path;
+        uint64_t nlookup;
+    };
+
+    Mutex mu_;
+    fuse_ino_t next_ino_ ABSL_GUARDED_BY(mu_) = FUSE_ROOT_ID + 1;
+    absl::flat_hash_map<fuse_ino_t, Entry> entries_ ABSL_GUARDED_BY(mu_);
+    // Ordered, so that the paths beneath a directory are found together.
+    absl::btree_map<std::string, fuse_ino_t> inos_ ABSL_GUARDED_BY(mu_);
+
+    void detach_locked(const std::string& path) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+
+/// Serves the lite format through the low-level API of FUSE, on top of `FuseHighLevelOps`. The
+/// kernel tells which directory each name is in, so paths are joined from the node table instead
+/// of being built by libfuse from its own tree for every operation.
+class FuseLowLevelOps : public ::securefs::FuseLowLevelOpsBase
+{
+public:
+    INJECT(FuseLowLevelOps(FuseHighLevelOps& ops,
+                           NameTranslator& name_trans,
+                           ANNOTATED(tKernelCacheTimeout, int) kernel_cache_timeout))
+        : ops_(ops), name_trans_(name_trans), kernel_cache_timeout_(kernel_cache_timeout)
+    {
+    }
+
+    void initialize(fuse_conn_info* info) override;
+    int vlookup(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    void vforget(fuse_ino_t ino, uint64_t nlookup) noexcept override;
+    int vgetattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vsetattr(fuse_req_t req,
+                 fuse_ino_t ino,
+                 fuse_stat* attr,
+                 int to_set,
+                 fuse_file_info* info) override;
+    int vreadlink(fuse_req_t req, fuse_ino_t ino) override;
+    int vmkdir(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_mode_t mode) override;
+    int vunlink(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    int vrmdir(fuse_req_t req, fuse_ino_t parent, const char* name) override;
+    int vsymlink(fuse_req_t req, const char* to, fuse_ino_t parent, const char* name) override;
+    int vrename(fuse_req_t req,
+                fuse_ino_t parent,
+                const char* name,
+                fuse_ino_t newparent,
+                const char* newname) override;
+    int vlink(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) override;
+    int vcreate(fuse_req_t req,
+                fuse_ino_t parent,
+                const char* name,
+                fuse_mode_t mode,
+                fuse_file_info* info) override;
+    int vopen(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vread(fuse_req_t req,
+              fuse_ino_t ino,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info) override;
+    int vwrite(fuse_req_t req,
+               fuse_ino_t ino,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info) override;
+    int vflush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vrelease(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vfsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info* info) override;
+    int vopendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vreaddir(fuse_req_t req,
+                 fuse_ino_t ino,
+                 size_t size,
+                 fuse_off_t off,
+                 fuse_file_info* info) override;
+    int vreleasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info) override;
+    int vstatfs(fuse_req_t req, fuse_ino_t ino) override;
+    int vlistxattr(fuse_req_t req, fuse_ino_t ino, size_t size) override;
+    int vgetxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) override;
+    int vsetxattr(fuse_req_t req,
+                  fuse_ino_t ino,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags) override;
+    int vremovexattr(fuse_req_t req, fuse_ino_t ino, const char* name) override;
+
+private:
+    // `FuseHighLevelOps::vreaddir` lists the whole directory on every call, so the listing is
+    // taken once when the kernel starts from the beginning, and then served by offset.
+    using DirEntries = std::vector<std::pair<std::string, fuse_stat>>;
+
+    struct DirHandle
+    {
+        fuse_file_info inner{};
+        Mutex mu;
+        DirEntries entries ABSL_GUARDED_BY(mu);
+    };
+
+    FuseHighLevelOps& ops_;
+    NameTranslator& name_trans_;
+    double kernel_cache_timeout_;
+    NodeTable nodes_;
+
+    std::string get_path(fuse_ino_t ino);
+    std::string get_child_path(fuse_ino_t parent, const char* name);
+    fuse_context make_context(fuse_req_t req);
+    int reply_entry(fuse_req_t req, const std::string& path, const fuse_context& ctx);
+    int
+    reply_attr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* info, const fuse_context& ctx);
+
+    static DirHandle* get_dir_handle(fuse_file_info* info)
+    {
+        return reinterpret_cast<DirHandle*>(static_cast<uintptr_t>(info->fh));
+    }
+};
+}    // namespace securefs::lite_format
+#endif
@@ -1,11 +1,17 @@
 #include "lite_long_name_lookup_table.h"
 #include "logger.h"
 #include "sqlite_helper.h"
+#include "trace_events.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 #include <cryptopp/sha.h>
 #include <string_view>
 
+#include <utility>
+
 namespace securefs
 {
 namespace
@@ -36,6 +42,30 @@ namespace
             delete from main.encrypted_mappings
                 where keyed_hash = ?;
         )";
+    // WAL lets a commit append to the log with a single sync, instead of writing and syncing a
+    // rollback journal and the database each time. The mode is persistent in the database file.
+    constexpr const char* kSetJournalMode = R"(
+            pragma journal_mode = WAL;
+            pragma synchronous = FULL;
+        )";
+
+    // The same database may be named differently, e.g. "a//./b" and "a/b", so the index is keyed
+    // on a spelling with empty and "." components removed.
+    std::string canonical_filename(std::string_view filename)
+    {
+        std::string result;
+        result.reserve(filename.size() + 1);
+        for (std::string_view piece : absl::StrSplit(filename, absl::ByAnyChar("/\\")))
+        {
+            if (piece.empty() || piece == ".")
+            {
+                continue;
+            }
+            result.push_back('/');
+            result.append(piece);
+        }
+        return result;
+    }
 }    // namespace
 LongNameLookupTable::LongNameLookupTable(const std::string& filename, bool readonly)
 {
@@ -44,17 +74,19 @@ LongNameLookupTable::LongNameLookupTable(const std::string& filename, bool reado
         SQLITE_OPEN_NOMUTEX
             | (readonly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)),
         nullptr);
+    db_.set_timeout(2000);
     if (!readonly)
     {
+        db_.exec(kSetJournalMode);
         db_.exec(kCreateTableInMainDb);
     }
-    db_.set_timeout(2000);
 }
 
 LongNameLookupTable::~LongNameLookupTable() {}
 
 std::string LongNameLookupTable::lookup(std::string_view keyed_hash)
 {
+    trace::ScopedSpan span("stage", "sqlite_lookup");
     SQLiteStatement q(db_, "select encrypted_name from encrypted_mappings where keyed_hash = ?;");
     q.reset();
     q.bind_text(1, keyed_hash);
@@ -78,9 +110,23 @@ std::vector<std::string> LongNameLookupTable::list_hashes()
     return result;
 }
 
+std::vector<std::pair<std::string, std::string>> LongNameLookupTable::list_mappings()
+{
+    trace::ScopedSpan span("stage", "sqlite_list_mappings");
+    SQLiteStatement q(db_, "select keyed_hash, encrypted_name from encrypted_mappings;");
+    q.reset();
+    std::vector<std::pair<std::string, std::string>> result;
+    while (q.step())
+    {
+        result.emplace_back(q.get_text(0), q.get_text(1));
+    }
+    return result;
+}
+
 void LongNameLookupTable::update_mapping(std::string_view keyed_hash,
                                          std::string_view encrypted_long_name)
 {
+    trace::ScopedSpan span("stage", "sqlite_update_mapping");
     SQLiteStatement q(db_, kUpdateMainMapping);
     q.reset();
     q.bind_text(1, keyed_hash);
@@ -90,6 +136,7 @@ void LongNameLookupTable::update_mapping(std::string_view keyed_hash,
 
 void LongNameLookupTable::remove_mapping(std::string_view keyed_hash)
 {
+    trace::ScopedSpan span("stage", "sqlite_remove_mapping");
     SQLiteStatement q(db_, kDeleteFromMainMapping);
     q.reset();
     q.bind_text(1, keyed_hash);
@@ -98,6 +145,8 @@ void LongNameLookupTable::remove_mapping(std::string_view keyed_hash)
 
 void internal::LookupTableBase::begin() { db_.exec("begin;"); }
 
+void internal::LookupTableBase::commit() { db_.exec("commit; begin;"); }
+
 void internal::LookupTableBase::finish() noexcept
 {
     try
@@ -125,6 +174,7 @@ DoubleLongNameLookupTable::DoubleLongNameLookupTable(const std::string& from_dir
                    SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
                    nullptr);
     db_.set_timeout(2000);
+    db_.exec(kSetJournalMode);
     if (is_same_db_)
     {
         db_.exec(kCreateTableInMainDb);
@@ -156,4 +206,367 @@ void DoubleLongNameLookupTable::update_mapping_to_to_db(std::string_view keyed_h
     q.step();
 }
 
+LongNameMappingCommitter::~LongNameMappingCommitter() {}
+
+void LongNameMappingCommitter::submit(const std::string& db_filename,
+                                      Action action,
+                                      std::string_view keyed_hash,
+                                      std::string_view encrypted_long_name)
+{
+    // Declared before the lock so that databases are closed after the mutex is released.
+    std::vector<std::unique_ptr<Channel>> closing;
+    UniqueLock<Mutex> lock(mu_);
+
+    auto& slot = channels_[db_filename];
+    if (!slot)
+    {
+        slot = std::make_unique<Channel>();
+    }
+    Channel* channel = slot.get();
+    if (!channel->pending)
+    {
+        channel->pending = std::make_shared<Batch>();
+    }
+    std::shared_ptr<Batch> batch = channel->pending;
+    batch->changes.push_back(
+        Change{action, std::string(keyed_hash), std::string(encrypted_long_name)});
+    ++channel->waiters;
+
+    auto can_proceed = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    { return batch->done || !channel->committing; };
+    mu_.Await(absl::Condition(&can_proceed));
+
+    if (!batch->done)
+    {
+        // No commit is in flight, so this thread writes the batch on behalf of every thread that
+        // has queued into it.
+        channel->committing = true;
+        channel->pending.reset();
+        lock.unlock();
+        std::exception_ptr error;
+        try
+        {
+            commit_batch(*channel, db_filename, batch->changes);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        lock.lock();
+        batch->error = std::move(error);
+        batch->done = true;
+        channel->committing = false;
+    }
+    --channel->waiters;
+    std::exception_ptr error = batch->error;
+    trim_idle_channels(closing);
+    lock.unlock();
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void LongNameMappingCommitter::evict(std::string_view prefix)
+{
+    std::vector<std::unique_ptr<Channel>> closing;
+    LockGuard<Mutex> lg(mu_);
+    if (channels_.empty())
+    {
+        return;
+    }
+    auto matching_idle = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    {
+        for (auto&& [filename, channel] : channels_)
+        {
+            if (channel->waiters > 0 && absl::StartsWith(filename, prefix))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    mu_.Await(absl::Condition(&matching_idle));
+    for (auto it = channels_.begin(); it != channels_.end();)
+    {
+        if (absl::StartsWith(it->first, prefix))
+        {
+            closing.emplace_back(std::move(it->second));
+            channels_.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void LongNameMappingCommitter::commit_batch(Channel& channel,
+                                            const std::string& db_filename,
+                                            const std::vector<Change>& changes)
+{
+    try
+    {
+        if (!channel.table.has_value())
+        {
+            channel.table.emplace(db_filename, false);
+        }
+        auto&& table = *channel.table;
+        LockGuard<LongNameLookupTable> lg(table);
+        for (const Change& c : changes)
+        {
+            switch (c.action)
+            {
+            case Action::kUpdate:
+                table.update_mapping(c.keyed_hash, c.encrypted_long_name);
+                break;
+            case Action::kRemove:
+                table.remove_mapping(c.keyed_hash);
+                break;
+            default:
+                throw_runtime_error("Unspecified action");
+            }
+        }
+        table.commit();
+    }
+    catch (...)
+    {
+        // The connection may be left in an unknown state, so the next batch starts afresh.
+        channel.table.reset();
+        throw;
+    }
+}
+
+void LongNameMappingCommitter::trim_idle_channels(std::vector<std::unique_ptr<Channel>>& closing)
+{
+    if (channels_.size() <= max_idle_tables_)
+    {
+        return;
+    }
+    for (auto it = channels_.begin(); it != channels_.end();)
+    {
+        if (it->second->waiters == 0)
+        {
+            closing.emplace_back(std::move(it->second));
+            channels_.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+LongNameIndex::~LongNameIndex() {}
+
+std::string LongNameIndex::lookup(const std::string& db_filename, std::string_view keyed_hash)
+{
+    auto key = canonical_filename(db_filename);
+    std::shared_ptr<Table> table;
+    bool loaded = false;
+    {
+        UniqueLock<Mutex> lock(mu_);
+        auto it = tables_.find(key);
+        if (it != tables_.end())
+        {
+            table = it->second;
+            auto done = [&]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) { return !table->loading; };
+            mu_.Await(absl::Condition(&done));
+            if (table->load_error)
+            {
+                std::rethrow_exception(table->load_error);
+            }
+            auto mapping_it = table->mappings.find(keyed_hash);
+            if (mapping_it != table->mappings.end())
+            {
+                return mapping_it->second.value_or(std::string());
+            }
+            loaded = true;
+        }
+        else
+        {
+            table = std::make_shared<Table>();
+            tables_.emplace(key, table);
+        }
+    }
+
+    if (loaded)
+    {
+        return lookup_in_database(key, db_filename, keyed_hash, table);
+    }
+
+    // Load outside of the mutex so that other directories are not blocked by the disk.
+    std::vector<std::pair<std::string, std::string>> mappings;
+    std::exception_ptr error;
+    try
+    {
+        LongNameLookupTable db(db_filename, true);
+        LockGuard<LongNameLookupTable> lg(db);
+        mappings = db.list_mappings();
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    LockGuard<Mutex> lg(mu_);
+    table->loading = false;
+    if (error)
+    {
+        table->load_error = error;
+        auto it = tables_.find(key);
+        if (it != tables_.end() && it->second == table)
+        {
+            tables_.erase(it);
+        }
+        std::rethrow_exception(error);
+    }
+    table->mappings.reserve(mappings.size());
+    for (auto&& [hash, name] : mappings)
+    {
+        table->mappings.insert_or_assign(std::move(hash), std::move(name));
+    }
+    for (auto&& [hash, name] : table->changes_during_load)
+    {
+        table->mappings.insert_or_assign(std::move(hash), std::move(name));
+    }
+    table->changes_during_load.clear();
+    table->changes_during_load.shrink_to_fit();
+    if (auto it = tables_.find(key); it != tables_.end() && it->second == table)
+    {
+        total_entries_ += table->mappings.size();
+    }
+
+    auto mapping_it = table->mappings.find(keyed_hash);
+    std::string result = mapping_it == table->mappings.end()
+        ? std::string()
+        : mapping_it->second.value_or(std::string());
+    trim();
+    return result;
+}
+
+std::string LongNameIndex::lookup_in_database(const std::string& key,
+                                              const std::string& db_filename,
+                                              std::string_view keyed_hash,
+                                              const std::shared_ptr<Table>& table)
+{
+    // Another process, such as a sync client or a second mount, may have added the mapping after
+    // the table was loaded.
+    std::string result;
+    {
+        LongNameLookupTable db(db_filename, true);
+        LockGuard<LongNameLookupTable> lg(db);
+        result = db.lookup(keyed_hash);
+    }
+    if (result.empty())
+    {
+        return result;
+    }
+    LockGuard<Mutex> lg(mu_);
+    // Changes of our own made in the meantime take precedence, as the database may lag behind.
+    auto it = tables_.find(key);
+    if (it != tables_.end() && it->second == table)
+    {
+        auto [mapping_it, inserted] = table->mappings.emplace(std::string(keyed_hash), result);
+        if (inserted)
+        {
+            ++total_entries_;
+            trim();
+        }
+        else
+        {
+            result = mapping_it->second.value_or(std::string());
+        }
+    }
+    return result;
+}
+
+void LongNameIndex::update_mapping(const std::string& db_filename,
+                                   std::string_view keyed_hash,
+                                   std::string_view encrypted_long_name)
+{
+    apply(db_filename, keyed_hash, encrypted_long_name);
+}
+
+void LongNameIndex::remove_mapping(const std::string& db_filename, std::string_view keyed_hash)
+{
+    apply(db_filename, keyed_hash, std::nullopt);
+}
+
+void LongNameIndex::apply(const std::string& db_filename,
+                          std::string_view keyed_hash,
+                          std::optional<std::string_view> encrypted_long_name)
+{
+    auto key = canonical_filename(db_filename);
+    LockGuard<Mutex> lg(mu_);
+    auto it = tables_.find(key);
+    if (it == tables_.end())
+    {
+        // Not loaded, so the next load will read the change from the database.
+        return;
+    }
+    Table& table = *it->second;
+    if (table.loading)
+    {
+        table.changes_during_load.emplace_back(
+            std::string(keyed_hash),
+            encrypted_long_name.has_value()
+                ? std::optional<std::string>(std::string(*encrypted_long_name))
+                : std::nullopt);
+        return;
+    }
+    std::optional<std::string> value;
+    if (encrypted_long_name.has_value())
+    {
+        value.emplace(*encrypted_long_name);
+    }
+    if (table.mappings.insert_or_assign(std::string(keyed_hash), std::move(value)).second)
+    {
+        ++total_entries_;
+    }
+}
+
+void LongNameIndex::evict(std::string_view dir)
+{
+    auto prefix = absl::StrCat(canonical_filename(dir), "/");
+    LockGuard<Mutex> lg(mu_);
+    for (auto it = tables_.begin(); it != tables_.end();)
+    {
+        if (absl::StartsWith(it->first, prefix))
+        {
+            if (!it->second->loading)
+            {
+                total_entries_ -= it->second->mappings.size();
+            }
+            tables_.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void LongNameIndex::trim()
+{
+    if (total_entries_ <= max_total_entries_)
+    {
+        return;
+    }
+    // Directories with many long names are rare, so a wholesale reset is good enough.
+    for (auto it = tables_.begin(); it != tables_.end();)
+    {
+        if (!it->second->loading)
+        {
+            total_entries_ -= it->second->mappings.size();
+            tables_.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
 }    // namespace securefs
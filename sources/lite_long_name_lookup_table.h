@@ -1,12 +1,19 @@
 #pragma once
+#include "lock_guard.h"
+#include "myutils.h"
 #include "platform.h"
 #include "sqlite_helper.h"
 
 #include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
 #include <absl/strings/str_cat.h>
 #include <string_view>
 
+#include <exception>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace securefs
@@ -29,6 +36,10 @@ namespace internal
             db_.mutex().Unlock();
         }
 
+        /// Commits the changes made so far and starts a new transaction. Unlike `unlock()`, a
+        /// failure to commit is reported as an exception.
+        void commit() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+
     protected:
         SQLiteDB db_ ABSL_GUARDED_BY(*this);
 
@@ -53,6 +64,8 @@ public:
     void remove_mapping(std::string_view keyed_hash) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
     std::vector<std::string> list_hashes() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
+    std::vector<std::pair<std::string, std::string>> list_mappings()
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 };
 
 ///@brief Only used in `rename` operations, when two operations need to be atomic together.
@@ -70,4 +83,126 @@ public:
 private:
     bool is_same_db_;
 };
+
+///@brief Coalesces the mapping changes of concurrent operations on the same directory into one
+/// transaction, so that they share the cost of a single commit.
+///
+/// `submit()` returns only after the transaction containing its change has been committed, so a
+/// caller may make the file visible right afterwards. There is no artificial delay: changes that
+/// arrive while a commit is in flight form the next batch, which is written as soon as the
+/// previous one finishes.
+class LongNameMappingCommitter
+{
+public:
+    enum class Action : unsigned char
+    {
+        kUpdate = 0,
+        kRemove = 1,
+    };
+
+    explicit LongNameMappingCommitter(size_t max_idle_tables = 64)
+        : max_idle_tables_(max_idle_tables)
+    {
+    }
+    ~LongNameMappingCommitter();
+    DISABLE_COPY_MOVE(LongNameMappingCommitter)
+
+    void submit(const std::string& db_filename,
+                Action action,
+                std::string_view keyed_hash,
+                std::string_view encrypted_long_name = {});
+
+    /// Closes the cached databases whose filenames start with `prefix`. Must be called before the
+    /// directory containing them is removed or renamed.
+    void evict(std::string_view prefix);
+
+private:
+    struct Change
+    {
+        Action action;
+        std::string keyed_hash, encrypted_long_name;
+    };
+
+    struct Batch
+    {
+        std::vector<Change> changes;
+        std::exception_ptr error;
+        bool done = false;
+    };
+
+    struct Channel
+    {
+        // Only accessed by the thread committing on behalf of the channel.
+        std::optional<LongNameLookupTable> table;
+        std::shared_ptr<Batch> pending;
+        size_t waiters = 0;
+        bool committing = false;
+    };
+
+    Mutex mu_;
+    absl::flat_hash_map<std::string, std::unique_ptr<Channel>> channels_ ABSL_GUARDED_BY(mu_);
+    size_t max_idle_tables_;
+
+private:
+    static void
+    commit_batch(Channel& channel, const std::string& db_filename, const std::vector<Change>& changes);
+    void trim_idle_channels(std::vector<std::unique_ptr<Channel>>& closing)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
+
+///@brief Keeps the mappings of recently listed directories in memory, so that decoding long names
+/// does not need a database round trip each.
+///
+/// A database is loaded in full on first use. The owner must report every change it commits
+/// afterwards, and call `evict()` before the directory is removed or renamed. Mappings added by
+/// other processes are found by looking up the database on a miss.
+class LongNameIndex
+{
+public:
+    explicit LongNameIndex(size_t max_total_entries = 1 << 16)
+        : max_total_entries_(max_total_entries)
+    {
+    }
+    ~LongNameIndex();
+    DISABLE_COPY_MOVE(LongNameIndex)
+
+    /// Returns the encrypted name mapped from `keyed_hash`, or an empty string if there is none.
+    std::string lookup(const std::string& db_filename, std::string_view keyed_hash);
+
+    void update_mapping(const std::string& db_filename,
+                        std::string_view keyed_hash,
+                        std::string_view encrypted_long_name);
+    void remove_mapping(const std::string& db_filename, std::string_view keyed_hash);
+
+    /// Forgets the databases within the directory `dir`.
+    void evict(std::string_view dir);
+
+private:
+    struct Table
+    {
+        // `std::nullopt` denotes a removal by this process, which the database may not reflect
+        // yet, so that it is not looked up there again.
+        absl::flat_hash_map<std::string, std::optional<std::string>> mappings;
+        // Changes reported while the table is being loaded. They are replayed on top of the
+        // loaded content, which may or may not include them. `std::nullopt` denotes a removal.
+        std::vector<std::pair<std::string, std::optional<std::string>>> changes_during_load;
+        std::exception_ptr load_error;
+        bool loading = true;
+    };
+
+    Mutex mu_;
+    absl::flat_hash_map<std::string, std::shared_ptr<Table>> tables_ ABSL_GUARDED_BY(mu_);
+    size_t total_entries_ ABSL_GUARDED_BY(mu_) = 0;
+    size_t max_total_entries_;
+
+private:
+    void apply(const std::string& db_filename,
+               std::string_view keyed_hash,
+               std::optional<std::string_view> encrypted_long_name);
+    std::string lookup_in_database(const std::string& key,
+                                   const std::string& db_filename,
+                                   std::string_view keyed_hash,
+                                   const std::shared_ptr<Table>& table);
+    void trim() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+};
 }    // namespace securefs
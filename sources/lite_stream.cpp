@@ -2,6 +2,7 @@
 #include "crypto.h"
 #include "logger.h"
 #include "myutils.h"
+#include "trace_events.h"
 
 #include <algorithm>
 #include <cryptopp/aes.h>
@@ -153,6 +154,7 @@ AESGCMCryptStream::read_multi_blocks(offset_type start_block, offset_type end_bl
                                     get_header_size() + get_underlying_block_size() * start_block,
                                     buffer.size());
     length_type transformed_read_len = 0;
+    trace::ScopedSpan span("stage", "gcm_decrypt", rc);
 
     for (length_type i = 0; i < rc; i += get_underlying_block_size())
     {
@@ -210,6 +212,7 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
     std::vector<unsigned char> buffer(
         (end_block - start_block) * get_underlying_block_size()
         + (end_residue <= 0 ? 0 : end_residue + get_iv_size() + get_mac_size()));
+    trace::ScopedSpan span("stage", "gcm_encrypt", buffer.size());
     for (length_type i = 0; i < buffer.size();)
     {
         auto this_block_underlying_size = std::min(get_underlying_block_size(), buffer.size() - i);
@@ -240,6 +243,7 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
         input = static_cast<const byte*>(input) + this_block_virtual_size;
         i += this_block_underlying_size;
     }
+    span.finish();
     m_stream->write(buffer.data(),
                     start_block * get_underlying_block_size() + get_header_size(),
                     buffer.size());
@@ -2,6 +2,8 @@
 #include <absl/base/thread_annotations.h>
 #include <absl/synchronization/mutex.h>
 
+#include <mutex>
+
 namespace securefs
 {
 template <class Lockable>
@@ -1,9 +1,18 @@
 #include "logger.h"
 #include "exceptions.h"
+#include "lock_guard.h"
 #include "myutils.h"
 #include "platform.h"
+#include "thread_local.h"
 
+#include <absl/time/clock.h>
+#include <absl/time/time.h>
+
+#include <algorithm>
+#include <cstring>
 #include <stdio.h>
+#include <thread>
+#include <vector>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -23,22 +32,139 @@ static const void* current_thread_id(void) { return (void*)(pthread_self()); }
 
 namespace securefs
 {
+namespace
+{
+    struct LogRecordHeader
+    {
+        int64_t time_ns;
+        const char* funcsig;
+        uint32_t message_size;
+        int lineno;
+        LoggingLevel level;
+        // Set when the message is a payload of `Logger::log_payload` still to be formatted.
+        void (*format)(std::string* out, absl::string_view payload) = nullptr;
+    };
+
+    /// A ring of bytes with a single producer, the thread that owns it, and a single consumer, the
+    /// writer thread. Each record is a `LogRecordHeader` followed by the message.
+    class LogRing
+    {
+    public:
+        static constexpr uint64_t kCapacity = 256 << 10;
+
+        explicit LogRing(const void* thread_id)
+            : m_data(std::make_unique<char[]>(kCapacity)), m_thread_id(thread_id)
+        {
+        }
+        DISABLE_COPY_MOVE(LogRing)
+
+        const void* thread_id() const noexcept { return m_thread_id; }
+
+        void push(const LogRecordHeader& header, absl::string_view message) noexcept
+        {
+            uint64_t tail = m_tail.load(std::memory_order_relaxed);
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            if (kCapacity - (tail - head) < sizeof(header) + message.size())
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            copy_in(tail, &header, sizeof(header));
+            copy_in(tail + sizeof(header), message.data(), message.size());
+            m_tail.store(tail + sizeof(header) + message.size(), std::memory_order_release);
+        }
+
+        template <class Consumer>
+        void drain(Consumer&& consumer)
+        {
+            uint64_t head = m_head.load(std::memory_order_relaxed);
+            uint64_t tail = m_tail.load(std::memory_order_acquire);
+            while (head < tail)
+            {
+                LogRecordHeader header;
+                copy_out(head, &header, sizeof(header));
+                std::string message(header.message_size, '\0');
+                copy_out(head + sizeof(header), message.data(), message.size());
+                head += sizeof(header) + message.size();
+                consumer(header, std::move(message));
+            }
+            m_head.store(head, std::memory_order_release);
+        }
+
+        bool empty() const noexcept
+        {
+            return m_head.load(std::memory_order_acquire)
+                == m_tail.load(std::memory_order_acquire);
+        }
+
+        uint64_t take_dropped() noexcept
+        {
+            return m_dropped.exchange(0, std::memory_order_relaxed);
+        }
+
+    private:
+        std::unique_ptr<char[]> m_data;
+        const void* m_thread_id;
+        // Kept on separate cache lines so that the producer and the consumer do not contend.
+        alignas(64) std::atomic<uint64_t> m_head{0};
+        alignas(64) std::atomic<uint64_t> m_tail{0};
+        std::atomic<uint64_t> m_dropped{0};
+
+        void copy_in(uint64_t pos, const void* src, size_t size) noexcept
+        {
+            size_t offset = pos % kCapacity;
+            size_t first = std::min<size_t>(size, kCapacity - offset);
+            memcpy(m_data.get() + offset, src, first);
+            memcpy(m_data.get(), static_cast<const char*>(src) + first, size - first);
+        }
+
+        void copy_out(uint64_t pos, void* dst, size_t size) const noexcept
+        {
+            size_t offset = pos % kCapacity;
+            size_t first = std::min<size_t>(size, kCapacity - offset);
+            memcpy(dst, m_data.get() + offset, first);
+            memcpy(static_cast<char*>(dst) + first, m_data.get(), size - first);
+        }
+    };
+
+    // Large enough for any line but a full dump of a directory.
+    constexpr size_t kMaxAsyncMessageSize = LogRing::kCapacity / 16;
+}    // namespace
+
+struct Logger::AsyncState
+{
+    Mutex mu;
+    std::vector<std::shared_ptr<LogRing>> rings ABSL_GUARDED_BY(mu);
+    bool stopping ABSL_GUARDED_BY(mu) = false;
+    ThreadLocal<std::shared_ptr<LogRing>> local_ring;
+    std::thread writer;
+
+    AsyncState()
+        : local_ring(
+            [this]()
+            {
+                auto ring = std::make_shared<LogRing>(current_thread_id());
+                LockGuard<Mutex> lg(mu);
+                rings.push_back(ring);
+                return std::make_unique<std::shared_ptr<LogRing>>(std::move(ring));
+            })
+    {
+    }
+};
+
 Logger::Logger(FILE* fp, bool close_on_exit)
     : m_level(LoggingLevel::kLogInfo), m_fp(fp), m_close_on_exit(close_on_exit)
 {
     m_console_color = ConsoleColourSetter::create_setter(m_fp);
 }
 
-void Logger::prelog(LoggingLevel level, const char* funcsig, int lineno) noexcept
+void Logger::write_line(LoggingLevel level,
+                        int64_t time_ns,
+                        const void* thread_id,
+                        const char* funcsig,
+                        int lineno,
+                        absl::string_view message) noexcept
 {
-    if (!m_fp || level < this->get_level())
-        return;
-
-    struct tm now;
-    int now_ns = 0;
-    OSService::get_current_time_in_tm(&now, &now_ns);
-
-    flockfile(m_fp);
     if (m_console_color)
     {
         switch (level)
@@ -54,54 +180,234 @@ void Logger::prelog(LoggingLevel level, const char* funcsig, int lineno) noexcep
         }
     }
 
-    fprintf(m_fp,
-            "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC] [%s:%d]    ",
-            stringify(level),
-            current_thread_id(),
-            now.tm_year + 1900,
-            now.tm_mon + 1,
-            now.tm_mday,
-            now.tm_hour,
-            now.tm_min,
-            now.tm_sec,
-            now_ns,
-            funcsig,
-            lineno);
-}
+    absl::FPrintF(m_fp,
+                  "[%s] [%p] [%s UTC] [%s:%d]    %s",
+                  stringify(level),
+                  thread_id,
+                  absl::FormatTime("%Y-%m-%d %H:%M:%E9S",
+                                   absl::FromUnixNanos(time_ns),
+                                   absl::UTCTimeZone()),
+                  funcsig,
+                  lineno,
+                  message);
 
-void Logger::postlog(LoggingLevel level) noexcept
-{
     if (m_console_color && (level == LoggingLevel::kLogWarning || level == LoggingLevel::kLogError))
     {
         m_console_color->use(Colour::Default);
     }
-
     putc('\n', m_fp);
-    fflush(m_fp);
-    funlockfile(m_fp);
 }
 
 void Logger::log_v2(LoggingLevel level,
                     const char* funcsig,
                     int lineno,
-                    absl::FunctionRef<void(std::FILE*)> output_fun)
+                    absl::FunctionRef<void(std::string*)> output_fun)
 {
     if (!m_fp || level < this->get_level())
         return;
-    prelog(level, funcsig, lineno);
-    DEFER(postlog(level));
+
+    // Reused so that logging does not allocate once the buffer has grown.
+    thread_local std::string message;
+    message.clear();
     try
     {
-        output_fun(m_fp);
+        output_fun(&message);
     }
     catch (const std::exception& e)
     {
-        absl::FPrintF(m_fp, "Logging itself throws exception: %s", e.what());
+        absl::StrAppendFormat(&message, "Logging itself throws exception: %s", e.what());
+    }
+    int64_t now = absl::GetCurrentTimeNanos();
+
+    if (m_async_enabled.load(std::memory_order_acquire))
+    {
+        absl::string_view truncated = message;
+        if (truncated.size() > kMaxAsyncMessageSize)
+        {
+            truncated = truncated.substr(0, kMaxAsyncMessageSize);
+        }
+        LogRecordHeader header{
+            now, funcsig, static_cast<uint32_t>(truncated.size()), lineno, level};
+        m_async->local_ring.get()->push(header, truncated);
+        return;
+    }
+
+    flockfile(m_fp);
+    write_line(level, now, current_thread_id(), funcsig, lineno, message);
+    fflush(m_fp);
+    funlockfile(m_fp);
+}
+
+void Logger::log_payload(LoggingLevel level,
+                         const char* funcsig,
+                         int lineno,
+                         PayloadFormatter format,
+                         absl::FunctionRef<void(std::string*)> encode_fun) noexcept
+{
+    if (!m_fp || level < this->get_level())
+        return;
+
+    thread_local std::string payload;
+    payload.clear();
+    bool async = m_async_enabled.load(std::memory_order_acquire);
+    try
+    {
+        encode_fun(&payload);
+    }
+    catch (const std::exception& e)
+    {
+        log_v2(level,
+               funcsig,
+               lineno,
+               [&](std::string* out)
+               { absl::StrAppendFormat(out, "Logging itself throws exception: %s", e.what()); });
+        return;
+    }
+    // A payload cannot be cut short like a message, so the big ones are formatted right away.
+    if (!async || payload.size() > kMaxAsyncMessageSize)
+    {
+        log_v2(level, funcsig, lineno, [&](std::string* out) { format(out, payload); });
+        return;
+    }
+
+    LogRecordHeader header{absl::GetCurrentTimeNanos(),
+                           funcsig,
+                           static_cast<uint32_t>(payload.size()),
+                           lineno,
+                           level,
+                           format};
+    m_async->local_ring.get()->push(header, payload);
+}
+
+void Logger::start_async()
+{
+    if (m_async_enabled.load() || !m_fp)
+    {
+        return;
+    }
+    if (!m_async)
+    {
+        m_async = std::make_unique<AsyncState>();
+    }
+    {
+        LockGuard<Mutex> lg(m_async->mu);
+        m_async->stopping = false;
+    }
+    m_async->writer = std::thread([this]() { run_writer(); });
+    m_async_enabled.store(true, std::memory_order_release);
+}
+
+void Logger::stop_async() noexcept
+{
+    if (!m_async_enabled.exchange(false))
+    {
+        return;
+    }
+    {
+        LockGuard<Mutex> lg(m_async->mu);
+        m_async->stopping = true;
+    }
+    m_async->writer.join();
+}
+
+void Logger::run_writer()
+{
+    struct Entry
+    {
+        LogRecordHeader header;
+        const void* thread_id;
+        std::string message;
+    };
+    std::vector<Entry> batch;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    while (true)
+    {
+        bool stopping;
+        {
+            LockGuard<Mutex> lg(m_async->mu);
+            // The producers never wake us up, as that would cost them a lock.
+            m_async->mu.AwaitWithTimeout(absl::Condition(&m_async->stopping),
+                                         absl::Milliseconds(10));
+            stopping = m_async->stopping;
+            rings = m_async->rings;
+        }
+
+        int64_t now = absl::GetCurrentTimeNanos();
+        for (auto& ring : rings)
+        {
+            ring->drain(
+                [&](const LogRecordHeader& header, std::string message)
+                {
+                    if (header.format)
+                    {
+                        std::string payload = std::move(message);
+                        message.clear();
+                        try
+                        {
+                            header.format(&message, payload);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            absl::StrAppendFormat(
+                                &message, "Logging itself throws exception: %s", e.what());
+                        }
+                    }
+                    batch.push_back(Entry{header, ring->thread_id(), std::move(message)});
+                });
+            if (auto dropped = ring->take_dropped(); dropped > 0)
+            {
+                LogRecordHeader header{
+                    now, FULL_FUNCTION_NAME, 0, __LINE__, LoggingLevel::kLogWarning};
+                batch.push_back(Entry{
+                    header,
+                    ring->thread_id(),
+                    absl::StrFormat("%d lines were dropped because the log buffer was full",
+                                    dropped)});
+            }
+        }
+        // Interleave the lines of different threads in the order they were logged.
+        std::stable_sort(batch.begin(),
+                         batch.end(),
+                         [](const Entry& a, const Entry& b)
+                         { return a.header.time_ns < b.header.time_ns; });
+        if (!batch.empty())
+        {
+            flockfile(m_fp);
+            for (const Entry& e : batch)
+            {
+                write_line(e.header.level,
+                           e.header.time_ns,
+                           e.thread_id,
+                           e.header.funcsig,
+                           e.header.lineno,
+                           e.message);
+            }
+            fflush(m_fp);
+            funlockfile(m_fp);
+            batch.clear();
+        }
+
+        rings.clear();
+        {
+            // Forget the buffers of exited threads once they are drained.
+            LockGuard<Mutex> lg(m_async->mu);
+            auto& all = m_async->rings;
+            all.erase(std::remove_if(all.begin(),
+                                     all.end(),
+                                     [](const std::shared_ptr<LogRing>& ring)
+                                     { return ring.use_count() == 1 && ring->empty(); }),
+                      all.end());
+        }
+        if (stopping)
+        {
+            return;
+        }
     }
 }
 
 Logger::~Logger()
 {
+    stop_async();
     if (m_close_on_exit)
         fclose(m_fp);
 }
@@ -4,6 +4,8 @@
 #include <absl/functional/function_ref.h>
 #include <absl/strings/str_format.h>
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <stdio.h>
 #include <string>
@@ -51,25 +53,55 @@ class Logger
     friend class trace::FuseTracer;
 
 private:
+    struct AsyncState;
+
     LoggingLevel m_level;
     FILE* m_fp;
     std::unique_ptr<ConsoleColourSetter> m_console_color;
     bool m_close_on_exit;
+    std::unique_ptr<AsyncState> m_async;
+    std::atomic<bool> m_async_enabled{false};
 
     explicit Logger(FILE* fp, bool close_on_exit);
 
-    void prelog(LoggingLevel level, const char* funcsig, int lineno) noexcept;
-    void postlog(LoggingLevel level) noexcept;
+    // Writes one line, with `m_fp` already locked by the caller.
+    void write_line(LoggingLevel level,
+                    int64_t time_ns,
+                    const void* thread_id,
+                    const char* funcsig,
+                    int lineno,
+                    absl::string_view message) noexcept;
+    void run_writer();
 
     void log_v2(LoggingLevel level,
                 const char* funcsig,
                 int lineno,
-                absl::FunctionRef<void(std::FILE*)> output_fun);
+                absl::FunctionRef<void(std::string*)> output_fun);
+
+    using PayloadFormatter = void (*)(std::string* out, absl::string_view payload);
+
+    /// Like `log_v2`, but `encode_fun` only copies what the message is made of into a binary
+    /// payload, from which `format` makes the message. When asynchronous, `format` runs on the
+    /// background thread, so the logging thread does no formatting at all.
+    void log_payload(LoggingLevel level,
+                     const char* funcsig,
+                     int lineno,
+                     PayloadFormatter format,
+                     absl::FunctionRef<void(std::string*)> encode_fun) noexcept;
 
 public:
     static Logger* create_stderr_logger();
     static Logger* create_file_logger(const std::string& path);
 
+    /// Moves the writing of log lines to a background thread. Afterwards the logging threads only
+    /// format the message itself and copy it into a lock-free buffer of their own, while the
+    /// timestamp, the line header and the file I/O are left to the background thread. Lines that
+    /// do not fit in a full buffer are dropped and counted.
+    void start_async();
+    /// Writes out the buffered lines and goes back to writing synchronously. Lines logged by
+    /// other threads while this runs may be lost.
+    void stop_async() noexcept;
+
     template <typename... Args>
     void log_v2(LoggingLevel level,
                 const char* funcsig,
@@ -80,7 +112,8 @@ public:
         log_v2(level,
                funcsig,
                lineno,
-               [&](std::FILE* fp) { absl::FPrintF(fp, fms, std::forward<Args>(args)...); });
+               [&](std::string* out)
+               { absl::StrAppendFormat(out, fms, std::forward<Args>(args)...); });
     }
 
     LoggingLevel get_level() const noexcept { return m_level; }
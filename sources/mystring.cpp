@@ -4,6 +4,10 @@
 
 #include <uni_algo/all.h>
 
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
 namespace securefs
 {
 
@@ -168,108 +172,121 @@ std::string hexify(const byte* data, size_t length)
     return result;
 }
 
-static const char* UPPER_BASE32_ALPHABET = "ABCDEFGHIJKMNPQRSTUVWXYZ23456789";
-static const char* LOWER_BASE32_ALPHABET = "abcdefghijkmnpqrstuvwxyz23456789";
+// Our base32 alphabet omits "L" and "O", so it cannot be translated arithmetically.
+static constexpr char BASE32_ALPHABET[] = "ABCDEFGHIJKMNPQRSTUVWXYZ23456789";
 
-static size_t get_alphabet_index(byte b, byte next, size_t i)
+static constexpr std::array<signed char, 256> make_base32_decoding_table()
 {
-    switch (i)
+    std::array<signed char, 256> table{};
+    for (auto& value : table)
     {
-    case 0:
-        return (b >> 3) & 31u;
-    case 1:
-        return (b >> 2) & 31u;
-    case 2:
-        return (b >> 1) & 31u;
-    case 3:
-        return b & 31u;
-    case 4:
-        return ((b & 15u) << 1u) | (next >> 7u);
-    case 5:
-        return ((b & 7u) << 2u) | (next >> 6u);
-    case 6:
-        return ((b & 3u) << 3u) | (next >> 5u);
-    case 7:
-        return ((b & 1u) << 4u) | (next >> 4u);
+        value = -1;
+    }
+    for (int i = 0; i < 32; ++i)
+    {
+        char c = BASE32_ALPHABET[i];
+        table[static_cast<unsigned char>(c)] = static_cast<signed char>(i);
+        if (c >= 'A' && c <= 'Z')
+        {
+            table[static_cast<unsigned char>(c - 'A' + 'a')] = static_cast<signed char>(i);
+        }
     }
-    throwInvalidArgumentException("Invalid index within byte");
+    return table;
 }
 
+static constexpr std::array<signed char, 256> BASE32_DECODING_TABLE
+    = make_base32_decoding_table();
+
 void base32_encode(const byte* input, size_t size, std::string& output)
 {
-    output.clear();
-    output.reserve((size * 8 + 4) / 5);
+    output.resize((size * 8 + 4) / 5);
+    char* out = output.data();
 
-    for (size_t bit_index = 0; bit_index < size * 8; bit_index += 5)
+    // Every 5 bytes map to exactly 8 characters, so the bulk of the input needs no bit
+    // bookkeeping.
+    size_t i = 0;
+    for (; i + 5 <= size; i += 5, out += 8)
     {
-        size_t byte_index = bit_index / 8, index_within_byte = bit_index % 8;
-        byte b = input[byte_index];
-        byte next = byte_index + 1 < size ? input[byte_index + 1] : 0;
-
-        size_t alphabet_index = get_alphabet_index(b, next, index_within_byte);
-        if (alphabet_index >= 32)
-            throw std::out_of_range("base32_encode encounters internal error");
-
-        output.push_back(UPPER_BASE32_ALPHABET[alphabet_index]);
+        uint64_t group = (uint64_t(input[i]) << 32u) | (uint64_t(input[i + 1]) << 24u)
+            | (uint64_t(input[i + 2]) << 16u) | (uint64_t(input[i + 3]) << 8u)
+            | uint64_t(input[i + 4]);
+        for (unsigned j = 0; j < 8; ++j)
+        {
+            out[j] = BASE32_ALPHABET[(group >> (35u - 5u * j)) & 31u];
+        }
     }
-}
 
-static std::pair<unsigned, unsigned> get_base32_pair(unsigned group, size_t i)
-{
-    switch (i)
+    // The trailing bits are padded with zeros.
+    unsigned bits = 0, num_bits = 0;
+    for (; i < size; ++i)
     {
-    case 0:
-        return std::make_pair(group << 3u, 0);
-    case 1:
-        return std::make_pair(group << 2u, 0);
-    case 2:
-        return std::make_pair(group << 1u, 0);
-    case 3:
-        return std::make_pair(group, 0);
-    case 4:
-        return std::make_pair(group >> 1u, (group & 1u) << 7u);
-    case 5:
-        return std::make_pair(group >> 2u, (group & 3u) << 6u);
-    case 6:
-        return std::make_pair(group >> 3u, (group & 7u) << 5u);
-    case 7:
-        return std::make_pair(group >> 4u, (group & 15u) << 4u);
+        bits = (bits << 8u) | input[i];
+        num_bits += 8;
+        while (num_bits >= 5)
+        {
+            num_bits -= 5;
+            *out++ = BASE32_ALPHABET[(bits >> num_bits) & 31u];
+        }
+    }
+    if (num_bits > 0)
+    {
+        *out++ = BASE32_ALPHABET[(bits << (5u - num_bits)) & 31u];
     }
-    throwInvalidArgumentException("Invalid index within byte");
 }
 
 void base32_decode(const char* input, size_t size, std::string& output)
 {
-    output.assign(size * 5 / 8, '\0');
-    auto out = (byte*)(output.data());
+    output.resize(size * 5 / 8);
+    auto out = reinterpret_cast<byte*>(output.data());
 
-    for (size_t i = 0; i < size; ++i)
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8, out += 5)
     {
-        unsigned group;
-        const char* finded = std::strchr(UPPER_BASE32_ALPHABET, input[i]);
-        if (finded)
-            group = unsigned(finded - UPPER_BASE32_ALPHABET);
-        else
+        uint64_t group = 0;
+        int invalid = 0;
+        for (size_t j = 0; j < 8; ++j)
         {
-            finded = std::strchr(LOWER_BASE32_ALPHABET, input[i]);
-            if (finded)
-            {
-                group = unsigned(finded - LOWER_BASE32_ALPHABET);
-            }
-            else
-            {
-                throwInvalidArgumentException("Cannot decode string with base32");
-            }
+            signed char value = BASE32_DECODING_TABLE[static_cast<unsigned char>(input[i + j])];
+            invalid |= value;
+            group = (group << 5u) | static_cast<unsigned>(value & 31);
         }
+        if (invalid < 0)
+        {
+            throwInvalidArgumentException("Cannot decode string with base32");
+        }
+        out[0] = static_cast<byte>(group >> 32u);
+        out[1] = static_cast<byte>(group >> 24u);
+        out[2] = static_cast<byte>(group >> 16u);
+        out[3] = static_cast<byte>(group >> 8u);
+        out[4] = static_cast<byte>(group);
+    }
 
-        size_t bit_index = i * 5;
-        size_t byte_index = bit_index / 8, index_within_byte = bit_index % 8;
-        auto p = get_base32_pair(group, index_within_byte);
-        if (byte_index >= output.size())
-            throw std::out_of_range("base32 decode encounters internal error");
-        out[byte_index] |= p.first;
-        if (byte_index + 1 < output.size())
-            out[byte_index + 1] |= p.second;
+    // Bits that do not fill up a whole byte are discarded.
+    unsigned bits = 0, num_bits = 0;
+    for (; i < size; ++i)
+    {
+        signed char value = BASE32_DECODING_TABLE[static_cast<unsigned char>(input[i])];
+        if (value < 0)
+        {
+            throwInvalidArgumentException("Cannot decode string with base32");
+        }
+        bits = (bits << 5u) | static_cast<unsigned>(value);
+        num_bits += 5;
+        if (num_bits >= 8)
+        {
+            num_bits -= 8;
+            *out++ = static_cast<byte>(bits >> num_bits);
+        }
+    }
+    switch (size % 8)
+    {
+    case 1:
+    case 3:
+    case 6:
+        // The last character would start a byte that does not exist.
+        throw std::out_of_range("base32 decode encounters internal error");
+    default:
+        break;
     }
 }
 
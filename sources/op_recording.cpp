@@ -0,0 +1,1018 @@
+#include "op_recording.h"
+#include "exceptions.h"
+#include "fuse_tracer_v2.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "operation_stats.h"
+#include "streams.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    constexpr std::string_view kMagic = "SFSREC1\n";
+
+    // Integers are stored as LEB128 varints, and signed ones zigzag encoded first, so that most
+    // fields of most records take a single byte.
+    void put_varint(std::string* out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out->push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out->push_back(static_cast<char>(value));
+    }
+
+    void put_signed(std::string* out, int64_t value)
+    {
+        put_varint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    void put_string(std::string* out, std::string_view value)
+    {
+        put_varint(out, value.size());
+        out->append(value);
+    }
+
+    class RecordReader
+    {
+    public:
+        explicit RecordReader(std::string_view data) : data_(data) {}
+
+        bool empty() const noexcept { return data_.empty(); }
+
+        bool get_varint(uint64_t* value)
+        {
+            uint64_t result = 0;
+            for (unsigned shift = 0; shift < 64 && !data_.empty(); shift += 7)
+            {
+                auto byte = static_cast<uint8_t>(data_.front());
+                data_.remove_prefix(1);
+                result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    *value = result;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool get_signed(int64_t* value)
+        {
+            uint64_t zigzag;
+            if (!get_varint(&zigzag))
+            {
+                return false;
+            }
+            *value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+            return true;
+        }
+
+        bool get_string(std::string* value)
+        {
+            uint64_t size;
+            if (!get_varint(&size) || size > data_.size())
+            {
+                return false;
+            }
+            value->assign(data_.substr(0, size));
+            data_.remove_prefix(size);
+            return true;
+        }
+
+    private:
+        std::string_view data_;
+    };
+
+    bool opens_handle(RecordedOpType type)
+    {
+        return type == RecordedOpType::kOpen || type == RecordedOpType::kCreate
+            || type == RecordedOpType::kOpendir;
+    }
+
+    bool releases_handle(RecordedOpType type)
+    {
+        return type == RecordedOpType::kRelease || type == RecordedOpType::kReleasedir;
+    }
+
+    bool uses_handle(RecordedOpType type)
+    {
+        switch (type)
+        {
+        case RecordedOpType::kFgetattr:
+        case RecordedOpType::kReleasedir:
+        case RecordedOpType::kReaddir:
+        case RecordedOpType::kRelease:
+        case RecordedOpType::kRead:
+        case RecordedOpType::kWrite:
+        case RecordedOpType::kFlush:
+        case RecordedOpType::kFtruncate:
+        case RecordedOpType::kFsync:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    RecordedOp make_op(RecordedOpType type, const char* path, const char* path2 = nullptr)
+    {
+        RecordedOp op;
+        op.type = type;
+        if (path)
+        {
+            op.path = path;
+        }
+        if (path2)
+        {
+            op.path2 = path2;
+        }
+        return op;
+    }
+
+    // Times are packed into the generic fields, with both nanoseconds in `mode`, as UTIME_NOW
+    // and UTIME_OMIT fit in 32 bits on every platform.
+    void pack_times(const fuse_timespec* ts, RecordedOp* op)
+    {
+        if (!ts)
+        {
+            return;
+        }
+        op->size = 1;
+        op->offset = ts[0].tv_sec;
+        op->flags = static_cast<uint64_t>(ts[1].tv_sec);
+        op->mode = (static_cast<uint64_t>(static_cast<uint32_t>(ts[0].tv_nsec)) << 32)
+            | static_cast<uint32_t>(ts[1].tv_nsec);
+    }
+
+    const fuse_timespec* unpack_times(const RecordedOp& op, fuse_timespec* ts)
+    {
+        if (!op.size)
+        {
+            return nullptr;
+        }
+        ts[0].tv_sec = op.offset;
+        ts[0].tv_nsec = static_cast<int32_t>(static_cast<uint32_t>(op.mode >> 32));
+        ts[1].tv_sec = static_cast<int64_t>(op.flags);
+        ts[1].tv_nsec = static_cast<int32_t>(static_cast<uint32_t>(op.mode));
+        return ts;
+    }
+}    // namespace
+
+std::vector<RecordedOp> read_recorded_ops(const std::string& path)
+{
+    auto content = OSService::get_default().open_file_stream(path, O_RDONLY, 0)->as_string();
+    std::string_view data = content;
+    if (data.substr(0, kMagic.size()) != kMagic)
+    {
+        throw_runtime_error("Not a recording of securefs operations: " + path);
+    }
+    data.remove_prefix(kMagic.size());
+
+    std::vector<RecordedOp> result;
+    RecordReader reader(data);
+    int64_t start_ns = 0;
+    while (!reader.empty())
+    {
+        RecordedOp op;
+        uint64_t type, thread;
+        int64_t start_delta;
+        if (!reader.get_varint(&type) || !reader.get_varint(&thread)
+            || !reader.get_signed(&start_delta) || !reader.get_varint(&op.duration_ns)
+            || !reader.get_signed(&op.rc) || !reader.get_varint(&op.fh)
+            || !reader.get_signed(&op.offset) || !reader.get_varint(&op.size)
+            || !reader.get_varint(&op.flags) || !reader.get_varint(&op.mode)
+            || !reader.get_string(&op.path) || !reader.get_string(&op.path2))
+        {
+            WARN_LOG("The recording %s ends with an incomplete record, which is ignored", path);
+            break;
+        }
+        if (type == 0 || type >= static_cast<uint64_t>(RecordedOpType::kEnd))
+        {
+            throw_runtime_error(absl::StrFormat(
+                "Unknown operation %d in the recording %s after %d records",
+                type,
+                path,
+                result.size()));
+        }
+        op.type = static_cast<RecordedOpType>(type);
+        op.thread = static_cast<uint32_t>(thread);
+        start_ns += start_delta;
+        op.start_ns = start_ns;
+        result.push_back(std::move(op));
+    }
+    return result;
+}
+
+RecordingOps::RecordingOps(FuseHighLevelOpsBase& inner, const std::string& path)
+    : inner_(inner), fp_(nullptr), origin_ns_(trace::OperationStats::now_ns())
+{
+#ifdef _WIN32
+    FILE* fp = _wfopen(widen_string(path).c_str(), L"wb");
+#else
+    FILE* fp = fopen(path.c_str(), "wb");
+#endif
+    if (!fp)
+        THROW_POSIX_EXCEPTION(errno, path);
+    fwrite(kMagic.data(), 1, kMagic.size(), fp);
+    LockGuard<Mutex> lg(mu_);
+    fp_ = fp;
+}
+
+RecordingOps::~RecordingOps()
+{
+    LockGuard<Mutex> lg(mu_);
+    fclose(fp_);
+}
+
+template <class Func>
+int RecordingOps::record(RecordedOp op, const fuse_file_info* info, Func&& func)
+{
+    int64_t start_ns = trace::OperationStats::now_ns();
+    if (info && uses_handle(op.type))
+    {
+        // Looked up before the call, as a release frees the handle for the next open to reuse.
+        LockGuard<Mutex> lg(handles_mu_);
+        auto it = handle_ids_.find(info->fh);
+        if (it != handle_ids_.end())
+        {
+            op.fh = it->second;
+            if (releases_handle(op.type))
+            {
+                handle_ids_.erase(it);
+            }
+        }
+    }
+    // The same error numbers as `FuseTracer::traced_call` makes of exceptions.
+    op.rc = -EPERM;
+    try
+    {
+        op.rc = func();
+    }
+    catch (const ExceptionBase& e)
+    {
+        op.rc = -e.error_number();
+        append(op, start_ns);
+        throw;
+    }
+    catch (...)
+    {
+        append(op, start_ns);
+        throw;
+    }
+    if (info && opens_handle(op.type) && op.rc >= 0)
+    {
+        LockGuard<Mutex> lg(handles_mu_);
+        op.fh = next_handle_id_++;
+        handle_ids_[info->fh] = op.fh;
+    }
+    append(op, start_ns);
+    return static_cast<int>(op.rc);
+}
+
+void RecordingOps::append(RecordedOp& op, int64_t start_ns) noexcept
+{
+    thread_local uint32_t thread = next_thread_.fetch_add(1, std::memory_order_relaxed);
+    op.thread = thread;
+    op.start_ns = start_ns - origin_ns_;
+    op.duration_ns = static_cast<uint64_t>(trace::OperationStats::now_ns() - start_ns);
+
+    // Start times are stored as the difference from the record before, which usually takes a
+    // byte or two. They are not sorted, as records are appended in the order the calls finish.
+    try
+    {
+        LockGuard<Mutex> lg(mu_);
+        std::string& buffer = buffer_;
+        buffer.clear();
+        put_varint(&buffer, static_cast<uint64_t>(op.type));
+        put_varint(&buffer, op.thread);
+        put_signed(&buffer, op.start_ns - last_start_ns_);
+        put_varint(&buffer, op.duration_ns);
+        put_signed(&buffer, op.rc);
+        put_varint(&buffer, op.fh);
+        put_signed(&buffer, op.offset);
+        put_varint(&buffer, op.size);
+        put_varint(&buffer, op.flags);
+        put_varint(&buffer, op.mode);
+        put_string(&buffer, op.path);
+        put_string(&buffer, op.path2);
+        fwrite(buffer.data(), 1, buffer.size(), fp_);
+        last_start_ns_ = op.start_ns;
+    }
+    catch (const std::exception& e)
+    {
+        ERROR_LOG("Failed to record an operation: %s", e.what());
+    }
+}
+
+void RecordingOps::initialize(fuse_conn_info* info) { inner_.initialize(info); }
+
+int RecordingOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kStatfs, path),
+                  nullptr,
+                  [&]() { return inner_.vstatfs(path, buf, ctx); });
+}
+
+int RecordingOps::vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kGetattr, path),
+                  nullptr,
+                  [&]() { return inner_.vgetattr(path, st, ctx); });
+}
+
+int RecordingOps::vfgetattr(const char* path,
+                            fuse_stat* st,
+                            fuse_file_info* info,
+                            const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kFgetattr, path),
+                  info,
+                  [&]() { return inner_.vfgetattr(path, st, info, ctx); });
+}
+
+int RecordingOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kOpendir, path),
+                  info,
+                  [&]() { return inner_.vopendir(path, info, ctx); });
+}
+
+int RecordingOps::vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kReleasedir, path),
+                  info,
+                  [&]() { return inner_.vreleasedir(path, info, ctx); });
+}
+
+int RecordingOps::vreaddir(const char* path,
+                           void* buf,
+                           fuse_fill_dir_t filler,
+                           fuse_off_t off,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kReaddir, path);
+    op.offset = off;
+    return record(std::move(op),
+                  info,
+                  [&]() { return inner_.vreaddir(path, buf, filler, off, info, ctx); });
+}
+
+int RecordingOps::vcreate(const char* path,
+                          fuse_mode_t mode,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kCreate, path);
+    op.flags = static_cast<uint32_t>(info->flags);
+    op.mode = mode;
+    return record(
+        std::move(op), info, [&]() { return inner_.vcreate(path, mode, info, ctx); });
+}
+
+int RecordingOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kOpen, path);
+    op.flags = static_cast<uint32_t>(info->flags);
+    return record(std::move(op), info, [&]() { return inner_.vopen(path, info, ctx); });
+}
+
+int RecordingOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kRelease, path),
+                  info,
+                  [&]() { return inner_.vrelease(path, info, ctx); });
+}
+
+int RecordingOps::vread(const char* path,
+                        char* buf,
+                        size_t size,
+                        fuse_off_t offset,
+                        fuse_file_info* info,
+                        const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kRead, path);
+    op.offset = offset;
+    op.size = size;
+    return record(std::move(op),
+                  info,
+                  [&]() { return inner_.vread(path, buf, size, offset, info, ctx); });
+}
+
+int RecordingOps::vwrite(const char* path,
+                         const char* buf,
+                         size_t size,
+                         fuse_off_t offset,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kWrite, path);
+    op.offset = offset;
+    op.size = size;
+    return record(std::move(op),
+                  info,
+                  [&]() { return inner_.vwrite(path, buf, size, offset, info, ctx); });
+}
+
+int RecordingOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kFlush, path),
+                  info,
+                  [&]() { return inner_.vflush(path, info, ctx); });
+}
+
+int RecordingOps::vftruncate(const char* path,
+                             fuse_off_t len,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kFtruncate, path);
+    op.offset = len;
+    return record(
+        std::move(op), info, [&]() { return inner_.vftruncate(path, len, info, ctx); });
+}
+
+int RecordingOps::vunlink(const char* path, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kUnlink, path),
+                  nullptr,
+                  [&]() { return inner_.vunlink(path, ctx); });
+}
+
+int RecordingOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kMkdir, path);
+    op.mode = mode;
+    return record(std::move(op), nullptr, [&]() { return inner_.vmkdir(path, mode, ctx); });
+}
+
+int RecordingOps::vrmdir(const char* path, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kRmdir, path),
+                  nullptr,
+                  [&]() { return inner_.vrmdir(path, ctx); });
+}
+
+int RecordingOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kChmod, path);
+    op.mode = mode;
+    return record(std::move(op), nullptr, [&]() { return inner_.vchmod(path, mode, ctx); });
+}
+
+int RecordingOps::vchown(const char* path,
+                         fuse_uid_t uid,
+                         fuse_gid_t gid,
+                         const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kChown, path);
+    op.flags = uid;
+    op.mode = gid;
+    return record(
+        std::move(op), nullptr, [&]() { return inner_.vchown(path, uid, gid, ctx); });
+}
+
+int RecordingOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kSymlink, from, to),
+                  nullptr,
+                  [&]() { return inner_.vsymlink(to, from, ctx); });
+}
+
+int RecordingOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kLink, src, dest),
+                  nullptr,
+                  [&]() { return inner_.vlink(src, dest, ctx); });
+}
+
+int RecordingOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kReadlink, path);
+    op.size = size;
+    return record(
+        std::move(op), nullptr, [&]() { return inner_.vreadlink(path, buf, size, ctx); });
+}
+
+int RecordingOps::vrename(const char* from, const char* to, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kRename, from, to),
+                  nullptr,
+                  [&]() { return inner_.vrename(from, to, ctx); });
+}
+
+int RecordingOps::vfsync(const char* path,
+                         int datasync,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kFsync, path);
+    op.flags = static_cast<uint64_t>(datasync);
+    return record(
+        std::move(op), info, [&]() { return inner_.vfsync(path, datasync, info, ctx); });
+}
+
+int RecordingOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kTruncate, path);
+    op.offset = len;
+    return record(std::move(op), nullptr, [&]() { return inner_.vtruncate(path, len, ctx); });
+}
+
+int RecordingOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kUtimens, path);
+    pack_times(ts, &op);
+    return record(std::move(op), nullptr, [&]() { return inner_.vutimens(path, ts, ctx); });
+}
+
+int RecordingOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kListxattr, path);
+    op.size = size;
+    return record(
+        std::move(op), nullptr, [&]() { return inner_.vlistxattr(path, list, size, ctx); });
+}
+
+int RecordingOps::vgetxattr(const char* path,
+                            const char* name,
+                            char* value,
+                            size_t size,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kGetxattr, path, name);
+    op.size = size;
+    op.offset = position;
+    return record(std::move(op),
+                  nullptr,
+                  [&]() { return inner_.vgetxattr(path, name, value, size, position, ctx); });
+}
+
+int RecordingOps::vsetxattr(const char* path,
+                            const char* name,
+                            const char* value,
+                            size_t size,
+                            int flags,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    auto op = make_op(RecordedOpType::kSetxattr, path, name);
+    op.size = size;
+    op.flags = static_cast<uint32_t>(flags);
+    op.offset = position;
+    return record(
+        std::move(op),
+        nullptr,
+        [&]() { return inner_.vsetxattr(path, name, value, size, flags, position, ctx); });
+}
+
+int RecordingOps::vremovexattr(const char* path, const char* name, const fuse_context* ctx)
+{
+    return record(make_op(RecordedOpType::kRemovexattr, path, name),
+                  nullptr,
+                  [&]() { return inner_.vremovexattr(path, name, ctx); });
+}
+
+bool RecordingOps::has_getpath() const { return inner_.has_getpath(); }
+
+int RecordingOps::vgetpath(
+    const char* path, char* buf, size_t size, fuse_file_info* info, const fuse_context* ctx)
+{
+    // Only answers how a path is spelled, so there is nothing to replay.
+    return inner_.vgetpath(path, buf, size, info, ctx);
+}
+
+void RecordingOps::collect_gauges(std::vector<trace::StatsGauge>* gauges)
+{
+    inner_.collect_gauges(gauges);
+}
+
+void RecordingOps::drop_caches() { inner_.drop_caches(); }
+
+void RecordingOps::flush_deferred() { inner_.flush_deferred(); }
+
+namespace
+{
+    class Replayer
+    {
+    public:
+        Replayer(FuseHighLevelOpsBase& ops, const std::vector<RecordedOp>& recorded)
+            : ops_(ops), recorded_(recorded), slot_of_(recorded.size(), -1)
+        {
+            ctx_.uid = OSService::getuid();
+            ctx_.gid = OSService::getgid();
+
+            // Each open gets a slot of its own, as the recorded handles are reused once released.
+            absl::flat_hash_map<uint64_t, int64_t> live;
+            int64_t num_slots = 0;
+            for (size_t i = 0; i < recorded.size(); ++i)
+            {
+                const RecordedOp& op = recorded[i];
+                if (opens_handle(op.type))
+                {
+                    slot_of_[i] = num_slots++;
+                    if (op.rc >= 0)
+                    {
+                        live[op.fh] = slot_of_[i];
+                    }
+                }
+                else if (uses_handle(op.type))
+                {
+                    auto it = live.find(op.fh);
+                    if (it == live.end())
+                    {
+                        continue;
+                    }
+                    slot_of_[i] = it->second;
+                    if (releases_handle(op.type))
+                    {
+                        live.erase(it);
+                    }
+                }
+            }
+            LockGuard<Mutex> lg(mu_);
+            slots_.resize(num_slots);
+        }
+
+        DISABLE_COPY_MOVE(Replayer)
+
+        void run_worker();
+        void release_leftovers();
+
+        ReplayResult result() const
+        {
+            ReplayResult result;
+            result.operations = recorded_.size();
+            result.mismatches = mismatches_.load();
+            result.skipped = skipped_.load();
+            result.bytes = bytes_.load();
+            return result;
+        }
+
+    private:
+        struct Slot
+        {
+            enum State
+            {
+                kPending,
+                kOpen,
+                kFailed,
+                kReleased,
+            };
+            State state = kPending;
+            uint64_t fh = 0;
+            bool is_dir = false;
+            // The calls taken so far that use the handle and have not finished.
+            unsigned users = 0;
+        };
+
+        FuseHighLevelOpsBase& ops_;
+        const std::vector<RecordedOp>& recorded_;
+        std::vector<int64_t> slot_of_;
+        fuse_context ctx_{};
+
+        Mutex mu_;
+        size_t next_ ABSL_GUARDED_BY(mu_) = 0;
+        std::vector<Slot> slots_ ABSL_GUARDED_BY(mu_);
+
+        std::atomic<uint64_t> mismatches_{0}, skipped_{0}, bytes_{0};
+
+        int call(const RecordedOp& op, fuse_file_info* info, std::vector<char>* buffer);
+    };
+
+    void Replayer::run_worker()
+    {
+        std::vector<char> buffer;
+        while (true)
+        {
+            size_t index;
+            {
+                LockGuard<Mutex> lg(mu_);
+                if (next_ == recorded_.size())
+                {
+                    return;
+                }
+                index = next_++;
+                // Counted while taking the call, so that a release taken later waits for it.
+                if (slot_of_[index] >= 0 && !opens_handle(recorded_[index].type))
+                {
+                    ++slots_[slot_of_[index]].users;
+                }
+            }
+            const RecordedOp& op = recorded_[index];
+            int64_t slot = slot_of_[index];
+
+            fuse_file_info info{};
+            info.flags = static_cast<int>(op.flags);
+            if (uses_handle(op.type))
+            {
+                if (slot < 0)
+                {
+                    // The handle was opened before the recording started.
+                    skipped_.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                bool usable;
+                {
+                    LockGuard<Mutex> lg(mu_);
+                    Slot& s = slots_[slot];
+                    bool release = releases_handle(op.type);
+                    auto ready = [&s, release]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+                    { return s.state != Slot::kPending && (!release || s.users == 1); };
+                    mu_.Await(absl::Condition(&ready));
+                    usable = s.state == Slot::kOpen;
+                    info.fh = s.fh;
+                    if (!usable)
+                    {
+                        --s.users;
+                    }
+                }
+                if (!usable)
+                {
+                    skipped_.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+            }
+
+            int rc = call(op, &info, &buffer);
+            if ((rc < 0) != (op.rc < 0))
+            {
+                mismatches_.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (rc > 0 && (op.type == RecordedOpType::kRead || op.type == RecordedOpType::kWrite))
+            {
+                bytes_.fetch_add(static_cast<uint64_t>(rc), std::memory_order_relaxed);
+            }
+
+            if (opens_handle(op.type))
+            {
+                bool is_dir = op.type == RecordedOpType::kOpendir;
+                bool keep = rc >= 0 && op.rc >= 0;
+                if (rc >= 0 && !keep)
+                {
+                    // Nothing in the recording uses or releases this handle.
+                    if (is_dir)
+                        ops_.vreleasedir(nullptr, &info, &ctx_);
+                    else
+                        ops_.vrelease(nullptr, &info, &ctx_);
+                }
+                LockGuard<Mutex> lg(mu_);
+                Slot& s = slots_[slot];
+                s.fh = info.fh;
+                s.is_dir = is_dir;
+                s.state = keep ? Slot::kOpen : Slot::kFailed;
+            }
+            else if (slot >= 0)
+            {
+                LockGuard<Mutex> lg(mu_);
+                Slot& s = slots_[slot];
+                --s.users;
+                if (releases_handle(op.type))
+                {
+                    s.state = Slot::kReleased;
+                }
+            }
+        }
+    }
+
+    void Replayer::release_leftovers()
+    {
+        LockGuard<Mutex> lg(mu_);
+        for (Slot& s : slots_)
+        {
+            if (s.state != Slot::kOpen)
+            {
+                continue;
+            }
+            fuse_file_info info{};
+            info.fh = s.fh;
+            if (s.is_dir)
+                ops_.vreleasedir(nullptr, &info, &ctx_);
+            else
+                ops_.vrelease(nullptr, &info, &ctx_);
+            s.state = Slot::kReleased;
+        }
+    }
+
+    int Replayer::call(const RecordedOp& op, fuse_file_info* info, std::vector<char>* buffer)
+    {
+        using trace::FuseTracer;
+
+        const char* path = op.path.c_str();
+        const char* path2 = op.path2.c_str();
+        const fuse_context* ctx = &ctx_;
+        if (buffer->size() < op.size)
+        {
+            buffer->resize(op.size);
+        }
+        char* buf = buffer->data();
+        size_t size = static_cast<size_t>(op.size);
+
+        // Each call site counts under its own name in `OperationStats`, the same names as when
+        // mounted.
+        switch (op.type)
+        {
+        case RecordedOpType::kStatfs:
+        {
+            fuse_statvfs st{};
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vstatfs(path, &st, ctx); }, "statfs", __LINE__, {});
+        }
+        case RecordedOpType::kGetattr:
+        {
+            fuse_stat st{};
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vgetattr(path, &st, ctx); }, "getattr", __LINE__, {});
+        }
+        case RecordedOpType::kFgetattr:
+        {
+            fuse_stat st{};
+            return FuseTracer::traced_call([&]() { return ops_.vfgetattr(path, &st, info, ctx); },
+                                           "fgetattr",
+                                           __LINE__,
+                                           {});
+        }
+        case RecordedOpType::kOpendir:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vopendir(path, info, ctx); }, "opendir", __LINE__, {});
+        case RecordedOpType::kReleasedir:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vreleasedir(path, info, ctx); }, "releasedir", __LINE__, {});
+        case RecordedOpType::kReaddir:
+        {
+            auto filler = [](void*, const char*, const fuse_stat*, fuse_off_t) { return 0; };
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vreaddir(path, nullptr, filler, op.offset, info, ctx); },
+                "readdir",
+                __LINE__,
+                {});
+        }
+        case RecordedOpType::kCreate:
+            return FuseTracer::traced_call(
+                [&]()
+                { return ops_.vcreate(path, static_cast<fuse_mode_t>(op.mode), info, ctx); },
+                "create",
+                __LINE__,
+                {});
+        case RecordedOpType::kOpen:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vopen(path, info, ctx); }, "open", __LINE__, {});
+        case RecordedOpType::kRelease:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vrelease(path, info, ctx); }, "release", __LINE__, {});
+        case RecordedOpType::kRead:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vread(path, buf, size, op.offset, info, ctx); },
+                "read",
+                __LINE__,
+                {});
+        case RecordedOpType::kWrite:
+            // The contents were not recorded, but encryption costs the same for any bytes.
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vwrite(path, buf, size, op.offset, info, ctx); },
+                "write",
+                __LINE__,
+                {});
+        case RecordedOpType::kFlush:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vflush(path, info, ctx); }, "flush", __LINE__, {});
+        case RecordedOpType::kFtruncate:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vftruncate(path, op.offset, info, ctx); },
+                "ftruncate",
+                __LINE__,
+                {});
+        case RecordedOpType::kUnlink:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vunlink(path, ctx); }, "unlink", __LINE__, {});
+        case RecordedOpType::kMkdir:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vmkdir(path, static_cast<fuse_mode_t>(op.mode), ctx); },
+                "mkdir",
+                __LINE__,
+                {});
+        case RecordedOpType::kRmdir:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vrmdir(path, ctx); }, "rmdir", __LINE__, {});
+        case RecordedOpType::kChmod:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vchmod(path, static_cast<fuse_mode_t>(op.mode), ctx); },
+                "chmod",
+                __LINE__,
+                {});
+        case RecordedOpType::kChown:
+            return FuseTracer::traced_call(
+                [&]()
+                {
+                    return ops_.vchown(path,
+                                       static_cast<fuse_uid_t>(op.flags),
+                                       static_cast<fuse_gid_t>(op.mode),
+                                       ctx);
+                },
+                "chown",
+                __LINE__,
+                {});
+        case RecordedOpType::kSymlink:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vsymlink(path2, path, ctx); }, "symlink", __LINE__, {});
+        case RecordedOpType::kLink:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vlink(path, path2, ctx); }, "link", __LINE__, {});
+        case RecordedOpType::kReadlink:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vreadlink(path, buf, size, ctx); }, "readlink", __LINE__, {});
+        case RecordedOpType::kRename:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vrename(path, path2, ctx); }, "rename", __LINE__, {});
+        case RecordedOpType::kFsync:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vfsync(path, static_cast<int>(op.flags), info, ctx); },
+                "fsync",
+                __LINE__,
+                {});
+        case RecordedOpType::kTruncate:
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vtruncate(path, op.offset, ctx); }, "truncate", __LINE__, {});
+        case RecordedOpType::kUtimens:
+        {
+            fuse_timespec ts[2] = {};
+            auto times = unpack_times(op, ts);
+            return FuseTracer::traced_call(
+                [&]() { return ops_.vutimens(path, times, ctx); }, "utimens", __LINE__, {});
+        }
+        case RecordedOpType::kListxattr:
+            return FuseTracer::traced_call([&]()
+                                           { return ops_.vlistxattr(path, buf, size, ctx); },
+                                           "listxattr",
+                                           __LINE__,
+                                           {});
+        case RecordedOpType::kGetxattr:
+            return FuseTracer::traced_call(
+                [&]()
+                {
+                    return ops_.vgetxattr(
+                        path, path2, buf, size, static_cast<uint32_t>(op.offset), ctx);
+                },
+                "getxattr",
+                __LINE__,
+                {});
+        case RecordedOpType::kSetxattr:
+            return FuseTracer::traced_call(
+                [&]()
+                {
+                    return ops_.vsetxattr(path,
+                                          path2,
+                                          buf,
+                                          size,
+                                          static_cast<int>(op.flags),
+                                          static_cast<uint32_t>(op.offset),
+                                          ctx);
+                },
+                "setxattr",
+                __LINE__,
+                {});
+        case RecordedOpType::kRemovexattr:
+            return FuseTracer::traced_call([&]() { return ops_.vremovexattr(path, path2, ctx); },
+                                           "removexattr",
+                                           __LINE__,
+                                           {});
+        default:
+            return -ENOSYS;
+        }
+    }
+}    // namespace
+
+ReplayResult replay_recorded_ops(FuseHighLevelOpsBase& ops,
+                                 const std::vector<RecordedOp>& recorded,
+                                 unsigned threads)
+{
+    Replayer replayer(ops, recorded);
+    int64_t start_ns = trace::OperationStats::now_ns();
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < std::max(threads, 1u); ++i)
+    {
+        workers.emplace_back([&replayer]() { replayer.run_worker(); });
+    }
+    replayer.run_worker();
+    for (auto& t : workers)
+    {
+        t.join();
+    }
+    auto result = replayer.result();
+    result.seconds = (trace::OperationStats::now_ns() - start_ns) / 1e9;
+    replayer.release_leftovers();
+    return result;
+}
+}    // namespace securefs
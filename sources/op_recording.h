@@ -0,0 +1,202 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "myutils.h"
+#include "platform.h"    // IWYU pragma: keep
+
+#include <absl/container/flat_hash_map.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+enum class RecordedOpType : uint8_t
+{
+    kStatfs = 1,
+    kGetattr,
+    kFgetattr,
+    kOpendir,
+    kReleasedir,
+    kReaddir,
+    kCreate,
+    kOpen,
+    kRelease,
+    kRead,
+    kWrite,
+    kFlush,
+    kFtruncate,
+    kUnlink,
+    kMkdir,
+    kRmdir,
+    kChmod,
+    kChown,
+    kSymlink,
+    kLink,
+    kReadlink,
+    kRename,
+    kFsync,
+    kTruncate,
+    kUtimens,
+    kListxattr,
+    kGetxattr,
+    kSetxattr,
+    kRemovexattr,
+    kEnd,
+};
+
+/// One call into `FuseHighLevelOpsBase`, as recorded by `RecordingOps`.
+struct RecordedOp
+{
+    RecordedOpType type = RecordedOpType::kStatfs;
+    // Numbered in the order the threads first made a call.
+    uint32_t thread = 0;
+    // Since the recording started.
+    int64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+    int64_t rc = 0;
+    // Identifies the handle the call was given, or the one returned by opens and creates. Unlike
+    // the handles themselves, these are never reused within a recording, and zero stands for the
+    // handles opened before it started.
+    uint64_t fh = 0;
+    // The offset of reads and writes, the length of truncations, or the xattr position.
+    int64_t offset = 0;
+    // The size of reads, writes and buffers.
+    uint64_t size = 0;
+    // The open flags, the uid of chown, the datasync of fsync, or the flags of setxattr.
+    uint64_t flags = 0;
+    // The mode of creations and chmod, or the gid of chown.
+    uint64_t mode = 0;
+    std::string path;
+    // The destination of renames and links, the target of symlinks, or the name of an xattr.
+    std::string path2;
+};
+
+/// Reads a file written by `RecordingOps`. A record cut short, as by a crash, ends the list.
+std::vector<RecordedOp> read_recorded_ops(const std::string& path);
+
+/// Passes every call on to another implementation, and appends it to a file in a compact binary
+/// form, so that `replay_recorded_ops` can repeat the workload later without the kernel. Paths
+/// are recorded in plain text, but file contents are not.
+class RecordingOps final : public FuseHighLevelOpsBase
+{
+public:
+    RecordingOps(FuseHighLevelOpsBase& inner, const std::string& path);
+    ~RecordingOps() override;
+    DISABLE_COPY_MOVE(RecordingOps)
+
+    void initialize(fuse_conn_info* info) override;
+    int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) override;
+    int vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx) override;
+    int vfgetattr(const char* path,
+                  fuse_stat* st,
+                  fuse_file_info* info,
+                  const fuse_context* ctx) override;
+    int vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreaddir(const char* path,
+                 void* buf,
+                 fuse_fill_dir_t filler,
+                 fuse_off_t off,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    int vcreate(const char* path,
+                fuse_mode_t mode,
+                fuse_file_info* info,
+                const fuse_context* ctx) override;
+    int vopen(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vread(const char* path,
+              char* buf,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info,
+              const fuse_context* ctx) override;
+    int vwrite(const char* path,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vflush(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vftruncate(const char* path,
+                   fuse_off_t len,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vunlink(const char* path, const fuse_context* ctx) override;
+    int vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vrmdir(const char* path, const fuse_context* ctx) override;
+    int vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx) override;
+    int vsymlink(const char* to, const char* from, const fuse_context* ctx) override;
+    int vlink(const char* src, const char* dest, const fuse_context* ctx) override;
+    int vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx) override;
+    int vrename(const char* from, const char* to, const fuse_context* ctx) override;
+    int
+    vfsync(const char* path, int datasync, fuse_file_info* info, const fuse_context* ctx) override;
+    int vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx) override;
+    int vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx) override;
+    int vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx) override;
+    int vgetxattr(const char* path,
+                  const char* name,
+                  char* value,
+                  size_t size,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vsetxattr(const char* path,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    bool has_getpath() const override;
+    int vgetpath(const char* path,
+                 char* buf,
+                 size_t size,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    void collect_gauges(std::vector<trace::StatsGauge>* gauges) override;
+    void drop_caches() override;
+    void flush_deferred() override;
+
+private:
+    FuseHighLevelOpsBase& inner_;
+    Mutex mu_;
+    FILE* fp_ ABSL_GUARDED_BY(mu_);
+    std::string buffer_ ABSL_GUARDED_BY(mu_);
+    int64_t last_start_ns_ ABSL_GUARDED_BY(mu_) = 0;
+    int64_t origin_ns_;
+    std::atomic<uint32_t> next_thread_{0};
+    Mutex handles_mu_;
+    absl::flat_hash_map<uint64_t, uint64_t> handle_ids_ ABSL_GUARDED_BY(handles_mu_);
+    uint64_t next_handle_id_ ABSL_GUARDED_BY(handles_mu_) = 1;
+
+    template <class Func>
+    int record(RecordedOp op, const fuse_file_info* info, Func&& func);
+    void append(RecordedOp& op, int64_t start_ns) noexcept;
+};
+
+struct ReplayResult
+{
+    uint64_t operations = 0;
+    // Calls whose success or failure differs from the recording.
+    uint64_t mismatches = 0;
+    // Calls on handles whose open failed in the replay, which are not made.
+    uint64_t skipped = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+};
+
+/// Makes the recorded calls on `ops` as fast as possible, from `threads` threads that take the
+/// calls in the recorded order. As with the kernel, a call on a handle waits for the open that
+/// returned it, and a release waits for all calls before it on the same handle. The latency of
+/// each call is counted in `trace::OperationStats`.
+ReplayResult replay_recorded_ops(FuseHighLevelOpsBase& ops,
+                                 const std::vector<RecordedOp>& recorded,
+                                 unsigned threads);
+}    // namespace securefs
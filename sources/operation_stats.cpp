@@ -0,0 +1,595 @@
+#include "operation_stats.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "myutils.h"
+#include "platform.h"
+
+#include <absl/numeric/bits.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace securefs::trace
+{
+namespace
+{
+    struct alignas(64) Counters
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::array<std::atomic<uint64_t>, OperationSummary::kNumBuckets> buckets{};
+    };
+
+    struct ThreadCounters
+    {
+        std::array<Counters, OperationStats::kMaxOperations> ops;
+    };
+
+    // Each counter has a single writer, so it needs no atomic read-modify-write.
+    void bump(std::atomic<uint64_t>& counter, uint64_t delta) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void raise(std::atomic<uint64_t>& counter, uint64_t value) noexcept
+    {
+        if (value > counter.load(std::memory_order_relaxed))
+        {
+            counter.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void merge(const Counters& from, Counters* to) noexcept
+    {
+        bump(to->calls, from.calls.load(std::memory_order_relaxed));
+        bump(to->errors, from.errors.load(std::memory_order_relaxed));
+        bump(to->bytes, from.bytes.load(std::memory_order_relaxed));
+        bump(to->total_ns, from.total_ns.load(std::memory_order_relaxed));
+        raise(to->max_ns, from.max_ns.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < from.buckets.size(); ++i)
+        {
+            bump(to->buckets[i], from.buckets[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    void add(const Counters& from, OperationSummary* to) noexcept
+    {
+        to->calls += from.calls.load(std::memory_order_relaxed);
+        to->errors += from.errors.load(std::memory_order_relaxed);
+        to->bytes += from.bytes.load(std::memory_order_relaxed);
+        to->total_ns += from.total_ns.load(std::memory_order_relaxed);
+        to->max_ns = std::max(to->max_ns, from.max_ns.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < from.buckets.size(); ++i)
+        {
+            to->buckets[i] += from.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    class Registry
+    {
+    public:
+        static Registry& get()
+        {
+            static Registry instance;
+            return instance;
+        }
+
+        Mutex mu;
+        std::array<const char*, OperationStats::kMaxOperations> names ABSL_GUARDED_BY(mu){};
+        size_t num_names ABSL_GUARDED_BY(mu) = 0;
+        std::vector<const ThreadCounters*> live ABSL_GUARDED_BY(mu);
+        // The counts of the threads that have exited.
+        std::unique_ptr<ThreadCounters> retired ABSL_GUARDED_BY(mu)
+            = std::make_unique<ThreadCounters>();
+
+    private:
+        Registry() = default;
+        DISABLE_COPY_MOVE(Registry)
+    };
+
+    class LocalCounters
+    {
+    public:
+        LocalCounters() : counters_(std::make_unique<ThreadCounters>())
+        {
+            auto& registry = Registry::get();
+            LockGuard<Mutex> lg(registry.mu);
+            registry.live.push_back(counters_.get());
+        }
+
+        ~LocalCounters()
+        {
+            auto& registry = Registry::get();
+            LockGuard<Mutex> lg(registry.mu);
+            for (size_t i = 0; i < counters_->ops.size(); ++i)
+            {
+                merge(counters_->ops[i], &registry.retired->ops[i]);
+            }
+            registry.live.erase(
+                std::find(registry.live.begin(), registry.live.end(), counters_.get()));
+        }
+
+        DISABLE_COPY_MOVE(LocalCounters)
+
+        ThreadCounters& get() noexcept { return *counters_; }
+
+    private:
+        std::unique_ptr<ThreadCounters> counters_;
+    };
+
+    ThreadCounters& local_counters()
+    {
+        thread_local LocalCounters local;
+        return local.get();
+    }
+}    // namespace
+
+unsigned OperationSummary::bucket_of(uint64_t ns) noexcept
+{
+    if (ns < kSubBuckets)
+    {
+        return static_cast<unsigned>(ns);
+    }
+    ns = std::min<uint64_t>(ns, (uint64_t(1) << kMaxBits) - 1);
+    unsigned shift = absl::bit_width(ns) - 1 - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + static_cast<unsigned>(ns >> shift) - kSubBuckets;
+}
+
+uint64_t OperationSummary::bucket_upper_bound(unsigned bucket) noexcept
+{
+    if (bucket < kSubBuckets)
+    {
+        return bucket;
+    }
+    unsigned shift = bucket / kSubBuckets - 1;
+    uint64_t sub = bucket % kSubBuckets;
+    return ((kSubBuckets + sub + 1) << shift) - 1;
+}
+
+uint64_t OperationSummary::percentile_ns(double fraction) const noexcept
+{
+    if (calls == 0)
+    {
+        return 0;
+    }
+    auto target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * calls)));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < buckets.size(); ++i)
+    {
+        seen += buckets[i];
+        if (seen >= target)
+        {
+            return std::min(bucket_upper_bound(i), max_ns);
+        }
+    }
+    return max_ns;
+}
+
+int OperationStats::register_operation(const char* name)
+{
+    auto& registry = Registry::get();
+    LockGuard<Mutex> lg(registry.mu);
+    for (size_t i = 0; i < registry.num_names; ++i)
+    {
+        if (strcmp(registry.names[i], name) == 0)
+        {
+            return static_cast<int>(i);
+        }
+    }
+    if (registry.num_names >= kMaxOperations)
+    {
+        return -1;
+    }
+    registry.names[registry.num_names] = name;
+    return static_cast<int>(registry.num_names++);
+}
+
+void OperationStats::record(int op, int64_t ns, int64_t rc) noexcept
+{
+    if (op < 0)
+    {
+        return;
+    }
+    auto latency = static_cast<uint64_t>(std::max<int64_t>(ns, 0));
+    Counters& counters = local_counters().ops[op];
+    bump(counters.calls, 1);
+    if (rc < 0)
+    {
+        bump(counters.errors, 1);
+    }
+    else
+    {
+        bump(counters.bytes, static_cast<uint64_t>(rc));
+    }
+    bump(counters.total_ns, latency);
+    raise(counters.max_ns, latency);
+    bump(counters.buckets[OperationSummary::bucket_of(latency)], 1);
+}
+
+std::vector<OperationSummary> OperationStats::snapshot()
+{
+    auto& registry = Registry::get();
+    LockGuard<Mutex> lg(registry.mu);
+    std::vector<OperationSummary> summaries(registry.num_names);
+    for (size_t i = 0; i < summaries.size(); ++i)
+    {
+        summaries[i].name = registry.names[i];
+        add(registry.retired->ops[i], &summaries[i]);
+        for (const ThreadCounters* counters : registry.live)
+        {
+            add(counters->ops[i], &summaries[i]);
+        }
+    }
+    summaries.erase(std::remove_if(summaries.begin(),
+                                   summaries.end(),
+                                   [](const OperationSummary& s) { return s.calls == 0; }),
+                    summaries.end());
+    return summaries;
+}
+
+std::string OperationStats::format_table(const std::vector<OperationSummary>& summaries)
+{
+    std::string result = absl::StrFormat("%-14s %12s %8s %16s %10s %10s %10s %10s %12s\n",
+                                         "operation",
+                                         "calls",
+                                         "errors",
+                                         "bytes",
+                                         "mean_us",
+                                         "p50_us",
+                                         "p90_us",
+                                         "p99_us",
+                                         "max_us");
+    for (const OperationSummary& s : summaries)
+    {
+        absl::StrAppendFormat(&result,
+                              "%-14s %12d %8d %16d %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+                              s.name,
+                              s.calls,
+                              s.errors,
+                              s.bytes,
+                              s.total_ns / 1e3 / std::max<uint64_t>(s.calls, 1),
+                              s.percentile_ns(0.5) / 1e3,
+                              s.percentile_ns(0.9) / 1e3,
+                              s.percentile_ns(0.99) / 1e3,
+                              s.max_ns / 1e3);
+    }
+    return result;
+}
+
+std::string OperationStats::format_json(const std::vector<OperationSummary>& summaries,
+                                        const std::vector<StatsGauge>& gauges)
+{
+    // Operation and gauge names are identifiers chosen by us, so they need no escaping.
+    std::string result = "{\n  \"operations\": {";
+    for (size_t i = 0; i < summaries.size(); ++i)
+    {
+        const OperationSummary& s = summaries[i];
+        absl::StrAppendFormat(&result,
+                              "%s\n    \"%s\": {\"calls\": %d, \"errors\": %d, \"bytes\": %d, "
+                              "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                              "\"p99_us\": %.1f, \"max_us\": %.1f}",
+                              i ? "," : "",
+                              s.name,
+                              s.calls,
+                              s.errors,
+                              s.bytes,
+                              s.total_ns / 1e3 / std::max<uint64_t>(s.calls, 1),
+                              s.percentile_ns(0.5) / 1e3,
+                              s.percentile_ns(0.9) / 1e3,
+                              s.percentile_ns(0.99) / 1e3,
+                              s.max_ns / 1e3);
+    }
+    result += "\n  },\n  \"gauges\": {";
+    for (size_t i = 0; i < gauges.size(); ++i)
+    {
+        absl::StrAppendFormat(
+            &result, "%s\n    \"%s\": %.17g", i ? "," : "", gauges[i].name, gauges[i].value);
+    }
+    result += "\n  }\n}\n";
+    return result;
+}
+
+std::string OperationStats::format_prometheus(const std::vector<OperationSummary>& summaries,
+                                              const std::vector<StatsGauge>& gauges)
+{
+    std::string result;
+    auto append_family = [&](const char* name, const char* type, auto&& value_of)
+    {
+        absl::StrAppendFormat(&result, "# TYPE securefs_%s %s\n", name, type);
+        for (const OperationSummary& s : summaries)
+        {
+            absl::StrAppendFormat(
+                &result, "securefs_%s{operation=\"%s\"} %d\n", name, s.name, value_of(s));
+        }
+    };
+    append_family("operation_calls_total",
+                  "counter",
+                  [](const OperationSummary& s) { return s.calls; });
+    append_family("operation_errors_total",
+                  "counter",
+                  [](const OperationSummary& s) { return s.errors; });
+    append_family("operation_bytes_total",
+                  "counter",
+                  [](const OperationSummary& s) { return s.bytes; });
+
+    result += "# TYPE securefs_operation_latency_seconds summary\n";
+    for (const OperationSummary& s : summaries)
+    {
+        // The quantiles are labelled as written, since their doubles do not print back exactly.
+        static const std::pair<double, const char*> kQuantiles[]
+            = {{0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}};
+        for (const auto& [q, label] : kQuantiles)
+        {
+            absl::StrAppendFormat(&result,
+                                  "securefs_operation_latency_seconds{operation=\"%s\","
+                                  "quantile=\"%s\"} %.17g\n",
+                                  s.name,
+                                  label,
+                                  s.percentile_ns(q) / 1e9);
+        }
+        absl::StrAppendFormat(&result,
+                              "securefs_operation_latency_seconds_sum{operation=\"%s\"} %.17g\n"
+                              "securefs_operation_latency_seconds_count{operation=\"%s\"} %d\n",
+                              s.name,
+                              s.total_ns / 1e9,
+                              s.name,
+                              s.calls);
+    }
+
+    for (const StatsGauge& g : gauges)
+    {
+        absl::StrAppendFormat(&result,
+                              "# TYPE securefs_%s %s\nsecurefs_%s %.17g\n",
+                              g.name,
+                              g.counter ? "counter" : "gauge",
+                              g.name,
+                              g.value);
+    }
+    return result;
+}
+
+#ifndef _WIN32
+namespace
+{
+    // The write end of the pipe that wakes up the server, for the signal handler.
+    std::atomic<int> dump_request_fd{-1};
+
+    void request_dump(int)
+    {
+        int saved_errno = errno;
+        int fd = dump_request_fd.load();
+        if (fd >= 0)
+        {
+            char c = 'd';
+            (void)!::write(fd, &c, 1);
+        }
+        errno = saved_errno;
+    }
+
+    sockaddr_un make_address(const std::string& path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            throw_runtime_error("The path of the socket is too long: " + path);
+        }
+        memcpy(addr.sun_path, path.data(), path.size());
+        return addr;
+    }
+
+    int open_socket()
+    {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            THROW_POSIX_EXCEPTION(errno, "socket");
+        }
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+
+    int listen_on(const std::string& path)
+    {
+        auto addr = make_address(path);
+        int fd = open_socket();
+        bool ok = false;
+        DEFER(if (!ok) ::close(fd));
+        // Remove the socket left over by an earlier mount, but nothing else the path may name.
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0)
+        {
+            if (!S_ISSOCK(st.st_mode))
+            {
+                throw_runtime_error(path + " exists and is not a socket");
+            }
+            if (::unlink(path.c_str()) != 0)
+            {
+                THROW_POSIX_EXCEPTION(errno, "unlink " + path);
+            }
+        }
+        else if (errno != ENOENT)
+        {
+            THROW_POSIX_EXCEPTION(errno, "lstat " + path);
+        }
+        // The socket is created with the permissions of the umask, so restrict it before bind
+        // rather than after, when others could already have connected. This runs before the
+        // filesystem is mounted, while no other thread creates files.
+        mode_t old_mask = ::umask(0077);
+        int rc = ::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+        int err = errno;
+        ::umask(old_mask);
+        if (rc != 0)
+        {
+            THROW_POSIX_EXCEPTION(err, "bind " + path);
+        }
+        if (::listen(fd, 4) != 0)
+        {
+            THROW_POSIX_EXCEPTION(errno, "listen " + path);
+        }
+        ok = true;
+        return fd;
+    }
+
+    void write_fully(int fd, const std::string& data)
+    {
+#ifdef MSG_NOSIGNAL
+        constexpr int kFlags = MSG_NOSIGNAL;
+#else
+        constexpr int kFlags = 0;
+#endif
+        size_t written = 0;
+        while (written < data.size())
+        {
+            auto rc = ::send(fd, data.data() + written, data.size() - written, kFlags);
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (rc <= 0)
+            {
+                return;
+            }
+            written += static_cast<size_t>(rc);
+        }
+    }
+}    // namespace
+
+StatsServer::StatsServer(std::string socket_path) : socket_path_(std::move(socket_path))
+{
+    if (!socket_path_.empty())
+    {
+        listen_fd_ = listen_on(socket_path_);
+    }
+    if (::pipe(wake_fds_) != 0)
+    {
+        int err = errno;
+        if (listen_fd_ >= 0)
+        {
+            ::close(listen_fd_);
+        }
+        THROW_POSIX_EXCEPTION(err, "pipe");
+    }
+    for (int fd : wake_fds_)
+    {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    // The signal handler must never block.
+    ::fcntl(wake_fds_[1], F_SETFL, O_NONBLOCK);
+
+    dump_request_fd = wake_fds_[1];
+    struct sigaction action = {};
+    action.sa_handler = &request_dump;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    ::sigaction(SIGUSR1, &action, nullptr);
+
+    thread_ = std::thread([this]() { run(); });
+}
+
+StatsServer::~StatsServer()
+{
+    ::signal(SIGUSR1, SIG_IGN);
+    dump_request_fd = -1;
+    char c = 'q';
+    (void)!::write(wake_fds_[1], &c, 1);
+    thread_.join();
+    ::close(wake_fds_[0]);
+    ::close(wake_fds_[1]);
+    if (listen_fd_ >= 0)
+    {
+        ::close(listen_fd_);
+        ::unlink(socket_path_.c_str());
+    }
+}
+
+void StatsServer::run()
+{
+    while (true)
+    {
+        pollfd fds[2] = {{wake_fds_[0], POLLIN, 0}, {listen_fd_, POLLIN, 0}};
+        int rc = ::poll(fds, listen_fd_ >= 0 ? 2 : 1, -1);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ERROR_LOG("The statistics server stops because poll fails with errno %d", errno);
+            return;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            char c;
+            if (::read(wake_fds_[0], &c, 1) == 1)
+            {
+                if (c == 'q')
+                {
+                    return;
+                }
+                INFO_LOG("Statistics of operations:\n%s",
+                         OperationStats::format_table(OperationStats::snapshot()));
+            }
+        }
+        if (listen_fd_ >= 0 && (fds[1].revents & POLLIN))
+        {
+            int client = ::accept(listen_fd_, nullptr, nullptr);
+            if (client < 0)
+            {
+                continue;
+            }
+            DEFER(::close(client));
+            write_fully(client, OperationStats::format_table(OperationStats::snapshot()));
+        }
+    }
+}
+
+std::string StatsServer::query(const std::string& socket_path)
+{
+    auto addr = make_address(socket_path);
+    int fd = open_socket();
+    DEFER(::close(fd));
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        THROW_POSIX_EXCEPTION(errno, "connect " + socket_path);
+    }
+    std::string result;
+    char buffer[4096];
+    while (true)
+    {
+        auto rc = ::read(fd, buffer, sizeof(buffer));
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc < 0)
+        {
+            THROW_POSIX_EXCEPTION(errno, "read " + socket_path);
+        }
+        if (rc == 0)
+        {
+            return result;
+        }
+        result.append(buffer, static_cast<size_t>(rc));
+    }
+}
+#endif
+}    // namespace securefs::trace
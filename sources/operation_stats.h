@@ -0,0 +1,111 @@
+#pragma once
+#include "myutils.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+/// The counters of one operation, summed over all threads.
+struct OperationSummary
+{
+    // Latencies are bucketed by their highest bits, as in HDR histograms. Every power of two is
+    // split into `kSubBuckets` buckets, so that a bucket is at most 1 / kSubBuckets as wide as the
+    // latencies in it. Latencies beyond 2^kMaxBits ns (about 18 minutes) share the last bucket.
+    static constexpr unsigned kSubBucketBits = 2;
+    static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+    static constexpr unsigned kMaxBits = 40;
+    static constexpr unsigned kNumBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+    static unsigned bucket_of(uint64_t ns) noexcept;
+    /// The largest latency that falls into the bucket.
+    static uint64_t bucket_upper_bound(unsigned bucket) noexcept;
+
+    std::string name;
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, kNumBuckets> buckets{};
+
+    /// An upper bound of the latency below which `fraction` of the calls finished.
+    uint64_t percentile_ns(double fraction) const noexcept;
+};
+
+/// A value reported by a component of the filesystem besides the operations, e.g. the size of a
+/// cache. `counter` tells whether it only ever grows, such as a number of cache hits.
+struct StatsGauge
+{
+    std::string name;
+    double value;
+    bool counter;
+};
+
+/// Counts the calls into the filesystem per operation, with their errors, the bytes they return
+/// and a histogram of their latencies.
+///
+/// Each thread counts into cache line aligned counters of its own, so that recording is a few
+/// uncontended stores. The counters of all threads are only summed up when read.
+class OperationStats
+{
+public:
+    static constexpr size_t kMaxOperations = 64;
+
+    /// Returns the index under which the operation is recorded, or -1 if there are too many.
+    /// `name` must outlive the process, e.g. a string literal.
+    static int register_operation(const char* name);
+
+    static int64_t now_ns() noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /// Counts one call that took `ns` and returned `rc`. A negative `rc` is counted as an error,
+    /// and a positive one as the number of bytes transferred.
+    static void record(int op, int64_t ns, int64_t rc) noexcept;
+
+    /// The operations that were called at least once, in the order they were registered.
+    static std::vector<OperationSummary> snapshot();
+
+    /// Renders a snapshot as a table for humans.
+    static std::string format_table(const std::vector<OperationSummary>& summaries);
+    /// Renders a snapshot and the gauges as a JSON object.
+    static std::string format_json(const std::vector<OperationSummary>& summaries,
+                                   const std::vector<StatsGauge>& gauges);
+    /// Renders a snapshot and the gauges in the text format of Prometheus.
+    static std::string format_prometheus(const std::vector<OperationSummary>& summaries,
+                                         const std::vector<StatsGauge>& gauges);
+};
+
+#ifndef _WIN32
+/// Serves the table of `OperationStats` to every client that connects to a unix socket, and
+/// writes it to the log whenever the process receives SIGUSR1.
+class StatsServer
+{
+public:
+    /// No socket is created if `socket_path` is empty.
+    explicit StatsServer(std::string socket_path);
+    ~StatsServer();
+    DISABLE_COPY_MOVE(StatsServer)
+
+    /// Reads the table from the socket of a running server.
+    static std::string query(const std::string& socket_path);
+
+private:
+    std::string socket_path_;
+    int listen_fd_ = -1;
+    int wake_fds_[2] = {-1, -1};
+    std::thread thread_;
+
+    void run();
+};
+#endif
+}    // namespace securefs::trace
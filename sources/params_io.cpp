@@ -33,6 +33,43 @@ namespace
     const char* const PBKDF_ALGO_SCRYPT = "scrypt";
     const char* const PBKDF_ALGO_ARGON2ID = "argon2id";
     constexpr size_t kParamIvSize = 12, kParamMacSize = 16, kParamSaltSize = 32;
+    constexpr std::string_view kHashIndexedDirectoriesFeature = "hash_indexed_directories";
+
+    // Lists the features that versions without them cannot read, and moves the parameters to
+    // where those versions fail on them.
+    DecryptedSecurefsParams gate_features(DecryptedSecurefsParams params)
+    {
+        if (params.has_full_format_params()
+            && params.full_format_params().hash_indexed_directories())
+        {
+            params.add_required_features(std::string(kHashIndexedDirectoriesFeature));
+        }
+        if (params.required_features_size() > 0 && params.has_full_format_params())
+        {
+            params.set_allocated_gated_full_format_params(params.release_full_format_params());
+        }
+        return params;
+    }
+
+    // The inverse of `gate_features`. Refuses the features unknown to this version.
+    void ungate_features(DecryptedSecurefsParams& params)
+    {
+        for (const std::string& feature : params.required_features())
+        {
+            if (feature != kHashIndexedDirectoriesFeature)
+            {
+                throw_runtime_error(
+                    absl::StrFormat("The repository requires the feature \"%s\", which this "
+                                    "version of securefs does not support",
+                                    feature));
+            }
+        }
+        params.clear_required_features();
+        if (params.has_gated_full_format_params())
+        {
+            params.set_allocated_full_format_params(params.release_gated_full_format_params());
+        }
+    }
 
     key_type legacy_compute_password_derived_key(const LegacySecurefsJsonParams& legacy,
                                                  absl::Span<const byte> password,
@@ -305,6 +342,7 @@ DecryptedSecurefsParams decrypt(const EncryptedSecurefsParams& encparams,
         throw_runtime_error(
             "The config file has an invalid format, even though it decrypted successfully");
     }
+    ungate_features(result);
     return result;
 }
 
@@ -319,7 +357,7 @@ EncryptedSecurefsParams encrypt(const DecryptedSecurefsParams& decparams,
     result.mutable_mac()->resize(kParamMacSize);
     result.mutable_argon2id_params()->CopyFrom(argon2id_params);
 
-    auto plaintext = decparams.SerializeAsString();
+    auto plaintext = gate_features(decparams).SerializeAsString();
     result.mutable_ciphertext()->resize(plaintext.size());
 
     auto wrapping_key = compute_password_derived_key(result, password, key_stream);
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace securefs
+{
+/**
+ * A value published under a sequence lock.
+ *
+ * Readers never block writers, and never wait for anything longer than the copy of the value,
+ * so a value published by the holder of a long held lock stays readable without that lock.
+ * Writers must be serialized by the caller. The value is stored in atomic words, so that a read
+ * racing with a write is well defined, and discarded by the sequence check.
+ */
+template <class T>
+class SeqLocked
+{
+    static_assert(std::is_trivially_copyable_v<T>, "The value is copied bytewise");
+
+private:
+    static constexpr inline size_t kNumWords
+        = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    // Odd while a write is in progress.
+    std::atomic<uint64_t> m_seq{0};
+    std::atomic<bool> m_valid{false};
+    std::array<std::atomic<uint64_t>, kNumWords> m_words{};
+
+    template <class Fn>
+    void write(Fn&& fn) noexcept
+    {
+        auto seq = m_seq.load(std::memory_order_relaxed);
+        m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        fn();
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+public:
+    void store(const T& value) noexcept
+    {
+        uint64_t words[kNumWords] = {};
+        memcpy(words, &value, sizeof(T));
+        write(
+            [&]()
+            {
+                for (size_t i = 0; i < kNumWords; ++i)
+                {
+                    m_words[i].store(words[i], std::memory_order_relaxed);
+                }
+                m_valid.store(true, std::memory_order_relaxed);
+            });
+    }
+
+    /// Makes `load()` fail until the next `store()`.
+    void reset() noexcept
+    {
+        write([&]() { m_valid.store(false, std::memory_order_relaxed); });
+    }
+
+    /// Returns false if nothing has been stored since construction or the last `reset()`.
+    bool load(T& out) const noexcept
+    {
+        uint64_t words[kNumWords];
+        bool valid;
+        while (true)
+        {
+            auto seq = m_seq.load(std::memory_order_acquire);
+            if (seq & 1u)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            valid = m_valid.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < kNumWords; ++i)
+            {
+                words[i] = m_words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_seq.load(std::memory_order_relaxed) == seq)
+            {
+                break;
+            }
+        }
+        if (!valid)
+        {
+            return false;
+        }
+        memcpy(&out, words, sizeof(T));
+        return true;
+    }
+};
+}    // namespace securefs
@@ -2,6 +2,7 @@
 #include "crypto.h"
 #include "exceptions.h"
 #include "myutils.h"
+#include "trace_events.h"
 
 #include <algorithm>
 #include <array>
@@ -379,6 +380,7 @@ namespace internal
             auto* data_buffer = buffer.data();
             auto data_buffer_size = m_block_size * (end_block - start_block) + end_residue;
             auto* meta_buffer = buffer.data() + data_buffer_size;
+            trace::ScopedSpan span("stage", "gcm_encrypt", data_buffer_size);
             for (length_type i = 0; i < data_buffer_size;)
             {
                 assert(data_buffer <= buffer.data() + data_buffer_size);
@@ -405,6 +407,7 @@ namespace internal
                 input = static_cast<const byte*>(input) + this_block_size;
                 i += this_block_size;
             }
+            span.finish();
             m_stream->write(buffer.data(), start_block * m_block_size, data_buffer_size);
             m_metastream.write(buffer.data() + data_buffer_size,
                                meta_position_for_iv(start_block),
@@ -436,6 +439,7 @@ namespace internal
                 throw MessageVerificationException(id(), start_block * m_block_size);
             }
             memset(output, 0, data_buffer_size);
+            trace::ScopedSpan span("stage", "gcm_decrypt", data_read_len);
 
             for (length_type i = 0; i < data_read_len;)
             {
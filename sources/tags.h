@@ -44,4 +44,13 @@ struct tCaseInsensitive
 struct tEnableSymlink
 {
 };
+struct tAttrCacheTimeout
+{
+};
+struct tMaxCachedFiles
+{
+};
+struct tKernelCacheTimeout
+{
+};
 }    // namespace securefs
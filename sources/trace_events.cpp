@@ -0,0 +1,259 @@
+#include "trace_events.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+namespace
+{
+    struct SpanEvent
+    {
+        const char* category;
+        const char* name;
+        int64_t start_ns;
+        int64_t end_ns;
+        uint64_t size;
+        int error;
+    };
+
+    // About a second of spans of a busy thread. Spans beyond it are dropped until the writer
+    // catches up, so that a stalled disk cannot make the buffers grow without bound.
+    constexpr size_t kMaxBufferedSpans = 1 << 16;
+
+    struct ThreadSpans
+    {
+        // Numbered in the order the threads first record a span, as the OS thread ids are not
+        // portably available as numbers.
+        explicit ThreadSpans(uint64_t tid) : tid(tid) {}
+
+        const uint64_t tid;
+        Mutex mu;
+        std::vector<SpanEvent> events ABSL_GUARDED_BY(mu);
+        uint64_t dropped ABSL_GUARDED_BY(mu) = 0;
+    };
+
+    class Writer
+    {
+    public:
+        static Writer& get()
+        {
+            static Writer instance;
+            return instance;
+        }
+
+        Mutex mu;
+        std::vector<std::shared_ptr<ThreadSpans>> threads ABSL_GUARDED_BY(mu);
+        uint64_t next_tid ABSL_GUARDED_BY(mu) = 1;
+        bool stopping ABSL_GUARDED_BY(mu) = false;
+
+        // Only touched by `start()`, `stop()` and the writer thread in between.
+        FILE* fp = nullptr;
+        int64_t origin_ns = 0;
+        std::thread thread;
+
+        void run();
+
+    private:
+        Writer() = default;
+        DISABLE_COPY_MOVE(Writer)
+
+        void append(std::string* out, const SpanEvent& e, uint64_t tid) const;
+    };
+
+    ThreadSpans& local_spans()
+    {
+        thread_local std::shared_ptr<ThreadSpans> local = []()
+        {
+            auto& writer = Writer::get();
+            LockGuard<Mutex> lg(writer.mu);
+            auto spans = std::make_shared<ThreadSpans>(writer.next_tid++);
+            writer.threads.push_back(spans);
+            return spans;
+        }();
+        return *local;
+    }
+
+    void Writer::append(std::string* out, const SpanEvent& e, uint64_t tid) const
+    {
+        // Chrome trace events count microseconds from an arbitrary origin.
+        absl::StrAppendFormat(out,
+                              ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                              "\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{",
+                              e.name,
+                              e.category,
+                              (e.start_ns - origin_ns) / 1e3,
+                              (e.end_ns - e.start_ns) / 1e3,
+                              tid);
+        const char* separator = "";
+        if (e.size > 0)
+        {
+            absl::StrAppendFormat(out, "\"size\":%d", e.size);
+            separator = ",";
+        }
+        if (e.error != 0)
+        {
+            absl::StrAppendFormat(out, "%s\"error\":%d", separator, e.error);
+        }
+        out->append("}}");
+    }
+
+    void Writer::run()
+    {
+        std::string out;
+        std::vector<SpanEvent> batch;
+        std::vector<std::shared_ptr<ThreadSpans>> snapshot;
+        while (true)
+        {
+            bool stop;
+            {
+                LockGuard<Mutex> lg(mu);
+                // The recording threads never wake us up, as that would cost them a lock.
+                mu.AwaitWithTimeout(absl::Condition(&stopping), absl::Milliseconds(100));
+                stop = stopping;
+                snapshot = threads;
+            }
+
+            for (auto& spans : snapshot)
+            {
+                uint64_t dropped;
+                {
+                    LockGuard<Mutex> lg(spans->mu);
+                    // The swap hands the capacity of the last batch back to the thread.
+                    batch.swap(spans->events);
+                    dropped = spans->dropped;
+                    spans->dropped = 0;
+                }
+                for (const SpanEvent& e : batch)
+                {
+                    append(&out, e, spans->tid);
+                }
+                batch.clear();
+                if (dropped > 0)
+                {
+                    WARN_LOG("%d spans of thread %d were dropped because the writer fell behind",
+                             dropped,
+                             spans->tid);
+                }
+            }
+            if (!out.empty())
+            {
+                fwrite(out.data(), 1, out.size(), fp);
+                fflush(fp);
+                out.clear();
+            }
+
+            snapshot.clear();
+            {
+                // Forget the buffers of exited threads once they are drained.
+                LockGuard<Mutex> lg(mu);
+                threads.erase(std::remove_if(threads.begin(),
+                                             threads.end(),
+                                             [](const std::shared_ptr<ThreadSpans>& spans)
+                                             {
+                                                 if (spans.use_count() != 1)
+                                                 {
+                                                     return false;
+                                                 }
+                                                 LockGuard<Mutex> lg(spans->mu);
+                                                 return spans->events.empty();
+                                             }),
+                              threads.end());
+            }
+            if (stop)
+            {
+                return;
+            }
+        }
+    }
+}    // namespace
+
+void TraceEvents::start(const std::string& path)
+{
+    if (enabled())
+    {
+        throw_runtime_error("Trace events are already being recorded");
+    }
+    auto& writer = Writer::get();
+#ifdef _WIN32
+    FILE* fp = _wfopen(widen_string(path).c_str(), L"w");
+#else
+    FILE* fp = fopen(path.c_str(), "w");
+#endif
+    if (!fp)
+        THROW_POSIX_EXCEPTION(errno, path);
+    // Every later event is preceded by a comma, so that the array stays valid up to the last
+    // complete event should the process die before `stop()`.
+    fputs("[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"securefs\"}}",
+          fp);
+    writer.fp = fp;
+    writer.origin_ns = OperationStats::now_ns();
+    {
+        LockGuard<Mutex> lg(writer.mu);
+        writer.stopping = false;
+        // Spans that raced with the last `stop()` belong to no file.
+        for (auto& spans : writer.threads)
+        {
+            LockGuard<Mutex> inner(spans->mu);
+            spans->events.clear();
+            spans->dropped = 0;
+        }
+    }
+    writer.thread = std::thread([&writer]() { writer.run(); });
+    enabled_.store(true, std::memory_order_release);
+}
+
+void TraceEvents::stop() noexcept
+{
+    if (!enabled_.exchange(false))
+    {
+        return;
+    }
+    auto& writer = Writer::get();
+    {
+        LockGuard<Mutex> lg(writer.mu);
+        writer.stopping = true;
+    }
+    writer.thread.join();
+    fputs("\n]\n", writer.fp);
+    fclose(writer.fp);
+    writer.fp = nullptr;
+}
+
+void TraceEvents::record(const char* category,
+                         const char* name,
+                         int64_t start_ns,
+                         int64_t end_ns,
+                         uint64_t size,
+                         int error) noexcept
+{
+    if (!enabled())
+    {
+        return;
+    }
+    try
+    {
+        auto& spans = local_spans();
+        LockGuard<Mutex> lg(spans.mu);
+        if (spans.events.size() >= kMaxBufferedSpans)
+        {
+            ++spans.dropped;
+            return;
+        }
+        spans.events.push_back(SpanEvent{category, name, start_ns, end_ns, size, error});
+    }
+    catch (...)
+    {
+        // Tracing must never fail the traced operation.
+    }
+}
+}    // namespace securefs::trace
@@ -0,0 +1,78 @@
+#pragma once
+#include "myutils.h"
+#include "operation_stats.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace securefs::trace
+{
+/// Records spans of time, such as the FUSE operations and the stages inside them, and writes them
+/// to a file as Chrome trace events, which chrome://tracing and https://ui.perfetto.dev show as a
+/// timeline. Spans of one thread nest by time, so a stage shows up under the operation it is in.
+///
+/// Each thread buffers its spans on its own, and a background thread writes them out, so that
+/// recording takes no lock shared with other threads. Nothing is recorded unless started.
+class TraceEvents
+{
+public:
+    /// Starts writing spans to `path`, truncating it. Must be called after any `fork()`.
+    static void start(const std::string& path);
+    /// Writes out the remaining spans and closes the file.
+    static void stop() noexcept;
+
+    static bool enabled() noexcept { return enabled_.load(std::memory_order_relaxed); }
+
+    /// Records a span. `category` and `name` must outlive the process, e.g. string literals.
+    /// `size` is the number of bytes processed and `error` the error number, if any.
+    static void record(const char* category,
+                       const char* name,
+                       int64_t start_ns,
+                       int64_t end_ns,
+                       uint64_t size,
+                       int error) noexcept;
+
+private:
+    inline static std::atomic<bool> enabled_{false};
+};
+
+/// Records a span from its construction to its destruction, if `TraceEvents` is started. Costs a
+/// relaxed load otherwise.
+class ScopedSpan
+{
+public:
+    ScopedSpan(const char* category, const char* name, uint64_t size = 0) noexcept
+        : category_(category)
+        , name_(name)
+        , size_(size)
+        , start_ns_(TraceEvents::enabled() ? OperationStats::now_ns() : -1)
+    {
+    }
+
+    ~ScopedSpan() { finish(); }
+
+    DISABLE_COPY_MOVE(ScopedSpan)
+
+    /// Ends the span before the end of the scope. Later calls have no effect.
+    void finish() noexcept
+    {
+        if (start_ns_ >= 0)
+        {
+            TraceEvents::record(
+                category_, name_, start_ns_, OperationStats::now_ns(), size_, error_);
+            start_ns_ = -1;
+        }
+    }
+
+    void set_size(uint64_t size) noexcept { size_ = size; }
+    void set_error(int error) noexcept { error_ = error; }
+
+private:
+    const char* category_;
+    const char* name_;
+    uint64_t size_;
+    int error_ = 0;
+    int64_t start_ns_;
+};
+}    // namespace securefs::trace
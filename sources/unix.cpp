@@ -4,6 +4,7 @@
 #include "lock_enabled.h"
 #include "logger.h"
 #include "platform.h"
+#include "trace_events.h"
 
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
@@ -94,6 +95,7 @@ public:
 
     length_type read(void* output, offset_type offset, length_type length) override
     {
+        trace::ScopedSpan span("stage", "pread", length);
         auto rc = ::pread(m_fd, output, length, offset);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "pread");
@@ -110,6 +112,7 @@ public:
 
     void write(const void* input, offset_type offset, length_type length) override
     {
+        trace::ScopedSpan span("stage", "pwrite", length);
         auto rc = ::pwrite(m_fd, input, length, offset);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "pwrite");
@@ -3,6 +3,7 @@
 #include "lock_enabled.h"
 #include "logger.h"
 #include "platform.h"
+#include "trace_events.h"
 
 #include <absl/container/inlined_vector.h>
 #include <absl/strings/str_cat.h>
@@ -674,6 +675,7 @@ public:
 
     length_type read(void* output, offset_type offset, length_type length) override
     {
+        trace::ScopedSpan span("stage", "pread", length);
         length_type total = 0;
         while (length > MAX_SINGLE_BLOCK)
         {
@@ -707,6 +709,7 @@ public:
 
     void write(const void* input, offset_type offset, length_type length) override
     {
+        trace::ScopedSpan span("stage", "pwrite", length);
         while (length > MAX_SINGLE_BLOCK)
         {
             write32(input, offset, MAX_SINGLE_BLOCK);
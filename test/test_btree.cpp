@@ -1,15 +1,19 @@
 #include "btree_dir.h"
 #include "crypto.h"
+#include "hash_dir.h"
 #include "myutils.h"
 #include "test_common.h"
 
 #include <algorithm>
 #include <limits>
+#include <memory>
 #include <random>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include <absl/strings/str_format.h>
 #include <cryptopp/rng.h>
 #include <doctest/doctest.h>
 #include <uni_algo/all.h>
@@ -35,6 +39,62 @@ namespace
         return una::utf32to8({buffer.data(), buffer.size()});
     }
 
+    // Lists the directory in chunks of `chunk_size`, each resuming from the last cookie seen.
+    std::vector<std::string> list_in_chunks(Directory& dir, size_t chunk_size)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(dir)
+    {
+        std::vector<std::string> names;
+        uint64_t cookie = 0;
+        while (true)
+        {
+            size_t count = 0;
+            dir.iterate_over_entries_from(cookie,
+                                          [&](const std::string& name,
+                                              const id_type&,
+                                              int,
+                                              uint64_t next_cookie)
+                                          {
+                                              REQUIRE(next_cookie != 0);
+                                              names.push_back(name);
+                                              cookie = next_cookie;
+                                              return ++count < chunk_size;
+                                          });
+            if (count < chunk_size)
+                return names;
+        }
+    }
+
+    // Lists the directory in chunks like `list_in_chunks`, but removes the entries of each chunk
+    // before resuming, as `rm -r` does between its readdir calls.
+    std::vector<std::string> list_while_removing(Directory& dir, size_t chunk_size)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(dir)
+    {
+        std::vector<std::string> names;
+        uint64_t cookie = 0;
+        while (true)
+        {
+            size_t count = 0;
+            dir.iterate_over_entries_from(cookie,
+                                          [&](const std::string& name,
+                                              const id_type&,
+                                              int,
+                                              uint64_t next_cookie)
+                                          {
+                                              names.push_back(name);
+                                              cookie = next_cookie;
+                                              return ++count < chunk_size;
+                                          });
+            for (size_t i = names.size() - count; i < names.size(); ++i)
+            {
+                id_type id;
+                int type;
+                REQUIRE(dir.remove_entry(names[i], id, type));
+            }
+            if (count < chunk_size)
+                return names;
+        }
+    }
+
     void test(BtreeDirectory& dir,
               Directory& reference,
               unsigned rounds,
@@ -111,6 +171,15 @@ namespace
             {
                 REQUIRE(dir.validate_free_list());
                 REQUIRE(dir.validate_btree_structure());
+
+                filenames.clear();
+                dir.iterate_over_entries(inserter);
+                for (size_t chunk_size : {1, 5, 100})
+                {
+                    bool equal_listing = list_in_chunks(dir, chunk_size) == filenames;
+                    REQUIRE(equal_listing);
+                    REQUIRE(list_in_chunks(reference, chunk_size).size() == filenames.size());
+                }
             }
         }
     }
@@ -134,6 +203,10 @@ namespace
         unsigned rounds = 50;
 #endif
 
+        // A budget this small makes every operation evict nodes, so the directories below
+        // constantly reload them from disk.
+        BtreeNodeBudget budget(1);
+
         {
             BtreeDirectory dir(cmp,
                                service.open_file_stream(tmp1, flags, 0644),
@@ -144,7 +217,8 @@ namespace
                                8000,
                                12,
                                max_padding_size,
-                               false);
+                               false,
+                               budget);
             SimpleDirectory ref_dir(cmp,
                                     service.open_file_stream(tmp3, flags, 0644),
                                     service.open_file_stream(tmp4, flags, 0644),
@@ -173,7 +247,8 @@ namespace
                                8000,
                                12,
                                max_padding_size,
-                               false);
+                               false,
+                               budget);
             SimpleDirectory ref_dir(cmp,
                                     service.open_file_stream(tmp3, O_RDWR, 0),
                                     service.open_file_stream(tmp4, O_RDWR, 0),
@@ -189,6 +264,315 @@ namespace
             dir.flush();
             ref_dir.flush();
         }
+        CHECK(budget.num_nodes() == 0);
+    }
+
+    void test_btree_add_entries(Directory::DirNameComparison cmp)
+    {
+        key_type key(0x3e);
+        id_type null_id{};
+
+        OSService service("tmp");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+        BtreeNodeBudget budget;
+        BtreeDirectory dir(cmp,
+                           service.open_file_stream(service.temp_name("btree", "1"), flags, 0644),
+                           service.open_file_stream(service.temp_name("btree", "2"), flags, 0644),
+                           key,
+                           null_id,
+                           true,
+                           8000,
+                           12,
+                           0,
+                           false,
+                           budget);
+        SimpleDirectory ref_dir(
+            cmp,
+            service.open_file_stream(service.temp_name("btree", "3"), flags, 0644),
+            service.open_file_stream(service.temp_name("btree", "4"), flags, 0644),
+            key,
+            null_id,
+            true,
+            8000,
+            12,
+            0,
+            false);
+        DoubleFileLockGuard dflg(dir, ref_dir);
+
+        std::uniform_int_distribution<int> name_size_dist(0, 20);
+        auto add_batch = [&](size_t size)
+        {
+            std::vector<DirEntry> batch;
+            size_t num_added_prime = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                DirEntry e;
+                e.filename = random_unicode_string(name_size_dist(get_random_number_engine()));
+                generate_random(e.id.data(), e.id.size());
+                e.type = S_IFREG;
+                num_added_prime += ref_dir.add_entry(e.filename, e.id, e.type);
+                batch.push_back(std::move(e));
+                if (i % 7 == 0)
+                {
+                    // A duplicate within the batch, which must be skipped
+                    batch.push_back(batch.back());
+                    generate_random(batch.back().id.data(), batch.back().id.size());
+                }
+            }
+            CHECK(dir.add_entries(std::move(batch)) == num_added_prime);
+            REQUIRE(dir.validate_free_list());
+            REQUIRE(dir.validate_btree_structure());
+        };
+
+        // The first and the large batch are bulk loaded, the small ones are inserted one by one.
+        add_batch(BTREE_MAX_NUM_ENTRIES);
+        add_batch(1);
+        add_batch(5);
+        test(dir, ref_dir, 20, 0.5, 0.3, 0.2, 1);
+        add_batch(3000);
+        add_batch(50);
+        test(dir, ref_dir, 50, 0.3, 0.3, 0.3, 2);
+        dir.rebuild();
+        REQUIRE(dir.validate_btree_structure());
+        test(dir, ref_dir, 50, 0.3, 0.3, 0.3, 3);
+    }
+
+    void test_hash_dir(Directory::DirNameComparison cmp)
+    {
+        key_type key(0x3e);
+        id_type null_id{};
+
+        OSService service("tmp");
+        auto tmp1 = service.temp_name("hashdir", "1");
+        auto tmp2 = service.temp_name("hashdir", "2");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+
+        SimpleDirectory ref_dir(
+            cmp,
+            service.open_file_stream(service.temp_name("hashdir", "3"), flags, 0644),
+            service.open_file_stream(service.temp_name("hashdir", "4"), flags, 0644),
+            key,
+            null_id,
+            true,
+            8000,
+            12,
+            0,
+            false);
+        FileLockGuard ref_lg(ref_dir);
+
+        auto sorted_names = [](Directory& dir) ABSL_EXCLUSIVE_LOCKS_REQUIRED(dir)
+        {
+            std::vector<std::string> names;
+            dir.iterate_over_entries([&](const std::string& name, const id_type&, int)
+                                     { names.push_back(name); });
+            std::sort(names.begin(), names.end());
+            return names;
+        };
+
+        std::uniform_int_distribution<int> name_size_dist(0, 30);
+        std::uniform_real_distribution<> prob_dist(0, 1);
+        std::vector<std::string> filenames;
+        {
+            HashDirectory dir(cmp,
+                              service.open_file_stream(tmp1, flags, 0644),
+                              service.open_file_stream(tmp2, flags, 0644),
+                              key,
+                              null_id,
+                              true,
+                              8000,
+                              12,
+                              0,
+                              false);
+            FileLockGuard lg(dir);
+            CHECK(dir.empty());
+
+            id_type id, id_prime;
+            int type, type_prime;
+            for (int i = 0; i < 5000; ++i)
+            {
+                // Mostly insertions, so that buckets keep splitting
+                if (prob_dist(get_random_number_engine()) < 0.8 || filenames.empty())
+                {
+                    auto name = random_unicode_string(name_size_dist(get_random_number_engine()));
+                    generate_random(id.data(), id.size());
+                    type = FileBase::REGULAR_FILE;
+                    bool added = dir.add_entry(name, id, type);
+                    REQUIRE(added == ref_dir.add_entry(name, id, type));
+                    filenames.push_back(std::move(name));
+                }
+                else
+                {
+                    std::uniform_int_distribution<size_t> index_dist(0, filenames.size() - 1);
+                    size_t idx = index_dist(get_random_number_engine());
+                    bool removed = dir.remove_entry(filenames[idx], id, type);
+                    REQUIRE(removed
+                            == ref_dir.remove_entry(filenames[idx], id_prime, type_prime));
+                    if (removed)
+                    {
+                        bool id_equal = id == id_prime;
+                        REQUIRE(id_equal);
+                    }
+                    filenames.erase(filenames.begin() + idx);
+                }
+            }
+            REQUIRE(dir.validate());
+            bool equal_names = sorted_names(dir) == sorted_names(ref_dir);
+            REQUIRE(equal_names);
+            dir.flush();
+        }
+        {
+            // Test if the data persists on the disk
+            HashDirectory dir(cmp,
+                              service.open_file_stream(tmp1, O_RDWR, 0),
+                              service.open_file_stream(tmp2, O_RDWR, 0),
+                              key,
+                              null_id,
+                              true,
+                              8000,
+                              12,
+                              0,
+                              false);
+            FileLockGuard lg(dir);
+            REQUIRE(dir.validate());
+            CHECK(!dir.empty());
+            auto names = sorted_names(dir);
+            bool equal_names = names == sorted_names(ref_dir);
+            REQUIRE(equal_names);
+
+            id_type id, id_prime;
+            int type, type_prime;
+            for (const std::string& name : names)
+            {
+                auto got = dir.get_entry(name, id, type);
+                REQUIRE(got == ref_dir.get_entry(name, id_prime, type_prime));
+                bool id_equal = id == id_prime;
+                REQUIRE(id_equal);
+                REQUIRE(type == type_prime);
+            }
+            for (size_t chunk_size : {1, 7, 1000})
+            {
+                auto chunked = list_in_chunks(dir, chunk_size);
+                std::sort(chunked.begin(), chunked.end());
+                bool equal_listing = chunked == names;
+                REQUIRE(equal_listing);
+            }
+        }
+    }
+
+    TEST_CASE("Resume listings of directories while removing entries")
+    {
+        key_type key(0x3e);
+        OSService service("tmp");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+        Directory::DirNameComparison cmp{binary_compare};
+        BtreeNodeBudget budget(1);
+        std::vector<std::string> names;
+        for (int i = 0; i < 1000; ++i)
+            names.push_back(absl::StrFormat("%08d", i));
+
+        auto check = [&](Directory& dir)
+        {
+            FileLockGuard lg(dir);
+            for (const std::string& name : names)
+            {
+                id_type id;
+                generate_random(id.data(), id.size());
+                REQUIRE(dir.add_entry(name, id, S_IFREG));
+            }
+            auto listed = list_while_removing(dir, 7);
+            std::sort(listed.begin(), listed.end());
+            bool equal_listing = listed == names;
+            CHECK(equal_listing);
+            CHECK(dir.empty());
+        };
+        auto open_streams = [&]()
+        {
+            return std::make_pair(
+                service.open_file_stream(service.temp_name("btree", "1"), flags, 0644),
+                service.open_file_stream(service.temp_name("btree", "2"), flags, 0644));
+        };
+        {
+            auto [data, meta] = open_streams();
+            BtreeDirectory dir(
+                cmp, data, meta, key, id_type{}, true, 8000, 12, 0, false, budget);
+            check(dir);
+        }
+        {
+            auto [data, meta] = open_streams();
+            SimpleDirectory dir(cmp, data, meta, key, id_type{}, true, 8000, 12, 0, false);
+            check(dir);
+        }
+        {
+            auto [data, meta] = open_streams();
+            HashDirectory dir(cmp, data, meta, key, id_type{}, true, 8000, 12, 0, false);
+            check(dir);
+        }
+    }
+
+    TEST_CASE("B-tree node budget across directories")
+    {
+        key_type key(0x3e);
+        OSService service("tmp");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+        BtreeNodeBudget budget(300);
+        auto make_dir = [&]()
+        {
+            return std::make_unique<BtreeDirectory>(
+                Directory::DirNameComparison{binary_compare},
+                service.open_file_stream(service.temp_name("btree", "1"), flags, 0644),
+                service.open_file_stream(service.temp_name("btree", "2"), flags, 0644),
+                key,
+                id_type{},
+                true,
+                8000,
+                12,
+                0,
+                false,
+                budget);
+        };
+        auto fill = [](BtreeDirectory& dir, int count)
+        {
+            FileLockGuard lg(dir);
+            for (int i = 0; i < count; ++i)
+            {
+                id_type id;
+                generate_random(id.data(), id.size());
+                REQUIRE(dir.add_entry(absl::StrFormat("%08d", i * 7919 % count), id, S_IFREG));
+            }
+            dir.flush();
+        };
+
+        auto idle = make_dir();
+        fill(*idle, 1500);
+        // The idle directory keeps its nodes while the budget has room.
+        REQUIRE(!budget.is_exceeded());
+        REQUIRE(budget.num_nodes() > 50);
+        {
+            auto busy = make_dir();
+            fill(*busy, 3000);
+        }
+        // The busy directory exceeded the budget, which took the nodes of the idle one first.
+        CHECK(budget.num_nodes() == 0);
+        {
+            FileLockGuard lg(*idle);
+            id_type id;
+            int type;
+            CHECK(idle->get_entry("00000042", id, type).has_value());
+        }
+    }
+
+    TEST_CASE("Test HashDirectory")
+    {
+        test_hash_dir({binary_compare});
+        test_hash_dir({case_insensitive_compare});
+        test_hash_dir({uni_norm_insensitive_compare});
+        test_hash_dir({case_uni_norm_insensitve_compare});
+    }
+
+    TEST_CASE("Batched insertion into BtreeDirectory")
+    {
+        test_btree_add_entries({binary_compare});
+        test_btree_add_entries({case_insensitive_compare});
     }
 
     TEST_CASE("Test BtreeDirectory")
@@ -11,6 +11,8 @@
 
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -126,6 +128,176 @@ namespace
         REQUIRE(ops.vgetxattr(path, name, result.data(), result.size(), 0, nullptr) > 0);
         return result;
     }
+
+#ifndef _WIN32
+    // Stands in for a request read from a mounted session, and keeps what is replied to it.
+    struct FakeRequest
+    {
+        fuse_ctx ctx{};
+        std::optional<int> error;
+        std::optional<fuse_entry_param> entry;
+        std::optional<fuse_stat> attr;
+        std::string buf;
+
+        fuse_req_t req() { return reinterpret_cast<fuse_req_t>(this); }
+        static FakeRequest& of(fuse_req_t req) { return *reinterpret_cast<FakeRequest*>(req); }
+    };
+
+    // Directory entries are packed as node id, next offset, name length and name, which is
+    // simpler to parse than what libfuse packs.
+    struct FakeDirent
+    {
+        uint64_t ino;
+        int64_t off;
+        uint32_t namelen;
+    };
+
+    FuseLowLevelReplies fake_replies()
+    {
+        FuseLowLevelReplies r;
+        r.err = [](fuse_req_t req, int err)
+        {
+            FakeRequest::of(req).error = err;
+            return 0;
+        };
+        r.entry = [](fuse_req_t req, const fuse_entry_param* e)
+        {
+            FakeRequest::of(req).entry = *e;
+            return 0;
+        };
+        r.create = [](fuse_req_t req, const fuse_entry_param* e, const fuse_file_info* info)
+        {
+            FakeRequest::of(req).entry = *e;
+            return 0;
+        };
+        r.attr = [](fuse_req_t req, const fuse_stat* st, double timeout)
+        {
+            FakeRequest::of(req).attr = *st;
+            return 0;
+        };
+        r.readlink = [](fuse_req_t req, const char* link)
+        {
+            FakeRequest::of(req).buf = link;
+            return 0;
+        };
+        r.open = [](fuse_req_t req, const fuse_file_info* info) { return 0; };
+        r.write = [](fuse_req_t req, size_t count) { return 0; };
+        r.buf = [](fuse_req_t req, const char* buf, size_t size)
+        {
+            FakeRequest::of(req).buf.assign(buf, size);
+            return 0;
+        };
+        r.statfs = [](fuse_req_t req, const fuse_statvfs* buf) { return 0; };
+        r.xattr = [](fuse_req_t req, size_t count) { return 0; };
+        r.req_ctx = [](fuse_req_t req) -> const fuse_ctx* { return &FakeRequest::of(req).ctx; };
+        r.add_direntry = [](fuse_req_t req,
+                            char* buf,
+                            size_t size,
+                            const char* name,
+                            const fuse_stat* st,
+                            fuse_off_t off) -> size_t
+        {
+            FakeDirent dirent{
+                static_cast<uint64_t>(st->st_ino), off, static_cast<uint32_t>(strlen(name))};
+            size_t entry_size = sizeof(dirent) + dirent.namelen;
+            if (entry_size <= size)
+            {
+                memcpy(buf, &dirent, sizeof(dirent));
+                memcpy(buf + sizeof(dirent), name, dirent.namelen);
+            }
+            return entry_size;
+        };
+        return r;
+    }
+
+    fuse_ino_t ll_lookup(FuseLowLevelOpsBase& ops, fuse_ino_t parent, const char* name)
+    {
+        FakeRequest r;
+        REQUIRE(ops.vlookup(r.req(), parent, name) == 0);
+        REQUIRE(r.entry.has_value());
+        return r.entry->ino;
+    }
+
+    fuse_ino_t ll_mkdir(FuseLowLevelOpsBase& ops, fuse_ino_t parent, const char* name)
+    {
+        FakeRequest r;
+        REQUIRE(ops.vmkdir(r.req(), parent, name, 0755) == 0);
+        REQUIRE(r.entry.has_value());
+        CHECK(S_ISDIR(r.entry->attr.st_mode));
+        return r.entry->ino;
+    }
+
+    void ll_create(FuseLowLevelOpsBase& ops, fuse_ino_t parent, const char* name, const char* data)
+    {
+        FakeRequest r;
+        fuse_file_info info{};
+        info.flags = O_RDWR;
+        REQUIRE(ops.vcreate(r.req(), parent, name, 0644, &info) == 0);
+        REQUIRE(r.entry.has_value());
+        FakeRequest w;
+        CHECK(ops.vwrite(w.req(), r.entry->ino, data, strlen(data), 0, &info) == strlen(data));
+        FakeRequest rel;
+        REQUIRE(ops.vrelease(rel.req(), r.entry->ino, &info) == 0);
+        ops.vforget(r.entry->ino, 1);
+    }
+
+    fuse_stat ll_getattr(FuseLowLevelOpsBase& ops, fuse_ino_t ino)
+    {
+        FakeRequest r;
+        REQUIRE(ops.vgetattr(r.req(), ino, nullptr) == 0);
+        REQUIRE(r.attr.has_value());
+        return *r.attr;
+    }
+
+    using LowLevelListDirResult = std::vector<std::pair<std::string, fuse_ino_t>>;
+
+    // Reads the directory in calls of at most `size` bytes, each resuming from the offset of the
+    // last entry of the previous one, as the kernel does.
+    LowLevelListDirResult ll_listdir(FuseLowLevelOpsBase& ops, fuse_ino_t ino, size_t size)
+    {
+        LowLevelListDirResult result;
+        fuse_file_info info{};
+        {
+            FakeRequest r;
+            REQUIRE(ops.vopendir(r.req(), ino, &info) == 0);
+        }
+        fuse_off_t off = 0;
+        while (true)
+        {
+            FakeRequest r;
+            REQUIRE(ops.vreaddir(r.req(), ino, size, off, &info) == 0);
+            if (r.buf.empty())
+            {
+                break;
+            }
+            for (size_t pos = 0; pos < r.buf.size();)
+            {
+                FakeDirent dirent;
+                memcpy(&dirent, r.buf.data() + pos, sizeof(dirent));
+                result.emplace_back(r.buf.substr(pos + sizeof(dirent), dirent.namelen),
+                                    dirent.ino);
+                off = dirent.off;
+                pos += sizeof(dirent) + dirent.namelen;
+            }
+        }
+        {
+            FakeRequest r;
+            REQUIRE(ops.vreleasedir(r.req(), ino, &info) == 0);
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    std::vector<std::string> names(const LowLevelListDirResult& l)
+    {
+        std::vector<std::string> result;
+        for (const auto& [name, ino] : l)
+        {
+            result.push_back(name);
+        }
+        return result;
+    }
+#endif
 }    // namespace
 void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_insensitive)
 {
@@ -299,4 +471,66 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         CHECK(getxattr(ops, "/cbd", "org.securefs.test") == "blah");
     }
 }
+
+#ifndef _WIN32
+void test_fuse_low_level_ops(FuseLowLevelOpsBase& ops, bool check_parent_ino)
+{
+    ops.set_replies(fake_replies());
+
+    auto ino_a = ll_mkdir(ops, FUSE_ROOT_ID, "a");
+    auto ino_b = ll_mkdir(ops, FUSE_ROOT_ID, "b");
+    auto ino_d = ll_mkdir(ops, ino_a, "d");
+    ll_create(ops, ino_d, "f", "hello");
+
+    // Each lookup of the same file returns the same node, and a missing name a negative entry.
+    CHECK(ll_lookup(ops, FUSE_ROOT_ID, "a") == ino_a);
+    CHECK(ll_lookup(ops, FUSE_ROOT_ID, "nonexistent") == 0);
+    auto ino_f = ll_lookup(ops, ino_d, "f");
+    CHECK(ll_getattr(ops, ino_f).st_size == 5);
+
+    // A moved directory keeps its node, and so do the files beneath it.
+    {
+        FakeRequest r;
+        REQUIRE(ops.vrename(r.req(), ino_a, "d", ino_b, "e") == 0);
+        CHECK(r.error == 0);
+    }
+    // Listed before any lookup of the new name, so that ".." must have moved with the rename.
+    auto listing = ll_listdir(ops, ino_d, 4096);
+    REQUIRE(names(listing) == std::vector<std::string>{".", "..", "f"});
+    if (check_parent_ino)
+    {
+        CHECK(listing[1].second == ll_getattr(ops, ino_b).st_ino);
+    }
+    CHECK(ll_lookup(ops, ino_a, "d") == 0);
+    CHECK(ll_lookup(ops, ino_b, "e") == ino_d);
+    CHECK(ll_lookup(ops, ino_d, "f") == ino_f);
+    CHECK(ll_getattr(ops, ino_f).st_size == 5);
+
+    // Listing in small pieces must neither skip nor repeat entries.
+    for (int i = 0; i < 20; ++i)
+    {
+        ll_create(ops, ino_d, absl::StrCat("g", i).c_str(), "");
+    }
+    auto whole = ll_listdir(ops, ino_d, 1 << 16);
+    CHECK(whole.size() == 23);
+    CHECK(names(ll_listdir(ops, ino_d, 100)) == names(whole));
+
+    {
+        FakeRequest r;
+        REQUIRE(ops.vunlink(r.req(), ino_d, "f") == 0);
+        CHECK(r.error == 0);
+    }
+    CHECK(ll_lookup(ops, ino_d, "f") == 0);
+
+    // Once every lookup is forgotten, the node is stale.
+    ops.vforget(ino_f, 2);
+    {
+        FakeRequest r;
+        CHECK_THROWS(ops.vgetattr(r.req(), ino_f, nullptr));
+    }
+    // The root is never forgotten.
+    ops.vforget(FUSE_ROOT_ID, 1);
+    CHECK(S_ISDIR(ll_getattr(ops, FUSE_ROOT_ID).st_mode));
+}
+#endif
 }    // namespace securefs::testing
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fuse_high_level_ops_base.h"
+#include "fuse_low_level_ops_base.h"
 #include "platform.h"
 
 #include <absl/strings/escaping.h>
@@ -41,4 +42,9 @@ struct doctest::StringMaker<std::vector<std::string>>
 namespace securefs::testing
 {
 void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_insensitive = false);
+#ifndef _WIN32
+/// Drives the operations as the kernel would, replying to fake requests. The ino of ".." is only
+/// checked if `check_parent_ino`, as the lite format reports that of the underlying directory.
+void test_fuse_low_level_ops(FuseLowLevelOpsBase& ops, bool check_parent_ino);
+#endif
 }
@@ -0,0 +1,130 @@
+#include "files.h"
+#include "platform.h"
+#include "stat_workaround.h"
+
+#include <doctest/doctest.h>
+
+#include <cstring>
+#include <memory>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Kernel cache of regular files")
+    {
+        OSService service("tmp");
+        auto data_name = service.temp_name("files", "data");
+        auto meta_name = service.temp_name("files", "meta");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+        {
+            RegularFile file(service.open_file_stream(data_name, flags, 0644),
+                             service.open_file_stream(meta_name, flags, 0644),
+                             key_type(0x5a),
+                             id_type{},
+                             true,
+                             4096,
+                             12,
+                             0,
+                             false);
+            {
+                FileLockGuard lg(file);
+                file.initialize_empty(S_IFREG | 0644, 0, 0);
+            }
+
+            // The kernel caches nothing before the first open, and the content is the same at the
+            // next one.
+            CHECK(!file.claim_kernel_cache());
+            CHECK(file.claim_kernel_cache());
+            CHECK(!file.check_underlying_changes());
+
+            // Our own writes and truncates bump the generation, but are not taken as others'.
+            {
+                FileLockGuard lg(file);
+                file.write("hello", 0, 5);
+            }
+            CHECK(!file.check_underlying_changes());
+            CHECK(!file.claim_kernel_cache());
+            CHECK(file.claim_kernel_cache());
+            {
+                FileLockGuard lg(file);
+                file.truncate(2);
+            }
+            CHECK(!file.claim_kernel_cache());
+            CHECK(file.claim_kernel_cache());
+
+            // Others modifying the underlying file are noticed by its modification time.
+            fuse_timespec ts[2] = {{1000, 0}, {1000, 0}};
+            service.utimens(data_name, ts);
+            CHECK(file.check_underlying_changes());
+            CHECK(!file.check_underlying_changes());
+            CHECK(!file.claim_kernel_cache());
+            CHECK(file.claim_kernel_cache());
+        }
+        service.remove_file(data_name);
+        service.remove_file(meta_name);
+    }
+
+    TEST_CASE("Stat snapshot of regular files")
+    {
+        OSService service("tmp");
+        int flags = O_RDWR | O_EXCL | O_CREAT;
+        for (bool store_time : {true, false})
+        {
+            auto data_name = service.temp_name("files", "data");
+            auto meta_name = service.temp_name("files", "meta");
+            {
+                RegularFile file(service.open_file_stream(data_name, flags, 0644),
+                                 service.open_file_stream(meta_name, flags, 0644),
+                                 key_type(0x5a),
+                                 id_type{},
+                                 true,
+                                 4096,
+                                 12,
+                                 0,
+                                 store_time);
+                fuse_stat st{};
+                {
+                    FileLockGuard lg(file);
+                    file.initialize_empty(S_IFREG | 0644, 0, 0);
+                    // Nothing is published before the first `stat()`.
+                    CHECK(!file.stat_snapshot(&st));
+                    file.stat(&st);
+                }
+                CHECK(file.stat_snapshot(&st));
+                CHECK(st.st_size == 0);
+
+                {
+                    FileLockGuard lg(file);
+                    file.write("hello", 0, 5);
+                    file.write("!", 9, 1);
+                    file.write("abc", 1, 3);
+                }
+                // With the times stored in the filesystem, writes republish the size and times
+                // without asking the underlying file. Otherwise the times are those of the
+                // underlying file, and a `stat()` under the lock is needed.
+                CHECK(file.stat_snapshot(&st) == store_time);
+                file.stat_without_waiting(&st);
+                CHECK(st.st_size == 10);
+                fuse_stat full{};
+                {
+                    FileLockGuard lg(file);
+                    file.stat(&full);
+                }
+                CHECK(full.st_size == st.st_size);
+                CHECK(get_mtim(full).tv_sec == get_mtim(st).tv_sec);
+                CHECK(get_mtim(full).tv_nsec == get_mtim(st).tv_nsec);
+
+                {
+                    FileLockGuard lg(file);
+                    file.truncate(3);
+                }
+                CHECK(file.stat_snapshot(&st));
+                CHECK(st.st_size == 3);
+            }
+            service.remove_file(data_name);
+            service.remove_file(meta_name);
+        }
+    }
+}    // namespace
+}    // namespace securefs
@@ -1,32 +1,55 @@
 #include "btree_dir.h"
+#include "control_dir.h"
 #include "full_format.h"
+#include "full_format_low_level.h"
 #include "fuse_high_level_ops_base.h"
 #include "mystring.h"
+#include "op_recording.h"
 #include "platform.h"
+#include "stat_workaround.h"
 #include "tags.h"
 #include "test_common.h"
 
 #include <doctest/doctest.h>
+#include <absl/strings/str_cat.h>
 #include <fruit/fruit.h>
+
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 
 namespace securefs::full_format
 {
 namespace
 {
-    template <bool CaseInsensitive>
-    fruit::Component<FuseHighLevelOpsBase> get_test_component(std::shared_ptr<OSService> os)
+#ifdef _WIN32
+    using TestOpsComponent = fruit::Component<FuseHighLevelOpsBase>;
+#else
+    using TestOpsComponent = fruit::Component<FuseHighLevelOpsBase, FuseLowLevelOps>;
+#endif
+
+    template <bool CaseInsensitive, bool LazyTime = false>
+    TestOpsComponent get_ops_test_component(std::shared_ptr<OSService> os)
     {
         return fruit::createComponent()
             .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>()
+#ifndef _WIN32
+            .template registerProvider<fruit::Annotated<tKernelCacheTimeout, int>()>(
+                []() { return 1; })
+#endif
             .install(full_format::get_table_io_component, 2)
             .template registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
             .template registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>()>(
-                []() { return false; })
+                []() { return LazyTime; })
             .template registerProvider<fruit::Annotated<tReadOnly, bool>()>([]() { return false; })
             .template registerProvider<fruit::Annotated<tCaseInsensitive, bool>()>(
                 []() { return CaseInsensitive; })
             .template bind<Directory, BtreeDirectory>()
+            .template registerProvider<fruit::Annotated<tMaxCachedFiles, unsigned>()>(
+                []() { return 4u; })
             .template registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>(
                 []() { return 0u; })
             .template registerProvider<fruit::Annotated<tIvSize, unsigned>()>([]() { return 12u; })
@@ -41,8 +64,354 @@ namespace
                                            : Directory::DirNameComparison{&binary_compare};
                 })
             .registerProvider([]() { return OwnerOverride{}; })
+            .registerProvider(
+                []()
+                {
+                    TimeUpdatePolicy policy;
+                    policy.lazy = LazyTime;
+                    return policy;
+                })
             .bindInstance(*os);
     }
+
+    template <bool CaseInsensitive, bool LazyTime = false>
+    fruit::Component<FuseHighLevelOpsBase> get_test_component(std::shared_ptr<OSService> os)
+    {
+        return fruit::createComponent().install(get_ops_test_component<CaseInsensitive, LazyTime>,
+                                                os);
+    }
+    TEST_CASE("Dentry cache")
+    {
+        id_type parent{}, other_parent{}, child{};
+        parent.data()[0] = 1;
+        other_parent.data()[0] = 2;
+        child.data()[0] = 3;
+
+        DentryCache exact(true);
+        CHECK(!exact.get(parent, "a").has_value());
+        exact.put(parent, "a", {child, Directory::class_type()});
+        exact.put(parent, "b", {child, RegularFile::class_type()});
+        exact.put(other_parent, "a", {child, RegularFile::class_type()});
+        REQUIRE(exact.get(parent, "a").has_value());
+        CHECK(exact.get(parent, "a")->id == child);
+        CHECK(exact.get(parent, "a")->type == Directory::class_type());
+        CHECK(!exact.get(parent, "A").has_value());
+
+        exact.invalidate(parent, "a");
+        CHECK(!exact.get(parent, "a").has_value());
+        CHECK(exact.get(parent, "b").has_value());
+        CHECK(exact.get(other_parent, "a").has_value());
+
+        exact.forget_directory(parent);
+        CHECK(!exact.get(parent, "b").has_value());
+        CHECK(exact.get(other_parent, "a").has_value());
+
+        // Another spelling may name the same entry, so the whole directory is invalidated.
+        DentryCache inexact(false);
+        inexact.put(parent, "a", {child, RegularFile::class_type()});
+        inexact.put(parent, "b", {child, RegularFile::class_type()});
+        inexact.invalidate(parent, "A");
+        CHECK(!inexact.get(parent, "a").has_value());
+        CHECK(!inexact.get(parent, "b").has_value());
+
+        DentryCache bounded(true, 2);
+        bounded.put(parent, "a", {child, RegularFile::class_type()});
+        bounded.put(parent, "b", {child, RegularFile::class_type()});
+        bounded.put(parent, "c", {child, RegularFile::class_type()});
+        CHECK(bounded.get(parent, "c").has_value());
+    }
+
+    TEST_CASE("Full format concurrent renames across directories")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false>, root);
+        auto& ops = injector.get<FuseHighLevelOpsBase&>();
+
+        fuse_context ctx{};
+        REQUIRE(ops.vmkdir("/a", 0755, &ctx) == 0);
+        REQUIRE(ops.vmkdir("/b", 0755, &ctx) == 0);
+        constexpr int kNumFiles = 8, kRounds = 200;
+        for (int i = 0; i < kNumFiles; ++i)
+        {
+            fuse_file_info info{};
+            REQUIRE(ops.vcreate(absl::StrCat("/a/", i).c_str(), 0644, &info, &ctx) == 0);
+            REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+        }
+
+        // Each thread moves its own files back and forth, so the two directories are locked in
+        // both argument orders at the same time.
+        std::vector<std::thread> threads;
+        std::atomic<int> failures{0};
+        for (int t = 0; t < 2; ++t)
+        {
+            threads.emplace_back(
+                [&, t]()
+                {
+                    fuse_context thread_ctx{};
+                    for (int round = 0; round < kRounds; ++round)
+                    {
+                        for (int i = t; i < kNumFiles; i += 2)
+                        {
+                            auto in_a = absl::StrCat("/a/", i), in_b = absl::StrCat("/b/", i);
+                            bool forth = round % 2 == 0;
+                            if (ops.vrename(forth ? in_a.c_str() : in_b.c_str(),
+                                            forth ? in_b.c_str() : in_a.c_str(),
+                                            &thread_ctx)
+                                != 0)
+                            {
+                                ++failures;
+                            }
+                        }
+                    }
+                });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        CHECK(failures.load() == 0);
+        for (int i = 0; i < kNumFiles; ++i)
+        {
+            fuse_stat st;
+            CHECK(ops.vgetattr(absl::StrCat("/a/", i).c_str(), &st, &ctx) == 0);
+        }
+    }
+
+    TEST_CASE("Full format lazy time updates")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        // More files than the table caches, so that some are written back on eviction and the
+        // rest on destruction.
+        constexpr int kNumFiles = 12;
+        std::vector<fuse_timespec> mtimes;
+        {
+            fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false, true>, root);
+            auto& ops = injector.get<FuseHighLevelOpsBase&>();
+            fuse_context ctx{};
+            for (int i = 0; i < kNumFiles; ++i)
+            {
+                auto path = absl::StrCat("/", i);
+                fuse_file_info info{};
+                REQUIRE(ops.vcreate(path.c_str(), 0644, &info, &ctx) == 0);
+                fuse_timespec old_times[2] = {{1, 2}, {1, 2}};
+                REQUIRE(ops.vutimens(path.c_str(), old_times, &ctx) == 0);
+                REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+                // Now the header is clean, and the write changes nothing there but the times.
+                info = {};
+                info.flags = O_RDWR;
+                REQUIRE(ops.vopen(path.c_str(), &info, &ctx) == 0);
+                REQUIRE(ops.vwrite(path.c_str(), "abc", 3, 0, &info, &ctx) == 3);
+                REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+                fuse_stat st;
+                REQUIRE(ops.vgetattr(path.c_str(), &st, &ctx) == 0);
+                CHECK(get_mtim(st).tv_sec > 1);
+                mtimes.push_back(get_mtim(st));
+            }
+        }
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false, true>, root);
+        auto& ops = injector.get<FuseHighLevelOpsBase&>();
+        fuse_context ctx{};
+        for (int i = 0; i < kNumFiles; ++i)
+        {
+            fuse_stat st;
+            REQUIRE(ops.vgetattr(absl::StrCat("/", i).c_str(), &st, &ctx) == 0);
+            CHECK(st.st_size == 3);
+            CHECK(get_mtim(st).tv_sec == mtimes[i].tv_sec);
+            CHECK(get_mtim(st).tv_nsec == mtimes[i].tv_nsec);
+        }
+    }
+
+    TEST_CASE("Control directory")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false>, root);
+        ControlDirOps ops(injector.get<FuseHighLevelOpsBase&>());
+        fuse_context ctx{};
+
+        fuse_file_info info{};
+        REQUIRE(ops.vcreate("/file", 0644, &info, &ctx) == 0);
+        REQUIRE(ops.vwrite(nullptr, "abc", 3, 0, &info, &ctx) == 3);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        fuse_stat st;
+        REQUIRE(ops.vgetattr("/.securefs", &st, &ctx) == 0);
+        CHECK((st.st_mode & S_IFMT) == S_IFDIR);
+        REQUIRE(ops.vgetattr("/.securefs/metrics", &st, &ctx) == 0);
+        CHECK((st.st_mode & S_IFMT) == S_IFREG);
+        CHECK(ops.vgetattr("/.securefs/nothing", &st, &ctx) == -ENOENT);
+        CHECK(ops.vunlink("/.securefs/control", &ctx) == -EPERM);
+
+        info = {};
+        REQUIRE(ops.vopendir("/.securefs", &info, &ctx) == 0);
+        std::vector<std::string> names;
+        REQUIRE(ops.vreaddir(
+                    nullptr,
+                    &names,
+                    [](void* buf, const char* name, const fuse_stat*, fuse_off_t)
+                    {
+                        static_cast<std::vector<std::string>*>(buf)->emplace_back(name);
+                        return 0;
+                    },
+                    0,
+                    &info,
+                    &ctx)
+                == 0);
+        REQUIRE(ops.vreleasedir(nullptr, &info, &ctx) == 0);
+        CHECK(names == std::vector<std::string>{".", "..", "stats.json", "metrics", "control"});
+
+        info = {};
+        info.flags = O_RDWR;
+        CHECK(ops.vopen("/.securefs/stats.json", &info, &ctx) == -EACCES);
+        info.flags = O_RDONLY;
+        REQUIRE(ops.vopen("/.securefs/stats.json", &info, &ctx) == 0);
+        std::string content(65536, '\0');
+        int size = ops.vread(nullptr, content.data(), content.size(), 0, &info, &ctx);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+        REQUIRE(size > 0);
+        content.resize(size);
+        CHECK(content.find("\"file_table_hits_total\"") != std::string::npos);
+
+        info = {};
+        info.flags = O_WRONLY;
+        REQUIRE(ops.vopen("/.securefs/control", &info, &ctx) == 0);
+        CHECK(ops.vwrite(nullptr, "drop_caches\nfl", 14, 0, &info, &ctx) == 14);
+        CHECK(ops.vwrite(nullptr, "ush", 3, 14, &info, &ctx) == 3);
+        CHECK(ops.vflush(nullptr, &info, &ctx) == 0);
+        CHECK(ops.vwrite(nullptr, "unknown\n", 8, 17, &info, &ctx) == -EINVAL);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        // The inner filesystem still works after its caches are dropped.
+        REQUIRE(ops.vgetattr("/file", &st, &ctx) == 0);
+        CHECK(st.st_size == 3);
+    }
+
+    TEST_CASE("Operation recording and replay")
+    {
+        auto make_root = []()
+        {
+            auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+            OSService::get_default().ensure_directory(temp_dir_name, 0755);
+            return std::make_shared<OSService>(temp_dir_name);
+        };
+        auto recording = OSService::temp_name("tmp/", ".rec");
+        {
+            auto root = make_root();
+            fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false>, root);
+            RecordingOps ops(injector.get<FuseHighLevelOpsBase&>(), recording);
+            testing::test_fuse_ops(ops, *root, false);
+        }
+
+        auto recorded = read_recorded_ops(recording);
+        REQUIRE(recorded.size() > 20);
+        CHECK(recorded.front().type == RecordedOpType::kOpendir);
+        CHECK(recorded.front().path == "/");
+        CHECK(std::any_of(recorded.begin(),
+                          recorded.end(),
+                          [](const RecordedOp& op)
+                          {
+                              return op.type == RecordedOpType::kWrite && op.offset == 1
+                                  && op.size == 333 && op.rc == 333;
+                          }));
+        std::set<uint32_t> threads;
+        std::set<uint64_t> opened;
+        for (const RecordedOp& op : recorded)
+        {
+            threads.insert(op.thread);
+            // Handles are recorded by ids never reused, even when the filesystem reuses them.
+            if ((op.type == RecordedOpType::kOpen || op.type == RecordedOpType::kCreate
+                 || op.type == RecordedOpType::kOpendir)
+                && op.rc >= 0)
+            {
+                CHECK(op.fh != 0);
+                CHECK(opened.insert(op.fh).second);
+            }
+        }
+        CHECK(threads.size() == 2);
+        CHECK(opened.size() > 1);
+
+        {
+            // A record cut short is dropped, with the ones before it kept.
+            auto content = OSService::get_default()
+                               .open_file_stream(recording, O_RDONLY, 0)
+                               ->as_string();
+            content.pop_back();
+            OSService::get_default()
+                .open_file_stream(recording, O_WRONLY | O_TRUNC, 0)
+                ->write(content.data(), 0, content.size());
+            CHECK(read_recorded_ops(recording).size() == recorded.size() - 1);
+            OSService::get_default().remove_file(recording);
+        }
+
+        for (unsigned num_threads : {1u, 4u})
+        {
+            auto root = make_root();
+            fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false>, root);
+            auto result = replay_recorded_ops(
+                injector.get<FuseHighLevelOpsBase&>(), recorded, num_threads);
+            CHECK(result.operations == recorded.size());
+            CHECK(result.bytes > 333);
+            if (num_threads == 1)
+            {
+                // Calls on different paths may be reordered by more threads.
+                CHECK(result.mismatches == 0);
+                CHECK(result.skipped == 0);
+            }
+        }
+    }
+
+#ifndef _WIN32
+    TEST_CASE("Node table")
+    {
+        NodeTable nodes;
+        REQUIRE(nodes.get(FUSE_ROOT_ID).has_value());
+        CHECK(nodes.get(FUSE_ROOT_ID)->id == kRootId);
+        CHECK(!nodes.get(FUSE_ROOT_ID + 1).has_value());
+
+        id_type a, b;
+        a.data()[0] = 1;
+        b.data()[0] = 2;
+        auto ino_a = nodes.remember(a, RegularFile::class_type());
+        auto ino_b = nodes.remember(b, Directory::class_type());
+        CHECK(ino_a != ino_b);
+        CHECK(ino_a != FUSE_ROOT_ID);
+        CHECK(nodes.remember(a, RegularFile::class_type()) == ino_a);
+        CHECK(nodes.size() == 3);
+
+        REQUIRE(nodes.get(ino_b).has_value());
+        CHECK(nodes.get(ino_b)->id == b);
+        CHECK(nodes.get(ino_b)->type == Directory::class_type());
+
+        // Two lookups of `a` must both be forgotten before its node id goes away.
+        nodes.forget(ino_a, 1);
+        CHECK(nodes.get(ino_a).has_value());
+        nodes.forget(ino_a, 1);
+        CHECK(!nodes.get(ino_a).has_value());
+
+        // A forgotten file gets a fresh node id, so that stale ones are never reused.
+        CHECK(nodes.remember(a, RegularFile::class_type()) != ino_a);
+
+        nodes.forget(FUSE_ROOT_ID, 100);
+        CHECK(nodes.get(FUSE_ROOT_ID).has_value());
+    }
+
+    TEST_CASE("Full format low-level operations")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        fruit::Injector<FuseHighLevelOpsBase, FuseLowLevelOps> injector(
+            get_ops_test_component<false>, root);
+        testing::test_fuse_low_level_ops(injector.get<FuseLowLevelOps&>(), true);
+    }
+#endif
+
     TEST_CASE("Full format test (case sensitive)")
     {
         auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
@@ -1,7 +1,11 @@
 #include "lite_format.h"
+#include "lite_format_low_level.h"
+#include "lite_long_name_lookup_table.h"
+#include "lock_guard.h"
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
+#include "stat_workaround.h"
 #include "tags.h"
 #include "test_common.h"
 
@@ -16,9 +20,12 @@
 #include <fruit/fruit.h>
 #include <fruit/injector.h>
 
+#include <algorithm>
 #include <array>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 namespace securefs::lite_format
 {
@@ -109,30 +116,280 @@ namespace
                                       nullptr));
     }
 
-    TEST_CASE("Lite FuseHighLevelOps")
+    TEST_CASE("Group committed long name mappings")
     {
-        auto whole_component = [](OSService* os) -> fruit::Component<FuseHighLevelOps>
+        auto temp_dir_name = OSService::temp_name("tmp/longname", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        auto db_name = root.norm_path_narrowed(kLongNameTableFileName);
+
+        constexpr int kNumThreads = 8, kNumPerThread = 40;
         {
-            return fruit::createComponent()
-                .registerProvider(
-                    []()
+            LongNameMappingCommitter committer(2);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < kNumThreads; ++i)
+            {
+                threads.emplace_back(
+                    [&, i]()
                     {
-                        NameNormalizationFlags flags{};
-                        flags.long_name_threshold = 133;
-                        return flags;
-                    })
-                .install(get_name_translator_component)
-                .install(get_test_component)
-                .bindInstance(*os);
-        };
+                        for (int j = 0; j < kNumPerThread; ++j)
+                        {
+                            auto hash = absl::StrCat("h", i, "_", j);
+                            committer.submit(db_name,
+                                             LongNameMappingCommitter::Action::kUpdate,
+                                             hash,
+                                             absl::StrCat("n", i, "_", j));
+                            if (j % 2)
+                            {
+                                committer.submit(
+                                    db_name, LongNameMappingCommitter::Action::kRemove, hash);
+                            }
+                        }
+                    });
+            }
+            for (auto&& t : threads)
+            {
+                t.join();
+            }
+
+            // Changes must be visible to other connections as soon as `submit()` returns.
+            LongNameLookupTable table(db_name, true);
+            LockGuard<LongNameLookupTable> lg(table);
+            CHECK(table.list_hashes().size() == kNumThreads * kNumPerThread / 2);
+            CHECK(table.lookup("h3_4") == "n3_4");
+            CHECK(table.lookup("h3_5") == "");
+        }
+    }
+
+    TEST_CASE("In-memory long name index")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/longname", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        auto db_name = root.norm_path_narrowed(kLongNameTableFileName);
+        {
+            LongNameLookupTable table(db_name, false);
+            LockGuard<LongNameLookupTable> lg(table);
+            table.update_mapping("abc", "def");
+            table.update_mapping("ghi", "jkl");
+        }
+
+        LongNameIndex index;
+        CHECK(index.lookup(db_name, "abc") == "def");
+        CHECK(index.lookup(db_name, "xyz") == "");
+
+        // Differently spelled names of the same database share the loaded copy.
+        auto alias = root.norm_path_narrowed(absl::StrCat(".//", kLongNameTableFileName));
+        index.update_mapping(alias, "xyz", "uvw");
+        index.remove_mapping(db_name, "abc");
+        CHECK(index.lookup(db_name, "xyz") == "uvw");
+        CHECK(index.lookup(alias, "abc") == "");
+        CHECK(index.lookup(db_name, "ghi") == "jkl");
+
+        // Mappings added by another process are found in the database, while removals of our own
+        // that have not reached the database yet still hold.
+        {
+            LongNameLookupTable table(db_name, false);
+            LockGuard<LongNameLookupTable> lg(table);
+            table.update_mapping("mno", "pqr");
+        }
+        CHECK(index.lookup(db_name, "mno") == "pqr");
+        CHECK(index.lookup(db_name, "abc") == "");
+
+        // After eviction, the content is reloaded from the database.
+        index.evict(root.norm_path_narrowed("."));
+        CHECK(index.lookup(db_name, "abc") == "def");
+        CHECK(index.lookup(db_name, "xyz") == "");
+    }
+
+    TEST_CASE("Virtual size cache")
+    {
+        VirtualSizeCache cache;
+        fuse_stat st{};
+        st.st_size = 1000;
+        CHECK(!cache.get_padding("/a/b", st).has_value());
+        cache.put_padding("/a/b", st, 17);
+        CHECK(cache.get_padding("/a/b", st) == 17u);
+        CHECK(!cache.get_padding("/a/c", st).has_value());
+
+        // Any modification of the underlying file invalidates the entry.
+        fuse_stat modified = st;
+        modified.st_size = 1001;
+        CHECK(!cache.get_padding("/a/b", modified).has_value());
+        modified = st;
+        set_mtim(modified, fuse_timespec{1, 2});
+        CHECK(!cache.get_padding("/a/b", modified).has_value());
+#ifndef _WIN32
+        // Another file renamed over it, with the same size and modification time.
+        modified = st;
+        modified.st_ino = 99;
+        CHECK(!cache.get_padding("/a/b", modified).has_value());
+        modified = st;
+        set_ctim(modified, fuse_timespec{3, 4});
+        CHECK(!cache.get_padding("/a/b", modified).has_value());
+#endif
+    }
+
+    TEST_CASE("Kernel cache tracker")
+    {
+        KernelCacheTracker tracker;
+        fuse_stat st{};
+        st.st_ino = 42;
+        st.st_size = 1000;
+        // Nothing is cached by the kernel on the first open.
+        CHECK(!tracker.claim(st));
+        CHECK(tracker.claim(st));
+
+        fuse_stat other = st;
+        other.st_ino = 43;
+        CHECK(!tracker.claim(other));
+        CHECK(tracker.claim(st));
+
+        fuse_stat modified = st;
+        set_mtim(modified, fuse_timespec{1, 2});
+        CHECK(!tracker.claim(modified));
+        CHECK(tracker.claim(modified));
+        modified.st_size = 1001;
+        CHECK(!tracker.claim(modified));
+        CHECK(tracker.claim(modified));
+    }
+
+    TEST_CASE("Attribute cache")
+    {
+        AttrCache cache(absl::Seconds(60));
+        fuse_stat st{};
+        st.st_size = 1000;
+        CHECK(cache.get("/a", &st) == AttrCache::LookupResult::kMiss);
+        cache.put("/a", &st, cache.begin_fill("/a"));
+        cache.put("/b", nullptr, cache.begin_fill("/b"));
+
+        fuse_stat cached{};
+        CHECK(cache.get("/a", &cached) == AttrCache::LookupResult::kFound);
+        CHECK(cached.st_size == 1000);
+        CHECK(cache.get("/b", &cached) == AttrCache::LookupResult::kNonexistent);
+
+        // Results read before an invalidation are stale and must be dropped.
+        auto token = cache.begin_fill("/c");
+        cache.invalidate("/c");
+        cache.put("/c", &st, token);
+        CHECK(cache.get("/c", &cached) == AttrCache::LookupResult::kMiss);
 
+        // Paths open for writing bypass the cache, including after being renamed.
+        cache.add_writer(1, "/dir/a");
+        cache.put("/dir/a", &st, cache.begin_fill("/dir/a"));
+        CHECK(cache.get("/dir/a", &cached) == AttrCache::LookupResult::kMiss);
+        cache.rename_writers("/dir", "/dir2");
+        cache.put("/dir2/a", &st, cache.begin_fill("/dir2/a"));
+        CHECK(cache.get("/dir2/a", &cached) == AttrCache::LookupResult::kMiss);
+        cache.remove_writer(1);
+        cache.put("/dir2/a", &st, cache.begin_fill("/dir2/a"));
+        CHECK(cache.get("/dir2/a", &cached) == AttrCache::LookupResult::kFound);
+
+        cache.invalidate_all();
+        CHECK(cache.get("/a", &cached) == AttrCache::LookupResult::kMiss);
+        CHECK(cache.get("/b", &cached) == AttrCache::LookupResult::kMiss);
+
+        AttrCache expired(absl::ZeroDuration());
+        expired.put("/a", &st, expired.begin_fill("/a"));
+        CHECK(expired.get("/a", &cached) == AttrCache::LookupResult::kMiss);
+    }
+
+#ifdef _WIN32
+    using TestOpsComponent = fruit::Component<FuseHighLevelOps>;
+#else
+    using TestOpsComponent = fruit::Component<FuseHighLevelOps, FuseLowLevelOps>;
+#endif
+
+    template <int AttrCacheTimeout>
+    TestOpsComponent get_all_ops_component(OSService* os)
+    {
+        return fruit::createComponent()
+#ifndef _WIN32
+            .registerProvider<fruit::Annotated<tKernelCacheTimeout, int>()>([]() { return 1; })
+#endif
+            .registerProvider(
+                []()
+                {
+                    NameNormalizationFlags flags{};
+                    flags.long_name_threshold = 133;
+                    return flags;
+                })
+            .template registerProvider<fruit::Annotated<tAttrCacheTimeout, int>()>(
+                []() { return AttrCacheTimeout; })
+            .install(get_name_translator_component)
+            .install(get_test_component)
+            .bindInstance(*os);
+    }
+
+    template <int AttrCacheTimeout>
+    fruit::Component<FuseHighLevelOps> get_ops_component(OSService* os)
+    {
+        return fruit::createComponent().install(get_all_ops_component<AttrCacheTimeout>, os);
+    }
+
+    template <int AttrCacheTimeout>
+    void test_lite_ops()
+    {
         auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
         OSService::get_default().ensure_directory(temp_dir_name, 0755);
         OSService root(temp_dir_name);
 
-        fruit::Injector<FuseHighLevelOps> injector(+whole_component, &root);
+        fruit::Injector<FuseHighLevelOps> injector(get_ops_component<AttrCacheTimeout>, &root);
         auto& ops = injector.get<FuseHighLevelOps&>();
         testing::test_fuse_ops(ops, root);
     }
+
+    TEST_CASE("Lite FuseHighLevelOps") { test_lite_ops<0>(); }
+
+    TEST_CASE("Lite FuseHighLevelOps with attribute cache") { test_lite_ops<60>(); }
+
+#ifndef _WIN32
+    TEST_CASE("Lite node table")
+    {
+        NodeTable nodes;
+        CHECK(nodes.get(FUSE_ROOT_ID) == "/");
+
+        auto ino_a = nodes.remember("/a");
+        auto ino_ab = nodes.remember("/a/b");
+        auto ino_abc = nodes.remember("/a/b/c");
+        auto ino_ax = nodes.remember("/ax");
+        auto ino_x = nodes.remember("/x");
+        CHECK(nodes.remember("/a") == ino_a);
+        CHECK(nodes.size() == 6);
+
+        // Only the paths beneath "/a" move with it, not those merely starting with its name.
+        nodes.rename("/a", "/x");
+        CHECK(nodes.get(ino_a) == "/x");
+        CHECK(nodes.get(ino_ab) == "/x/b");
+        CHECK(nodes.get(ino_abc) == "/x/b/c");
+        CHECK(nodes.get(ino_ax) == "/ax");
+        // The node that was replaced lingers without a path until the kernel forgets it.
+        CHECK(!nodes.get(ino_x).has_value());
+        CHECK(nodes.remember("/x/b") == ino_ab);
+
+        nodes.detach("/x/b");
+        CHECK(!nodes.get(ino_ab).has_value());
+        CHECK(!nodes.get(ino_abc).has_value());
+        CHECK(nodes.remember("/x/b") != ino_ab);
+
+        nodes.forget(ino_a, 2);
+        CHECK(!nodes.get(ino_a).has_value());
+        nodes.forget(ino_x, 1);
+        nodes.forget(ino_ab, 2);
+        nodes.forget(FUSE_ROOT_ID, 100);
+        CHECK(nodes.get(FUSE_ROOT_ID) == "/");
+    }
+
+    TEST_CASE("Lite FuseLowLevelOps")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+
+        fruit::Injector<FuseHighLevelOps, FuseLowLevelOps> injector(get_all_ops_component<0>,
+                                                                    &root);
+        testing::test_fuse_low_level_ops(injector.get<FuseLowLevelOps&>(), false);
+    }
+#endif
 }    // namespace
 }    // namespace securefs::lite_format
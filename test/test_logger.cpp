@@ -0,0 +1,126 @@
+#include "fuse_tracer_v2.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <doctest/doctest.h>
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Asynchronous logging keeps every line")
+    {
+        auto path = OSService::temp_name("tmp/", ".log");
+        {
+            std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+            logger->start_async();
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; ++t)
+            {
+                threads.emplace_back(
+                    [&logger, t]()
+                    {
+                        for (int i = 0; i < 1000; ++i)
+                        {
+                            logger->log_v2(
+                                LoggingLevel::kLogInfo, __func__, __LINE__, "line %d %d", t, i);
+                        }
+                    });
+            }
+            for (auto& t : threads)
+            {
+                t.join();
+            }
+            logger->stop_async();
+            logger->log_v2(LoggingLevel::kLogInfo, __func__, __LINE__, "synchronous line");
+        }
+
+        std::ifstream in(path);
+        std::string line;
+        int count = 0, dropped = 0;
+        bool last_is_synchronous = false;
+        while (std::getline(in, line))
+        {
+            if (line.find("lines were dropped") != std::string::npos)
+            {
+                ++dropped;
+            }
+            else
+            {
+                ++count;
+            }
+            last_is_synchronous = line.find("synchronous line") != std::string::npos;
+        }
+        // The lines of each thread fit in its buffer even if the writer never drained it.
+        CHECK(dropped == 0);
+        CHECK(count == 4001);
+        CHECK(last_is_synchronous);
+        OSService::get_default().remove_file(path);
+    }
+
+    TEST_CASE("Traced calls log the same lines synchronously and asynchronously")
+    {
+        // Without the header, which holds the time and the thread.
+        auto trace_messages = [](bool async)
+        {
+            auto path = OSService::temp_name("tmp/", ".log");
+            {
+                std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+                logger->set_level(LoggingLevel::kLogTrace);
+                if (async)
+                {
+                    logger->start_async();
+                }
+                fuse_stat st{};
+                st.st_size = 12345;
+                st.st_mode = S_IFREG | 0644;
+                fuse_file_info info{};
+                info.fh = 0xabc;
+                std::string path_arg = "/dir/\"name\"";
+                int rc = trace::FuseTracer::traced_call(
+                    [&]()
+                    {
+                        // Changes after the call starts show up only in the line of its end.
+                        st.st_nlink = 3;
+                        return 7;
+                    },
+                    "test_op",
+                    __LINE__,
+                    {{"path", {path_arg.c_str()}},
+                     {"null", {static_cast<const char*>(nullptr)}},
+                     {"st", {&st}},
+                     {"info", {&info}},
+                     {"off", {int64_t{-5}}},
+                     {"size", {uint64_t{4096}}}},
+                    logger.get());
+                CHECK(rc == 7);
+                // The payload is copied on the call, not when the writer gets to it.
+                path_arg = "overwritten";
+            }
+            std::ifstream in(path);
+            std::vector<std::string> messages;
+            std::string line;
+            while (std::getline(in, line))
+            {
+                messages.push_back(line.substr(line.find("]    ")));
+            }
+            OSService::get_default().remove_file(path);
+            return messages;
+        };
+        auto sync = trace_messages(false);
+        REQUIRE(sync.size() == 2);
+        CHECK(sync[0].find("\"/dir/\\\"name\\\"\"") != std::string::npos);
+        CHECK(sync[0].find("st_size=12345") != std::string::npos);
+        CHECK(sync[0].find("st_nlink=0") != std::string::npos);
+        CHECK(sync[1].find("st_nlink=3") != std::string::npos);
+        CHECK(sync[1].find("return code 7") != std::string::npos);
+        CHECK(trace_messages(true) == sync);
+    }
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,78 @@
+#include "operation_stats.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+namespace
+{
+    TEST_CASE("Latency buckets")
+    {
+        for (uint64_t ns : {0ull, 1ull, 3ull, 4ull, 7ull, 8ull, 9ull, 1000ull, 123456789ull})
+        {
+            auto bucket = OperationSummary::bucket_of(ns);
+            CHECK(bucket < OperationSummary::kNumBuckets);
+            CHECK(OperationSummary::bucket_upper_bound(bucket) >= ns);
+            if (bucket > 0)
+            {
+                CHECK(OperationSummary::bucket_upper_bound(bucket - 1) < ns);
+            }
+        }
+        CHECK(OperationSummary::bucket_of(~0ull) == OperationSummary::kNumBuckets - 1);
+    }
+
+    TEST_CASE("Operation stats are summed over threads")
+    {
+        int op = OperationStats::register_operation("test_op");
+        REQUIRE(op >= 0);
+        CHECK(OperationStats::register_operation("test_op") == op);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                [op]()
+                {
+                    for (int i = 1; i <= 100; ++i)
+                    {
+                        OperationStats::record(op, i * 1000, i % 10 == 0 ? -1 : 10);
+                    }
+                });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+
+        auto summaries = OperationStats::snapshot();
+        auto it = std::find_if(summaries.begin(),
+                               summaries.end(),
+                               [](const OperationSummary& s) { return s.name == "test_op"; });
+        REQUIRE(it != summaries.end());
+        CHECK(it->calls == 400);
+        CHECK(it->errors == 40);
+        CHECK(it->bytes == 3600);
+        CHECK(it->max_ns == 100000);
+        auto p50 = it->percentile_ns(0.5);
+        CHECK(p50 >= 50000);
+        CHECK(p50 <= 50000 * (1 + 1.0 / OperationSummary::kSubBuckets));
+        CHECK(OperationStats::format_table(summaries).find("test_op") != std::string::npos);
+
+        std::vector<StatsGauge> gauges{{"cached_files", 3, false}, {"hits", 123456789, true}};
+        auto json = OperationStats::format_json(summaries, gauges);
+        CHECK(json.find("\"test_op\": {\"calls\": 400") != std::string::npos);
+        CHECK(json.find("\"cached_files\": 3") != std::string::npos);
+        CHECK(json.find("\"hits\": 123456789\n") != std::string::npos);
+        auto metrics = OperationStats::format_prometheus(summaries, gauges);
+        CHECK(metrics.find("securefs_operation_calls_total{operation=\"test_op\"} 400")
+              != std::string::npos);
+        CHECK(metrics.find("# TYPE securefs_cached_files gauge") != std::string::npos);
+        CHECK(metrics.find("securefs_hits 123456789\n") != std::string::npos);
+        CHECK(metrics.find("operation=\"test_op\",quantile=\"0.9\"}") != std::string::npos);
+    }
+}    // namespace
+}    // namespace securefs::trace
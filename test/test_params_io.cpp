@@ -111,5 +111,28 @@ namespace
 
         REQUIRE(total_cases == 15 * 4 * 2);
     }
+
+    TEST_CASE("Required features")
+    {
+        google::protobuf::util::MessageDifferencer differ;
+        EncryptedSecurefsParams::Argon2idParams argon2id_params;
+        argon2id_params.set_memory_cost(64);
+        argon2id_params.set_parallelism(2);
+        argon2id_params.set_time_cost(2);
+        std::string password = "abc";
+
+        DecryptedSecurefsParams params;
+        params.mutable_size_params()->set_block_size(4096);
+        params.mutable_size_params()->set_iv_size(12);
+        params.mutable_full_format_params()->set_master_key(std::string(32, 'k'));
+        params.mutable_full_format_params()->set_hash_indexed_directories(true);
+
+        auto encparams = encrypt(params, argon2id_params, as_byte_span(password), nullptr);
+        CHECK(differ.Compare(decrypt(encparams, as_byte_span(password), nullptr), params));
+
+        params.add_required_features("made_up_feature");
+        encparams = encrypt(params, argon2id_params, as_byte_span(password), nullptr);
+        CHECK_THROWS(decrypt(encparams, as_byte_span(password), nullptr));
+    }
 }    // namespace
 }    // namespace securefs
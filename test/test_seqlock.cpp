@@ -0,0 +1,84 @@
+#include "seqlock.h"
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    struct Sample
+    {
+        uint64_t values[9];
+        uint32_t tail;
+    };
+
+    TEST_CASE("Test SeqLocked")
+    {
+        SeqLocked<Sample> locked;
+        Sample sample{};
+        CHECK(!locked.load(sample));
+
+        sample.values[0] = 5;
+        sample.tail = 7;
+        locked.store(sample);
+        Sample out{};
+        REQUIRE(locked.load(out));
+        CHECK(out.values[0] == 5);
+        CHECK(out.tail == 7);
+
+        locked.reset();
+        CHECK(!locked.load(out));
+    }
+
+    TEST_CASE("Concurrent reads of SeqLocked never tear")
+    {
+        SeqLocked<Sample> locked;
+        std::atomic<bool> done{false};
+        std::atomic<int> torn{0};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t)
+        {
+            readers.emplace_back(
+                [&]()
+                {
+                    Sample out;
+                    while (!done.load())
+                    {
+                        if (!locked.load(out))
+                        {
+                            continue;
+                        }
+                        for (auto v : out.values)
+                        {
+                            if (v != out.tail)
+                            {
+                                ++torn;
+                            }
+                        }
+                    }
+                });
+        }
+        Sample sample;
+        for (uint32_t i = 0; i < 100000; ++i)
+        {
+            for (auto& v : sample.values)
+            {
+                v = i;
+            }
+            sample.tail = i;
+            locked.store(sample);
+        }
+        done = true;
+        for (auto& t : readers)
+        {
+            t.join();
+        }
+        CHECK(torn.load() == 0);
+    }
+}    // namespace
+}    // namespace securefs
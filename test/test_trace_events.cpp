@@ -0,0 +1,74 @@
+#include "platform.h"
+#include "trace_events.h"
+
+#include <doctest/doctest.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+namespace
+{
+    size_t count_occurrences(const std::string& haystack, const std::string& needle)
+    {
+        size_t count = 0;
+        for (size_t pos = haystack.find(needle); pos != std::string::npos;
+             pos = haystack.find(needle, pos + needle.size()))
+        {
+            ++count;
+        }
+        return count;
+    }
+
+    TEST_CASE("Trace events")
+    {
+        auto path = OSService::temp_name("tmp/", ".json");
+        {
+            ScopedSpan ignored("test", "before_start");
+        }
+        TraceEvents::start(path);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back(
+                []()
+                {
+                    for (int i = 0; i < 100; ++i)
+                    {
+                        ScopedSpan outer("test", "outer");
+                        {
+                            ScopedSpan inner("test", "inner", 4096);
+                        }
+                        outer.set_error(5);
+                    }
+                });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        TraceEvents::stop();
+        {
+            ScopedSpan ignored("test", "after_stop");
+        }
+
+        std::ifstream in(path);
+        std::stringstream content;
+        content << in.rdbuf();
+        auto json = content.str();
+        CHECK(json.front() == '[');
+        CHECK(json.substr(json.size() - 2) == "]\n");
+        CHECK(count_occurrences(json, "\"name\":\"outer\"") == 400);
+        CHECK(count_occurrences(json, "\"name\":\"inner\"") == 400);
+        CHECK(count_occurrences(json, "\"args\":{\"size\":4096}") == 400);
+        CHECK(count_occurrences(json, "\"args\":{\"error\":5}") == 400);
+        CHECK(json.find("before_start") == std::string::npos);
+        CHECK(json.find("after_stop") == std::string::npos);
+        OSService::get_default().remove_file(path);
+    }
+}    // namespace
+}    // namespace securefs::trace